@@ -0,0 +1,62 @@
+/**
+ * Logins per second per core for PBKDF2-HMAC-SHA512 password checks: Crypto++ one at a time (the old UserDB path)
+ * against Pbkdf2Sha512::DeriveBatch. Single threaded, so the numbers are per core.
+ *   scons bench && ./bench/pbkdf2_bench [rounds] [batch]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include <crypto++/cryptlib.h>
+#include <crypto++/sha.h>
+#include <crypto++/pwdbased.h>
+using namespace CryptoPP;
+
+#include "../src/Main/Pbkdf2Batch.hpp"
+
+static double Now_() {
+   struct timeval tv;
+   gettimeofday(&tv, NULL);
+   return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+int main(int argc, char* argv[]) {
+   unsigned int rounds = argc > 1 ? atoi(argv[1]) : 5000; // UserDB's rounds_
+   unsigned int batch = argc > 2 ? atoi(argv[2]) : 64;
+
+   vector<Pbkdf2Request> requests;
+   for(unsigned int i = 0; i < batch; i++) {
+      char password[32], salt[17];
+      snprintf(password, sizeof(password), "password%u", i);
+      snprintf(salt, sizeof(salt), "salt%012u", i);
+      requests.push_back(Pbkdf2Request(password, string(salt, 16), rounds));
+   }
+
+   printf("PBKDF2-HMAC-SHA512, %u rounds, %u logins per run.\n", rounds, batch);
+
+   vector<string> expected(batch);
+   double start = Now_();
+   for(unsigned int i = 0; i < batch; i++) {
+      byte key[SHA512::DIGESTSIZE];
+      PKCS5_PBKDF2_HMAC<SHA512> dk;
+      dk.DeriveKey(key, SHA512::DIGESTSIZE, (byte)0, (const byte*)requests[i].password.data(), requests[i].password.size(), (const byte*)requests[i].salt.data(), requests[i].salt.size(), rounds, 0);
+      expected[i].assign((const char*)key, SHA512::DIGESTSIZE);
+   }
+   double single = Now_() - start;
+   printf("  Crypto++ one at a time: %8.1f logins/s\n", batch / single);
+
+   start = Now_();
+   Pbkdf2Sha512::DeriveBatch(requests);
+   double batched = Now_() - start;
+   printf("  Batched (%s):%*s %8.1f logins/s  (%.2fx)\n", Pbkdf2Sha512::getKernelName(), (int)(10 - strlen(Pbkdf2Sha512::getKernelName())), "", batch / batched, single / batched);
+
+   for(unsigned int i = 0; i < batch; i++) {
+      if(expected[i].compare(0, string::npos, (const char*)requests[i].key, Pbkdf2Sha512::KEY_SIZE) != 0) {
+         printf("MISMATCH on login %u!\n", i);
+         return 1;
+      }
+   }
+   printf("  Keys match.\n");
+   return 0;
+}
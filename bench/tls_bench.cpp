@@ -0,0 +1,187 @@
+/**
+ * TLS handshakes per second over loopback against the server's TlsContext: full handshakes, then reconnects that
+ * resume the session, for TLS 1.3 and TLS 1.2 (with a session ticket, and from the session cache without one). One
+ * client and one server thread, so a handshake's cost on both ends is in the time. Makes a throwaway P-256 certificate.
+ *   scons bench && ./bench/tls_bench [handshakes]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <string>
+using namespace std;
+
+#include <boost/asio.hpp>
+#include <boost/asio/ssl.hpp>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+using boost::asio::ip::tcp;
+
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+
+#include "../src/Main/TlsContext.hpp"
+
+static double Now_() {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+/**
+ * Writes a self signed certificate and its key out as PEM.
+ */
+static bool MakeCertificate_(const string& certificate, const string& key) {
+   EVP_PKEY* pkey = NULL;
+   EVP_PKEY_CTX* pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL);
+   bool generated = pctx && EVP_PKEY_keygen_init(pctx) == 1 && EVP_PKEY_CTX_set_ec_paramgen_curve_nid(pctx, NID_X9_62_prime256v1) == 1 && EVP_PKEY_keygen(pctx, &pkey) == 1;
+   EVP_PKEY_CTX_free(pctx);
+   if(!generated) {
+      return false;
+   }
+
+   X509* x509 = X509_new();
+   ASN1_INTEGER_set(X509_get_serialNumber(x509), 1);
+   X509_gmtime_adj(X509_get_notBefore(x509), 0);
+   X509_gmtime_adj(X509_get_notAfter(x509), 86400);
+   X509_set_pubkey(x509, pkey);
+   X509_NAME* name = X509_get_subject_name(x509);
+   X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char*)"localhost", -1, -1, 0);
+   X509_set_issuer_name(x509, name);
+   bool ok = X509_sign(x509, pkey, EVP_sha256()) > 0;
+
+   FILE* file = fopen(certificate.c_str(), "w");
+   ok = ok && file && PEM_write_X509(file, x509) == 1;
+   if(file) {
+      fclose(file);
+   }
+   file = fopen(key.c_str(), "w");
+   ok = ok && file && PEM_write_PrivateKey(file, pkey, NULL, NULL, 0, NULL, NULL) == 1;
+   if(file) {
+      fclose(file);
+   }
+
+   X509_free(x509);
+   EVP_PKEY_free(pkey);
+   return ok;
+}
+
+/**
+ * Accepts count connections one after another, handshakes, sends a byte so the client has any session ticket, then
+ * waits for the client to hang up.
+ */
+static void Serve_(boost::asio::io_service* io_service, tcp::acceptor* acceptor, TlsContext* tls, unsigned int count) {
+   for(unsigned int i = 0; i < count; i++) {
+      boost::asio::ssl::stream<tcp::socket> stream(*io_service, tls->getContext());
+      boost::system::error_code error;
+      acceptor->accept(stream.lowest_layer(), error);
+      if(error) {
+         fprintf(stderr, "accept: %s\n", error.message().c_str());
+         return;
+      }
+      stream.lowest_layer().set_option(tcp::no_delay(true));
+      stream.handshake(boost::asio::ssl::stream_base::server, error);
+      if(error) {
+         fprintf(stderr, "server handshake: %s\n", error.message().c_str());
+         continue;
+      }
+      char byte = 'x';
+      boost::asio::write(stream, boost::asio::buffer(&byte, 1), error);
+      stream.read_some(boost::asio::buffer(&byte, 1), error);
+      SSL_set_shutdown(stream.native_handle(), SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN); // As the server does, the session stays resumable.
+   }
+}
+
+/**
+ * Connects count times. With resume every connection offers the session from the one before. Returns handshakes per
+ * second, counting how many were actually resumed.
+ */
+static double Connect_(boost::asio::io_service& io_service, boost::asio::ssl::context& client, const tcp::endpoint& endpoint, unsigned int count, bool resume, unsigned int& resumed) {
+   SSL_SESSION* session = NULL;
+   resumed = 0;
+   double start = Now_();
+   for(unsigned int i = 0; i < count; i++) {
+      boost::asio::ssl::stream<tcp::socket> stream(io_service, client);
+      stream.lowest_layer().connect(endpoint);
+      stream.lowest_layer().set_option(tcp::no_delay(true));
+      if(session) {
+         SSL_set_session(stream.native_handle(), session);
+      }
+      stream.handshake(boost::asio::ssl::stream_base::client);
+      char byte;
+      boost::asio::read(stream, boost::asio::buffer(&byte, 1)); // Any TLS 1.3 ticket comes before this.
+      resumed += SSL_session_reused(stream.native_handle());
+      if(resume) {
+         if(session) {
+            SSL_SESSION_free(session);
+         }
+         session = SSL_get1_session(stream.native_handle());
+      }
+      SSL_set_shutdown(stream.native_handle(), SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+      boost::system::error_code ignored;
+      stream.lowest_layer().close(ignored);
+   }
+   double elapsed = Now_() - start;
+   if(session) {
+      SSL_SESSION_free(session);
+   }
+   return count / elapsed;
+}
+
+static void Run_(TlsContext& tls, const char* name, int version, bool tickets, unsigned int count) {
+   boost::asio::io_service io_service;
+   tcp::acceptor acceptor(io_service, tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0));
+   tcp::endpoint endpoint = acceptor.local_endpoint();
+
+   boost::asio::ssl::context client(boost::asio::ssl::context::sslv23_client);
+   client.set_verify_mode(boost::asio::ssl::verify_none);
+   SSL_CTX_set_min_proto_version(client.native_handle(), version);
+   SSL_CTX_set_max_proto_version(client.native_handle(), version);
+   SSL_CTX_set_session_cache_mode(client.native_handle(), SSL_SESS_CACHE_CLIENT);
+   if(!tickets) {
+      SSL_CTX_set_options(client.native_handle(), SSL_OP_NO_TICKET);
+   }
+
+   // Warm up, then the real thing.
+   unsigned int resumed;
+   boost::thread server(boost::bind(&Serve_, &io_service, &acceptor, &tls, 10 + count * 2));
+   Connect_(io_service, client, endpoint, 10, true, resumed);
+   double full = Connect_(io_service, client, endpoint, count, false, resumed);
+   double resume = Connect_(io_service, client, endpoint, count, true, resumed);
+   server.join();
+
+   printf("  %-22s %8.0f full/s  %8.0f resumed/s  (%u of %u resumed)  %.1fx\n", name, full, resume, resumed, count, resume / full);
+}
+
+int main(int argc, char* argv[]) {
+   unsigned int count = argc > 1 ? atoi(argv[1]) : 2000;
+
+   char directory[] = "/tmp/tls_bench.XXXXXX";
+   if(!mkdtemp(directory)) {
+      perror("mkdtemp");
+      return 1;
+   }
+   string certificate = string(directory) + "/cert.pem";
+   string key = string(directory) + "/key.pem";
+   if(!MakeCertificate_(certificate, key)) {
+      fprintf(stderr, "Could not make a certificate.\n");
+      return 1;
+   }
+
+   TlsContext tls;
+   bool loaded = tls.Load(certificate, key);
+   unlink(certificate.c_str());
+   unlink(key.c_str());
+   rmdir(directory);
+   if(!loaded) {
+      return 1;
+   }
+
+   printf("%u handshakes each, ECDSA P-256, loopback:\n", count);
+   Run_(tls, "TLS 1.3 ticket", TLS1_3_VERSION, true, count);
+   Run_(tls, "TLS 1.2 ticket", TLS1_2_VERSION, true, count);
+   Run_(tls, "TLS 1.2 session cache", TLS1_2_VERSION, false, count);
+   return 0;
+}
@@ -0,0 +1,126 @@
+/**
+ * UserStore lookup latency with a lot of users: SQLite against the memory mapped store. Fills both with the same
+ * made up users, then times lookups of random registered names and of names that aren't registered. No UserCache in
+ * front, this is what a cache miss costs.
+ *   scons bench && ./bench/userstore_bench [users] [lookups] [directory]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+using namespace std;
+
+#include "../src/Main/UserStore.hpp"
+
+static double Now_() {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+static string Username_(unsigned int i) {
+   char username[32];
+   snprintf(username, sizeof(username), "user%u", i);
+   return username;
+}
+
+static UserRecord Record_(unsigned int i) {
+   UserRecord record;
+   record.hash.assign(64, (char)i);
+   record.salt.assign(16, (char)(i >> 8));
+   record.scram_salt.assign(16, (char)(i >> 16));
+   record.scram_iterations = 4096;
+   record.sha1_stored_key.assign(20, 1);
+   record.sha1_server_key.assign(20, 2);
+   record.sha256_stored_key.assign(32, 3);
+   record.sha256_server_key.assign(32, 4);
+   return record;
+}
+
+static bool Fill_(UserStore* store, unsigned int users) {
+   const unsigned int per_commit = 10000;
+   for(unsigned int i = 0; i < users; i += per_commit) {
+      if(!store->Begin()) {
+         return false;
+      }
+      for(unsigned int j = i; j < min(users, i + per_commit); j++) {
+         store->Insert(Username_(j), Record_(j));
+      }
+      if(!store->Commit()) {
+         return false;
+      }
+   }
+   return true;
+}
+
+/**
+ * Times each lookup on its own and prints the mean and percentiles. Returns how many were found.
+ */
+static unsigned int Time_(UserStore* store, const char* what, const vector<string>& names) {
+   vector<double> latencies(names.size());
+   unsigned int found = 0;
+   UserRecord record;
+   for(size_t i = 0; i < names.size(); i++) {
+      double start = Now_();
+      found += store->Lookup(names[i], record);
+      latencies[i] = (Now_() - start) * 1000000000.0;
+   }
+
+   double total = 0;
+   for(size_t i = 0; i < latencies.size(); i++) {
+      total += latencies[i];
+   }
+   sort(latencies.begin(), latencies.end());
+   printf("  %-7s %-7s %8.0f ns mean  %8.0f ns p50  %8.0f ns p99  %8.0f ns max\n", store->getName(), what, total / latencies.size(),
+      latencies[latencies.size() / 2], latencies[latencies.size() * 99 / 100], latencies.back());
+   return found;
+}
+
+int main(int argc, char* argv[]) {
+   unsigned int users = argc > 1 ? atoi(argv[1]) : 1000000;
+   unsigned int lookups = argc > 2 ? atoi(argv[2]) : 200000;
+   char directory[] = "/tmp/userstore_bench.XXXXXX";
+   string dir = argc > 3 ? argv[3] : mkdtemp(directory);
+
+   vector<string> hits, misses;
+   srand(1);
+   for(unsigned int i = 0; i < lookups; i++) {
+      hits.push_back(Username_(rand() % users));
+      misses.push_back(Username_(users + rand() % users));
+   }
+
+   printf("%u users, %u lookups each, in %s.\n", users, lookups, dir.c_str());
+
+   const char* types[] = { "sqlite", "mmap" };
+   for(unsigned int t = 0; t < sizeof(types)/sizeof(types[0]); t++) {
+      UserStore* store = UserStore::Create(types[t], dir);
+      if(!store) {
+         printf("Could not open the %s store.\n", types[t]);
+         return 1;
+      }
+      double start = Now_();
+      if(!Fill_(store, users)) {
+         printf("Could not fill the %s store.\n", types[t]);
+         return 1;
+      }
+      printf("  %-7s filled in %.1fs\n", store->getName(), Now_() - start);
+
+      if(Time_(store, "hit", hits) != lookups || Time_(store, "miss", misses) != 0) {
+         printf("Wrong answers from the %s store!\n", types[t]);
+         return 1;
+      }
+      delete store;
+   }
+
+   if(argc <= 3) {
+      const char* files[] = { "users.db", "users.db-wal", "users.db-shm", "users.idx", "users.log" };
+      for(unsigned int i = 0; i < sizeof(files)/sizeof(files[0]); i++) {
+         unlink((dir + "/" + files[i]).c_str());
+      }
+      rmdir(dir.c_str());
+   }
+   return 0;
+}
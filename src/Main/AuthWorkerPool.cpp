@@ -0,0 +1,72 @@
+#include "../Main/AuthWorkerPool.hpp"
+
+#include <boost/bind.hpp>
+
+#include "../Debug/console.h"
+
+AuthWorkerPool::AuthWorkerPool(unsigned int threads, unsigned int max_pending) : work_(new boost::asio::io_service::work(io_service_)), pending_(0), max_pending_(max_pending) {
+   if(threads == 0) {
+      threads = boost::thread::hardware_concurrency();
+   }
+   if(threads == 0) {
+      threads = 1;
+   }
+   warn_pending_ = max_pending_ / 4;
+
+   for(unsigned int i = 0; i < threads; i++) {
+      threads_.create_thread(boost::bind(&boost::asio::io_service::run, &io_service_));
+   }
+   LOG("Created %d auth worker threads.", threads);
+}
+
+AuthWorkerPool::~AuthWorkerPool() {
+   Stop();
+}
+
+/**
+ * Stops the workers, anything still queued is dropped.
+ */
+void AuthWorkerPool::Stop() {
+   work_.reset();
+   io_service_.stop();
+   threads_.join_all();
+}
+
+/**
+ * Queues a job to run on a worker.
+ */
+bool AuthWorkerPool::Submit(const Job& job) {
+   {
+      boost::mutex::scoped_lock lock(pending_mutex_);
+      if(pending_ >= max_pending_) {
+         WARNING("Auth backlog full (%d pending), refusing login. %s", pending_, SYMBOL_WARNING);
+         return false;
+      }
+      pending_++;
+      if(pending_ >= warn_pending_ && warn_pending_ > 0) {
+         WARNING("Auth backlog is %d deep (max %d).", pending_, max_pending_);
+         warn_pending_ *= 2;
+      }
+   }
+   io_service_.post(boost::bind(&AuthWorkerPool::RunJob_, this, job));
+   return true;
+}
+
+unsigned int AuthWorkerPool::getPending() const {
+   boost::mutex::scoped_lock lock(pending_mutex_);
+   return pending_;
+}
+
+void AuthWorkerPool::RunJob_(Job job) {
+   try {
+      job();
+   } catch(std::exception& e) {
+      ERROR("Auth job failed: %s", e.what());
+   }
+
+   boost::mutex::scoped_lock lock(pending_mutex_);
+   pending_--;
+   if(pending_ < max_pending_ / 8) {
+      warn_pending_ = max_pending_ / 4; // Backlog has drained, warn again next time it builds.
+   }
+}
@@ -0,0 +1,40 @@
+#ifndef LAZYXMPP_AUTHWORKERPOOL_HPP_
+#define LAZYXMPP_AUTHWORKERPOOL_HPP_
+
+#include <boost/asio.hpp>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+#include <boost/noncopyable.hpp>
+
+/**
+ * Worker threads for expensive authentication work (password hashing) so it never runs on an io thread.
+ * The queue is bounded, when it is full new jobs are refused and the caller should fail the login for now.
+ */
+class AuthWorkerPool: private boost::noncopyable {
+   public:
+      typedef boost::function<void()> Job;
+
+      AuthWorkerPool(unsigned int threads = 0, unsigned int max_pending = 1024); // threads=0 uses one per core.
+      ~AuthWorkerPool();
+
+      bool Submit(const Job& job); // Returns false if the backlog is full.
+      void Stop();
+
+      unsigned int getPending() const; // Jobs queued or running.
+      unsigned int getMaxPending() const { return max_pending_; }
+
+   private:
+      void RunJob_(Job job);
+
+      boost::asio::io_service io_service_;
+      boost::shared_ptr<boost::asio::io_service::work> work_;
+      boost::thread_group threads_;
+
+      mutable boost::mutex pending_mutex_;
+      unsigned int pending_;
+      unsigned int max_pending_;
+      unsigned int warn_pending_; // Next backlog depth to warn at.
+};
+
+#endif /* LAZYXMPP_AUTHWORKERPOOL_HPP_ */
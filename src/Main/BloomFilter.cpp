@@ -0,0 +1,76 @@
+#include "../Main/BloomFilter.hpp"
+
+#include <algorithm>
+
+static const unsigned int BITS_PER_WORD = sizeof(unsigned long) * 8;
+
+BloomFilter::BloomFilter(unsigned long expected_items, unsigned int bits_per_item) : bits_per_item_(bits_per_item) {
+   if(bits_per_item_ < 1) {
+      bits_per_item_ = 1;
+   }
+   // k = bits per item * ln 2 gives the lowest false positive rate.
+   hashes_ = (bits_per_item_ * 693 + 500) / 1000;
+   if(hashes_ < 1) {
+      hashes_ = 1;
+   }
+   Clear(expected_items);
+}
+
+void BloomFilter::Clear(unsigned long expected_items) {
+   expected_items_ = expected_items < 64 ? 64 : expected_items;
+   bit_count_ = (unsigned long long)expected_items_ * bits_per_item_;
+   bits_.assign((bit_count_ + BITS_PER_WORD - 1) / BITS_PER_WORD, 0);
+   bit_count_ = bits_.size() * BITS_PER_WORD;
+   count_ = 0;
+}
+
+void BloomFilter::swap(BloomFilter& other) {
+   bits_.swap(other.bits_);
+   std::swap(bit_count_, other.bit_count_);
+   std::swap(bits_per_item_, other.bits_per_item_);
+   std::swap(hashes_, other.hashes_);
+   std::swap(expected_items_, other.expected_items_);
+   std::swap(count_, other.count_);
+}
+
+void BloomFilter::Add(const string& key) {
+   unsigned long long h1, h2;
+   Hash_(key, h1, h2);
+   for(unsigned int i = 0; i < hashes_; i++) {
+      unsigned long long bit = (h1 + i * h2) % bit_count_;
+      bits_[bit / BITS_PER_WORD] |= 1UL << (bit % BITS_PER_WORD);
+   }
+   count_++;
+}
+
+bool BloomFilter::MayContain(const string& key) const {
+   unsigned long long h1, h2;
+   Hash_(key, h1, h2);
+   for(unsigned int i = 0; i < hashes_; i++) {
+      unsigned long long bit = (h1 + i * h2) % bit_count_;
+      if(!(bits_[bit / BITS_PER_WORD] & (1UL << (bit % BITS_PER_WORD)))) {
+         return false;
+      }
+   }
+   return true;
+}
+
+/**
+ * Two independent hashes, the k bit positions are h1 + i*h2 (Kirsch and Mitzenmacher). FNV-1a, then a
+ * finaliser mix for the second.
+ */
+void BloomFilter::Hash_(const string& key, unsigned long long& h1, unsigned long long& h2) const {
+   unsigned long long h = 14695981039346656037ULL;
+   for(size_t i = 0; i < key.size(); i++) {
+      h ^= (unsigned char)key[i];
+      h *= 1099511628211ULL;
+   }
+   h1 = h;
+
+   h ^= h >> 33;
+   h *= 0xff51afd7ed558ccdULL;
+   h ^= h >> 33;
+   h *= 0xc4ceb9fe1a85ec53ULL;
+   h ^= h >> 33;
+   h2 = h | 1; // Odd, so it never repeats a position early.
+}
@@ -0,0 +1,36 @@
+#ifndef LAZYXMPP_BLOOMFILTER_HPP_
+#define LAZYXMPP_BLOOMFILTER_HPP_
+
+#include <string>
+#include <vector>
+using namespace std;
+
+/**
+ * A Bloom filter over strings. MayContain() never says no to something that was added, and says yes to something
+ * that wasn't about 1% of the time at 10 bits per item. Not thread safe, callers lock.
+ */
+class BloomFilter {
+   public:
+      BloomFilter(unsigned long expected_items = 1024, unsigned int bits_per_item = 10);
+
+      void Add(const string& key);
+      bool MayContain(const string& key) const;
+      void Clear(unsigned long expected_items); // Empties and resizes it.
+      void swap(BloomFilter& other);
+
+      unsigned long getCount() const { return count_; }
+      bool isOverloaded() const { return count_ > expected_items_; } // Past this the false positive rate climbs, rebuild it bigger.
+      size_t getMemoryUsage() const { return bits_.size() * sizeof(unsigned long); }
+
+   private:
+      void Hash_(const string& key, unsigned long long& h1, unsigned long long& h2) const;
+
+      vector<unsigned long> bits_;
+      unsigned long long bit_count_;
+      unsigned int bits_per_item_;
+      unsigned int hashes_;
+      unsigned long expected_items_;
+      unsigned long count_;
+};
+
+#endif /* LAZYXMPP_BLOOMFILTER_HPP_ */
@@ -0,0 +1,163 @@
+#include "../Main/ConnectionRegistry.hpp"
+
+#include <boost/functional/hash.hpp>
+
+ConnectionRegistry::ConnectionRegistry() {
+   for(size_t i = 0; i < SHARDS; i++) {
+      shards_[i].routes.reset(new RegistryShard());
+   }
+}
+
+/**
+ * Picks the shard from the bare part of a JID, so all of a user's routes change together.
+ */
+ConnectionRegistry::Shard& ConnectionRegistry::getShard_(const string& jid) {
+   size_t slash = jid.find('/');
+   return shards_[boost::hash_range(jid.begin(), slash == string::npos ? jid.end() : jid.begin() + slash) % SHARDS];
+}
+
+const ConnectionRegistry::Shard& ConnectionRegistry::getShard_(const string& jid) const {
+   return const_cast<ConnectionRegistry*>(this)->getShard_(jid);
+}
+
+/**
+ * Reads every shard. Lock free for readers, each stays valid for as long as the caller holds it.
+ */
+void ConnectionRegistry::getSnapshot(RegistrySnapshot& snapshot) const {
+   snapshot.resize(SHARDS);
+   for(size_t i = 0; i < SHARDS; i++) {
+      snapshot[i] = boost::atomic_load(&shards_[i].routes);
+   }
+}
+
+/**
+ * Makes a private copy of a shard's routes. Must hold the shard's writer_mutex.
+ */
+boost::shared_ptr<RegistryShard> ConnectionRegistry::Copy_(const Shard& shard) {
+   return boost::shared_ptr<RegistryShard>(new RegistryShard(*shard.routes));
+}
+
+/**
+ * Swaps in a shard's new routes. Must hold the shard's writer_mutex.
+ */
+void ConnectionRegistry::Publish_(Shard& shard, const boost::shared_ptr<RegistryShard>& routes) {
+   boost::atomic_store(&shard.routes, RegistryShardPtr(routes));
+}
+
+/**
+ * Adds a bound resource to the routing index.
+ */
+bool ConnectionRegistry::addRoute(const LazyXMPPConnectionPtr& connection) {
+   string jid = connection->getJid();
+   string fulljid = connection->getFullJid();
+
+   Shard& shard = getShard_(jid);
+   boost::mutex::scoped_lock lock(shard.writer_mutex);
+   FullJidRoutes::const_iterator full = shard.routes->full_routes.find(fulljid);
+   if(full != shard.routes->full_routes.end() && !full->second.expired()) {
+      return false;
+   }
+
+   boost::shared_ptr<RegistryShard> routes = Copy_(shard);
+   routes->full_routes[fulljid] = connection;
+   routes->bare_routes[jid].push_back(connection);
+   Publish_(shard, routes);
+   return true;
+}
+
+/**
+ * Takes a connection's resource out of the routing index. Dead entries for the same user are cleaned up too.
+ * The full JID is only removed if it still points at this connection, a newer one may have taken it over.
+ */
+void ConnectionRegistry::removeRoute(const string& jid, const string& fulljid, const LazyXMPPConnection* connection) {
+   Shard& shard = getShard_(jid);
+   boost::mutex::scoped_lock lock(shard.writer_mutex);
+   boost::shared_ptr<RegistryShard> routes = Copy_(shard);
+
+   FullJidRoutes::iterator full = routes->full_routes.find(fulljid);
+   if(full != routes->full_routes.end()) {
+      LazyXMPPConnectionPtr current = full->second.lock();
+      if(!current || current.get() == connection) {
+         routes->full_routes.erase(full);
+      }
+   }
+
+   BareJidRoutes::iterator resources = routes->bare_routes.find(jid);
+   if(resources != routes->bare_routes.end()) {
+      Resources& list = resources->second;
+      for(Resources::iterator it = list.begin(); it != list.end(); ) {
+         LazyXMPPConnectionPtr current = it->lock();
+         if(!current || current.get() == connection) {
+            it = list.erase(it);
+         } else {
+            it++;
+         }
+      }
+      if(list.empty()) {
+         routes->bare_routes.erase(resources);
+      }
+   }
+   Publish_(shard, routes);
+}
+
+/**
+ * Points a bound resource at a new connection, for a resumed stream. Whatever the old connection had is swapped
+ * in place, nothing in between sees the resource unbound.
+ */
+void ConnectionRegistry::replaceRoute(const LazyXMPPConnectionPtr& connection, const LazyXMPPConnection* previous) {
+   string jid = connection->getJid();
+   string fulljid = connection->getFullJid();
+
+   Shard& shard = getShard_(jid);
+   boost::mutex::scoped_lock lock(shard.writer_mutex);
+   boost::shared_ptr<RegistryShard> routes = Copy_(shard);
+   routes->full_routes[fulljid] = connection;
+
+   Resources& list = routes->bare_routes[jid];
+   for(Resources::iterator it = list.begin(); it != list.end(); ) {
+      LazyXMPPConnectionPtr current = it->lock();
+      if(!current || current.get() == previous) {
+         it = list.erase(it);
+      } else {
+         it++;
+      }
+   }
+   list.push_back(connection);
+   Publish_(shard, routes);
+}
+
+/**
+ * Looks up the live connections a JID routes to. A bare JID gives all of the user's resources.
+ */
+void ConnectionRegistry::findRoutes(const string& jid, bool fallbackToBare, vector<LazyXMPPConnectionPtr>& targets) const {
+   RegistryShardPtr routes = boost::atomic_load(&getShard_(jid).routes);
+   string bare = jid;
+   size_t slash = jid.find('/');
+
+   if(slash != string::npos) {
+      FullJidRoutes::const_iterator full = routes->full_routes.find(jid);
+      if(full != routes->full_routes.end()) {
+         LazyXMPPConnectionPtr target = full->second.lock();
+         if(target) {
+            targets.push_back(target);
+            return;
+         }
+      }
+
+      if(!fallbackToBare) {
+         return;
+      }
+      bare = jid.substr(0, slash);
+   }
+
+   BareJidRoutes::const_iterator resources = routes->bare_routes.find(bare);
+   if(resources == routes->bare_routes.end()) {
+      return;
+   }
+   for(Resources::const_iterator it = resources->second.begin(); it != resources->second.end(); it++) {
+      LazyXMPPConnectionPtr target = it->lock();
+      if(target) {
+         targets.push_back(target);
+      }
+   }
+}
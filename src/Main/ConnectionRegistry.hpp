@@ -0,0 +1,63 @@
+#ifndef LAZYXMPP_CONNECTIONREGISTRY_HPP_
+#define LAZYXMPP_CONNECTIONREGISTRY_HPP_
+
+#include <vector>
+#include <string>
+using namespace std;
+
+#include <boost/shared_ptr.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/noncopyable.hpp>
+
+#include "../Main/LazyXMPPConnection.hpp"
+
+// Routing index, bound resources keyed by their full and bare JIDs.
+typedef vector<LazyXMPPConnectionWeakPtr> Resources;
+typedef boost::unordered_map<string, LazyXMPPConnectionWeakPtr> FullJidRoutes;
+typedef boost::unordered_map<string, Resources> BareJidRoutes;
+
+/**
+ * An immutable view of the routes of one shard of users at one point in time. A user's full and bare routes are
+ * always in the same shard.
+ */
+struct RegistryShard {
+   FullJidRoutes full_routes;
+   BareJidRoutes bare_routes;
+};
+typedef boost::shared_ptr<const RegistryShard> RegistryShardPtr;
+typedef vector<RegistryShardPtr> RegistrySnapshot; // Every shard, each as it was when it was read.
+
+/**
+ * The JID routing index, copy-on-write in shards by bare JID.
+ * Readers grab a shard (or all of them) and walk it without taking any locks. Binds and unbinds are serialized per
+ * shard, they copy only the shard the user is in, change the copy and publish it.
+ */
+class ConnectionRegistry: private boost::noncopyable {
+   public:
+      ConnectionRegistry();
+
+      void getSnapshot(RegistrySnapshot& snapshot) const;
+
+      bool addRoute(const LazyXMPPConnectionPtr& connection); // Returns false if the full JID is already bound.
+      void removeRoute(const string& jid, const string& fulljid, const LazyXMPPConnection* connection);
+      void replaceRoute(const LazyXMPPConnectionPtr& connection, const LazyXMPPConnection* previous); // connection takes over previous's resource.
+      void findRoutes(const string& jid, bool fallbackToBare, vector<LazyXMPPConnectionPtr>& targets) const;
+
+   private:
+      static const size_t SHARDS = 64;
+
+      struct Shard {
+         RegistryShardPtr routes;
+         boost::mutex writer_mutex;
+      };
+
+      Shard& getShard_(const string& jid); // By the bare part of jid.
+      const Shard& getShard_(const string& jid) const;
+      static boost::shared_ptr<RegistryShard> Copy_(const Shard& shard);
+      static void Publish_(Shard& shard, const boost::shared_ptr<RegistryShard>& routes);
+
+      Shard shards_[SHARDS];
+};
+
+#endif /* LAZYXMPP_CONNECTIONREGISTRY_HPP_ */
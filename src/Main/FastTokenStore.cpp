@@ -0,0 +1,107 @@
+#include "../Main/FastTokenStore.hpp"
+
+#include <crypto++/misc.h>
+
+#include "../Main/Scram.hpp"
+
+static const unsigned int FAST_TOKEN_SIZE = 32; // Random bytes, before base64.
+static const unsigned int FAST_PURGE_INTERVAL = 1024; // Sweep out expired tokens every this many issued.
+
+FastTokenStore::FastTokenStore(unsigned int lifetime) : lifetime_(lifetime), issued_(0) {
+}
+
+string FastTokenStore::Issue(const string& username, const string& agent_id, const string& keep, time_t& expiry) {
+   unsigned char random[FAST_TOKEN_SIZE];
+   time_t now = time(NULL);
+   expiry = now + lifetime_;
+
+   boost::mutex::scoped_lock lock(mutex_);
+   rng_.GenerateBlock(random, FAST_TOKEN_SIZE);
+   string token = Scram::Base64Encode(string((const char*)random, FAST_TOKEN_SIZE));
+
+   Entry& entry = entries_[Key_(username, agent_id)];
+   if(keep.empty()) {
+      entry.previous_count = 0;
+   } else if(keep == entry.current) {
+      entry.previous_count = entry.current_count;
+   } else if(keep != entry.previous) {
+      entry.previous_count = 0;
+   }
+   entry.previous = keep;
+   entry.current = token;
+   entry.current_count = 0;
+   entry.expiry = expiry;
+
+   if(++issued_ % FAST_PURGE_INTERVAL == 0) {
+      PurgeExpired_(now);
+   }
+   return token;
+}
+
+bool FastTokenStore::Verify(const string& username, const string& agent_id, const string& proof, unsigned long count, string& used) {
+   if(count == 0) {
+      return false; // Without a count a proof could be replayed until the token rotates.
+   }
+   time_t now = time(NULL);
+   string current, previous;
+   {
+      boost::mutex::scoped_lock lock(mutex_);
+      Entries::iterator it = entries_.find(Key_(username, agent_id));
+      if(it == entries_.end()) {
+         return false;
+      }
+      if(it->second.expiry < now) {
+         entries_.erase(it);
+         return false;
+      }
+      current = it->second.current;
+      previous = it->second.previous;
+   }
+
+   // Check against both every time so the timing doesn't say which one matched.
+   string current_proof = Proof(current);
+   bool is_current = proof.size() == current_proof.size() && CryptoPP::VerifyBufsEqual((const unsigned char*)proof.data(), (const unsigned char*)current_proof.data(), proof.size());
+   bool is_previous = false;
+   if(!previous.empty()) {
+      string previous_proof = Proof(previous);
+      is_previous = proof.size() == previous_proof.size() && CryptoPP::VerifyBufsEqual((const unsigned char*)proof.data(), (const unsigned char*)previous_proof.data(), proof.size());
+   }
+   if(!is_current && !is_previous) {
+      return false;
+   }
+
+   boost::mutex::scoped_lock lock(mutex_);
+   Entries::iterator it = entries_.find(Key_(username, agent_id));
+   if(it == entries_.end() || (is_current && it->second.current != current) || (!is_current && it->second.previous != previous)) {
+      return false; // Rotated or invalidated while we were checking.
+   }
+   unsigned long& last_count = is_current ? it->second.current_count : it->second.previous_count;
+   if(count <= last_count) {
+      return false; // Replayed.
+   }
+   last_count = count;
+   if(is_current) {
+      it->second.previous.clear(); // The client has the newest token, the old one isn't needed now.
+   }
+   used = is_current ? current : previous;
+   return true;
+}
+
+void FastTokenStore::Invalidate(const string& username, const string& agent_id) {
+   boost::mutex::scoped_lock lock(mutex_);
+   entries_.erase(Key_(username, agent_id));
+}
+
+string FastTokenStore::Proof(const string& token) {
+   return Scram::Hmac(Scram::SHA256, token, "Initiator");
+}
+
+void FastTokenStore::PurgeExpired_(time_t now) {
+   for(Entries::iterator it = entries_.begin(); it != entries_.end();) {
+      if(it->second.expiry < now) {
+         it = entries_.erase(it);
+      } else {
+         ++it;
+      }
+   }
+}
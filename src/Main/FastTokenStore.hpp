@@ -0,0 +1,56 @@
+#ifndef LAZYXMPP_FASTTOKENSTORE_HPP_
+#define LAZYXMPP_FASTTOKENSTORE_HPP_
+
+#include <string>
+#include <ctime>
+using namespace std;
+
+#include <boost/unordered_map.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/noncopyable.hpp>
+
+#include <crypto++/osrng.h>
+
+/**
+ * In memory FAST tokens (XEP-0484), one per user and client (user-agent id).
+ * A token is only good for the client it was issued to. After a token is used a new one is issued, the used one
+ * stays valid until the client shows it has the new one, in case the success never made it across.
+ * Tokens don't survive a restart, clients just do a full login again.
+ */
+class FastTokenStore: private boost::noncopyable {
+   public:
+      FastTokenStore(unsigned int lifetime = 14*24*60*60); // Seconds a token stays valid.
+
+      // Issues a fresh token. keep is the token the client logged in with (if any), it stays valid as well.
+      string Issue(const string& username, const string& agent_id, const string& keep, time_t& expiry);
+
+      // Checks an HT-SHA-256-NONE proof, HMAC-SHA-256(token, "Initiator"). count is the client's <fast count=''>, it
+      // has to be higher than the last one used with the same token. On success used is the matching token.
+      bool Verify(const string& username, const string& agent_id, const string& proof, unsigned long count, string& used);
+
+      void Invalidate(const string& username, const string& agent_id);
+
+      static string Proof(const string& token); // What a client sends for a token.
+
+   private:
+      struct Entry {
+         Entry() : expiry(0), current_count(0), previous_count(0) {}
+         string current;
+         string previous;
+         time_t expiry;
+         unsigned long current_count; // Highest count used with each token.
+         unsigned long previous_count;
+      };
+      typedef boost::unordered_map<string, Entry> Entries;
+
+      static string Key_(const string& username, const string& agent_id) { return username + '\0' + agent_id; }
+      void PurgeExpired_(time_t now);
+
+      Entries entries_;
+      boost::mutex mutex_; // Guards entries_ and rng_.
+      CryptoPP::AutoSeededRandomPool rng_;
+      unsigned int lifetime_;
+      unsigned int issued_;
+};
+
+#endif /* LAZYXMPP_FASTTOKENSTORE_HPP_ */
@@ -0,0 +1,610 @@
+#include "../Main/FullTextIndex.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <map>
+
+#include <boost/filesystem.hpp>
+namespace fs=boost::filesystem;
+
+#include "../Main/RawStanza.hpp"
+#include "../Debug/console.h"
+
+static const char RUN_MAGIC[8] = "LXFTS1";
+static const size_t MIN_TERM = 2; // Bytes, single letters aren't worth a posting list.
+static const size_t MAX_TERM = 64;
+static const size_t WRITE_BUFFER = 1 << 20;
+
+struct RunHeader {
+   char magic[8];
+   unsigned long long min_id;
+   unsigned long long max_id;
+   unsigned long long dict_offset;
+   unsigned int term_count;
+   unsigned int reserved;
+};
+
+// The dictionary is term_count of these, sorted by term, then the terms themselves.
+struct RunDictEntry {
+   unsigned long long postings_offset;
+   unsigned int postings_length;
+   unsigned int count;
+   unsigned int term_offset; // From the end of the entries.
+   unsigned int term_length;
+};
+
+static void PutVarint_(string& out, unsigned long long value) {
+   while(value >= 0x80) {
+      out.push_back((char)(value | 0x80));
+      value >>= 7;
+   }
+   out.push_back((char)value);
+}
+
+static bool GetVarint_(const unsigned char*& p, const unsigned char* end, unsigned long long& value) {
+   value = 0;
+   for(int shift = 0; p < end && shift < 64; shift += 7) {
+      unsigned char byte = *p++;
+      value |= (unsigned long long)(byte & 0x7f) << shift;
+      if(!(byte & 0x80)) {
+         return true;
+      }
+   }
+   return false;
+}
+
+/**
+ * A run mapped for reading. Terms are found by binary search on the dictionary.
+ */
+class FullTextIndex::RunReader {
+   public:
+      RunReader(const string& path) : map_(NULL), size_(0), entries_(NULL), terms_(NULL) {
+         int fd = open(path.c_str(), O_RDONLY);
+         if(fd < 0) {
+            ERROR("Could not open search index run '%s': %s", path.c_str(), strerror(errno));
+            return;
+         }
+         struct stat st;
+         if(fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(RunHeader)) {
+            void* map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            if(map != MAP_FAILED) {
+               map_ = (const char*)map;
+               size_ = st.st_size;
+            }
+         }
+         close(fd);
+         if(!map_) {
+            return;
+         }
+
+         memcpy(&header_, map_, sizeof(header_));
+         unsigned long long terms_at = header_.dict_offset + (unsigned long long)header_.term_count * sizeof(RunDictEntry);
+         if(memcmp(header_.magic, RUN_MAGIC, sizeof(RUN_MAGIC)) != 0 || header_.dict_offset > size_ || terms_at > size_) {
+            ERROR("'%s' isn't a search index run.", path.c_str());
+            Close_();
+            return;
+         }
+         entries_ = map_ + header_.dict_offset;
+         terms_ = map_ + terms_at;
+      }
+
+      ~RunReader() { Close_(); }
+
+      bool isOpen() const { return map_ != NULL; }
+      const RunHeader& getHeader() const { return header_; }
+      unsigned int getTermCount() const { return header_.term_count; }
+
+      string getTerm(unsigned int i) const {
+         RunDictEntry entry = getEntry_(i);
+         if(!isTermInBounds_(entry)) {
+            return "";
+         }
+         return string(terms_ + entry.term_offset, entry.term_length);
+      }
+
+      // Appends the ids in term i's posting list to ids.
+      bool getPostings(unsigned int i, vector<unsigned long long>& ids) const {
+         RunDictEntry entry = getEntry_(i);
+         if(entry.postings_offset + entry.postings_length > header_.dict_offset) {
+            return false;
+         }
+         const unsigned char* p = (const unsigned char*)map_ + entry.postings_offset;
+         const unsigned char* end = p + entry.postings_length;
+         unsigned long long id = 0;
+         unsigned long long delta;
+         ids.reserve(ids.size() + entry.count);
+         for(unsigned int n = 0; n < entry.count; n++) {
+            if(!GetVarint_(p, end, delta)) {
+               return false;
+            }
+            id += delta;
+            ids.push_back(id);
+         }
+         return true;
+      }
+
+      // Returns term_count if it's not there.
+      unsigned int Find(const string& term) const {
+         unsigned int lo = 0;
+         unsigned int hi = header_.term_count;
+         while(lo < hi) {
+            unsigned int mid = lo + (hi - lo) / 2;
+            RunDictEntry entry = getEntry_(mid);
+            if(!isTermInBounds_(entry)) {
+               return header_.term_count;
+            }
+            int c = memcmp(terms_ + entry.term_offset, term.data(), min((size_t)entry.term_length, term.size()));
+            if(c == 0) {
+               c = entry.term_length < term.size() ? -1 : (entry.term_length > term.size() ? 1 : 0);
+            }
+            if(c == 0) {
+               return mid;
+            }
+            if(c < 0) {
+               lo = mid + 1;
+            } else {
+               hi = mid;
+            }
+         }
+         return header_.term_count;
+      }
+
+   private:
+      RunDictEntry getEntry_(unsigned int i) const {
+         RunDictEntry entry;
+         memcpy(&entry, entries_ + (size_t)i * sizeof(RunDictEntry), sizeof(entry));
+         return entry;
+      }
+
+      bool isTermInBounds_(const RunDictEntry& entry) const {
+         return (unsigned long long)(terms_ - map_) + entry.term_offset + entry.term_length <= size_;
+      }
+
+      void Close_() {
+         if(map_) {
+            munmap((void*)map_, size_);
+            map_ = NULL;
+         }
+      }
+
+      const char* map_;
+      size_t size_;
+      RunHeader header_;
+      const char* entries_;
+      const char* terms_;
+};
+
+/**
+ * Writes a run, terms in sorted order. It goes to a temporary file that's only renamed into place once it's synced.
+ */
+class FullTextIndex::RunWriter {
+   public:
+      RunWriter(const string& path) : path_(path), fd_(-1), offset_(sizeof(RunHeader)) {
+         fd_ = open((path_ + ".tmp").c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+         if(fd_ < 0) {
+            ERROR("Could not create search index run '%s': %s", path_.c_str(), strerror(errno));
+         }
+      }
+
+      ~RunWriter() {
+         if(fd_ >= 0) {
+            // Never finished.
+            close(fd_);
+            unlink((path_ + ".tmp").c_str());
+         }
+      }
+
+      void Add(const string& term, const vector<unsigned long long>& ids) {
+         RunDictEntry entry;
+         entry.postings_offset = offset_ + buffer_.size();
+         entry.count = ids.size();
+         entry.term_offset = terms_.size();
+         entry.term_length = term.size();
+         size_t start = buffer_.size();
+         unsigned long long last = 0;
+         for(vector<unsigned long long>::const_iterator it = ids.begin(); it != ids.end(); it++) {
+            PutVarint_(buffer_, *it - last);
+            last = *it;
+         }
+         entry.postings_length = buffer_.size() - start;
+         dict_.append((const char*)&entry, sizeof(entry));
+         terms_.append(term);
+         if(buffer_.size() >= WRITE_BUFFER) {
+            Write_(buffer_);
+         }
+      }
+
+      bool Finish(unsigned long long min_id, unsigned long long max_id) {
+         RunHeader header;
+         memset(&header, 0, sizeof(header));
+         memcpy(header.magic, RUN_MAGIC, sizeof(RUN_MAGIC));
+         header.min_id = min_id;
+         header.max_id = max_id;
+         header.dict_offset = offset_ + buffer_.size();
+         header.term_count = dict_.size() / sizeof(RunDictEntry);
+
+         bool ok = Write_(buffer_) && Write_(dict_) && Write_(terms_) && fd_ >= 0;
+         ok = ok && pwrite(fd_, &header, sizeof(header), 0) == (ssize_t)sizeof(header) && fdatasync(fd_) == 0;
+         if(fd_ >= 0) {
+            close(fd_);
+            fd_ = -1;
+         }
+         if(!ok || rename((path_ + ".tmp").c_str(), path_.c_str()) != 0) {
+            ERROR("Could not write search index run '%s': %s", path_.c_str(), strerror(errno));
+            unlink((path_ + ".tmp").c_str());
+            return false;
+         }
+         return true;
+      }
+
+   private:
+      bool Write_(string& data) {
+         if(fd_ < 0) {
+            return false;
+         }
+         const char* p = data.data();
+         size_t left = data.size();
+         while(left > 0) {
+            ssize_t written = pwrite(fd_, p, left, offset_);
+            if(written < 0 && errno == EINTR) {
+               continue;
+            }
+            if(written <= 0) {
+               close(fd_);
+               fd_ = -1;
+               return false;
+            }
+            p += written;
+            left -= written;
+            offset_ += written;
+         }
+         data.clear();
+         return true;
+      }
+
+      string path_;
+      int fd_;
+      unsigned long long offset_;
+      string buffer_; // Postings not written yet.
+      string dict_;
+      string terms_;
+};
+
+FullTextIndex::FullTextIndex(const string& directory, size_t max_buffered, unsigned int max_runs) : directory_(directory), max_buffered_(max_buffered), max_runs_(max_runs), buffered_(0) {
+}
+
+FullTextIndex::~FullTextIndex() {
+}
+
+unsigned long long FullTextIndex::getIndexedUpTo(const string& owner) {
+   return getPartition_(owner).indexed_up_to;
+}
+
+/**
+ * Adds a message's body to owner's buffer. Once every buffer together holds too much they're all written out.
+ */
+void FullTextIndex::Add(const string& owner, unsigned long long id, const string& stanza) {
+   Partition& partition = getPartition_(owner);
+   if(id <= partition.indexed_up_to) {
+      return; // Already there.
+   }
+   partition.indexed_up_to = id;
+
+   size_t open = stanza.find("<body");
+   while(open != string::npos && stanza.find_first_of(" \t\r\n/>", open + 5) != open + 5) {
+      open = stanza.find("<body", open + 5);
+   }
+   size_t body = open == string::npos ? open : stanza.find('>', open);
+   size_t close = body == string::npos ? body : stanza.find("</body>", body);
+   if(close == string::npos || stanza[body - 1] == '/') {
+      return;
+   }
+
+   vector<string> terms;
+   Tokenize(RawStanza::Unescape(stanza.substr(body + 1, close - body - 1)), terms);
+   for(vector<string>::iterator it = terms.begin(); it != terms.end(); it++) {
+      partition.buffer[*it].push_back(id);
+   }
+   partition.buffered += terms.size();
+   buffered_ += terms.size();
+   if(buffered_ > max_buffered_) {
+      Flush();
+   }
+}
+
+/**
+ * Looks up every word in each run and the buffer, then intersects the lists, shortest first. The lists come out in
+ * id order because the runs are in order and everything buffered is newer than they are.
+ */
+void FullTextIndex::Find(const string& owner, const string& text, vector<unsigned long long>& ids) {
+   ids.clear();
+   vector<string> terms;
+   Tokenize(text, terms);
+   if(terms.empty()) {
+      return;
+   }
+
+   Partition& partition = getPartition_(owner);
+   vector<vector<unsigned long long> > lists(terms.size());
+   for(vector<Run>::iterator run = partition.runs.begin(); run != partition.runs.end(); run++) {
+      RunReader reader(getRunPath_(owner, run->seq));
+      if(!reader.isOpen()) {
+         continue;
+      }
+      for(size_t i = 0; i < terms.size(); i++) {
+         unsigned int at = reader.Find(terms[i]);
+         if(at < reader.getTermCount()) {
+            reader.getPostings(at, lists[i]);
+         }
+      }
+   }
+   for(size_t i = 0; i < terms.size(); i++) {
+      boost::unordered_map<string, vector<unsigned long long> >::iterator buffered = partition.buffer.find(terms[i]);
+      if(buffered != partition.buffer.end()) {
+         lists[i].insert(lists[i].end(), buffered->second.begin(), buffered->second.end());
+      }
+   }
+
+   size_t shortest = 0;
+   for(size_t i = 1; i < lists.size(); i++) {
+      if(lists[i].size() < lists[shortest].size()) {
+         shortest = i;
+      }
+   }
+   ids.swap(lists[shortest]);
+   vector<unsigned long long> both;
+   for(size_t i = 0; i < lists.size() && !ids.empty(); i++) {
+      if(i == shortest) {
+         continue;
+      }
+      both.clear();
+      set_intersection(ids.begin(), ids.end(), lists[i].begin(), lists[i].end(), back_inserter(both));
+      ids.swap(both);
+   }
+}
+
+void FullTextIndex::Flush() {
+   for(boost::unordered_map<string, Partition>::iterator it = partitions_.begin(); it != partitions_.end(); it++) {
+      FlushPartition_(it->first, it->second);
+   }
+   // They're cheap to load again, only the run headers are read.
+   partitions_.clear();
+   buffered_ = 0;
+}
+
+/**
+ * Writes a partition's buffer out as a new run, merging the runs if that makes too many.
+ */
+void FullTextIndex::FlushPartition_(const string& owner, Partition& partition) {
+   if(partition.buffer.empty()) {
+      return;
+   }
+
+   map<string, vector<unsigned long long>*> sorted;
+   unsigned long long min_id = ~0ULL;
+   for(boost::unordered_map<string, vector<unsigned long long> >::iterator it = partition.buffer.begin(); it != partition.buffer.end(); it++) {
+      sorted[it->first] = &it->second;
+      min_id = min(min_id, it->second.front());
+   }
+
+   try {
+      fs::create_directories(getPartitionPath_(owner));
+   } catch(fs::filesystem_error& e) {
+      ERROR("%s", e.what());
+      return;
+   }
+
+   Run run;
+   run.seq = partition.next_seq++;
+   run.min_id = min_id;
+   run.max_id = partition.indexed_up_to;
+   RunWriter writer(getRunPath_(owner, run.seq));
+   for(map<string, vector<unsigned long long>*>::iterator it = sorted.begin(); it != sorted.end(); it++) {
+      writer.Add(it->first, *it->second);
+   }
+   if(!writer.Finish(run.min_id, run.max_id)) {
+      // The archive will hand them over again next time the partition is loaded.
+      return;
+   }
+   partition.runs.push_back(run);
+   partition.buffer.clear();
+   buffered_ -= min(buffered_, partition.buffered);
+   partition.buffered = 0;
+
+   if(partition.runs.size() > max_runs_) {
+      Merge_(owner, partition);
+   }
+}
+
+/**
+ * Merges all of a partition's runs into one, walking their dictionaries side by side so only one word's postings
+ * are in memory at a time. The old runs are removed once the new one is in place. If that's interrupted they're
+ * noticed as covered by the merged run and removed the next time the partition is loaded.
+ */
+void FullTextIndex::Merge_(const string& owner, Partition& partition) {
+   vector<RunReader*> readers;
+   for(vector<Run>::iterator it = partition.runs.begin(); it != partition.runs.end(); it++) {
+      RunReader* reader = new RunReader(getRunPath_(owner, it->seq));
+      readers.push_back(reader);
+      if(!reader->isOpen()) {
+         // Leave them all be rather than lose its words.
+         for(size_t i = 0; i < readers.size(); i++) {
+            delete readers[i];
+         }
+         return;
+      }
+   }
+
+   Run merged;
+   merged.seq = partition.next_seq++;
+   merged.min_id = partition.runs.front().min_id;
+   merged.max_id = partition.runs.back().max_id;
+   RunWriter writer(getRunPath_(owner, merged.seq));
+
+   vector<unsigned int> next(readers.size(), 0);
+   vector<string> heads(readers.size());
+   for(size_t i = 0; i < readers.size(); i++) {
+      if(readers[i]->getTermCount() > 0) {
+         heads[i] = readers[i]->getTerm(0);
+      }
+   }
+   vector<unsigned long long> ids;
+   for(;;) {
+      // The smallest word at the head of any run.
+      const string* term = NULL;
+      for(size_t i = 0; i < readers.size(); i++) {
+         if(next[i] < readers[i]->getTermCount() && (!term || heads[i] < *term)) {
+            term = &heads[i];
+         }
+      }
+      if(!term) {
+         break;
+      }
+      string word = *term;
+      ids.clear();
+      for(size_t i = 0; i < readers.size(); i++) {
+         if(next[i] < readers[i]->getTermCount() && heads[i] == word) {
+            readers[i]->getPostings(next[i], ids);
+            if(++next[i] < readers[i]->getTermCount()) {
+               heads[i] = readers[i]->getTerm(next[i]);
+            }
+         }
+      }
+      writer.Add(word, ids);
+   }
+
+   bool ok = writer.Finish(merged.min_id, merged.max_id);
+   for(size_t i = 0; i < readers.size(); i++) {
+      delete readers[i];
+   }
+   if(!ok) {
+      return;
+   }
+
+   for(vector<Run>::iterator it = partition.runs.begin(); it != partition.runs.end(); it++) {
+      unlink(getRunPath_(owner, it->seq).c_str());
+   }
+   partition.runs.clear();
+   partition.runs.push_back(merged);
+   DEBUG_M("Merged the search index runs for '%s'.", owner.c_str());
+}
+
+/**
+ * Finds a partition, or loads it from the headers of its runs. A run whose ids are all inside another run's is left
+ * over from an interrupted merge.
+ */
+FullTextIndex::Partition& FullTextIndex::getPartition_(const string& owner) {
+   boost::unordered_map<string, Partition>::iterator found = partitions_.find(owner);
+   if(found != partitions_.end()) {
+      return found->second;
+   }
+   Partition& partition = partitions_[owner];
+
+   string path = getPartitionPath_(owner);
+   vector<Run> runs;
+   try {
+      if(!fs::exists(path)) {
+         return partition;
+      }
+      for(fs::directory_iterator it(path); it != fs::directory_iterator(); it++) {
+         string name = it->path().filename().string();
+         if(name.size() != 12 || name.compare(8, 4, ".run") != 0) {
+            if(name.size() > 4 && name.compare(name.size() - 4, 4, ".tmp") == 0) {
+               unlink(it->path().string().c_str());
+            }
+            continue;
+         }
+         Run run;
+         run.seq = strtoul(name.c_str(), NULL, 10);
+         RunReader reader(it->path().string());
+         if(!reader.isOpen()) {
+            continue;
+         }
+         run.min_id = reader.getHeader().min_id;
+         run.max_id = reader.getHeader().max_id;
+         runs.push_back(run);
+         partition.next_seq = max(partition.next_seq, run.seq + 1);
+      }
+   } catch(fs::filesystem_error& e) {
+      ERROR("%s", e.what());
+      return partition;
+   }
+
+   for(size_t i = 0; i < runs.size(); i++) {
+      bool covered = false;
+      for(size_t j = 0; j < runs.size() && !covered; j++) {
+         covered = j != i && runs[j].min_id <= runs[i].min_id && runs[j].max_id >= runs[i].max_id && (runs[j].min_id != runs[i].min_id || runs[j].max_id != runs[i].max_id || runs[j].seq > runs[i].seq);
+      }
+      if(covered) {
+         unlink(getRunPath_(owner, runs[i].seq).c_str());
+         continue;
+      }
+      partition.runs.push_back(runs[i]);
+      partition.indexed_up_to = max(partition.indexed_up_to, runs[i].max_id);
+   }
+   for(size_t i = 1; i < partition.runs.size(); i++) {
+      for(size_t j = i; j > 0 && partition.runs[j].min_id < partition.runs[j - 1].min_id; j--) {
+         swap(partition.runs[j], partition.runs[j - 1]);
+      }
+   }
+   return partition;
+}
+
+/**
+ * Splits text into words: runs of letters and digits, lower cased. Anything outside ASCII counts as a letter, so
+ * UTF-8 words stay in one piece.
+ */
+void FullTextIndex::Tokenize(const string& text, vector<string>& terms) {
+   terms.clear();
+   string word;
+   for(size_t i = 0; i <= text.size(); i++) {
+      unsigned char c = i < text.size() ? text[i] : ' ';
+      if(c >= 0x80 || (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z')) {
+         word.push_back(c);
+      } else if(c >= 'A' && c <= 'Z') {
+         word.push_back(c - 'A' + 'a');
+      } else if(!word.empty()) {
+         if(word.size() >= MIN_TERM && word.size() <= MAX_TERM) {
+            terms.push_back(word);
+         }
+         word.clear();
+      }
+   }
+   sort(terms.begin(), terms.end());
+   terms.erase(unique(terms.begin(), terms.end()), terms.end());
+}
+
+string FullTextIndex::getFileName(const string& jid) {
+   static const char hex[] = "0123456789abcdef";
+   string name;
+   for(size_t i = 0; i < jid.size(); i++) {
+      unsigned char c = jid[i];
+      if(isalnum(c) || c == '@' || c == '-' || c == '_' || (c == '.' && i > 0)) {
+         name += c;
+      } else {
+         name += '%';
+         name += hex[c >> 4];
+         name += hex[c & 15];
+      }
+   }
+   return name;
+}
+
+string FullTextIndex::getPartitionPath_(const string& owner) const {
+   return directory_ + "/" + getFileName(owner);
+}
+
+string FullTextIndex::getRunPath_(const string& owner, unsigned int seq) const {
+   char name[32];
+   snprintf(name, sizeof(name), "/%08u.run", seq);
+   return getPartitionPath_(owner) + name;
+}
@@ -0,0 +1,65 @@
+#ifndef LAZYXMPP_FULLTEXTINDEX_HPP_
+#define LAZYXMPP_FULLTEXTINDEX_HPP_
+
+#include <string>
+#include <vector>
+using namespace std;
+
+#include <boost/unordered_map.hpp>
+#include <boost/noncopyable.hpp>
+
+/**
+ * Inverted index over the message archive's bodies, one partition per user so a search only ever touches the
+ * searcher's own messages. New postings are kept in memory and written out as an immutable run: a posting list per
+ * word (archive ids, delta and varint encoded) and a sorted dictionary of the words to binary search. Once a user
+ * has too many runs they're merged into one.
+ *
+ * Nothing here is logged, it can all be rebuilt from the archive. Each partition knows the newest archive id it has,
+ * so after a crash the archive feeds it whatever it lost. Not thread safe, it belongs to the archive's thread.
+ */
+class FullTextIndex: private boost::noncopyable {
+   public:
+      FullTextIndex(const string& directory, size_t max_buffered = 1 << 20, unsigned int max_runs = 8);
+      ~FullTextIndex();
+
+      unsigned long long getIndexedUpTo(const string& owner); // The newest archive id in owner's partition.
+      void Add(const string& owner, unsigned long long id, const string& stanza); // Ids must go up.
+      void Find(const string& owner, const string& text, vector<unsigned long long>& ids); // Messages with every word in text, oldest first.
+      void Flush(); // Writes out every partition's buffer.
+
+      static void Tokenize(const string& text, vector<string>& terms); // Lower case words, each only once.
+      static string getFileName(const string& jid); // Anything that isn't safe in a file name hex escaped.
+
+   private:
+      struct Run {
+         unsigned int seq;
+         unsigned long long min_id;
+         unsigned long long max_id;
+      };
+
+      struct Partition {
+         Partition() : indexed_up_to(0), next_seq(1), buffered(0) {}
+         vector<Run> runs; // Oldest first.
+         boost::unordered_map<string, vector<unsigned long long> > buffer; // Word -> ids not written yet.
+         unsigned long long indexed_up_to;
+         unsigned int next_seq;
+         size_t buffered;
+      };
+
+      class RunReader;
+      class RunWriter;
+
+      Partition& getPartition_(const string& owner); // Loads it the first time.
+      void FlushPartition_(const string& owner, Partition& partition);
+      void Merge_(const string& owner, Partition& partition);
+      string getPartitionPath_(const string& owner) const;
+      string getRunPath_(const string& owner, unsigned int seq) const;
+
+      string directory_;
+      size_t max_buffered_;
+      unsigned int max_runs_;
+      size_t buffered_; // Postings in every partition's buffer.
+      boost::unordered_map<string, Partition> partitions_;
+};
+
+#endif /* LAZYXMPP_FULLTEXTINDEX_HPP_ */
@@ -0,0 +1,109 @@
+#include "../Main/IoServicePool.hpp"
+
+#include <boost/bind.hpp>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include "../Debug/console.h"
+
+/**
+ * Creates the io_services. A size of 0 uses one per hardware thread.
+ */
+IoServicePool::IoServicePool(unsigned int size, bool pinThreads) : next_(0), pinThreads_(pinThreads), running_(false) {
+   if(size == 0) {
+      size = boost::thread::hardware_concurrency();
+   }
+   if(size == 0) {
+      size = 1;
+   }
+
+   for(unsigned int i = 0; i < size; i++) {
+      IoServicePtr io_service(new boost::asio::io_service(1)); // Each io_service is only ever run from one thread.
+      io_services_.push_back(io_service);
+      // Keep run() from returning while there is nothing to do.
+      work_.push_back(WorkPtr(new boost::asio::io_service::work(*io_service)));
+   }
+   LOG("Created %d io threads.", size);
+}
+
+IoServicePool::~IoServicePool() {
+   Stop();
+}
+
+/**
+ * Starts a thread for each io_service.
+ */
+void IoServicePool::Run() {
+   if(running_) {
+      return;
+   }
+   running_ = true;
+   for(unsigned int i = 0; i < io_services_.size(); i++) {
+      threads_.create_thread(boost::bind(&IoServicePool::RunThread_, this, i));
+   }
+}
+
+/**
+ * Stops every io_service and waits for all their threads to exit.
+ */
+void IoServicePool::Stop() {
+   work_.clear();
+   for(unsigned int i = 0; i < io_services_.size(); i++) {
+      io_services_[i]->stop();
+   }
+   if(running_) {
+      threads_.join_all();
+      running_ = false;
+   }
+}
+
+/**
+ * Returns the next io_service to put a connection on.
+ */
+boost::asio::io_service& IoServicePool::getIoService() {
+   boost::mutex::scoped_lock lock(next_mutex_);
+   boost::asio::io_service& io_service = *io_services_[next_];
+   next_ = (next_ + 1) % io_services_.size();
+   return io_service;
+}
+
+/**
+ * Thread entry point, runs the io_service at index.
+ */
+void IoServicePool::RunThread_(unsigned int index) {
+   if(pinThreads_) {
+      pinThread_(index);
+   }
+
+   DEBUG_M("io thread %d running.", index);
+   try {
+      io_services_[index]->run();
+   } catch(exception& e) {
+      ERROR("io thread %d: %s. %s", index, e.what(), SYMBOL_FATAL);
+   }
+   DEBUG_M("io thread %d finished.", index);
+}
+
+/**
+ * Pins the calling thread to a single CPU.
+ */
+void IoServicePool::pinThread_(unsigned int index) const {
+#ifdef __linux__
+   unsigned int cpus = boost::thread::hardware_concurrency();
+   if(cpus == 0) {
+      return;
+   }
+
+   cpu_set_t cpuset;
+   CPU_ZERO(&cpuset);
+   CPU_SET(index % cpus, &cpuset);
+   if(pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset) != 0) {
+      WARNING("Could not pin io thread %d to cpu %d.", index, index % cpus);
+   }
+#else
+   WARNING("CPU pinning is not supported on this platform.");
+#endif
+}
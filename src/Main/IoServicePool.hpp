@@ -0,0 +1,44 @@
+#ifndef LAZYXMPP_IOSERVICEPOOL_HPP_
+#define LAZYXMPP_IOSERVICEPOOL_HPP_
+
+#include <vector>
+using namespace std;
+
+#include <boost/asio.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+#include <boost/noncopyable.hpp>
+
+/**
+ * A pool of io_services, one per thread, so each core runs it's own event loop.
+ * Connections are handed out round robin and stay on the same loop for their lifetime.
+ */
+class IoServicePool: private boost::noncopyable {
+   public:
+      IoServicePool(unsigned int size = 0, bool pinThreads = false);
+      ~IoServicePool();
+
+      void Run(); // Start a thread for each io_service.
+      void Stop(); // Stop all the io_services and wait for their threads to finish.
+
+      boost::asio::io_service& getIoService(); // Get the next io_service (round robin).
+      boost::asio::io_service& getAcceptorIoService() { return *io_services_[0]; } // The io_service the acceptors live on.
+      unsigned int getSize() const { return io_services_.size(); }
+
+   private:
+      typedef boost::shared_ptr<boost::asio::io_service> IoServicePtr;
+      typedef boost::shared_ptr<boost::asio::io_service::work> WorkPtr;
+
+      void RunThread_(unsigned int index);
+      void pinThread_(unsigned int index) const;
+
+      vector<IoServicePtr> io_services_;
+      vector<WorkPtr> work_;
+      boost::thread_group threads_;
+      boost::mutex next_mutex_;
+      unsigned int next_;
+      bool pinThreads_;
+      bool running_;
+};
+
+#endif /* LAZYXMPP_IOSERVICEPOOL_HPP_ */
@@ -1,21 +1,33 @@
 #include "../Main/LazyXMPP.hpp"
 
+#include <stdlib.h>
+
 #include <boost/bind.hpp>
 
+#include "../Main/RawStanza.hpp"
 #include "../Debug/console.h"
 
-LazyXMPP::LazyXMPP(int port, bool enableIPv6, bool enableIPv4) : port_(port), enableIPv6_(enableIPv6), enableIPv4_(enableIPv4) {
+LazyXMPP::LazyXMPP(int port, bool enableIPv6, bool enableIPv4, unsigned int threads, bool pinThreads, const string& userStore) : userdb(userStore), port_(port), io_pool_(threads, pinThreads), passwordBatcher_(&userdb, authPool_), enableIPv6_(enableIPv6), enableIPv4_(enableIPv4) {
    LOG("Starting LazyXMPP server.");
    acceptor4_ = NULL;
    acceptor6_ = NULL;
 
    // TODO: Security!
-   enableTLS_ = false;
+   const char* home = getenv("HOME");
+   string tlsdir = string(home ? home : "") + "/.config/LazyXMPP/tls/";
+   enableTLS_ = tls_.Load(tlsdir + "cert.pem", tlsdir + "key.pem");
    enableRegistration_ = true;
    enableAnonymousAuth_ = false;
    enablePlainAuth_ = true;
+   enableScramAuth_ = true;
+   enableSasl2_ = true;
+   enableFastAuth_ = true;
    enableUnencryptedAnonymousAuth_ = true;
    enableUnencryptedPlainAuth_ = true;
+   enableCompression_ = true;
+   compressionLevel_ = -1; // Z_DEFAULT_COMPRESSION
+   enableStreamManagement_ = true;
+   resumeTimeout_ = 300;
    
    if(!enableIPv6 && !enableIPv4) {
       LOG("You must enable a socket type!");
@@ -35,7 +47,7 @@ LazyXMPP::LazyXMPP(int port, bool enableIPv6, bool enableIPv4) : port_(port), en
 
          // On POSIX compatible systems and Windows starting at Vista, dual stack allows for both IPv4 and IPv6 on the one interface.
          
-         acceptor6_ = new tcp::acceptor(io_service_, tcp::endpoint(tcp::v6(), port));
+         acceptor6_ = new tcp::acceptor(io_pool_.getAcceptorIoService(), tcp::endpoint(tcp::v6(), port));
       } catch(exception& e) {
          ERROR("%s. %s", e.what(), SYMBOL_FATAL);
       }
@@ -52,7 +64,7 @@ LazyXMPP::LazyXMPP(int port, bool enableIPv6, bool enableIPv4) : port_(port), en
       try {
          // If there is no IPv6 socket or the socket doesn't support dual stack with IPv4, bring up a seperate IPv4 socket.
          if(!acceptor6_ || !isDualStack_) {
-            acceptor4_ = new tcp::acceptor(io_service_, tcp::endpoint(tcp::v4(), port));
+            acceptor4_ = new tcp::acceptor(io_pool_.getAcceptorIoService(), tcp::endpoint(tcp::v4(), port));
          } else {
             DEBUG_M("Dual stack supported, skipping IPv4 socket...");
          }
@@ -71,13 +83,15 @@ LazyXMPP::LazyXMPP(int port, bool enableIPv6, bool enableIPv4) : port_(port), en
       ERROR("%s. %s", e.what(), SYMBOL_FATAL);
    }
 
+   offline_.Start();
+   archive_.Start();
+
    try {
-      // Thead off the io_service...
-      thread_.reset(new boost::thread(boost::bind(&boost::asio::io_service::run, &io_service_)));
+      // Thread off the io_services, one thread each...
+      io_pool_.Run();
       LOG("LazyXMPP server started.");
-      thread_->detach();
-   } catch (void *e) {
-      ERROR("Could not create thread...");
+   } catch (exception& e) {
+      ERROR("Could not create io threads: %s", e.what());
    }  
 }
 
@@ -88,50 +102,197 @@ void LazyXMPP::StartAccepting_() {
    DEBUG_M("LazyXMPP binding accept handler.");
    
    if(acceptor6_) {
-      LazyXMPPConnectionPtr session6(new LazyXMPPConnection(io_service_, this));
-      acceptor6_->async_accept(session6->getSocket_(), boost::bind(&LazyXMPP::AcceptHandler_, this, session6, boost::asio::placeholders::error));
+      StartAccepting_(acceptor6_);
    }
    
    if(acceptor4_) {
-      LazyXMPPConnectionPtr session4(new LazyXMPPConnection(io_service_, this));
-      acceptor4_->async_accept(session4->getSocket_(), boost::bind(&LazyXMPP::AcceptHandler_, this, session4, boost::asio::placeholders::error));
+      StartAccepting_(acceptor4_);
    }
    
    DEBUG_M("bound accept handler.");
 }
 
+/**
+ * Bind ASIO to accept a connection on a single acceptor.
+ */
+void LazyXMPP::StartAccepting_(tcp::acceptor* acceptor) {
+   // New connections are spread across the io_services, the acceptors themselves all live on the first one.
+   LazyXMPPConnectionPtr session(new LazyXMPPConnection(io_pool_.getIoService(), this));
+   acceptor->async_accept(session->getSocket_(), boost::bind(&LazyXMPP::AcceptHandler_, this, acceptor, session, boost::asio::placeholders::error));
+}
+
 /**
  * Fires when a new connection is recieved, accepts it.
  */
-void LazyXMPP::AcceptHandler_(LazyXMPPConnectionPtr session, const boost::system::error_code& error) {
+void LazyXMPP::AcceptHandler_(tcp::acceptor* acceptor, LazyXMPPConnectionPtr session, const boost::system::error_code& error) {
    DEBUG_M("AcceptHandler fired.");
    if(!error) {
       LOG("Connection from %s.", session->getAddress().c_str());
       // TODO: Block any banned ip addresses.
-      session->BindRead_(); // Bind ASIO to start accepting data on this connection
-      addConnection_(session.get()); // Add our new connection to the list of connections.
-      StartAccepting_();
+      session->Start_(); // Start reading on the connection's own io_service.
+      StartAccepting_(acceptor);
    } else {
       ERROR("There was an ASIO accept error...");
    }
 }
 
+/**
+ * Loads the certificate and key for STARTTLS, turning it on if they load and off if they don't.
+ */
+bool LazyXMPP::setTLSCertificate(const string& certificate, const string& key) {
+   enableTLS_ = tls_.Load(certificate, key);
+   return enableTLS_;
+}
+
 /**
  * Dispatches data to a connection based on it's Jabber ID (either full or normal).
  */
-void LazyXMPP::WriteJid(const string& jid, const char* data, const int& size) {
-   connections_mutex_.lock();
-
-   for (Connections::iterator it=connections_.begin() ; it != connections_.end(); it++ ) {
-      string temp_jid = (*it)->getJid();
-      string temp_jid_r = (*it)->getFullJid();
-      if((temp_jid.compare(jid) == 0) || (temp_jid_r.compare(jid) == 0)) {
-         DEBUG_M("Found target...");
-         (*it)->Write(data, size);
+bool LazyXMPP::WriteJid(const string& jid, const char* data, const int& size, bool fallbackToBare) {
+   return WriteJid(jid, SharedBuffer(new string(data, size)), fallbackToBare);
+}
+
+/**
+ * Dispatches a shared buffer to a connection based on it's Jabber ID. Every matching connection queues the same buffer.
+ * A bare JID goes to all of the user's resources (RFC 6121 8.5.2). If fallbackToBare is set, a full JID that isn't bound is treated as the bare JID (RFC 6121 8.5.3.2.1 for messages).
+ */
+bool LazyXMPP::WriteJid(const string& jid, const SharedBuffer& data, bool fallbackToBare) {
+   vector<LazyXMPPConnectionPtr> targets;
+   registry_.findRoutes(jid, fallbackToBare, targets);
+
+   if(targets.empty()) {
+      DEBUG_M("Target not found...");
+      return false;
+   }
+
+   DEBUG_M("Found target...");
+   for(vector<LazyXMPPConnectionPtr>::iterator it = targets.begin(); it != targets.end(); it++) {
+      (*it)->Write(data);
+   }
+   return true;
+}
+
+/**
+ * Fans a stanza out to every bound resource. The body (everything after the element name) is serialized once by the caller
+ * and shared by every write queue, each recipient only gets a small "<tag_name to='jid'" prefix of it's own.
+ */
+void LazyXMPP::Broadcast(const string& tag_name, const SharedBuffer& body) {
+   const string open = "<" + tag_name + " to=\"";
+
+   // No locks, just walk the current snapshot of the routing index.
+   RegistrySnapshot snapshot;
+   registry_.getSnapshot(snapshot);
+   for(RegistrySnapshot::const_iterator shard = snapshot.begin(); shard != snapshot.end(); shard++) {
+      for(BareJidRoutes::const_iterator it = (*shard)->bare_routes.begin(); it != (*shard)->bare_routes.end(); it++) {
+         SharedBuffer prefix;
+         for(Resources::const_iterator resource = it->second.begin(); resource != it->second.end(); resource++) {
+            LazyXMPPConnectionPtr target = resource->lock();
+            if(!target) {
+               continue;
+            }
+            if(!prefix) {
+               prefix.reset(new string(open + RawStanza::Escape(it->first) + "\""));
+            }
+            target->Write(prefix, body);
+         }
       }
    }
-   DEBUG_M("Target not found...");
-   connections_mutex_.unlock();
+}
+
+/**
+ * Remembers the last available presence of a resource. The body is the same shared buffer used for the broadcast.
+ */
+void LazyXMPP::setPresence_(const string& jid, const string& fulljid, const SharedBuffer& body) {
+   boost::mutex::scoped_lock lock(presences_mutex_);
+   presences_[jid][fulljid] = body;
+}
+
+/**
+ * Forgets a resource's presence, when it goes unavailable or disconnects.
+ */
+bool LazyXMPP::removePresence_(const string& jid, const string& fulljid) {
+   boost::mutex::scoped_lock lock(presences_mutex_);
+   PresenceCache::iterator user = presences_.find(jid);
+   if(user == presences_.end() || user->second.erase(fulljid) == 0) {
+      return false;
+   }
+   if(user->second.empty()) {
+      presences_.erase(user);
+   }
+   return true;
+}
+
+/**
+ * Sends cached presences to a connection on behalf of their owners, so nobody has to be probed.
+ * With of empty every available resource on the server is sent (initial presence), otherwise just those of a bare or full JID.
+ */
+void LazyXMPP::WriteCachedPresences_(LazyXMPPConnection* target, const string& of) {
+   vector<SharedBuffer> bodies;
+   const string self = target->getFullJid();
+
+   {
+      boost::mutex::scoped_lock lock(presences_mutex_);
+      if(of.empty()) {
+         for(PresenceCache::iterator user = presences_.begin(); user != presences_.end(); user++) {
+            for(ResourcePresences::iterator it = user->second.begin(); it != user->second.end(); it++) {
+               if(it->first != self) {
+                  bodies.push_back(it->second);
+               }
+            }
+         }
+      } else {
+         size_t slash = of.find('/');
+         PresenceCache::iterator user = presences_.find(of.substr(0, slash));
+         if(user != presences_.end()) {
+            for(ResourcePresences::iterator it = user->second.begin(); it != user->second.end(); it++) {
+               if(slash == string::npos || it->first == of) {
+                  bodies.push_back(it->second);
+               }
+            }
+         }
+      }
+   }
+
+   if(bodies.empty()) {
+      return;
+   }
+
+   LazyXMPPConnectionPtr connection = target->shared_from_this();
+   SharedBuffer prefix(new string("<presence to=\"" + RawStanza::Escape(target->getJid()) + "\""));
+   for(vector<SharedBuffer>::iterator it = bodies.begin(); it != bodies.end(); it++) {
+      connection->Write(prefix, *it);
+   }
+}
+
+/**
+ * Keeps a message for a registered local user who isn't online (XEP-0160), they get it with their next initial presence.
+ * Only queues it, the spool does the writing on it's own thread.
+ */
+bool LazyXMPP::StoreOffline_(const string& to, const SharedBuffer& stanza) {
+   string jid = to.substr(0, to.find('/'));
+   if(!isLocalUser_(jid)) {
+      return false;
+   }
+   offline_.Store(jid, stanza);
+   return true;
+}
+
+bool LazyXMPP::isLocalUser_(const string& jid) {
+   size_t at = jid.find('@');
+   return at != string::npos && jid.compare(at + 1, string::npos, hostname_) == 0 && userdb.isRegistered(jid.substr(0, at));
+}
+
+/**
+ * Adds a routed message to the sender's and recipient's history (XEP-0313), if they have one. Only queues it, the
+ * archive does the writing on it's own thread.
+ */
+void LazyXMPP::ArchiveMessage_(const string& from, const string& to, const SharedBuffer& stanza) {
+   string from_jid = from.substr(0, from.find('/'));
+   string to_jid = to.substr(0, to.find('/'));
+   bool for_sender = isLocalUser_(from_jid);
+   bool for_recipient = isLocalUser_(to_jid);
+   if(for_sender || for_recipient) {
+      archive_.Archive(from_jid, to_jid, for_sender, for_recipient, stanza);
+   }
 }
 
 LazyXMPP::~LazyXMPP() {
@@ -139,6 +300,9 @@ LazyXMPP::~LazyXMPP() {
    // TODO: Shutdown all the connections...
    delete acceptor4_;
    delete acceptor6_;
-   io_service_.stop();
+   authPool_.Stop();
+   offline_.Stop(); // Before the io threads, these may still be handing them backlogs and query results.
+   archive_.Stop();
+   io_pool_.Stop(); // Joins the io threads, so nothing is still parsing when Xerces goes away.
    XMLPlatformUtils::Terminate();
 }
@@ -1,13 +1,14 @@
 #ifndef LAZYXMPP_LAZYXMPP_HPP_
 #define LAZYXMPP_LAZYXMPP_HPP_
 
-#include <set>
+#include <vector>
 using namespace std;
 
 
 #include <boost/asio.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/thread.hpp>
+#include <boost/unordered_map.hpp>
 
 using namespace boost::asio;
 using boost::asio::ip::tcp;
@@ -15,48 +16,98 @@ using boost::shared_ptr;
 
 #include "../Main/UserDB.hpp"
 #include "../Main/LazyXMPPConnection.hpp"
+#include "../Main/IoServicePool.hpp"
+#include "../Main/ConnectionRegistry.hpp"
+#include "../Main/AuthWorkerPool.hpp"
+#include "../Main/FastTokenStore.hpp"
+#include "../Main/PasswordBatcher.hpp"
+#include "../Main/OfflineSpool.hpp"
+#include "../Main/MessageArchive.hpp"
+#include "../Main/TlsContext.hpp"
+#include "../Main/ResumableSessions.hpp"
 
-typedef set<LazyXMPPConnection*> Connections;
+
+// Last available presence of every resource, bare JID -> full JID -> shared presence body.
+typedef boost::unordered_map<string, SharedBuffer> ResourcePresences;
+typedef boost::unordered_map<string, ResourcePresences> PresenceCache;
 
 
 class LazyXMPP {
    public:
-      LazyXMPP(int port=5222, bool enableIPv6=true, bool enableIPv4=true);
+      LazyXMPP(int port=5222, bool enableIPv6=true, bool enableIPv4=true, unsigned int threads=0, bool pinThreads=false, const string& userStore="sqlite"); // threads=0 uses one io thread per core
       ~LazyXMPP();
 
       inline string getServerHostname() { return hostname_; }
       inline void setServerHostname(string hostname) { hostname_ = hostname; }
 
-      void WriteJid(const string& jid, const char* data, const int& size);
+      bool WriteJid(const string& jid, const char* data, const int& size, bool fallbackToBare = false);
+      bool WriteJid(const string& jid, const SharedBuffer& data, bool fallbackToBare = false); // Returns false if no resource got it.
+      void Broadcast(const string& tag_name, const SharedBuffer& body); // Sends <tag_name to='bare jid' + body to every bound resource.
 
       bool isPlainAuthEnabled() { return enableRegistration_; }
       bool isAnonymousAuthEnabled() { return enableRegistration_; }
-      bool isTLSEnabled() { return enableTLS_; }
+      bool isScramAuthEnabled() { return enableScramAuth_; } // SCRAM-SHA-256/SCRAM-SHA-1, never sends the password so it's fine unencrypted.
+      bool isSasl2Enabled() { return enableSasl2_; } // SASL2 (XEP-0388) with inline resource binding (XEP-0386).
+      bool isFastAuthEnabled() { return enableSasl2_ && enableFastAuth_; } // FAST reconnect tokens (XEP-0484), needs SASL2.
+      bool isTLSEnabled() { return enableTLS_; } // STARTTLS, on if the certificate loaded.
+      bool setTLSCertificate(const string& certificate, const string& key); // PEM files, by default ~/.config/LazyXMPP/tls/cert.pem and key.pem. Call before the server has clients.
       bool isRegistrationEnabled() { return enableRegistration_; }
       bool isUnencryptedAnonymousAuthEnabled() { return enableUnencryptedAnonymousAuth_; } // True if accepts plain auth/registeration over unencrytped stream
       bool isUnencryptedPlainAuthEnabled() { return enableUnencryptedPlainAuth_; } // True if accepts plain auth/registeration over unencrytped stream
+      bool isCompressionEnabled() { return enableCompression_; } // zlib stream compression (XEP-0138), offered once authenticated.
+      int getCompressionLevel() { return compressionLevel_; }
+      void setCompressionLevel(int level) { compressionLevel_ = level; } // zlib's 0 (none) to 9 (smallest), -1 for zlib's default. Applies to new streams.
+      bool isStreamManagementEnabled() { return enableStreamManagement_; } // Acks (XEP-0198).
+      unsigned int getResumeTimeout() { return resumeTimeout_; }
+      void setResumeTimeout(unsigned int seconds) { resumeTimeout_ = seconds; } // How long a dropped stream can be resumed, 0 turns resumption off. Applies to new streams.
 
 
    friend class LazyXMPPConnection;
    
    private:
-      void StartAccepting_(); // Bind the accept handler
-      void AcceptHandler_(LazyXMPPConnectionPtr session, const boost::system::error_code& error);
-      void addConnection_(LazyXMPPConnection* connection) { connections_mutex_.lock(); connections_ .insert(connection); connections_mutex_.unlock();}
-      void removeConnection_(LazyXMPPConnection* connection) { connections_mutex_.lock(); connections_ .erase(connection); connections_mutex_.unlock();}
+      void StartAccepting_(); // Bind the accept handlers
+      void StartAccepting_(tcp::acceptor* acceptor);
+      void AcceptHandler_(tcp::acceptor* acceptor, LazyXMPPConnectionPtr session, const boost::system::error_code& error);
+      ConnectionRegistry& getRegistry_() { return registry_; }
       UserDB* getUserDB() { return &userdb; }
+      AuthWorkerPool& getAuthPool_() { return authPool_; }
+      PasswordBatcher& getPasswordBatcher_() { return passwordBatcher_; }
+      FastTokenStore& getFastTokens_() { return fastTokens_; }
+      OfflineSpool& getOfflineSpool_() { return offline_; }
+      MessageArchive& getArchive_() { return archive_; }
+      TlsContext& getTls_() { return tls_; }
+      ResumableSessions& getResumable_() { return resumable_; }
+
+      bool addRoute_(const LazyXMPPConnectionPtr& connection) { return registry_.addRoute(connection); } // Returns false if the full JID is already bound.
+      void removeRoute_(const string& jid, const string& fulljid, const LazyXMPPConnection* connection) { registry_.removeRoute(jid, fulljid, connection); }
+      void replaceRoute_(const LazyXMPPConnectionPtr& connection, const LazyXMPPConnection* previous) { registry_.replaceRoute(connection, previous); }
+
+      void setPresence_(const string& jid, const string& fulljid, const SharedBuffer& body);
+      bool removePresence_(const string& jid, const string& fulljid); // Returns true if there was one.
+      void WriteCachedPresences_(LazyXMPPConnection* target, const string& of = ""); // Answers a probe (or initial presence if of is empty) from the cache.
+      bool isLocalUser_(const string& jid); // A registered user on this server, jid is bare.
+      bool StoreOffline_(const string& to, const SharedBuffer& stanza); // Returns false if to isn't a local user.
+      void ArchiveMessage_(const string& from, const string& to, const SharedBuffer& stanza); // Into the history of whichever of them are local users.
 
       UserDB userdb;
 
       const int port_;
-      boost::asio::io_service io_service_;
+      IoServicePool io_pool_;
+      AuthWorkerPool authPool_; // Password hashing happens here, off the io threads.
+      PasswordBatcher passwordBatcher_; // Groups PLAIN logins so the workers hash them in batches.
+      FastTokenStore fastTokens_;
+      OfflineSpool offline_; // Messages for users who aren't online.
+      MessageArchive archive_; // Every user's message history.
+      TlsContext tls_; // Shared by every connection so reconnects can resume their sessions.
+      ResumableSessions resumable_; // Stream Management sessions a client can come back to.
       tcp::acceptor* acceptor4_;
       tcp::acceptor* acceptor6_;
       string hostname_;
-      shared_ptr<boost::thread> thread_;
       
-      Connections connections_;
-      boost::mutex connections_mutex_;
+      ConnectionRegistry registry_; // The JID routing index.
+
+      PresenceCache presences_;
+      boost::mutex presences_mutex_;
       
       bool enableIPv6_;
       bool enableIPv4_;
@@ -65,9 +116,16 @@ class LazyXMPP {
       bool enableTLS_;
       bool enableRegistration_;
       bool enablePlainAuth_;
+      bool enableScramAuth_;
+      bool enableSasl2_;
+      bool enableFastAuth_;
       bool enableUnencryptedAnonymousAuth_;
       bool enableUnencryptedPlainAuth_;
       bool enableAnonymousAuth_;
+      bool enableCompression_;
+      int compressionLevel_;
+      bool enableStreamManagement_;
+      unsigned int resumeTimeout_;
 
 };
 
@@ -1,9 +1,15 @@
 #include "../Main/LazyXMPPConnection.hpp"
 
+#include <stdlib.h>
+#include <time.h>
+
 #include <boost/bind.hpp>
+#include <boost/lexical_cast.hpp>
 #include <xercesc/util/Base64.hpp>
 
 #include "../Main/LazyXMPP.hpp"
+#include "../Main/StanzaParser.hpp"
+#include "../Main/RawStanza.hpp"
 #include "../Debug/console.h"
 
 // Some prebaked raw XMPP XML...
@@ -20,22 +26,75 @@ static const string XMPP_STREAMFEATURES_MECHANISMS_02 = "<required/></mechanisms
 
 static const string XMPP_STREAMFEATURES_MECHANISM_ANONYMOUS = "<mechanism>ANONYMOUS</mechanism>";
 static const string XMPP_STREAMFEATURES_MECHANISM_PLAIN = "<mechanism>PLAIN</mechanism>";
+static const string XMPP_STREAMFEATURES_MECHANISM_SCRAMSHA256 = "<mechanism>SCRAM-SHA-256</mechanism>";
+static const string XMPP_STREAMFEATURES_MECHANISM_SCRAMSHA1 = "<mechanism>SCRAM-SHA-1</mechanism>";
+
+static const string XMPP_STREAMFEATURES_AUTHENTICATION_01 = "<authentication xmlns='urn:xmpp:sasl:2'>";
+static const string XMPP_STREAMFEATURES_AUTHENTICATION_02 = "<inline><bind xmlns='urn:xmpp:bind:0'/>";
+static const string XMPP_STREAMFEATURES_AUTHENTICATION_FAST = "<fast xmlns='urn:xmpp:fast:0'><mechanism>HT-SHA-256-NONE</mechanism></fast>";
+static const string XMPP_STREAMFEATURES_AUTHENTICATION_03 = "</inline></authentication>";
 
 static const string XMPP_STREAMFEATURES_REGISTER = "<register xmlns='http://jabber.org/features/iq-register'/>";
 static const string XMPP_STREAMFEATURES_BIND = "<bind xmlns=\"urn:ietf:params:xml:ns:xmpp-bind\"><required/></bind>";
 static const string XMPP_STREAMFEATURES_SESSION = "<session xmlns=\"urn:ietf:params:xml:ns:xmpp-session\"><optional/></session>";
 static const string XMPP_STREAMFEATURES_STARTTLS = "<starttls xmlns='urn:ietf:params:xml:ns:xmpp-tls'/>";
+static const string XMPP_TLS_PROCEED = "<proceed xmlns='urn:ietf:params:xml:ns:xmpp-tls'/>";
+static const string XMPP_TLS_FAILURE = "<failure xmlns='urn:ietf:params:xml:ns:xmpp-tls'/></stream:stream>";
+static const string XMPP_STREAMFEATURES_SM = "<sm xmlns='urn:xmpp:sm:3'/>";
+static const string XMPP_STREAMFEATURES_COMPRESSION = "<compression xmlns='http://jabber.org/features/compress'><method>zlib</method></compression>";
 
 static const string XMPP_STREAMERROR_INVALIDNAMESPACE = "<?xml version='1.0'?><stream:stream id='' xmlns:stream='http://etherx.jabber.org/streams' version='1.0' xmlns='jabber:client'><stream:error><invalid-namespace xmlns='urn:ietf:params:xml:ns:xmpp-streams'/></stream:error></stream:stream>";
+static const string XMPP_STREAMERROR_NOTWELLFORMED = "<stream:error><not-well-formed xmlns='urn:ietf:params:xml:ns:xmpp-streams'/></stream:error></stream:stream>";
+static const string XMPP_STREAMERROR_POLICYVIOLATION = "<stream:error><policy-violation xmlns='urn:ietf:params:xml:ns:xmpp-streams'/></stream:error></stream:stream>";
+static const string XMPP_STREAM_CLOSE = "</stream:stream>";
 static const string XMPP_STREAMERROR_NOTAUTHORIZED = "<stream:error><not-authorized xmlns='urn:ietf:params:xml:ns:xmpp-streams'/></stream:error></stream:stream>";
 
-static const string XMPP_AUTHFAILURE_INVALIDMECHANISM = "<failure xmlns='urn:ietf:params:xml:ns:xmpp-sasl'><invalid-mechanism/></failure></stream:stream>";
+static const string XMPP_AUTHFAILURE_INVALIDMECHANISM = "<failure xmlns='urn:ietf:params:xml:ns:xmpp-sasl'><invalid-mechanism/></failure>";
 static const string XMPP_AUTHFAILURE_MALFORMEDREQUEST = "<failure xmlns='urn:ietf:params:xml:ns:xmpp-sasl'><malformed-request/></failure>";
 static const string XMPP_AUTHFAILURE_NOTAUTHORIZED = "<failure xmlns='urn:ietf:params:xml:ns:xmpp-sasl'><not-authorized xmlns='urn:ietf:params:xml:ns:xmpp-streams'/></failure>";
 static const string XMPP_AUTHFAILURE_ENCRYPTIONREQUIRED = "<failure xmlns='urn:ietf:params:xml:ns:xmpp-sasl'><encryption-required/></failure>";
+static const string XMPP_AUTHFAILURE_TEMPORARYAUTHFAILURE = "<failure xmlns='urn:ietf:params:xml:ns:xmpp-sasl'><temporary-auth-failure/></failure>";
+static const string XMPP_AUTHFAILURE_ABORTED = "<failure xmlns='urn:ietf:params:xml:ns:xmpp-sasl'><aborted/></failure>";
 static const string XMPP_AUTHFAILURE_MECHANISMTOOWEAK = "<failure xmlns='urn:ietf:params:xml:ns:xmpp-sasl'><mechanism-too-weak/></failure>";
 
 static const string XMPP_SUCCESS = "<success xmlns=\"urn:ietf:params:xml:ns:xmpp-sasl\"/>";
+static const string XMPP_SUCCESS_DATA_01 = "<success xmlns=\"urn:ietf:params:xml:ns:xmpp-sasl\">";
+static const string XMPP_SUCCESS_DATA_02 = "</success>";
+static const string XMPP_CHALLENGE_01 = "<challenge xmlns=\"urn:ietf:params:xml:ns:xmpp-sasl\">";
+static const string XMPP_CHALLENGE_02 = "</challenge>";
+
+static const string XMPP_SM_NAMESPACE = "urn:xmpp:sm:3";
+static const SharedBuffer XMPP_SM_REQUEST(new string("<r xmlns='urn:xmpp:sm:3'/>"));
+static const string XMPP_SM_ENABLED_01 = "<enabled xmlns='urn:xmpp:sm:3'";
+static const string XMPP_SM_ENABLED_02 = " resume='true' max='";
+static const string XMPP_SM_RESUMED_01 = "<resumed xmlns='urn:xmpp:sm:3' previd='";
+static const string XMPP_SM_ACK_01 = "<a xmlns='urn:xmpp:sm:3' h='";
+static const string XMPP_SM_FAILED_01 = "<failed xmlns='urn:xmpp:sm:3'><";
+static const string XMPP_SM_FAILED_02 = " xmlns='urn:ietf:params:xml:ns:xmpp-stanzas'/></failed>";
+static const string XMPP_STREAMERROR_HANDLEDCOUNTTOOHIGH_01 = "<stream:error><undefined-condition xmlns='urn:ietf:params:xml:ns:xmpp-streams'/><handled-count-too-high xmlns='urn:xmpp:sm:3' h='";
+static const string XMPP_STREAMERROR_HANDLEDCOUNTTOOHIGH_02 = "' send-count='";
+static const string XMPP_STREAMERROR_HANDLEDCOUNTTOOHIGH_03 = "'/></stream:error></stream:stream>";
+static const size_t SM_REQUEST_EVERY = 10; // Unacked stanzas before an <r/> is sent.
+static const size_t SM_MAX_UNACKED = 5000; // A client that lets more pile up loses it's session.
+
+static const string XMPP_COMPRESSED = "<compressed xmlns='http://jabber.org/protocol/compress'/>";
+static const string XMPP_COMPRESSFAILURE_SETUPFAILED = "<failure xmlns='http://jabber.org/protocol/compress'><setup-failed/></failure>";
+static const string XMPP_COMPRESSFAILURE_UNSUPPORTEDMETHOD = "<failure xmlns='http://jabber.org/protocol/compress'><unsupported-method/></failure>";
+
+static const string XMPP_SASL2_CHALLENGE_01 = "<challenge xmlns='urn:xmpp:sasl:2'>";
+static const string XMPP_SASL2_FAILURE_01 = "<failure xmlns='urn:xmpp:sasl:2'><";
+static const string XMPP_SASL2_FAILURE_02 = " xmlns='urn:ietf:params:xml:ns:xmpp-sasl'/></failure>";
+static const string XMPP_SASL2_SUCCESS_01 = "<success xmlns='urn:xmpp:sasl:2'>";
+static const string XMPP_SASL2_SUCCESS_02 = "</success>";
+static const string XMPP_SASL2_ADDITIONALDATA_01 = "<additional-data>";
+static const string XMPP_SASL2_ADDITIONALDATA_02 = "</additional-data>";
+static const string XMPP_SASL2_AUTHZID_01 = "<authorization-identifier>";
+static const string XMPP_SASL2_AUTHZID_02 = "</authorization-identifier>";
+static const string XMPP_SASL2_BOUND = "<bound xmlns='urn:xmpp:bind:0'/>";
+static const string XMPP_SASL2_TOKEN_01 = "<token xmlns='urn:xmpp:fast:0' expiry='";
+static const string XMPP_SASL2_TOKEN_02 = "' token='";
+static const string XMPP_SASL2_TOKEN_03 = "'/>";
+static const string XMPP_FAST_MECHANISM = "HT-SHA-256-NONE";
 
 static const string XMPP_IQRESULT_BIND_01 = "<iq type='result' id='";
 static const string XMPP_IQRESULT_BIND_02 = "'><bind xmlns='urn:ietf:params:xml:ns:xmpp-bind'><jid>";
@@ -69,15 +128,179 @@ static const string XMPP_PRESENCE_04 = "\"/>";
 LazyXMPPConnection::~LazyXMPPConnection() {
    DEBUG_M("Shutting down connection. '%s'", getNodeId().c_str());
    // TODO: Send a XMPP error to the client
-   getServer()->removeConnection_(this);
+   if(sm_) {
+      EndStreamSession_();
+   }
+   if(isBound_) {
+      getServer()->removeRoute_(getJid(), getFullJid(), this);
+   }
+   if(isAvailable_ && getServer()->removePresence_(getJid(), getFullJid())) {
+      // Tell everyone we've gone.
+      SharedBuffer body(new string(" from=\"" + RawStanza::Escape(getFullJid()) + "\" type=\"unavailable\"/>"));
+      getServer()->Broadcast("presence", body);
+   }
+   if(tls_state_ == TLS_ON) {
+      // OpenSSL won't resume a session that ended without a close_notify. TLS 1.3 doesn't ask for that and a dropped
+      // link is exactly when a client wants to resume, so the session is let go as if it closed cleanly.
+      SSL_set_shutdown(tls_->native_handle(), SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+   }
 }
 
 /**
- * Writes data to a connection.
+ * Starts the connection reading. May be called from any thread.
+ */
+void LazyXMPPConnection::Start_() {
+   io_service_.post(boost::bind(&LazyXMPPConnection::BindRead_, shared_from_this()));
+}
+
+/**
+ * Writes data to a connection. May be called from any thread, the data is copied.
  */
 void LazyXMPPConnection::Write(const char* data, const int& size) {
-   DEBUG_M("WRITE: '%s'", data);
-   boost::asio::async_write(socket_, boost::asio::buffer(data, size), boost::bind(&LazyXMPPConnection::WriteHandler_, shared_from_this(), boost::asio::placeholders::error));
+   Write(SharedBuffer(new string(data, size)));
+}
+
+/**
+ * Queues a shared buffer to be written to the connection. May be called from any thread.
+ */
+void LazyXMPPConnection::Write(const SharedBuffer& data) {
+   io_service_.post(boost::bind(&LazyXMPPConnection::QueueWrite_, shared_from_this(), data));
+}
+
+/**
+ * Queues data only if the stream is still there to take it, for senders that have to know whether it went out (the
+ * offline spool only tombstones what was handed over). May be called from any thread.
+ */
+void LazyXMPPConnection::WriteIfLive(const SharedBuffer& data, const WriteCallback& done) {
+   io_service_.post(boost::bind(&LazyXMPPConnection::QueueWriteIfLive_, shared_from_this(), data, done));
+}
+
+/**
+ * Queues a prefix and a shared body as one stanza. May be called from any thread.
+ */
+void LazyXMPPConnection::Write(const SharedBuffer& prefix, const SharedBuffer& body) {
+   io_service_.post(boost::bind(&LazyXMPPConnection::QueueWrite2_, shared_from_this(), prefix, body));
+}
+
+/**
+ * Adds a prefix and body to the outbound queue together. Must be run on the connection's io_service.
+ */
+void LazyXMPPConnection::QueueWrite2_(const SharedBuffer& prefix, const SharedBuffer& body) {
+   if(isHandedOver_) {
+      LazyXMPPConnectionPtr by = resumed_by_.lock();
+      if(by) {
+         by->Write(prefix, body);
+      }
+      return;
+   }
+   write_queue_.push_back(prefix);
+   write_queue_.push_back(body);
+   if(sm_) {
+      sm_->Sent(prefix, body);
+      CheckUnacked_();
+   }
+   FlushWrites_();
+}
+
+/**
+ * WriteIfLive on the connection's io_service. A detached stream still counts, it's session keeps the stanzas and
+ * spools whatever is never acked.
+ */
+void LazyXMPPConnection::QueueWriteIfLive_(const SharedBuffer& data, const WriteCallback& done) {
+   if(isHandedOver_) {
+      LazyXMPPConnectionPtr by = resumed_by_.lock();
+      if(by) {
+         by->WriteIfLive(data, done);
+      } else {
+         done(false);
+      }
+      return;
+   }
+   if(!isBound_ || connection_close_) {
+      done(false);
+      return;
+   }
+   QueueWrite_(data);
+   done(true);
+}
+
+/**
+ * Adds data to the outbound queue and starts a write if there isn't one in flight. Must be run on the connection's io_service.
+ */
+void LazyXMPPConnection::QueueWrite_(const SharedBuffer& data) {
+   if(isHandedOver_) {
+      LazyXMPPConnectionPtr by = resumed_by_.lock();
+      if(by) {
+         by->Write(data);
+      }
+      return;
+   }
+   write_queue_.push_back(data);
+   if(sm_) {
+      sm_->Sent(data);
+      CheckUnacked_();
+   }
+   FlushWrites_();
+}
+
+/**
+ * Sends everything in the outbound queue as a single gather write. Only one write is ever in flight per socket.
+ * Once the stream is compressed the queue is deflated into one buffer first.
+ */
+void LazyXMPPConnection::FlushWrites_() {
+   if(isDetached_) {
+      write_queue_.clear(); // Nowhere to send it, the stream session has the stanzas for a resume.
+      return;
+   }
+   if(isWriting_ || write_queue_.empty() || tls_state_ == TLS_HANDSHAKE) {
+      return;
+   }
+
+   size_t count = write_queue_.size();
+   if(tls_state_ == TLS_PROCEEDING) {
+      if(plain_writes_ == 0) {
+         return; // The rest waits for the handshake.
+      }
+      count = plain_writes_;
+      plain_writes_ = 0;
+   }
+   writing_.assign(write_queue_.begin(), write_queue_.begin() + count);
+   write_queue_.erase(write_queue_.begin(), write_queue_.begin() + count);
+
+   for(vector<SharedBuffer>::const_iterator it = writing_.begin(); it != writing_.end(); it++) {
+      DEBUG_M("WRITE: '%s'", (*it)->c_str());
+   }
+
+   if(isDeflating_ && uncompressed_writes_ < writing_.size()) {
+      boost::shared_ptr<string> compressed(new string());
+      compression_->Deflate(writing_.begin() + uncompressed_writes_, writing_.end(), *compressed);
+      writing_.resize(uncompressed_writes_);
+      writing_.push_back(compressed);
+   }
+   uncompressed_writes_ = 0;
+
+   if(tls_state_ == TLS_ON) {
+      // An SSL stream writes a gather list a buffer at a time, a record and a send each. Joined it's as few as possible.
+      if(writing_.size() > 1) {
+         boost::shared_ptr<string> joined(new string());
+         for(vector<SharedBuffer>::const_iterator it = writing_.begin(); it != writing_.end(); it++) {
+            joined->append(**it);
+         }
+         writing_.assign(1, joined);
+      }
+      isWriting_ = true;
+      boost::asio::async_write(*tls_, boost::asio::buffer(*writing_.front()), boost::bind(&LazyXMPPConnection::WriteHandler_, shared_from_this(), boost::asio::placeholders::error));
+      return;
+   }
+
+   vector<boost::asio::const_buffer> buffers;
+   buffers.reserve(writing_.size());
+   for(vector<SharedBuffer>::const_iterator it = writing_.begin(); it != writing_.end(); it++) {
+      buffers.push_back(boost::asio::buffer(**it));
+   }
+
+   isWriting_ = true;
+   boost::asio::async_write(socket_, buffers, boost::bind(&LazyXMPPConnection::WriteHandler_, shared_from_this(), boost::asio::placeholders::error));
 }
 
 /**
@@ -85,8 +308,8 @@ void LazyXMPPConnection::Write(const char* data, const int& size) {
  */
 bool LazyXMPPConnection::enforeAuthorization_() {
    if(connection_type_ < 1) {
+      connection_close_ = true; // Stream errors are unrecoverable.
       Write(XMPP_STREAMERROR_NOTAUTHORIZED.c_str(), XMPP_STREAMERROR_NOTAUTHORIZED.size());
-      BindRead_();
       return true;
    }
    return false;
@@ -95,10 +318,14 @@ bool LazyXMPPConnection::enforeAuthorization_() {
 /**
  * Decides what to do with a XMPP stanza based on it's type.
  */
-void LazyXMPPConnection::Chooser_(const char* tag_name_c, DOMElement* element) {
+void LazyXMPPConnection::Chooser_(const char* tag_name_c, DOMElement* element, const string& stanza) {
    static const string stream = "stream:stream";
    static const string starttls = "starttls";
    static const string auth = "auth";
+   static const string response = "response";
+   static const string abort = "abort";
+   static const string authenticate = "authenticate";
+   static const string compress = "compress";
    static const string iq = "iq";
    static const string message = "message";
    static const string presence = "presence";
@@ -113,23 +340,34 @@ void LazyXMPPConnection::Chooser_(const char* tag_name_c, DOMElement* element) {
    // Everything below needs to be in an established stream...   
    if(!isInStream_) {
       DEBUG_M("XMPP recieved out of stream.");
+      connection_close_ = true;
       Write(XMPP_STREAMERROR_INVALIDNAMESPACE.c_str(), XMPP_STREAMERROR_INVALIDNAMESPACE.size());
-      BindRead_();
       return;
    }
 
    if(starttls.compare(tag_name_c) == 0) { // Match a <starttls> tag.
-      // FIXME: Support TLS
-      DEBUG_M("Client attempted to start a TLS stream. We don't support that.");
-      static const string ihatesecurity = "<failure xmlns='urn:ietf:params:xml:ns:xmpp-tls'/></stream:stream>";
-      connection_close_ = true;
-      Write(ihatesecurity.c_str(), ihatesecurity.size());
+      DEBUG_M("STARTTLS requested...");
+      StarttlsHandler_();
       return;
    } else if(auth.compare(tag_name_c) == 0) { // Match an <auth> tag.
       DEBUG_M("Auth recieved...");  
       AuthHandler_(element);
       return;
-   } 
+   } else if(response.compare(tag_name_c) == 0) { // Match a SASL <response> tag.
+      AuthResponseHandler_(element);
+      return;
+   } else if(abort.compare(tag_name_c) == 0) { // Match a SASL <abort> tag.
+      AuthAbortHandler_();
+      return;
+   } else if(authenticate.compare(tag_name_c) == 0) { // Match a SASL2 <authenticate> tag.
+      DEBUG_M("SASL2 authenticate recieved...");
+      AuthenticateHandler_(element);
+      return;
+   } else if(compress.compare(tag_name_c) == 0) { // Match a <compress> tag.
+      DEBUG_M("Compression requested...");
+      CompressHandler_(element);
+      return;
+   }
 
    if(iq.compare(tag_name_c) == 0) { // Match <iq> tag.
       IqHandler_(element);
@@ -144,7 +382,7 @@ void LazyXMPPConnection::Chooser_(const char* tag_name_c, DOMElement* element) {
    if (message.compare(tag_name_c) == 0) {
       MessageHandler_(element);
    } else if (presence.compare(tag_name_c) == 0) {
-      PresenceHandler_(element);
+      PresenceHandler_(element, stanza);
    } else {
       DEBUG_M("Unknown XMPP stanza... '%s'", tag_name_c);
    }
@@ -155,89 +393,181 @@ void LazyXMPPConnection::Chooser_(const char* tag_name_c, DOMElement* element) {
  */
 void LazyXMPPConnection::WriteHandler_(const boost::system::error_code& error) {
    DEBUG_M("Write handler fired...");
-   if(!error && !connection_close_) { // If theres no error and we arn't closing this connection, bind another read.
-      BindRead_();
-   } else if(error) {
+   isWriting_ = false;
+   writing_.clear();
+
+   if(error) {
       DEBUG_M("Write error...");
-   } else {
+      write_queue_.clear();
+   } else if(tls_state_ == TLS_PROCEEDING && plain_writes_ == 0) { // <proceed/> is out.
+      DEBUG_M("Starting TLS handshake...");
+      tls_state_ = TLS_HANDSHAKE;
+      tls_->async_handshake(boost::asio::ssl::stream_base::server, boost::bind(&LazyXMPPConnection::HandshakeHandler_, shared_from_this(), boost::asio::placeholders::error));
+   } else if(!write_queue_.empty()) { // More was queued while we were writing, send it all in one go.
+      FlushWrites_();
+   } else if(connection_close_) {
+      // Everything has been sent, drop the socket. This also cancels the outstanding read.
       DEBUG_M("Connection closed...");
+      boost::system::error_code ignored;
+      socket_.shutdown(tcp::socket::shutdown_both, ignored);
+      socket_.close(ignored);
    }
+   // Reads are never bound from here, ReadHandler_ keeps exactly one read outstanding.
 }
 
 /**
- * Parses the data read from socket into XML.
+ * Feeds the data read from the socket to the framer and handles every complete element it has.
  */
-// TODO: Put the XML parsing things somewhere else as static rather than create new ones every request.
 void LazyXMPPConnection::Process_(const int size) {
-   XMLByte* data_xml_ = reinterpret_cast<XMLByte*>(data_);
-   InputSource* in = new MemBufInputSource(data_xml_, size, "xmppstanza", false);
-
-   XercesDOMParser *parser  = new XercesDOMParser();
-   ErrorHandler* errHandler = (ErrorHandler*) new HandlerBase();
-   parser->setErrorHandler(errHandler);
-   
-   // We check this here due to the way LazyXMPP parses XML (ie the bad way).
-   // This will only work if the closing stream element is by itself.
-   static const string endstream = "</stream:stream>";
-   if(size > (int)endstream.size()) {
-      if(endstream.compare(0, endstream.size(), data_, endstream.size()) == 0) {
-         DEBUG_M("End of stream detected...");
+   if(compression_) {
+      string inflated;
+      if(!compression_->Inflate(data_, size, inflated)) {
+         DEBUG_M("Compressed stream broken...");
          connection_close_ = true;
+         Write(XMPP_STREAMERROR_NOTWELLFORMED.c_str(), XMPP_STREAMERROR_NOTWELLFORMED.size());
          return;
       }
+      DEBUG_M("INFLATED: '%s'", inflated.c_str());
+      framer_.Feed(inflated.data(), inflated.size());
+   } else {
+      framer_.Feed(data_, size);
    }
-   
-   try {
-      parser->parse(*in); // Parse the recieved XML
-   } catch (const XMLException& toCatch) {
-      char* message = XMLString::transcode(toCatch.getMessage());
-      ERROR("XMPP parsing exception: %s", message);
-      // TODO: Send a valid XMPP error message
-      XMLString::release(&message);
-   } catch (const DOMException& toCatch) {
-      char* message = XMLString::transcode(toCatch.msg);
-      ERROR("XMPP parsing exception: %s", message);
-      // TODO: Send a valid XMPP error message
-      XMLString::release(&message);
-   } catch(const SAXParseException& toCatch) {
-      // This error is to be expected as XMPP is a stream and doesn't close all tags (notabale <stream> ones)...
-      /*char* message = XMLString::transcode(toCatch.getMessage());
-      ERROR("XMPP parsing exception: %s", message);
-      XMLString::release(&message);*/
-   }
-   catch (...) {
-      ERROR("XMPP parsing, unexpected exception...");
-      // TODO: Send a valid XMPP error message
+   ProcessBuffered_();
+}
+
+/**
+ * Handles complete elements already in the framer. Stops early while an auth is pending, the rest waits in the framer.
+ */
+void LazyXMPPConnection::ProcessBuffered_() {
+   string element;
+   while(!connection_close_ && !isInputHeld_()) {
+      switch(framer_.Next(element)) {
+         case StanzaFramer::NEED_MORE:
+            return;
+         case StanzaFramer::STREAM_OPEN:
+            // The stream tag is never closed until the end, close it so it parses on it's own. A client may have
+            // self-closed it already, another '/' would make it unparseable.
+            if(element.compare(element.size()-2, 2, "/>") != 0) {
+               element.insert(element.size()-1, "/");
+            }
+            ProcessStanza_(element);
+            break;
+         case StanzaFramer::STANZA:
+            if(!StreamManagement_(element) && !ForwardRaw_(element)) {
+               ProcessStanza_(element);
+            }
+            break;
+         case StanzaFramer::STREAM_CLOSE:
+            DEBUG_M("End of stream detected...");
+            connection_close_ = true;
+            Write(XMPP_STREAM_CLOSE.c_str(), XMPP_STREAM_CLOSE.size());
+            break;
+         case StanzaFramer::TOO_BIG:
+            DEBUG_M("Stanza too big...");
+            connection_close_ = true;
+            Write(XMPP_STREAMERROR_POLICYVIOLATION.c_str(), XMPP_STREAMERROR_POLICYVIOLATION.size());
+            break;
+         case StanzaFramer::NOT_WELL_FORMED:
+            DEBUG_M("Stream not well formed...");
+            connection_close_ = true;
+            Write(XMPP_STREAMERROR_NOTWELLFORMED.c_str(), XMPP_STREAMERROR_NOTWELLFORMED.size());
+            break;
+      }
+   }
+}
+
+/**
+ * Fast path for routed stanzas. <message> and directed <presence> are forwarded with 'from' spliced into the raw bytes, no DOM involved.
+ * Returns false if the stanza needs the full parse.
+ */
+bool LazyXMPPConnection::ForwardRaw_(const string& stanza) {
+   static const string message = "message";
+   static const string presence = "presence";
+
+   // Let the normal path deal with errors for anything not allowed to route.
+   if(!isInStream_ || connection_type_ < 1) {
+      return false;
+   }
+
+   string tag_name = RawStanza::getTagName(stanza);
+   bool isMessage = message.compare(tag_name) == 0;
+   if(!isMessage && presence.compare(tag_name) != 0) {
+      return false;
    }
-   
-   //TODO: Handle multiple XMPP elements.
-   
-   DOMDocument* xmlDoc = parser->getDocument();
-   DOMElement* elementRoot = xmlDoc->getDocumentElement();
-   if(!elementRoot) {
-      // This is expected as there are <?xml> headers.
-      //ERROR("Empty XML document...");
-   } else {
-      const XMLCh* tag_name = elementRoot->getTagName();
-      char* tag_name_c = XMLString::transcode(tag_name);
 
-      DEBUG_M("Tag name '%s'...", tag_name_c);
-      Chooser_(tag_name_c, elementRoot);
+   // The bytes go out as they came in, so anything odd about them is left to the parser to accept or reject.
+   if(!RawStanza::isForwardable(stanza)) {
+      return false;
+   }
+
+   string to;
+   if(!RawStanza::getAttribute(stanza, "to", to) || to.empty()) {
+      return false; // Broadcast presence, or a message for the server.
+   }
+
+   if(isMessage && !RawStanza::hasChild(stanza, "body")) {
+      return false;
+   }
+
+   string type;
+   RawStanza::getAttribute(stanza, "type", type);
+
+   // Presence probes are answered from the server's cache.
+   if(!isMessage && type.compare("probe") == 0) {
+      getServer()->WriteCachedPresences_(this, to);
+      return true;
+   }
+
+   // Chat and normal messages to an unknown resource go to the bare JID instead (RFC 6121 8.5.3.2.1).
+   bool fallbackToBare = isMessage && (type.empty() || type.compare("chat") == 0 || type.compare("normal") == 0);
+
+   // Stamp on the 'from' attribute, replacing anything the client put there. The result goes straight onto the recipient's queue.
+   boost::shared_ptr<string> forward(new string());
+   RawStanza::setFrom(stanza, getFullJid()).swap(*forward);
+   DEBUG_M("Forward '%s'", forward->c_str());
+   if(!getServer()->WriteJid(to, forward, fallbackToBare) && fallbackToBare) {
+      getServer()->StoreOffline_(to, forward); // Chat and normal messages are kept until they're back (XEP-0160).
+   }
+   if(fallbackToBare) {
+      getServer()->ArchiveMessage_(getFullJid(), to, forward);
+   }
+   return true;
+}
 
-      XMLString::release(&tag_name_c);
+/**
+ * Parses a single complete stanza into XML and hands it to the chooser.
+ */
+void LazyXMPPConnection::ProcessStanza_(const string& stanza) {
+   // The parser belongs to this io thread and is reused, the element is only valid until the next parse.
+   DOMElement* elementRoot = StanzaParser::get().Parse(stanza);
+   if(!elementRoot) {
+      DEBUG_M("Empty XML document...");
+      return;
    }
 
-   delete in;
-   delete parser;
-   delete errHandler;
+   const XMLCh* tag_name = elementRoot->getTagName();
+   char* tag_name_c = XMLString::transcode(tag_name);
+
+   DEBUG_M("Tag name '%s'...", tag_name_c);
+   Chooser_(tag_name_c, elementRoot, stanza);
+
+   XMLString::release(&tag_name_c);
 }
 
 /**
- * Binds ASIO handler for reading data.
+ * Binds ASIO handler for reading data. There is only ever one read outstanding on a connection.
  */
 void LazyXMPPConnection::BindRead_() {
+   if(isReading_) {
+      return;
+   }
    DEBUG_M("Bind read handler.");      
-   socket_.async_read_some(boost::asio::buffer(data_, max_length_), boost::bind(&LazyXMPPConnection::ReadHandler_, shared_from_this(), boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred));
+   isReading_ = true;
+   if(tls_state_ == TLS_ON) {
+      tls_->async_read_some(boost::asio::buffer(data_, max_length_), boost::bind(&LazyXMPPConnection::ReadHandler_, shared_from_this(), boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred));
+   } else {
+      socket_.async_read_some(boost::asio::buffer(data_, max_length_), boost::bind(&LazyXMPPConnection::ReadHandler_, shared_from_this(), boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred));
+   }
 };
 
 /**
@@ -245,6 +575,17 @@ void LazyXMPPConnection::BindRead_() {
  */
 void LazyXMPPConnection::ReadHandler_(const boost::system::error_code& error, size_t bytes) {
    DEBUG_M("Read handler fired, read %d bytes.", bytes);
+   isReading_ = false;
+
+   if(error && !connection_close_ && sm_ && !sm_->getId().empty()) {
+      DEBUG_M("Connection lost, the stream can be resumed...");
+      Detach_();
+      return;
+   }
+
+   if(error) {
+      connection_close_ = true; // Gone, nothing written from now on can reach the client.
+   }
 
    // Check for read error
    try {
@@ -260,18 +601,15 @@ void LazyXMPPConnection::ReadHandler_(const boost::system::error_code& error, si
        return; // TODO: Write XMPP error message here
    }
 
-   // Null terminate.
+   // Null terminate for logging, the framer is given the exact byte count.
    data_[bytes] = '\0';
 
-   // Strip off trailing newlines to help with logging/debugging.
-   if(data_[bytes-1] == '\n') {
-      data_[bytes-1] = '\0';
-   }
-
    if(!error) {
       DEBUG_M("READ: '%s'", data_);
       Process_(bytes);
-      BindRead_();
+      if(!connection_close_ && !isInputHeld_()) {
+         BindRead_();
+      }
    } else {
       ERROR("Read error");
    }
@@ -291,6 +629,360 @@ void LazyXMPPConnection::StreamHandler_(const DOMElement* element) {
    Write(response.c_str(), response.size());
 }
 
+/**
+ * Handles <starttls/>. Input stops here, the client has to wait for <proceed/> and anything it sent early is dropped.
+ * Like <compressed/>, <proceed/> is posted so it goes out after the replies already posted.
+ */
+void LazyXMPPConnection::StarttlsHandler_() {
+   if(!getServer()->isTLSEnabled() || tls_state_ != TLS_OFF || connection_type_ != NOT_AUTHENTICATED) {
+      DEBUG_M("Refusing STARTTLS.");
+      connection_close_ = true;
+      Write(XMPP_TLS_FAILURE.c_str(), XMPP_TLS_FAILURE.size());
+      return;
+   }
+
+   tls_.reset(new boost::asio::ssl::stream<tcp::socket&>(socket_, getServer()->getTls_().getContext()));
+   tls_state_ = TLS_REQUESTED;
+   framer_.Reset();
+   io_service_.post(boost::bind(&LazyXMPPConnection::StartTls_, shared_from_this()));
+}
+
+/**
+ * Sends <proceed/> as the last plain write. Must be run on the connection's io_service.
+ */
+void LazyXMPPConnection::StartTls_() {
+   write_queue_.push_back(SharedBuffer(new string(XMPP_TLS_PROCEED)));
+   plain_writes_ = write_queue_.size();
+   tls_state_ = TLS_PROCEEDING;
+   FlushWrites_();
+}
+
+/**
+ * The TLS handshake finished. The client starts a new stream over it.
+ */
+void LazyXMPPConnection::HandshakeHandler_(const boost::system::error_code& error) {
+   if(error) {
+      DEBUG_M("TLS handshake failed: %s", error.message().c_str());
+      connection_close_ = true;
+      write_queue_.clear();
+      boost::system::error_code ignored;
+      socket_.close(ignored);
+      return;
+   }
+
+   DEBUG_M("TLS handshake done, %s.", SSL_session_reused(tls_->native_handle()) ? "session resumed" : "full handshake");
+   tls_state_ = TLS_ON;
+   isEncrypted_ = true;
+   isInStream_ = false;
+   FlushWrites_();
+   BindRead_();
+}
+
+/**
+ * Counts inbound stanzas once Stream Management is on, and handles it's <enable/>, <resume/>, <r/> and <a/> without
+ * a DOM. Returns true if the element was one of those.
+ */
+bool LazyXMPPConnection::StreamManagement_(const string& stanza) {
+   string tag_name = RawStanza::getTagName(stanza);
+   if(RawStanza::isStanza(tag_name)) {
+      if(sm_) {
+         sm_->Handled();
+      }
+      return false;
+   }
+
+   string xmlns;
+   if(!RawStanza::getAttribute(stanza, "xmlns", xmlns) || xmlns != XMPP_SM_NAMESPACE) {
+      return false;
+   }
+   if(enforeAuthorization_()) {
+      return true;
+   }
+
+   if(tag_name == "r") {
+      if(sm_) {
+         string ack = XMPP_SM_ACK_01 + boost::lexical_cast<string>(sm_->getHandled()) + "'/>";
+         Write(ack.c_str(), ack.size());
+      }
+   } else if(tag_name == "a") {
+      AckHandler_(stanza);
+   } else if(tag_name == "enable") {
+      EnableHandler_(stanza);
+   } else if(tag_name == "resume") {
+      ResumeHandler_(stanza);
+   } else {
+      DEBUG_M("Unknown Stream Management element... '%s'", tag_name.c_str());
+   }
+   return true;
+}
+
+/**
+ * Turns on Stream Management, resumable if the client asks and resumption isn't off.
+ */
+void LazyXMPPConnection::EnableHandler_(const string& stanza) {
+   if(sm_ || !isBound_ || !getServer()->isStreamManagementEnabled()) {
+      string failed = XMPP_SM_FAILED_01 + "unexpected-request" + XMPP_SM_FAILED_02;
+      Write(failed.c_str(), failed.size());
+      return;
+   }
+
+   string resume;
+   string max;
+   unsigned int timeout = getServer()->getResumeTimeout();
+   RawStanza::getAttribute(stanza, "resume", resume);
+   if(RawStanza::getAttribute(stanza, "max", max)) {
+      unsigned long requested = strtoul(max.c_str(), NULL, 10);
+      if(requested > 0 && requested < timeout) {
+         timeout = requested;
+      }
+   }
+
+   string id;
+   string enabled = XMPP_SM_ENABLED_01;
+   if((resume == "true" || resume == "1") && timeout > 0) {
+      id = generateRandomId_();
+      getServer()->getResumable_().Add(id, getJid(), shared_from_this());
+      enabled += " id='" + id + "'" + XMPP_SM_ENABLED_02 + boost::lexical_cast<string>(timeout) + "'";
+   }
+   enabled += "/>";
+
+   // Straight onto the queue rather than posted, so everything queued from here on is counted and comes after it.
+   write_queue_.push_back(SharedBuffer(new string(enabled)));
+   sm_.reset(new StreamSession(id, timeout));
+   FlushWrites_();
+}
+
+/**
+ * The client's count of stanzas it has had from us.
+ */
+void LazyXMPPConnection::AckHandler_(const string& stanza) {
+   string h;
+   if(!sm_ || !RawStanza::getAttribute(stanza, "h", h)) {
+      return;
+   }
+   if(!sm_->Acked(strtoul(h.c_str(), NULL, 10))) {
+      connection_close_ = true;
+      string error = XMPP_STREAMERROR_HANDLEDCOUNTTOOHIGH_01 + RawStanza::Escape(h) + XMPP_STREAMERROR_HANDLEDCOUNTTOOHIGH_02 + boost::lexical_cast<string>(sm_->getSent()) + XMPP_STREAMERROR_HANDLEDCOUNTTOOHIGH_03;
+      Write(error.c_str(), error.size());
+      return;
+   }
+   sm_->setAckRequested(false);
+}
+
+/**
+ * Asks the client for an ack once enough is unacked. One that lets too much pile up loses it's stream, if it's
+ * detached the session just ends early.
+ */
+void LazyXMPPConnection::CheckUnacked_() {
+   if(sm_->getUnackedCount() > SM_MAX_UNACKED) {
+      if(isDetached_) {
+         connection_close_ = true;
+         resume_timer_.cancel();
+      } else if(!connection_close_) {
+         DEBUG_M("Too many unacked stanzas...");
+         connection_close_ = true;
+         write_queue_.push_back(SharedBuffer(new string(XMPP_STREAMERROR_POLICYVIOLATION)));
+      }
+   } else if(!isDetached_ && !sm_->isAckRequested() && sm_->getUnackedCount() >= SM_REQUEST_EVERY) {
+      sm_->setAckRequested(true);
+      write_queue_.push_back(XMPP_SM_REQUEST);
+   }
+}
+
+/**
+ * Resumes a stream in place of binding a resource. The connection it was on may still be alive, it's asked to hand
+ * the session over on it's own io thread and input is held until it has.
+ */
+void LazyXMPPConnection::ResumeHandler_(const string& stanza) {
+   string previd;
+   string h;
+   if(sm_ || isBound_ || !RawStanza::getAttribute(stanza, "previd", previd) || !RawStanza::getAttribute(stanza, "h", h)) {
+      ResumeFailed_("unexpected-request");
+      return;
+   }
+
+   LazyXMPPConnectionPtr previous = getServer()->getResumable_().Find(RawStanza::Unescape(previd), getJid());
+   if(!previous || previous.get() == this) {
+      ResumeFailed_("item-not-found");
+      return;
+   }
+
+   isResumePending_ = true;
+   previous->io_service_.post(boost::bind(&LazyXMPPConnection::Takeover_, previous, shared_from_this(), (unsigned int)strtoul(h.c_str(), NULL, 10)));
+}
+
+/**
+ * Gives this connection's stream session to the one resuming it. Run on this connection's io_service. From here on
+ * this connection doesn't own the resource, presence or session, so it's destructor leaves them alone, and anything
+ * still routed here is passed on.
+ */
+void LazyXMPPConnection::Takeover_(const LazyXMPPConnectionPtr& by, unsigned int h) {
+   if(!sm_ || sm_->getId().empty() || connection_close_ || isHandedOver_) {
+      by->io_service_.post(boost::bind(&LazyXMPPConnection::ResumeFailed_, by, string("item-not-found")));
+      return;
+   }
+
+   Handover handover;
+   handover.session = sm_;
+   handover.previous = this;
+   handover.resource = getResource();
+   handover.nickname = getNickname();
+   handover.isSession = isSession_;
+   handover.isAvailable = isAvailable_;
+
+   sm_.reset();
+   isBound_ = false;
+   isAvailable_ = false;
+   isHandedOver_ = true;
+   resumed_by_ = by;
+   connection_close_ = true;
+   write_queue_.clear(); // The session has them.
+   resume_timer_.cancel();
+   boost::system::error_code ignored;
+   socket_.close(ignored);
+
+   by->io_service_.post(boost::bind(&LazyXMPPConnection::Resumed_, by, handover, h));
+}
+
+/**
+ * Takes over a stream session and sends the client whatever it hadn't acked.
+ */
+void LazyXMPPConnection::Resumed_(const Handover& handover, unsigned int h) {
+   isResumePending_ = false;
+   setResource_(handover.resource);
+   setNickname_(handover.nickname);
+   isBound_ = true;
+   isSession_ = handover.isSession;
+   isAvailable_ = handover.isAvailable;
+   sm_ = handover.session;
+   getServer()->replaceRoute_(shared_from_this(), handover.previous);
+   getServer()->getResumable_().Add(sm_->getId(), getJid(), shared_from_this());
+   DEBUG_M("Resumed '%s', %d unacked.", getFullJid().c_str(), (int)sm_->getUnackedCount());
+
+   if(!sm_->Acked(h)) {
+      connection_close_ = true;
+      string error = XMPP_STREAMERROR_HANDLEDCOUNTTOOHIGH_01 + boost::lexical_cast<string>(h) + XMPP_STREAMERROR_HANDLEDCOUNTTOOHIGH_02 + boost::lexical_cast<string>(sm_->getSent()) + XMPP_STREAMERROR_HANDLEDCOUNTTOOHIGH_03;
+      Write(error.c_str(), error.size());
+      return;
+   }
+   sm_->setAckRequested(false);
+
+   // Sent again as they are, they're already counted.
+   write_queue_.push_back(SharedBuffer(new string(XMPP_SM_RESUMED_01 + sm_->getId() + "' h='" + boost::lexical_cast<string>(sm_->getHandled()) + "'/>")));
+   vector<SharedBuffer> unacked;
+   sm_->getUnacked(unacked);
+   write_queue_.insert(write_queue_.end(), unacked.begin(), unacked.end());
+   FlushWrites_();
+   Resume_();
+}
+
+/**
+ * Tells the client it can't resume, it carries on with a normal bind.
+ */
+void LazyXMPPConnection::ResumeFailed_(const string& condition) {
+   string failed = XMPP_SM_FAILED_01 + condition + XMPP_SM_FAILED_02;
+   Write(failed.c_str(), failed.size());
+   if(isResumePending_) {
+      isResumePending_ = false;
+      Resume_();
+   }
+}
+
+/**
+ * The link dropped with a resumable stream. The route, presence and session all stay, stanzas for it collect in the
+ * session until the client resumes or the timer runs out. The timer's handler is what keeps this connection alive.
+ */
+void LazyXMPPConnection::Detach_() {
+   isDetached_ = true;
+   write_queue_.clear();
+   boost::system::error_code ignored;
+   socket_.close(ignored);
+   resume_timer_.expires_from_now(boost::posix_time::seconds(sm_->getTimeout()));
+   resume_timer_.async_wait(boost::bind(&LazyXMPPConnection::ResumeExpired_, shared_from_this(), boost::asio::placeholders::error));
+}
+
+/**
+ * Either resumed elsewhere (cancelled) or out of time. Either way the last reference goes with this handler.
+ */
+void LazyXMPPConnection::ResumeExpired_(const boost::system::error_code& error) {
+   if(error != boost::asio::error::operation_aborted) {
+      DEBUG_M("Stream wasn't resumed in time...");
+      connection_close_ = true;
+   }
+}
+
+/**
+ * The stream session is over. What the client never acked is treated as undelivered, messages go to the offline
+ * spool for it's next login.
+ */
+void LazyXMPPConnection::EndStreamSession_() {
+   static const string message = "message";
+   if(!sm_->getId().empty()) {
+      getServer()->getResumable_().Remove(sm_->getId(), this);
+   }
+
+   vector<SharedBuffer> unacked;
+   sm_->getUnacked(unacked);
+   for(vector<SharedBuffer>::const_iterator it = unacked.begin(); it != unacked.end(); it++) {
+      string type;
+      RawStanza::getAttribute(**it, "type", type);
+      if(RawStanza::getTagName(**it) == message && (type.empty() || type == "chat" || type == "normal")) {
+         getServer()->StoreOffline_(getJid(), *it);
+      }
+   }
+   sm_.reset();
+}
+
+/**
+ * Handles a request to compress the stream (XEP-0138). The client compresses everything after <compress/>, so
+ * inflating starts straight away. Replies to what was read before it are already posted, so <compressed/> is
+ * posted after them and deflating starts there.
+ */
+void LazyXMPPConnection::CompressHandler_(const DOMElement* element) {
+   if(compression_ || connection_type_ < 1 || !getServer()->isCompressionEnabled()) {
+      Write(XMPP_COMPRESSFAILURE_SETUPFAILED.c_str(), XMPP_COMPRESSFAILURE_SETUPFAILED.size());
+      return;
+   }
+
+   const DOMElement* method = getSingleDOMElementByTagName_(element, "method");
+   if(!method || getTextContent_(method) != "zlib") {
+      Write(XMPP_COMPRESSFAILURE_UNSUPPORTEDMETHOD.c_str(), XMPP_COMPRESSFAILURE_UNSUPPORTEDMETHOD.size());
+      return;
+   }
+
+   compression_.reset(new StreamCompression(getServer()->getCompressionLevel()));
+   if(!compression_->Start()) {
+      compression_.reset();
+      Write(XMPP_COMPRESSFAILURE_SETUPFAILED.c_str(), XMPP_COMPRESSFAILURE_SETUPFAILED.size());
+      return;
+   }
+   io_service_.post(boost::bind(&LazyXMPPConnection::StartDeflating_, shared_from_this()));
+
+   // Anything read past <compress/> is already compressed.
+   string rest;
+   framer_.TakeBuffered(rest);
+   if(!rest.empty()) {
+      string inflated;
+      if(!compression_->Inflate(rest.data(), rest.size(), inflated)) {
+         DEBUG_M("Compressed stream broken...");
+         connection_close_ = true;
+         Write(XMPP_STREAMERROR_NOTWELLFORMED.c_str(), XMPP_STREAMERROR_NOTWELLFORMED.size());
+         return;
+      }
+      framer_.Feed(inflated.data(), inflated.size());
+   }
+}
+
+/**
+ * Sends <compressed/> as the last plain write. Must be run on the connection's io_service.
+ */
+void LazyXMPPConnection::StartDeflating_() {
+   write_queue_.push_back(SharedBuffer(new string(XMPP_COMPRESSED)));
+   uncompressed_writes_ = write_queue_.size();
+   isDeflating_ = true;
+   FlushWrites_();
+}
+
 /**
  * Generates a stream request response XMPP stanza.
  */
@@ -313,15 +1005,14 @@ string LazyXMPPConnection::generateRandomId_() const {
  * Generate a stream features XMPP stanza.
  */
 string LazyXMPPConnection::generateStreamFeatures_() const {
-   return XMPP_STREAMFEATURES_01 + generateStreamFeaturesTLS_() + generateStreamFeaturesMechanisms_() + generateStreamFeaturesCompression_() + generateStreamFeaturesBind_() + generateStreamFeaturesSession_() + generateStreamFeaturesRegister_() + XMPP_STREAMFEATURES_02;
+   return XMPP_STREAMFEATURES_01 + generateStreamFeaturesTLS_() + generateStreamFeaturesMechanisms_() + generateStreamFeaturesAuthentication_() + generateStreamFeaturesCompression_() + generateStreamFeaturesBind_() + generateStreamFeaturesSession_() + generateStreamFeaturesStreamManagement_() + generateStreamFeaturesRegister_() + XMPP_STREAMFEATURES_02;
 }
 
 /**
  * Generates a TLS stream feature entry.
  */
 string LazyXMPPConnection::generateStreamFeaturesTLS_() const {
-   // FIXME: Support TLS...
-   if(!getServer()->isTLSEnabled()) {
+   if(!getServer()->isTLSEnabled() || tls_state_ != TLS_OFF || connection_type_ != NOT_AUTHENTICATED) {
       return "";
    }
 
@@ -332,14 +1023,18 @@ string LazyXMPPConnection::generateStreamFeaturesTLS_() const {
  * Generates a serialized list of authentication mechanisms as a stream feature entry.
  */
 string LazyXMPPConnection::generateStreamFeaturesMechanisms_() const {
-   // FIXME: Support secure logins...
-   
    // Don't offer mechanisms if we are already logged in.
    if(connection_type_ > 0) {
       return "";
    }
    string mechanisms_s = XMPP_STREAMFEATURES_MECHANISMS_01;
 
+   // Strongest first, clients tend to pick the first one they know.
+   if(getServer()->isScramAuthEnabled()) {
+      mechanisms_s.append(XMPP_STREAMFEATURES_MECHANISM_SCRAMSHA256);
+      mechanisms_s.append(XMPP_STREAMFEATURES_MECHANISM_SCRAMSHA1);
+   }
+
    if(getServer()->isAnonymousAuthEnabled()) {
       mechanisms_s.append(XMPP_STREAMFEATURES_MECHANISM_ANONYMOUS);
    }
@@ -351,11 +1046,50 @@ string LazyXMPPConnection::generateStreamFeaturesMechanisms_() const {
    return mechanisms_s;
 }
 
+/**
+ * Generates the SASL2 (XEP-0388) stream feature entry, with inline bind (XEP-0386) and FAST (XEP-0484).
+ */
+string LazyXMPPConnection::generateStreamFeaturesAuthentication_() const {
+   if(connection_type_ > 0 || !getServer()->isSasl2Enabled()) {
+      return "";
+   }
+   string authentication_s = XMPP_STREAMFEATURES_AUTHENTICATION_01;
+
+   if(getServer()->isScramAuthEnabled()) {
+      authentication_s.append(XMPP_STREAMFEATURES_MECHANISM_SCRAMSHA256);
+      authentication_s.append(XMPP_STREAMFEATURES_MECHANISM_SCRAMSHA1);
+   }
+
+   if(getServer()->isPlainAuthEnabled()) {
+     authentication_s.append(XMPP_STREAMFEATURES_MECHANISM_PLAIN);
+   }
+
+   authentication_s.append(XMPP_STREAMFEATURES_AUTHENTICATION_02);
+   if(getServer()->isFastAuthEnabled() && isEncrypted()) {
+      authentication_s.append(XMPP_STREAMFEATURES_AUTHENTICATION_FAST);
+   }
+   authentication_s.append(XMPP_STREAMFEATURES_AUTHENTICATION_03);
+   return authentication_s;
+}
+
 /**
  * Generates a serialized compression stream feature entry.
  */
 string LazyXMPPConnection::generateStreamFeaturesCompression_() const {
-   // FIXME: Support compression...
+   // Offered once authenticated, compressing the SASL exchange gains little.
+   if(connection_type_ > 0 && !compression_ && getServer()->isCompressionEnabled()) {
+      return XMPP_STREAMFEATURES_COMPRESSION;
+   }
+   return "";
+}
+
+/**
+ * Generates a serialized Stream Management feature entry.
+ */
+string LazyXMPPConnection::generateStreamFeaturesStreamManagement_() const {
+   if(connection_type_ > 0 && !sm_ && getServer()->isStreamManagementEnabled()) {
+      return XMPP_STREAMFEATURES_SM;
+   }
    return "";
 }
 
@@ -392,8 +1126,14 @@ string LazyXMPPConnection::generateStreamFeaturesRegister_() const {
  */
 void LazyXMPPConnection::AuthHandler_(const DOMElement* element) {
    string auth_mechanism = getDOMAttribute_(element, "mechanism");
+   Scram::Mechanism scram_mechanism;
+   isSasl2_ = false;
    
-   if((auth_mechanism.compare("PLAIN") == 0) && getServer()->isPlainAuthEnabled()){
+   if(Scram::fromName(auth_mechanism, scram_mechanism) && getServer()->isScramAuthEnabled()) {
+      DEBUG_M("Recieved %s auth.", auth_mechanism.c_str());
+      AuthScramHandler_(scram_mechanism, getTextContent_(element));
+      return;
+   } else if((auth_mechanism.compare("PLAIN") == 0) && getServer()->isPlainAuthEnabled()){
       if(!isEncrypted() && !getServer()->isUnencryptedPlainAuthEnabled()) {
          // Not secure enough.
          Write(XMPP_AUTHFAILURE_ENCRYPTIONREQUIRED.c_str(), XMPP_AUTHFAILURE_ENCRYPTIONREQUIRED.size());
@@ -419,7 +1159,8 @@ void LazyXMPPConnection::AuthHandler_(const DOMElement* element) {
       DEBUG_M("Recieved unknown auth.");
 
       connection_close_ = true;
-      Write(XMPP_AUTHFAILURE_INVALIDMECHANISM.c_str(), XMPP_AUTHFAILURE_INVALIDMECHANISM.size());
+      string failure = XMPP_AUTHFAILURE_INVALIDMECHANISM + XMPP_STREAM_CLOSE;
+      Write(failure.c_str(), failure.size());
       return;
    }
 }
@@ -471,30 +1212,300 @@ void LazyXMPPConnection::AuthPlainHandler_(const DOMElement* element) {
          // Decoded datasize doesn't match extracted nodeid/password size. Weirdness.
          DEBUG_M("Size mismatch");
          Write(XMPP_AUTHFAILURE_MALFORMEDREQUEST.c_str(), XMPP_AUTHFAILURE_MALFORMEDREQUEST.size());
+         return;
       }
 
       // TODO: How do you release these in xerces3...
       //XMLString::release(&decoded_data_x);
 
-      // Check password is correct...
-      if(!getServer()->getUserDB()->verifyPassword(nodeid, password)) {
-         connection_close_ = true;
-         LOG("Login failure for user: '%s' from '%s'", nodeid, getAddress().c_str());
-         Write(XMPP_AUTHFAILURE_NOTAUTHORIZED.c_str(), XMPP_AUTHFAILURE_NOTAUTHORIZED.size());
-         return;
+      // Check password is correct... The hashing is slow, so it's done on an auth worker and this connection
+      // stops processing input until the result comes back.
+      isAuthPending_ = true;
+      if(!getServer()->getPasswordBatcher_().Submit(nodeid, password, boost::bind(&LazyXMPPConnection::PlainVerified_, shared_from_this(), string(nodeid), _1))) {
+         isAuthPending_ = false;
+         WriteAuthFailure_(XMPP_AUTHFAILURE_TEMPORARYAUTHFAILURE, "temporary-auth-failure");
       }
+}
 
-      // Set the node id (the bit befoure the @ in a JID). Also set the displayed nick name if there isn't one already.
-      setNodeId_(nodeid);
-      if(getNickname().empty()) {
-         setNickname_(getNodeId());
+/**
+ * Gets a plain auth password check back, probably checked along with others. Runs on an auth worker thread, the
+ * result is posted back to the connection's io_service.
+ */
+void LazyXMPPConnection::PlainVerified_(const string& nodeid, bool verified) {
+   io_service_.post(boost::bind(&LazyXMPPConnection::AuthPlainResult_, shared_from_this(), nodeid, verified));
+}
+
+/**
+ * Finishes a plain auth once the password has been checked, then carries on with any input that was held back.
+ */
+void LazyXMPPConnection::AuthPlainResult_(const string& nodeid, bool verified) {
+   isAuthPending_ = false;
+
+   if(!verified) {
+      connection_close_ = !isSasl2_;
+      LOG("Login failure for user: '%s' from '%s'", nodeid.c_str(), getAddress().c_str());
+      WriteAuthFailure_(XMPP_AUTHFAILURE_NOTAUTHORIZED, "not-authorized");
+      Resume_();
+      return;
+   }
+
+   AuthSucceeded_(nodeid, "");
+   DEBUG_M("Authentication sucessfull.");
+   Resume_();
+}
+
+/**
+ * Picks up input processing again after it was held back, and starts reading again.
+ */
+void LazyXMPPConnection::Resume_() {
+   ProcessBuffered_();
+   if(!connection_close_ && !isInputHeld_()) {
+      BindRead_();
+   }
+}
+
+/**
+ * Starts a SCRAM exchange (RFC 5802). The client-first-message normally comes with the <auth>, if not we ask for it.
+ * The server only does a database lookup and a few HMACs, the key derivation happened at registration.
+ */
+void LazyXMPPConnection::AuthScramHandler_(Scram::Mechanism mechanism, const string& initial_response) {
+   scram_.reset(new ScramSession(mechanism));
+
+   if(initial_response.empty() || initial_response.compare("=") == 0) {
+      WriteAuthChallenge_("");
+      return;
+   }
+
+   string client_first, username;
+   if(!Scram::Base64Decode(initial_response, client_first) || !scram_->ClientFirst(client_first, username)) {
+      DEBUG_M("Malformed SCRAM client-first-message.");
+      scram_.reset();
+      WriteAuthFailure_(XMPP_AUTHFAILURE_MALFORMEDREQUEST, "malformed-request");
+      return;
+   }
+
+   // Unknown users get fake credentials, they fail at the proof the same as a bad password.
+   ScramCredentials credentials;
+   if(getServer()->getUserDB()->getScramCredentials(username, scram_->getMechanism(), credentials) == UserDB::SCRAM_NO_KEYS) {
+      // Registered before SCRAM, so no proof could ever match. invalid-mechanism without closing the stream makes
+      // the client move on to PLAIN, and that login adds the keys for next time.
+      DEBUG_M("No SCRAM keys for '%s' yet.", username.c_str());
+      scram_.reset();
+      WriteAuthFailure_(XMPP_AUTHFAILURE_INVALIDMECHANISM, "invalid-mechanism");
+      return;
+   }
+   WriteAuthChallenge_(scram_->ServerFirst(credentials, generateRandomId_()));
+}
+
+/**
+ * Handles a SASL <response>, either a late client-first-message or the client-final-message with the proof.
+ */
+void LazyXMPPConnection::AuthResponseHandler_(const DOMElement* element) {
+   if(!scram_) {
+      WriteAuthFailure_(XMPP_AUTHFAILURE_MALFORMEDREQUEST, "malformed-request");
+      return;
+   }
+
+   if(scram_->getUsername().empty()) {
+      AuthScramHandler_(scram_->getMechanism(), getTextContent_(element));
+      return;
+   }
+
+   boost::shared_ptr<ScramSession> scram = scram_;
+   scram_.reset();
+
+   string client_final, server_final;
+   if(!Scram::Base64Decode(getTextContent_(element), client_final) || !scram->ClientFinal(client_final, server_final)) {
+      connection_close_ = !isSasl2_;
+      LOG("Login failure for user: '%s' from '%s'", scram->getUsername().c_str(), getAddress().c_str());
+      WriteAuthFailure_(XMPP_AUTHFAILURE_NOTAUTHORIZED, "not-authorized");
+      return;
+   }
+
+   AuthSucceeded_(scram->getUsername(), server_final);
+}
+
+/**
+ * The client gave up on the SASL exchange.
+ */
+void LazyXMPPConnection::AuthAbortHandler_() {
+   scram_.reset();
+   WriteAuthFailure_(XMPP_AUTHFAILURE_ABORTED, "aborted");
+}
+
+/**
+ * Handles a SASL2 <authenticate> (XEP-0388). Besides the mechanism it can ask for a resource to be bound (XEP-0386)
+ * and for a FAST token (XEP-0484), so a reconnect is one round trip and no stream restart.
+ */
+void LazyXMPPConnection::AuthenticateHandler_(const DOMElement* element) {
+   if(!getServer()->isSasl2Enabled() || connection_type_ != NOT_AUTHENTICATED) {
+      connection_close_ = true;
+      Write(XMPP_STREAMERROR_POLICYVIOLATION.c_str(), XMPP_STREAMERROR_POLICYVIOLATION.size());
+      return;
+   }
+
+   isSasl2_ = true;
+   scram_.reset();
+   sasl2_ = Sasl2Request();
+
+   string mechanism = getDOMAttribute_(element, "mechanism");
+   const DOMElement* initial_response = getSingleDOMElementByTagName_(element, "initial-response");
+
+   const DOMElement* user_agent = getSingleDOMElementByTagName_(element, "user-agent");
+   if(user_agent) {
+      agent_id_ = getDOMAttribute_(user_agent, "id");
+   }
+
+   const DOMElement* bind = getSingleDOMElementByTagName_(element, "bind");
+   if(bind) {
+      sasl2_.bind = true;
+      const DOMElement* tag = getSingleDOMElementByTagName_(bind, "tag");
+      if(tag) {
+         sasl2_.bind_tag = getTextContent_(tag);
       }
+   }
 
-      // Set that this connection is authenticated and send a sucess response.
-      connection_type_ = AUTHENTICATED;      
-      Write(XMPP_SUCCESS.c_str(), XMPP_SUCCESS.size());
-      LOG("XMPP authentication sucessfull for %s. Logged in as '%s'.", getAddress().c_str(), getNodeId().c_str());
-      DEBUG_M("Authentication sucessfull.");
+   const DOMElement* request_token = getSingleDOMElementByTagName_(element, "request-token");
+   sasl2_.request_token = request_token && getDOMAttribute_(request_token, "mechanism").compare(XMPP_FAST_MECHANISM) == 0;
+
+   unsigned long count = 0;
+   const DOMElement* fast = getSingleDOMElementByTagName_(element, "fast");
+   if(fast) {
+      count = strtoul(getDOMAttribute_(fast, "count").c_str(), NULL, 10);
+      string invalidate = getDOMAttribute_(fast, "invalidate");
+      sasl2_.invalidate = invalidate.compare("true") == 0 || invalidate.compare("1") == 0;
+   }
+
+   Scram::Mechanism scram_mechanism;
+   if(mechanism.compare(XMPP_FAST_MECHANISM) == 0 && getServer()->isFastAuthEnabled()) {
+      // HT-SHA-256-NONE proves nothing about the channel, a proof seen on a plain stream would work for anyone.
+      if(!isEncrypted()) {
+         WriteAuthFailure_(XMPP_AUTHFAILURE_ENCRYPTIONREQUIRED, "encryption-required");
+      } else if(count == 0) {
+         WriteAuthFailure_(XMPP_AUTHFAILURE_MALFORMEDREQUEST, "malformed-request");
+      } else {
+         AuthFastHandler_(initial_response ? getTextContent_(initial_response) : "", count);
+      }
+   } else if(Scram::fromName(mechanism, scram_mechanism) && getServer()->isScramAuthEnabled()) {
+      AuthScramHandler_(scram_mechanism, initial_response ? getTextContent_(initial_response) : "");
+   } else if(mechanism.compare("PLAIN") == 0 && getServer()->isPlainAuthEnabled()) {
+      if(!isEncrypted() && !getServer()->isUnencryptedPlainAuthEnabled()) {
+         WriteAuthFailure_(XMPP_AUTHFAILURE_ENCRYPTIONREQUIRED, "encryption-required");
+      } else if(!initial_response) {
+         WriteAuthFailure_(XMPP_AUTHFAILURE_MALFORMEDREQUEST, "malformed-request");
+      } else {
+         AuthPlainHandler_(initial_response);
+      }
+   } else {
+      WriteAuthFailure_(XMPP_AUTHFAILURE_INVALIDMECHANISM, "invalid-mechanism");
+   }
+}
+
+/**
+ * Handles HT-SHA-256-NONE, the initial response is the username, a null and HMAC-SHA-256(token, "Initiator").
+ * Only a couple of HMACs, so unlike PLAIN it's done right here on the io thread.
+ */
+void LazyXMPPConnection::AuthFastHandler_(const string& initial_response, unsigned long count) {
+   string decoded;
+   size_t separator = string::npos;
+   if(Scram::Base64Decode(initial_response, decoded)) {
+      separator = decoded.find('\0');
+   }
+   if(separator == string::npos || separator == 0) {
+      WriteAuthFailure_(XMPP_AUTHFAILURE_MALFORMEDREQUEST, "malformed-request");
+      return;
+   }
+
+   string nodeid = decoded.substr(0, separator);
+   if(agent_id_.empty() || !getServer()->getFastTokens_().Verify(nodeid, agent_id_, decoded.substr(separator + 1), count, sasl2_.used_token)) {
+      // The client still has its password to fall back on, so the stream stays up.
+      LOG("FAST token login failure for user: '%s' from '%s'", nodeid.c_str(), getAddress().c_str());
+      WriteAuthFailure_(XMPP_AUTHFAILURE_NOTAUTHORIZED, "not-authorized");
+      return;
+   }
+
+   AuthSucceeded_(nodeid, "");
+}
+
+/**
+ * Logs the connection in once any mechanism has checked out. For SASL2 this also does the inline bind and hands out
+ * a fresh FAST token, all in the one <success>.
+ */
+void LazyXMPPConnection::AuthSucceeded_(const string& nodeid, const string& additional_data) {
+   // Set the node id (the bit befoure the @ in a JID). Also set the displayed nick name if there isn't one already.
+   setNodeId_(nodeid);
+   if(getNickname().empty()) {
+      setNickname_(getNodeId());
+   }
+
+   // Set that this connection is authenticated and send a sucess response.
+   connection_type_ = AUTHENTICATED;
+   LOG("XMPP authentication sucessfull for %s. Logged in as '%s'.", getAddress().c_str(), getNodeId().c_str());
+
+   if(!isSasl2_) {
+      if(additional_data.empty()) {
+         Write(XMPP_SUCCESS.c_str(), XMPP_SUCCESS.size());
+      } else {
+         string success = XMPP_SUCCESS_DATA_01 + Scram::Base64Encode(additional_data) + XMPP_SUCCESS_DATA_02;
+         Write(success.c_str(), success.size());
+      }
+      return;
+   }
+
+   string success = XMPP_SASL2_SUCCESS_01;
+   if(!additional_data.empty()) {
+      success += XMPP_SASL2_ADDITIONALDATA_01 + Scram::Base64Encode(additional_data) + XMPP_SASL2_ADDITIONALDATA_02;
+   }
+
+   if(sasl2_.bind) {
+      // XEP-0386 has the server pick the resource, the client's tag just makes it recognisable.
+      string tag = sasl2_.bind_tag.substr(0, 32);
+      BindResource_((tag.empty() ? "" : tag + ".") + generateRandomId_().substr(0, 8));
+      success += XMPP_SASL2_AUTHZID_01 + getFullJid() + XMPP_SASL2_AUTHZID_02 + XMPP_SASL2_BOUND;
+   } else {
+      success += XMPP_SASL2_AUTHZID_01 + getJid() + XMPP_SASL2_AUTHZID_02;
+   }
+
+   FastTokenStore& tokens = getServer()->getFastTokens_();
+   if(sasl2_.invalidate) {
+      tokens.Invalidate(nodeid, agent_id_);
+   } else if(getServer()->isFastAuthEnabled() && isEncrypted() && !agent_id_.empty() && (sasl2_.request_token || !sasl2_.used_token.empty())) {
+      // Every FAST login rotates the token. The one just used keeps working until the client uses the new one.
+      time_t expiry;
+      string token = tokens.Issue(nodeid, agent_id_, sasl2_.used_token, expiry);
+      char expiry_c[32];
+      struct tm expiry_tm;
+      strftime(expiry_c, sizeof(expiry_c), "%Y-%m-%dT%H:%M:%SZ", gmtime_r(&expiry, &expiry_tm));
+      success += XMPP_SASL2_TOKEN_01 + expiry_c + XMPP_SASL2_TOKEN_02 + token + XMPP_SASL2_TOKEN_03;
+   }
+
+   success += XMPP_SASL2_SUCCESS_02;
+   Write(success.c_str(), success.size());
+   sasl2_ = Sasl2Request();
+
+   if(isBound_) {
+      addToRosters_();
+   }
+}
+
+/**
+ * Sends a SASL challenge in whichever namespace the exchange started with.
+ */
+void LazyXMPPConnection::WriteAuthChallenge_(const string& data) {
+   string challenge = (isSasl2_ ? XMPP_SASL2_CHALLENGE_01 : XMPP_CHALLENGE_01) + Scram::Base64Encode(data) + XMPP_CHALLENGE_02;
+   Write(challenge.c_str(), challenge.size());
+}
+
+/**
+ * Sends a SASL failure. Legacy SASL uses the prebaked stanza, SASL2 wraps the condition in its own <failure>.
+ */
+void LazyXMPPConnection::WriteAuthFailure_(const string& failure, const string& condition) {
+   if(!isSasl2_) {
+      Write(failure.c_str(), failure.size());
+      return;
+   }
+   string sasl2_failure = XMPP_SASL2_FAILURE_01 + condition + XMPP_SASL2_FAILURE_02;
+   Write(sasl2_failure.c_str(), sasl2_failure.size());
 }
 
 // IQ Stuff here
@@ -573,14 +1584,22 @@ void LazyXMPPConnection::IqSetHandler_(const string& id, const DOMElement* eleme
 // TODO: This doesn't seem to work...
 void LazyXMPPConnection::addToRosters_() {
    DEBUG_M("Entered function...");
-   getServer()->connections_mutex_.lock();
-   for (Connections::iterator it=getServer()->connections_.begin() ; it != getServer()->connections_.end(); it++ ) {
-      string to = (*it)->getJid();
-      string forward = generateIqHeader_("set", generateRandomId_(), to, getFullJid()) + XMPP_ROSTER_RESPONSE_01 + generateRosterItem_(getNickname(), getFullJid(), "") + XMPP_ROSTER_RESPONSE_02 + XMPP_IQ_CLOSE;
-      
-      (*it)->Write(forward.c_str(), forward.size());
+   string item = XMPP_ROSTER_RESPONSE_01 + generateRosterItem_(getNickname(), getFullJid(), "") + XMPP_ROSTER_RESPONSE_02 + XMPP_IQ_CLOSE;
+
+   RegistrySnapshot snapshot;
+   getServer()->getRegistry_().getSnapshot(snapshot);
+   for(RegistrySnapshot::const_iterator shard = snapshot.begin(); shard != snapshot.end(); shard++) {
+      for(BareJidRoutes::const_iterator it = (*shard)->bare_routes.begin(); it != (*shard)->bare_routes.end(); it++) {
+         string forward = generateIqHeader_("set", generateRandomId_(), it->first, getFullJid()) + item;
+         SharedBuffer forward_b(new string(forward));
+         for(Resources::const_iterator resource = it->second.begin(); resource != it->second.end(); resource++) {
+            LazyXMPPConnectionPtr target = resource->lock();
+            if(target) {
+               target->Write(forward_b);
+            }
+         }
+      }
    }
-   getServer()->connections_mutex_.unlock();
 }
 
 /**
@@ -597,18 +1616,33 @@ void LazyXMPPConnection::IqSetBind_(const string& id, const DOMElement* bind) {
    if(!resourceElement) {
       resource = generateRandomId_();
    } else {
-      char *tag_name = XMLString::transcode(resourceElement->getTextContent());
+      resource = getTextContent_(resourceElement);
       DEBUG_M("Requested resource '%s'", resource.c_str());
-      resource = tag_name;
    }
-   
-   setResource_(resource);
-   isBound_ = true;
+
+   resource = BindResource_(resource);
    string response = generateIqResultBind_(id, resource);
    Write(response.c_str(), response.size());
    addToRosters_();
 }
 
+/**
+ * Routes the resource to this connection. If it's already in use it's overridden with a generated one (RFC 6120 7.7.2.2).
+ */
+string LazyXMPPConnection::BindResource_(const string& resource) {
+   if(isBound_) {
+      // Rebinding, the old resource no longer routes here.
+      getServer()->removeRoute_(getJid(), getFullJid(), this);
+   }
+
+   setResource_(resource);
+   while(getResource().empty() || !getServer()->addRoute_(shared_from_this())) {
+      setResource_(generateRandomId_());
+   }
+   isBound_ = true;
+   return getResource();
+}
+
 /**
  * Generates a serialized iq bind response stanza.
  */
@@ -631,7 +1665,13 @@ void LazyXMPPConnection::IqSetSession_(const string& id) {
  * Gets the ip address of the connection.
  */
 string LazyXMPPConnection::getAddress() const { 
-   return socket_.remote_endpoint().address().to_string();
+   // The peer may have gone by the time an async auth finishes, don't throw for the sake of a log message.
+   boost::system::error_code error;
+   tcp::endpoint endpoint = socket_.remote_endpoint(error);
+   if(error) {
+      return "(disconnected)";
+   }
+   return endpoint.address().to_string();
 }
 
 /**
@@ -698,10 +1738,71 @@ void LazyXMPPConnection::IqSetQueryHandler_(const string& id, const DOMElement*
 
    if(query_type_s.compare("jabber:iq:register") == 0) {
       IqSetQueryRegister_(id, element);
-   } 
+   } else if(query_type_s.compare("urn:xmpp:mam:2") == 0) {
+      if(!enforeAuthorization_()) {
+         IqSetQueryArchive_(id, element);
+      }
+   }
    // TODO: Error
 }
 
+/**
+ * Handles a message archive query (XEP-0313) against the user's own history. The form fields and RSM paging are only
+ * picked out here, the archive checks them and answers on it's own thread.
+ */
+void LazyXMPPConnection::IqSetQueryArchive_(const string& id, const DOMElement* element) {
+   ArchiveQuery query;
+   query.owner = getJid();
+   query.to = getFullJid();
+   query.iq_id = id;
+   query.queryid = getDOMAttribute_(element, "queryid");
+
+   XMLCh* field_x = XMLString::transcode("field");
+   DOMNodeList* fields = element->getElementsByTagName(field_x);
+   XMLString::release(&field_x);
+   for(XMLSize_t i = 0; i < fields->getLength(); i++) {
+      DOMElement* field = dynamic_cast<DOMElement*>(fields->item(i));
+      if(!field) {
+         continue;
+      }
+      string var = getDOMAttribute_(field, "var");
+      DOMElement* value_e = getSingleDOMElementByTagName_(field, "value");
+      string value = value_e ? getTextContent_(value_e) : "";
+      if(var.compare("with") == 0) {
+         query.with = value;
+      } else if(var.compare("start") == 0) {
+         query.start = value;
+      } else if(var.compare("end") == 0) {
+         query.end = value;
+      } else if(var.compare("{urn:xmpp:fulltext:0}fulltext") == 0) {
+         query.fulltext = value; // XEP-0431
+      } else if(var.compare("FORM_TYPE") != 0) {
+         string response = generateIqHeader_("error", id, getFullJid()) + "<error type='cancel'><feature-not-implemented xmlns='urn:ietf:params:xml:ns:xmpp-stanzas'/></error>" + XMPP_IQ_CLOSE;
+         Write(response.c_str(), response.size());
+         return;
+      }
+   }
+
+   DOMElement* set = getSingleDOMElementByTagName_(element, "set");
+   if(set) {
+      DOMElement* max_e = getSingleDOMElementByTagName_(set, "max");
+      DOMElement* after_e = getSingleDOMElementByTagName_(set, "after");
+      DOMElement* before_e = getSingleDOMElementByTagName_(set, "before");
+      if(max_e) {
+         query.max = strtoul(getTextContent_(max_e).c_str(), NULL, 10);
+      }
+      if(after_e) {
+         query.after = getTextContent_(after_e);
+      }
+      if(before_e) {
+         query.has_before = true;
+         query.before = getTextContent_(before_e);
+      }
+   }
+
+   getServer()->getArchive_().Query(query, shared_from_this());
+}
+
 /**
  * Handels a XMPP In-Band registeration (XEP-0077).
  */
@@ -710,6 +1811,7 @@ void LazyXMPPConnection::IqSetQueryRegister_(const string& id, const DOMElement*
    if(connection_type_ != NOT_AUTHENTICATED || !getServer()->isRegistrationEnabled()) {
       string errormsg = generateServiceUnavailableError_(id, element);
       Write(errormsg.c_str(), errormsg.size());
+      return;
    }
 
    /*int username_min_len = 5;
@@ -752,14 +1854,43 @@ void LazyXMPPConnection::IqSetQueryRegister_(const string& id, const DOMElement*
 
    // Check to see if a user with that name is already registered.
    if(getServer()->getUserDB()->isRegistered(username)) {
-      string err_s = generateIqHeader_("error", id) + "<error code='409' type='cancel'><conflict xmlns='urn:ietf:params:xml:ns:xmpp-stanzas'/></error>" + XMPP_IQ_CLOSE;
-      Write(err_s.c_str(), err_s.size());
+      RegisterResult_(id, false);
       return;
    }
 
    // TODO: Check password is long enough, etc...
 
-   getServer()->getUserDB()->registerUser(username, password);
+   // Hashing the password is slow and the insert is written behind, neither happens on this thread. The result
+   // is sent once the user is committed.
+   if(!getServer()->getAuthPool_().Submit(boost::bind(&LazyXMPPConnection::RegisterUser_, shared_from_this(), id, username, password))) {
+      string err_s = generateIqHeader_("error", id) + "<error code='500' type='wait'><resource-constraint xmlns='urn:ietf:params:xml:ns:xmpp-stanzas'/></error>" + XMPP_IQ_CLOSE;
+      Write(err_s.c_str(), err_s.size());
+   }
+}
+
+/**
+ * Runs on an auth worker. Works out the password hash and queues the new user with the database writer.
+ */
+void LazyXMPPConnection::RegisterUser_(const string& id, const string& username, const string& password) {
+   getServer()->getUserDB()->registerUserAsync(username, password, boost::bind(&LazyXMPPConnection::Registered_, shared_from_this(), id, _1));
+}
+
+/**
+ * Runs on the database writer thread once the new user is committed (or failed), passes the result back to the io thread.
+ */
+void LazyXMPPConnection::Registered_(const string& id, bool registered) {
+   io_service_.post(boost::bind(&LazyXMPPConnection::RegisterResult_, shared_from_this(), id, registered));
+}
+
+/**
+ * Answers the register request. Failing at this point almost always means someone else got the name first.
+ */
+void LazyXMPPConnection::RegisterResult_(const string& id, bool registered) {
+   if(!registered) {
+      string err_s = generateIqHeader_("error", id) + "<error code='409' type='cancel'><conflict xmlns='urn:ietf:params:xml:ns:xmpp-stanzas'/></error>" + XMPP_IQ_CLOSE;
+      Write(err_s.c_str(), err_s.size());
+      return;
+   }
 
    string successful = generateIqHeader_("result", id, "", "", true);
    Write(successful.c_str(), successful.size());
@@ -856,16 +1987,23 @@ string LazyXMPPConnection::generateRosterItems_() const {
    DEBUG_M("Entering function...");
    // TODO
    string roster;
-   getServer()->connections_mutex_.lock();
    
    // TODO: This adds everyone to everyone's roster. Switching to MUC chat makes more sense.
-   for (Connections::iterator it=getServer()->connections_.begin() ; it != getServer()->connections_.end(); it++ ) {
-      string nickname = (*it)->getNickname();
-      string jid = (*it)->getJid();
-      roster.append(generateRosterItem_(nickname, jid, ""));
+   // A resource's nickname doesn't change once it is bound, so it's safe to read from here.
+   RegistrySnapshot snapshot;
+   getServer()->getRegistry_().getSnapshot(snapshot);
+   for(RegistrySnapshot::const_iterator shard = snapshot.begin(); shard != snapshot.end(); shard++) {
+      for(BareJidRoutes::const_iterator it = (*shard)->bare_routes.begin(); it != (*shard)->bare_routes.end(); it++) {
+         for(Resources::const_iterator resource = it->second.begin(); resource != it->second.end(); resource++) {
+            LazyXMPPConnectionPtr connection = resource->lock();
+            if(connection) {
+               roster.append(generateRosterItem_(connection->getNickname(), it->first, ""));
+               break;
+            }
+         }
+      }
    }
    
-   getServer()->connections_mutex_.unlock();
    return roster;
 }
 
@@ -979,7 +2117,7 @@ void LazyXMPPConnection::MessageHandler_(DOMElement* element) {
    //TODO
    string to = getDOMAttribute_(element, "to");
    //string from = getDOMAttribute_(element, "from");
-   //string type = getDOMAttribute_(element, "type");
+   string type = getDOMAttribute_(element, "type");
    
    DOMElement* body_e = getSingleDOMElementByTagName_(element, "body");
    if(!body_e) {
@@ -992,9 +2130,15 @@ void LazyXMPPConnection::MessageHandler_(DOMElement* element) {
    setDOMAttribute_(element, "from", getFullJid());
    
    // Convert the Xerces dom back into text and send it to the recipient.
-   string forward = StringifyNode_(element);  
-   getServer()->WriteJid(to, forward.c_str(), forward.size());
-   DEBUG_M("Forward '%s'", forward.c_str());
+   SharedBuffer forward(new string(StringifyNode_(element)));
+   DEBUG_M("Forward '%s'", forward->c_str());
+   bool offlineable = type.empty() || type.compare("chat") == 0 || type.compare("normal") == 0;
+   if(!getServer()->WriteJid(to, forward, offlineable) && offlineable) {
+      getServer()->StoreOffline_(to, forward);
+   }
+   if(offlineable) {
+      getServer()->ArchiveMessage_(getFullJid(), to, forward);
+   }
         
    return;
 }
@@ -1014,39 +2158,44 @@ string LazyXMPPConnection::generatePresence_(const string& to, const string& typ
 /**
  * Handles a XMPP <presence>
  */
-void LazyXMPPConnection::PresenceHandler_(DOMElement* element) {
+void LazyXMPPConnection::PresenceHandler_(DOMElement* element, const string& stanza) {
    string type = getDOMAttribute_(element, "type");
    string to = getDOMAttribute_(element, "to");
- 
-   // Initial presence... Send probes to everyone.
-   if(to.empty() && type.empty()) {
-      getServer()->connections_mutex_.lock();
-      for (Connections::iterator it=getServer()->connections_.begin() ; it != getServer()->connections_.end(); it++ ) {
-         
-         string jid = (*it)->getJid();
-         string presence = generatePresence_(jid, "probe");
-         (*it)->Write(presence.c_str(), presence.size());
+
+   // Probes are answered by the server from it's cache, the contact never sees them.
+   if(type.compare("probe") == 0) {
+      if(!to.empty()) {
+         getServer()->WriteCachedPresences_(this, to);
       }
-      getServer()->connections_mutex_.unlock();
+      return;
    }
-   
+ 
    // Forward normal presences...
    if(!to.empty()) {
       setDOMAttribute_(element, "from", getFullJid());
       string forward = StringifyNode_(element);
       getServer()->WriteJid(to, forward.c_str(), forward.size());
+      return;
    }
 
-   // Normal broadcast...
-   if(to.empty()) {
-      setDOMAttribute_(element, "from", getFullJid());
-      getServer()->connections_mutex_.lock();
-      for (Connections::iterator it=getServer()->connections_.begin() ; it != getServer()->connections_.end(); it++ ) {
-         string jid = (*it)->getJid();
-         setDOMAttribute_(element, "to", jid);
-         string forward = StringifyNode_(element);
-         (*it)->Write(forward.c_str(), forward.size());
+   // Normal broadcast... The stanza is serialized once and shared, only the 'to' differs per recipient. Each
+   // recipient's prefix carries it's own 'to', so any the client sent (even an empty one) is taken out of the body.
+   string stamped = RawStanza::setFrom(RawStanza::removeAttribute(stanza, "to"), getFullJid());
+   size_t name_end = stamped.find('<') + 1 + RawStanza::getTagName(stamped).size();
+   SharedBuffer body(new string(stamped, name_end));
+
+   if(type.empty()) {
+      // Initial presence... Send the new user everyone's last presence in one pass rather than probing them all.
+      if(!isAvailable_) {
+         isAvailable_ = true;
+         getServer()->WriteCachedPresences_(this);
+         getServer()->getOfflineSpool_().Flush(getJid(), getServer()->getServerHostname(), shared_from_this()); // Anything stored while they were away, in one write.
       }
-      getServer()->connections_mutex_.unlock();
+      getServer()->setPresence_(getJid(), getFullJid(), body);
+   } else if(type.compare("unavailable") == 0) {
+      isAvailable_ = false;
+      getServer()->removePresence_(getJid(), getFullJid());
    }
+
+   getServer()->Broadcast("presence", body);
 }
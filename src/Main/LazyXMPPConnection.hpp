@@ -3,10 +3,17 @@
 
 #include <uuid/uuid.h>
 #include <string>
+#include <deque>
+#include <vector>
 using namespace std;
 
 #include <boost/enable_shared_from_this.hpp>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/weak_ptr.hpp>
+#include <boost/scoped_ptr.hpp>
 #include <boost/asio.hpp>
+#include <boost/asio/ssl.hpp>
 using boost::asio::ip::tcp;
 
 #include <xercesc/parsers/XercesDOMParser.hpp>
@@ -18,11 +25,19 @@ using boost::asio::ip::tcp;
 #include <xercesc/dom/DOMElement.hpp>
 using namespace xercesc;
 
+#include "../Main/StanzaFramer.hpp"
+#include "../Main/Scram.hpp"
+#include "../Main/StreamCompression.hpp"
+#include "../Main/StreamSession.hpp"
+
 class LazyXMPP;
 
+typedef boost::shared_ptr<const string> SharedBuffer; // An immutable chunk of outbound data that can sit in several write queues at once.
+
 class LazyXMPPConnection: public boost::enable_shared_from_this<LazyXMPPConnection> {
    public:
       LazyXMPPConnection(boost::asio::io_service& io_service, LazyXMPP* server):
+         io_service_(io_service),
          socket_(io_service),
          server_(server),
          connection_type_(NOT_AUTHENTICATED),
@@ -30,7 +45,20 @@ class LazyXMPPConnection: public boost::enable_shared_from_this<LazyXMPPConnecti
          isInStream_(false),
          isBound_(false),
          isSession_(false),
-         isEncrypted_(false)
+         isEncrypted_(false),
+         isAvailable_(false),
+         isAuthPending_(false),
+         isReading_(false),
+         isSasl2_(false),
+         isWriting_(false),
+         tls_state_(TLS_OFF),
+         plain_writes_(0),
+         isDeflating_(false),
+         uncompressed_writes_(0),
+         isDetached_(false),
+         isResumePending_(false),
+         isHandedOver_(false),
+         resume_timer_(io_service)
          { data_[0] = '\0'; }
       ~LazyXMPPConnection();
 
@@ -50,16 +78,32 @@ class LazyXMPPConnection: public boost::enable_shared_from_this<LazyXMPPConnecti
 
    private:
       friend class LazyXMPP;
+      friend class OfflineSpool;
+      friend class MessageArchive;
+
+      typedef boost::function<void(bool)> WriteCallback; // Called on the connection's io_service, true if the data was queued.
+
       tcp::socket& getSocket_() { return socket_; }
+      void Start_();
       void BindRead_();
       void Write(const char* data, const int& size);
+      void Write(const SharedBuffer& data);
+      void Write(const SharedBuffer& prefix, const SharedBuffer& body); // Both go out back to back, nothing can be queued between them.
+      void WriteIfLive(const SharedBuffer& data, const WriteCallback& done); // Only queued if the stream is still bound and open.
+      void QueueWrite_(const SharedBuffer& data);
+      void QueueWriteIfLive_(const SharedBuffer& data, const WriteCallback& done);
+      void QueueWrite2_(const SharedBuffer& prefix, const SharedBuffer& body);
+      void FlushWrites_();
 
       // ASIO socket handlers...
       void ReadHandler_(const boost::system::error_code& error, size_t bytes);
       void WriteHandler_(const boost::system::error_code& error);
 
       void Process_(const int size);
-      void Chooser_(const char* tagName_c, DOMElement* element);
+      void ProcessBuffered_();
+      void ProcessStanza_(const string& stanza);
+      bool ForwardRaw_(const string& stanza);
+      void Chooser_(const char* tagName_c, DOMElement* element, const string& stanza);
       bool enforeAuthorization_();
 
       inline void setNodeId_(const string& nodeid) { nodeid_ = nodeid; }
@@ -68,14 +112,56 @@ class LazyXMPPConnection: public boost::enable_shared_from_this<LazyXMPPConnecti
 
       // Handle XMPP requests...
       void StreamHandler_(const DOMElement* element);
+      void StarttlsHandler_();
+      void StartTls_(); // Queues <proceed/>, the handshake starts once it's written.
+      void HandshakeHandler_(const boost::system::error_code& error);
+      void CompressHandler_(const DOMElement* element);
+      void StartDeflating_(); // Queues <compressed/>, everything after it is compressed.
+
+      // Stream Management (XEP-0198).
+      struct Handover { // What a resumed stream takes over from the connection it replaces.
+         boost::shared_ptr<StreamSession> session;
+         const LazyXMPPConnection* previous;
+         string resource;
+         string nickname;
+         bool isSession;
+         bool isAvailable;
+      };
+      bool StreamManagement_(const string& stanza); // Counts inbound stanzas and handles SM's own elements. True if it was one of those.
+      void CheckUnacked_(); // After anything is queued, asks for an ack or gives up on a client that never sends one.
+      void EnableHandler_(const string& stanza);
+      void ResumeHandler_(const string& stanza);
+      void AckHandler_(const string& stanza);
+      void Takeover_(const boost::shared_ptr<LazyXMPPConnection>& by, unsigned int h); // On the old connection's io thread.
+      void Resumed_(const Handover& handover, unsigned int h); // Back on the new one.
+      void ResumeFailed_(const string& condition);
+      void Detach_(); // The link dropped, keep the session for a while.
+      void ResumeExpired_(const boost::system::error_code& error);
+      void EndStreamSession_(); // Unacked messages go to the offline spool.
       void AuthHandler_(const DOMElement* element);
       void AuthPlainHandler_(const DOMElement* element);
+      void PlainVerified_(const string& nodeid, bool verified); // Runs on an auth worker.
+      void AuthPlainResult_(const string& nodeid, bool verified); // Back on the io thread.
+      void Resume_();
+      void AuthScramHandler_(Scram::Mechanism mechanism, const string& initial_response);
+      void AuthResponseHandler_(const DOMElement* element);
+      void AuthAbortHandler_();
+      void AuthenticateHandler_(const DOMElement* element); // SASL2 <authenticate>
+      void AuthFastHandler_(const string& initial_response, unsigned long count);
+      void AuthSucceeded_(const string& nodeid, const string& additional_data);
+      void WriteAuthChallenge_(const string& data);
+      void WriteAuthFailure_(const string& failure, const string& condition); // failure is the legacy SASL stanza, condition the SASL2 one.
+      string BindResource_(const string& resource); // Binds the resource, or a generated one if it's taken. Returns what was bound.
       void IqHandler_(const DOMElement* element);
       void IqSetHandler_(const string& id, const DOMElement* element);
       inline void IqSetQueryHandler_(const string& id, const DOMElement* element);
       void IqSetBind_(const string& id, const DOMElement* bind);
       void IqSetSession_(const string& id);
       void IqSetQueryRegister_(const string& id, const DOMElement* element);
+      void IqSetQueryArchive_(const string& id, const DOMElement* element);
+      void RegisterUser_(const string& id, const string& username, const string& password); // Runs on an auth worker.
+      void Registered_(const string& id, bool registered); // Runs on the database writer.
+      void RegisterResult_(const string& id, bool registered);
       inline void IqGetHandler_(const string& id, const DOMElement* element);
       inline void IqGetQueryHandler_(const string& id, const DOMElement* element);
       inline void IqGetQueryRosterHandler_(const string& id, const DOMElement* element);
@@ -84,7 +170,7 @@ class LazyXMPPConnection: public boost::enable_shared_from_this<LazyXMPPConnecti
       void IqGetQueryRegister_(const string& id, const DOMElement* element);
       inline void MessageHandler_(DOMElement* element);
       string StringifyNode_(const DOMNode* node) const;
-      inline void PresenceHandler_(DOMElement* element);
+      inline void PresenceHandler_(DOMElement* element, const string& stanza);
       inline string generateServiceUnavailableError_(const string& id, const DOMElement* element) const;
 
       // Functions to generate XMPP stanzas...
@@ -93,10 +179,12 @@ class LazyXMPPConnection: public boost::enable_shared_from_this<LazyXMPPConnecti
       inline string generateStreamFeatures_() const;
       inline string generateStreamFeaturesTLS_() const;
       inline string generateStreamFeaturesMechanisms_() const;
+      inline string generateStreamFeaturesAuthentication_() const;
       inline string generateStreamFeaturesCompression_() const;
       inline string generateStreamFeaturesBind_() const;
       inline string generateStreamFeaturesSession_() const;
       inline string generateStreamFeaturesRegister_() const;
+      inline string generateStreamFeaturesStreamManagement_() const;
 
       inline string generateIqHeader_(const string& type, const string& id, const string& to = "", const string& from = "", const bool nobody = false) const;
       inline string generateIqResultBind_(const string& id, const string& resource) const;
@@ -112,11 +200,13 @@ class LazyXMPPConnection: public boost::enable_shared_from_this<LazyXMPPConnecti
       inline DOMElement* getSingleDOMElementByTagName_(const DOMElement* element, const string& tag) const;
       inline string getTextContent_(const DOMElement* element) const;
 
+      boost::asio::io_service& io_service_; // The io_service (and so io thread) this connection lives on.
       tcp::socket socket_;
       LazyXMPP* server_;
       static const unsigned int buffer_size_ = 8192;
       static const int max_length_ = buffer_size_-1;
       char data_[buffer_size_];
+      StanzaFramer framer_; // Carries partial stanzas over between reads.
 
       int connection_type_;
       bool connection_close_;
@@ -124,12 +214,52 @@ class LazyXMPPConnection: public boost::enable_shared_from_this<LazyXMPPConnecti
       bool isBound_;
       bool isSession_;
       bool isEncrypted_;
+      bool isAvailable_; // Sent an available presence that is in the server's presence cache.
+      bool isAuthPending_; // Waiting on an auth worker, no more input is processed until it's done.
+      bool isReading_;
+      bool isInputHeld_() const { return isAuthPending_ || isResumePending_ || (tls_state_ != TLS_OFF && tls_state_ != TLS_ON); } // Nothing more is read or handled for now.
+      boost::shared_ptr<ScramSession> scram_; // The SCRAM exchange in progress, if any.
+
+      // What a SASL2 <authenticate> asked for on top of the login.
+      struct Sasl2Request {
+         Sasl2Request() : bind(false), request_token(false), invalidate(false) {}
+         bool bind;
+         string bind_tag;
+         bool request_token;
+         bool invalidate;
+         string used_token; // The FAST token the client logged in with.
+      };
+      bool isSasl2_; // The auth exchange in progress is SASL2, replies use its namespace.
+      Sasl2Request sasl2_;
+      string agent_id_; // SASL2 <user-agent id=''>, FAST tokens are tied to it.
+
+      // Outbound data. Only touched from this connection's io_service.
+      deque<SharedBuffer> write_queue_; // Waiting for the current write to finish.
+      vector<SharedBuffer> writing_; // Owned by the write in flight.
+      bool isWriting_;
+
+      // STARTTLS. No reads from <starttls/> until the handshake is done, writes queued after <proceed/> wait for it too.
+      enum TlsState { TLS_OFF, TLS_REQUESTED, TLS_PROCEEDING, TLS_HANDSHAKE, TLS_ON };
+      TlsState tls_state_;
+      size_t plain_writes_; // While TLS_PROCEEDING, how many at the front of write_queue_ go out before the handshake.
+      boost::scoped_ptr<boost::asio::ssl::stream<tcp::socket&> > tls_;
+      boost::scoped_ptr<StreamCompression> compression_; // Set once <compress/> has been accepted, reads are inflated from then on.
+      bool isDeflating_;
+      size_t uncompressed_writes_; // How many at the front of write_queue_ still go out as they are, up to and including <compressed/>.
+
+      boost::shared_ptr<StreamSession> sm_; // Set once Stream Management is enabled.
+      bool isDetached_; // The link dropped, resume_timer_ keeps this around for the client to resume.
+      bool isResumePending_; // Waiting on the old connection to hand its session over, input is held.
+      bool isHandedOver_; // Resumed on another connection, anything still written here is passed on to resumed_by_.
+      boost::weak_ptr<LazyXMPPConnection> resumed_by_;
+      boost::asio::deadline_timer resume_timer_;
 
       string nodeid_;
       string resource_;
       string nickname_;
 };
 typedef boost::shared_ptr<LazyXMPPConnection> LazyXMPPConnectionPtr;
+typedef boost::weak_ptr<LazyXMPPConnection> LazyXMPPConnectionWeakPtr;
 
 
 #endif /* LAZYXMPP_LAZYXMPPCONNECTION_HPP_ */
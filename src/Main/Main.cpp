@@ -11,6 +11,7 @@ int main(int argc, char* argv[]) {
    LazyXMPP xmpp;
    xmpp.setServerHostname("localhost");
    while(true) {
+      boost::this_thread::sleep(boost::posix_time::seconds(1)); // The io threads do all the work, don't steal a core from them.
    }
    
    LOG("Finished.");
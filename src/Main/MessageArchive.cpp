@@ -0,0 +1,762 @@
+#include "../Main/MessageArchive.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include <algorithm>
+
+#include <boost/bind.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/lexical_cast.hpp>
+namespace fs=boost::filesystem;
+
+#include "../Main/RawStanza.hpp"
+#include "../Debug/console.h"
+
+static const char SEGMENT_MAGIC[16] = "LXARCH1";
+static const unsigned int RECORD_MAGIC = 0x4843584c; // "LXCH"
+static const unsigned int ARCHIVE_OUTGOING = 1; // The owner sent it.
+static const size_t MAX_OPEN_INDEXES = 256;
+static const size_t MAX_OPEN_SEGMENTS = 32;
+static const size_t READ_BLOCK = 128; // Index entries read at a time while scanning.
+
+struct ArchiveRecordHeader {
+   unsigned int magic;
+   unsigned int length; // Of the stanza.
+   unsigned int checksum; // FNV-1a of the stanza, catches a torn write at the end.
+   unsigned int reserved;
+   unsigned long long id;
+};
+
+static unsigned int Checksum_(const char* data, size_t size) {
+   unsigned int h = 2166136261U;
+   for(size_t i = 0; i < size; i++) {
+      h ^= (unsigned char)data[i];
+      h *= 16777619U;
+   }
+   return h;
+}
+
+static unsigned long long getNow_() {
+   struct timeval now;
+   gettimeofday(&now, NULL);
+   return now.tv_sec * 1000000ULL + now.tv_usec;
+}
+
+static unsigned int getDay_(unsigned long long micros) {
+   time_t t = micros / 1000000ULL;
+   struct tm utc;
+   gmtime_r(&t, &utc);
+   return (utc.tm_year + 1900) * 10000 + (utc.tm_mon + 1) * 100 + utc.tm_mday;
+}
+
+static bool WriteAll_(int fd, const string& data, off_t offset) {
+   const char* p = data.data();
+   size_t left = data.size();
+   while(left > 0) {
+      ssize_t written = offset < 0 ? write(fd, p, left) : pwrite(fd, p, left, offset);
+      if(written < 0 && errno == EINTR) {
+         continue;
+      }
+      if(written <= 0) {
+         return false;
+      }
+      p += written;
+      left -= written;
+      if(offset >= 0) {
+         offset += written;
+      }
+   }
+   return true;
+}
+
+MessageArchive::MessageArchive(const string& directory, unsigned int default_page, unsigned int max_page) : directory_(directory), default_page_(default_page), max_page_(max_page), ready_(false), last_id_(0), segment_day_(0), segment_fd_(-1), segment_size_(0), dirty_(false), stopping_(false) {
+   if(directory_.empty()) {
+      fs::path archivedir;
+      archivedir /= getenv("HOME");
+      archivedir /= "/.config/LazyXMPP/archive";
+      directory_ = archivedir.string();
+   }
+   search_.reset(new FullTextIndex(directory_ + "/search"));
+}
+
+MessageArchive::~MessageArchive() {
+   Stop();
+   for(boost::unordered_map<string, int>::iterator it = index_fds_.begin(); it != index_fds_.end(); it++) {
+      close(it->second);
+   }
+   for(map<unsigned int, int>::iterator it = segment_fds_.begin(); it != segment_fds_.end(); it++) {
+      close(it->second);
+   }
+   if(segment_fd_ >= 0) {
+      close(segment_fd_);
+   }
+}
+
+void MessageArchive::Start() {
+   ready_ = Recover_();
+   if(!ready_) {
+      ERROR("Messages won't be archived, the archive in '%s' won't open.", directory_.c_str());
+   }
+   thread_ = boost::thread(boost::bind(&MessageArchive::Run_, this));
+}
+
+void MessageArchive::Stop() {
+   {
+      boost::mutex::scoped_lock lock(mutex_);
+      if(stopping_ || !thread_.joinable()) {
+         return;
+      }
+      stopping_ = true;
+   }
+   queued_.notify_all();
+   thread_.join();
+}
+
+void MessageArchive::Archive(const string& from, const string& to, bool for_sender, bool for_recipient, const SharedBuffer& stanza) {
+   Operation operation;
+   operation.query = false;
+   operation.from = from;
+   operation.to = to;
+   operation.for_sender = for_sender;
+   operation.for_recipient = for_recipient;
+   operation.stanza = stanza;
+   {
+      boost::mutex::scoped_lock lock(mutex_);
+      queue_.push_back(operation);
+   }
+   queued_.notify_one();
+}
+
+void MessageArchive::Query(const ArchiveQuery& query, const LazyXMPPConnectionPtr& connection) {
+   Operation operation;
+   operation.query = true;
+   operation.for_sender = false;
+   operation.for_recipient = false;
+   operation.archive_query = query;
+   operation.connection = connection;
+   {
+      boost::mutex::scoped_lock lock(mutex_);
+      queue_.push_back(operation);
+   }
+   queued_.notify_one();
+}
+
+/**
+ * The archive thread. Takes everything queued and applies it in order, committing once for the lot. A query commits
+ * what came before it first so it sees every message archived ahead of it.
+ */
+void MessageArchive::Run_() {
+   deque<Operation> batch;
+   for(;;) {
+      {
+         boost::mutex::scoped_lock lock(mutex_);
+         while(queue_.empty() && !stopping_) {
+            queued_.wait(lock);
+         }
+         if(queue_.empty()) {
+            search_->Flush(); // Stopping and nothing left.
+            return;
+         }
+         batch.swap(queue_);
+      }
+
+      for(deque<Operation>::iterator it = batch.begin(); it != batch.end(); it++) {
+         if(it->query) {
+            Commit_();
+            Query_(*it);
+         } else if(ready_) {
+            Archive_(*it);
+         }
+      }
+      batch.clear();
+      Commit_();
+   }
+}
+
+void MessageArchive::Archive_(Operation& operation) {
+   unsigned long long id = max(getNow_(), last_id_ + 1); // Never goes backwards, even if the clock does.
+   unsigned int day = getDay_(id);
+   if((segment_fd_ < 0 || day != segment_day_) && !OpenSegment_(day)) {
+      return;
+   }
+
+   IndexEntry entry;
+   memset(&entry, 0, sizeof(entry));
+   if(!Append_(id, operation.stanza, &entry.offset)) {
+      return;
+   }
+   last_id_ = id;
+   entry.id = id;
+   entry.segment = day;
+   entry.length = operation.stanza->size();
+
+   if(operation.for_sender) {
+      entry.with = Hash_(operation.to);
+      entry.flags = ARCHIVE_OUTGOING;
+      pending_[operation.from].append((const char*)&entry, sizeof(entry));
+   }
+   if(operation.for_recipient && !(operation.for_sender && operation.from == operation.to)) {
+      entry.with = Hash_(operation.from);
+      entry.flags = 0;
+      pending_[operation.to].append((const char*)&entry, sizeof(entry));
+   }
+}
+
+void MessageArchive::Commit_() {
+   if(pending_.empty()) {
+      return;
+   }
+   if(dirty_) {
+      if(fdatasync(segment_fd_) != 0) {
+         ERROR("Could not sync the message archive, %lu users' history is missing messages: %s", (unsigned long)pending_.size(), strerror(errno));
+         pending_.clear();
+         return;
+      }
+      dirty_ = false;
+   }
+
+   for(boost::unordered_map<string, string>::iterator it = pending_.begin(); it != pending_.end(); it++) {
+      int fd = getIndexFd_(it->first, true);
+      if(fd < 0 || !WriteAll_(fd, it->second, -1) || fdatasync(fd) != 0) {
+         ERROR("Could not write the message archive index for '%s': %s", it->first.c_str(), strerror(errno));
+         continue;
+      }
+      CatchUpSearch_(it->first);
+   }
+   pending_.clear();
+}
+
+/**
+ * Feeds the search index every message in the owner's archive index newer than the newest it has. Normally that's
+ * just what was committed, but after a crash it's whatever the search index hadn't written out.
+ */
+void MessageArchive::CatchUpSearch_(const string& owner) {
+   unsigned long long indexed = search_->getIndexedUpTo(owner);
+   int fd = getIndexFd_(owner, false);
+   struct stat st;
+   if(fd < 0 || fstat(fd, &st) != 0) {
+      return;
+   }
+   size_t count = st.st_size / sizeof(IndexEntry);
+
+   // Look back from the end, the new entries are almost always in the last block.
+   vector<IndexEntry> block;
+   size_t from = count;
+   while(from > 0) {
+      size_t n = min(READ_BLOCK, from);
+      if(!ReadEntries_(fd, from - n, n, block)) {
+         return;
+      }
+      if(block[0].id <= indexed) {
+         size_t newer = n;
+         while(newer > 0 && block[newer - 1].id > indexed) {
+            newer--;
+         }
+         from = from - n + newer;
+         break;
+      }
+      from -= n;
+   }
+
+   string stanza;
+   for(size_t i = from; i < count; i += block.size()) {
+      if(!ReadEntries_(fd, i, min(READ_BLOCK, count - i), block)) {
+         return;
+      }
+      for(size_t j = 0; j < block.size(); j++) {
+         if(ReadStanza_(block[j], stanza)) {
+            search_->Add(owner, block[j].id, stanza);
+         }
+      }
+   }
+}
+
+/**
+ * Answers a query. Only the entries in the page (and the one after it, to know if it's complete) are read, the rest
+ * of the range is found by binary search. Filtering by 'with' has to look at every entry in the range until the
+ * page is full, but only messages whose hash matches are read. A full text search walks the ids the search index
+ * found instead of the whole range, looking each one up.
+ */
+void MessageArchive::Query_(Operation& operation) {
+   const ArchiveQuery& query = operation.archive_query;
+   unsigned long long start = 0;
+   unsigned long long end = ~0ULL;
+   if((!query.start.empty() && !ParseStamp_(query.start, start)) || (!query.end.empty() && !ParseStamp_(query.end, end))) {
+      operation.connection->Write(SharedBuffer(new string(generateError_(query, "modify", "bad-request"))));
+      return;
+   }
+   unsigned int max_results = query.max ? min(query.max, max_page_) : default_page_;
+
+   vector<unsigned long long> hits;
+   bool fulltext = !query.fulltext.empty();
+   if(fulltext) {
+      CatchUpSearch_(query.owner);
+      search_->Find(query.owner, query.fulltext, hits);
+   }
+
+   int fd = getIndexFd_(query.owner, false);
+   size_t count = 0;
+   struct stat st;
+   if(fd >= 0 && fstat(fd, &st) == 0) {
+      count = st.st_size / sizeof(IndexEntry);
+   }
+   size_t range_begin = Search_(fd, count, start);
+   size_t range_end = max(range_begin, end == ~0ULL ? count : Search_(fd, count, end + 1));
+   size_t begin = range_begin;
+   size_t stop = range_end;
+
+   // RSM ids have to be ones we gave out.
+   vector<IndexEntry> block;
+   unsigned long long id;
+   if(!query.after.empty()) {
+      size_t at = ParseId_(query.after, id) ? Search_(fd, count, id) : count;
+      if(at == count || !ReadEntries_(fd, at, 1, block) || block[0].id != id) {
+         operation.connection->Write(SharedBuffer(new string(generateError_(query, "cancel", "item-not-found"))));
+         return;
+      }
+      begin = max(begin, at + 1);
+   }
+   if(!query.before.empty()) {
+      size_t at = ParseId_(query.before, id) ? Search_(fd, count, id) : count;
+      if(at == count || !ReadEntries_(fd, at, 1, block) || block[0].id != id) {
+         operation.connection->Write(SharedBuffer(new string(generateError_(query, "cancel", "item-not-found"))));
+         return;
+      }
+      stop = min(stop, at);
+   }
+   begin = min(begin, stop);
+
+   const string& with = query.with;
+   unsigned int with_hash = Hash_(BareJid_(with));
+   vector<IndexEntry> page;
+   bool complete = true;
+   size_t total = range_end - range_begin;
+   if(fulltext) {
+      // The same window, as ids.
+      unsigned long long first_id = ~0ULL;
+      unsigned long long stop_id = ~0ULL;
+      if(begin < count && ReadEntries_(fd, begin, 1, block)) {
+         first_id = block[0].id;
+      }
+      if(stop < count && ReadEntries_(fd, stop, 1, block)) {
+         stop_id = block[0].id;
+      }
+      vector<unsigned long long>::iterator lo = lower_bound(hits.begin(), hits.end(), first_id);
+      vector<unsigned long long>::iterator hi = max(lo, lower_bound(hits.begin(), hits.end(), stop_id));
+      total = upper_bound(hits.begin(), hits.end(), end) - lower_bound(hits.begin(), hits.end(), start);
+
+      size_t n = hi - lo;
+      for(size_t k = 0; k < n && complete; k++) {
+         unsigned long long hit = query.has_before ? *(hi - 1 - k) : *(lo + k);
+         size_t at = Search_(fd, count, hit);
+         if(at == count || !ReadEntries_(fd, at, 1, block) || block[0].id != hit) {
+            continue;
+         }
+         complete = TakeEntry_(block[0], with, with_hash, max_results, page);
+      }
+   } else if(!query.has_before) {
+      // Forwards from begin.
+      for(size_t i = begin; i < stop && complete; i += block.size()) {
+         if(!ReadEntries_(fd, i, min(READ_BLOCK, stop - i), block)) {
+            break;
+         }
+         for(size_t j = 0; j < block.size() && complete; j++) {
+            complete = TakeEntry_(block[j], with, with_hash, max_results, page);
+         }
+      }
+   } else {
+      // Backwards from stop, for the last page or the one before an id.
+      for(size_t i = stop; i > begin && complete; i -= block.size()) {
+         size_t n = min(READ_BLOCK, i - begin);
+         if(!ReadEntries_(fd, i - n, n, block)) {
+            break;
+         }
+         for(size_t j = block.size(); j > 0 && complete; j--) {
+            complete = TakeEntry_(block[j - 1], with, with_hash, max_results, page);
+         }
+      }
+   }
+   if(query.has_before) {
+      reverse(page.begin(), page.end());
+   }
+
+   const string to = RawStanza::Escape(query.to);
+   const string queryid = query.queryid.empty() ? "" : " queryid=\"" + RawStanza::Escape(query.queryid) + "\"";
+   boost::shared_ptr<string> response(new string());
+   string stanza;
+   for(vector<IndexEntry>::iterator it = page.begin(); it != page.end(); it++) {
+      if(!ReadStanza_(*it, stanza)) {
+         continue;
+      }
+      response->append("<message to=\"" + to + "\" from=\"" + RawStanza::Escape(query.owner) + "\"><result xmlns=\"urn:xmpp:mam:2\"" + queryid + " id=\"" + boost::lexical_cast<string>(it->id) + "\"><forwarded xmlns=\"urn:xmpp:forward:0\"><delay xmlns=\"urn:xmpp:delay\" stamp=\"" + FormatStamp_(it->id) + "\"/>");
+      response->append(stanza);
+      response->append("</forwarded></result></message>");
+   }
+
+   response->append("<iq type=\"result\" id=\"" + RawStanza::Escape(query.iq_id) + "\" to=\"" + to + "\"><fin xmlns=\"urn:xmpp:mam:2\"" + (complete ? " complete=\"true\"" : "") + "><set xmlns=\"http://jabber.org/protocol/rsm\">");
+   if(!page.empty()) {
+      response->append("<first>" + boost::lexical_cast<string>(page.front().id) + "</first><last>" + boost::lexical_cast<string>(page.back().id) + "</last>");
+   }
+   if(with.empty()) {
+      response->append("<count>" + boost::lexical_cast<string>(total) + "</count>"); // Free without a filter, otherwise it's left out.
+   }
+   response->append("</set></fin></iq>");
+   operation.connection->Write(response);
+   DEBUG_M("Archive query for '%s' returned %d messages.", query.owner.c_str(), (int)page.size());
+}
+
+bool MessageArchive::TakeEntry_(const IndexEntry& entry, const string& with, unsigned int with_hash, unsigned int max_results, vector<IndexEntry>& page) {
+   if(!with.empty() && !MatchesWith_(entry, with, with_hash)) {
+      return true;
+   }
+   if(page.size() == max_results) {
+      return false;
+   }
+   page.push_back(entry);
+   return true;
+}
+
+/**
+ * Checks the other side of a message against a 'with' filter. The hash rules most out without reading the message.
+ */
+bool MessageArchive::MatchesWith_(const IndexEntry& entry, const string& with, unsigned int with_hash) {
+   if(entry.with != with_hash) {
+      return false;
+   }
+   string stanza;
+   string peer;
+   if(!ReadStanza_(entry, stanza) || !RawStanza::getAttribute(stanza, entry.flags & ARCHIVE_OUTGOING ? "to" : "from", peer)) {
+      return false;
+   }
+   return with.find('/') == string::npos ? BareJid_(peer) == with : peer == with;
+}
+
+bool MessageArchive::ReadStanza_(const IndexEntry& entry, string& stanza) {
+   int fd = getSegmentFd_(entry.segment);
+   if(fd < 0) {
+      return false;
+   }
+   stanza.resize(entry.length);
+   return entry.length == 0 || pread(fd, &stanza[0], entry.length, entry.offset) == (ssize_t)entry.length;
+}
+
+size_t MessageArchive::Search_(int fd, size_t count, unsigned long long id) {
+   vector<IndexEntry> entry;
+   size_t lo = 0;
+   size_t hi = count;
+   while(lo < hi) {
+      size_t mid = lo + (hi - lo) / 2;
+      if(!ReadEntries_(fd, mid, 1, entry)) {
+         return count;
+      }
+      if(entry[0].id < id) {
+         lo = mid + 1;
+      } else {
+         hi = mid;
+      }
+   }
+   return lo;
+}
+
+bool MessageArchive::ReadEntries_(int fd, size_t first, size_t count, vector<IndexEntry>& entries) {
+   entries.resize(count);
+   if(count == 0) {
+      return true;
+   }
+   ssize_t size = count * sizeof(IndexEntry);
+   return pread(fd, &entries[0], size, first * sizeof(IndexEntry)) == size;
+}
+
+/**
+ * Appends a message to the current segment. offset is where the stanza itself went.
+ */
+bool MessageArchive::Append_(unsigned long long id, const SharedBuffer& stanza, unsigned long long* offset) {
+   ArchiveRecordHeader header;
+   header.magic = RECORD_MAGIC;
+   header.length = stanza->size();
+   header.checksum = Checksum_(stanza->data(), stanza->size());
+   header.reserved = 0;
+   header.id = id;
+
+   string record((const char*)&header, sizeof(header));
+   record.append(*stanza);
+   if(!WriteAll_(segment_fd_, record, segment_size_)) {
+      ERROR("Could not write to the message archive: %s", strerror(errno));
+      if(ftruncate(segment_fd_, segment_size_) != 0) {
+         ERROR("Could not undo a partial message archive write.");
+      }
+      return false;
+   }
+   *offset = segment_size_ + sizeof(header);
+   segment_size_ += record.size();
+   dirty_ = true;
+   return true;
+}
+
+/**
+ * Switches appends to the segment for another day. The old one is synced and kept open for reading.
+ */
+bool MessageArchive::OpenSegment_(unsigned int day) {
+   if(segment_fd_ >= 0) {
+      if(dirty_) {
+         fdatasync(segment_fd_);
+         dirty_ = false;
+      }
+      segment_fds_[segment_day_] = segment_fd_;
+      segment_fd_ = -1;
+   }
+   map<unsigned int, int>::iterator open_fd = segment_fds_.find(day);
+   if(open_fd != segment_fds_.end()) {
+      close(open_fd->second);
+      segment_fds_.erase(open_fd);
+   }
+
+   string path = getSegmentPath_(day);
+   int fd = open(path.c_str(), O_RDWR | O_CREAT, 0600);
+   if(fd < 0) {
+      ERROR("Could not open message archive segment '%s': %s", path.c_str(), strerror(errno));
+      return false;
+   }
+   struct stat st;
+   char magic[sizeof(SEGMENT_MAGIC)];
+   if(fstat(fd, &st) != 0) {
+      close(fd);
+      return false;
+   }
+   if(st.st_size == 0) {
+      if(pwrite(fd, SEGMENT_MAGIC, sizeof(SEGMENT_MAGIC), 0) != (ssize_t)sizeof(SEGMENT_MAGIC)) {
+         close(fd);
+         return false;
+      }
+      st.st_size = sizeof(SEGMENT_MAGIC);
+      dirty_ = true;
+   } else if(pread(fd, magic, sizeof(magic), 0) != (ssize_t)sizeof(magic) || memcmp(magic, SEGMENT_MAGIC, sizeof(magic)) != 0) {
+      ERROR("'%s' isn't a message archive segment.", path.c_str());
+      close(fd);
+      return false;
+   }
+
+   segment_fd_ = fd;
+   segment_day_ = day;
+   segment_size_ = st.st_size;
+   return true;
+}
+
+/**
+ * Opens the newest segment and drops anything torn off the end of it by a crash. Index entries are only written
+ * once their messages are synced, so nothing can point at what's dropped. Older segments were synced when the day
+ * ended and are left alone.
+ */
+bool MessageArchive::Recover_() {
+   unsigned int newest = 0;
+   try {
+      fs::create_directories(directory_ + "/users");
+      for(fs::directory_iterator it(directory_); it != fs::directory_iterator(); it++) {
+         string name = it->path().filename().string();
+         if(name.size() == 12 && name.compare(8, 4, ".seg") == 0) {
+            newest = max(newest, (unsigned int)strtoul(name.c_str(), NULL, 10));
+         }
+      }
+   } catch(fs::filesystem_error& e) {
+      ERROR("%s", e.what());
+      return false;
+   }
+   if(newest == 0) {
+      return true;
+   }
+   if(!OpenSegment_(newest)) {
+      return false;
+   }
+
+   unsigned long long offset = sizeof(SEGMENT_MAGIC);
+   string stanza;
+   while(offset + sizeof(ArchiveRecordHeader) <= segment_size_) {
+      ArchiveRecordHeader header;
+      if(pread(segment_fd_, &header, sizeof(header), offset) != (ssize_t)sizeof(header) || header.magic != RECORD_MAGIC || header.length > segment_size_ - offset - sizeof(header)) {
+         break;
+      }
+      stanza.resize(header.length);
+      if(header.length > 0 && pread(segment_fd_, &stanza[0], header.length, offset + sizeof(header)) != (ssize_t)header.length) {
+         break;
+      }
+      if(Checksum_(stanza.data(), stanza.size()) != header.checksum) {
+         break;
+      }
+      last_id_ = max(last_id_, header.id);
+      offset += sizeof(header) + header.length;
+   }
+
+   if(offset != segment_size_) {
+      WARNING("Message archive segment '%s' has %llu bytes of incomplete writes at the end, dropping them.", getSegmentPath_(newest).c_str(), segment_size_ - offset);
+      if(ftruncate(segment_fd_, offset) != 0) {
+         return false;
+      }
+      segment_size_ = offset;
+   }
+   return true;
+}
+
+/**
+ * Returns the open index file for a user, opening it if need be. Without create a user with no history gets -1.
+ */
+int MessageArchive::getIndexFd_(const string& owner, bool create) {
+   boost::unordered_map<string, int>::iterator it = index_fds_.find(owner);
+   if(it != index_fds_.end()) {
+      return it->second;
+   }
+   if(index_fds_.size() >= MAX_OPEN_INDEXES) {
+      // Everything in them is already synced.
+      for(it = index_fds_.begin(); it != index_fds_.end(); it++) {
+         close(it->second);
+      }
+      index_fds_.clear();
+   }
+
+   string path = getIndexPath_(owner);
+   int fd = open(path.c_str(), O_RDWR | O_APPEND | (create ? O_CREAT : 0), 0600);
+   if(fd < 0) {
+      if(create || errno != ENOENT) {
+         ERROR("Could not open message archive index '%s': %s", path.c_str(), strerror(errno));
+      }
+      return -1;
+   }
+
+   struct stat st;
+   if(fstat(fd, &st) == 0 && st.st_size % sizeof(IndexEntry) != 0) {
+      WARNING("Message archive index '%s' has an incomplete entry at the end, dropping it.", path.c_str());
+      if(ftruncate(fd, st.st_size - st.st_size % sizeof(IndexEntry)) != 0) {
+         close(fd);
+         return -1;
+      }
+   }
+   index_fds_[owner] = fd;
+   return fd;
+}
+
+int MessageArchive::getSegmentFd_(unsigned int day) {
+   if(segment_fd_ >= 0 && day == segment_day_) {
+      return segment_fd_;
+   }
+   map<unsigned int, int>::iterator it = segment_fds_.find(day);
+   if(it != segment_fds_.end()) {
+      return it->second;
+   }
+   if(segment_fds_.size() >= MAX_OPEN_SEGMENTS) {
+      for(it = segment_fds_.begin(); it != segment_fds_.end(); it++) {
+         close(it->second);
+      }
+      segment_fds_.clear();
+   }
+
+   string path = getSegmentPath_(day);
+   int fd = open(path.c_str(), O_RDONLY);
+   if(fd < 0) {
+      ERROR("Could not open message archive segment '%s': %s", path.c_str(), strerror(errno));
+      return -1;
+   }
+   segment_fds_[day] = fd;
+   return fd;
+}
+
+string MessageArchive::getSegmentPath_(unsigned int day) const {
+   char name[32];
+   snprintf(name, sizeof(name), "/%08u.seg", day);
+   return directory_ + name;
+}
+
+string MessageArchive::getIndexPath_(const string& owner) const {
+   return directory_ + "/users/" + FullTextIndex::getFileName(owner) + ".idx";
+}
+
+unsigned int MessageArchive::Hash_(const string& jid) {
+   return Checksum_(jid.data(), jid.size());
+}
+
+bool MessageArchive::ParseId_(const string& id, unsigned long long& value) {
+   if(id.empty() || id.size() > 20) {
+      return false;
+   }
+   for(size_t i = 0; i < id.size(); i++) {
+      if(!isdigit((unsigned char)id[i])) {
+         return false;
+      }
+   }
+   value = strtoull(id.c_str(), NULL, 10);
+   return true;
+}
+
+/**
+ * Reads a XEP-0082 DateTime, 'CCYY-MM-DDThh:mm:ss[.sss]TZD', into microseconds since the epoch.
+ */
+bool MessageArchive::ParseStamp_(const string& stamp, unsigned long long& micros) {
+   struct tm t;
+   memset(&t, 0, sizeof(t));
+   int n = 0;
+   if(sscanf(stamp.c_str(), "%4d-%2d-%2dT%2d:%2d:%2d%n", &t.tm_year, &t.tm_mon, &t.tm_mday, &t.tm_hour, &t.tm_min, &t.tm_sec, &n) != 6) {
+      return false;
+   }
+   const char* p = stamp.c_str() + n;
+
+   unsigned long long fraction = 0;
+   if(*p == '.') {
+      int digits = 0;
+      for(p++; isdigit((unsigned char)*p); p++) {
+         if(digits < 6) {
+            fraction = fraction * 10 + (*p - '0');
+            digits++;
+         }
+      }
+      for(; digits < 6; digits++) {
+         fraction *= 10;
+      }
+   }
+
+   long long offset = 0;
+   if(*p == 'Z') {
+      p++;
+   } else if(*p == '+' || *p == '-') {
+      int hours, minutes;
+      if(sscanf(p + 1, "%2d:%2d", &hours, &minutes) != 2 || strlen(p) != 6) {
+         return false;
+      }
+      offset = (hours * 60 + minutes) * 60 * (*p == '-' ? -1 : 1);
+      p += 6;
+   } else {
+      return false;
+   }
+   if(*p != '\0') {
+      return false;
+   }
+
+   t.tm_year -= 1900;
+   t.tm_mon -= 1;
+   long long seconds = (long long)timegm(&t) - offset;
+   if(seconds < 0) {
+      return false;
+   }
+   micros = seconds * 1000000ULL + fraction;
+   return true;
+}
+
+string MessageArchive::FormatStamp_(unsigned long long micros) {
+   char when[48];
+   time_t t = micros / 1000000ULL;
+   struct tm utc;
+   gmtime_r(&t, &utc);
+   size_t n = strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%S", &utc);
+   snprintf(when + n, sizeof(when) - n, ".%03uZ", (unsigned int)(micros % 1000000ULL / 1000));
+   return when;
+}
+
+string MessageArchive::generateError_(const ArchiveQuery& query, const string& type, const string& condition) {
+   return "<iq type=\"error\" id=\"" + RawStanza::Escape(query.iq_id) + "\" to=\"" + RawStanza::Escape(query.to) + "\"><error type=\"" + type + "\"><" + condition + " xmlns=\"urn:ietf:params:xml:ns:xmpp-stanzas\"/></error></iq>";
+}
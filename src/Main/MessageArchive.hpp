@@ -0,0 +1,130 @@
+#ifndef LAZYXMPP_MESSAGEARCHIVE_HPP_
+#define LAZYXMPP_MESSAGEARCHIVE_HPP_
+
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+using namespace std;
+
+#include <boost/thread.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/scoped_ptr.hpp>
+
+#include "../Main/LazyXMPPConnection.hpp"
+#include "../Main/FullTextIndex.hpp"
+
+/**
+ * A query against one user's archive (XEP-0313), paged with RSM (XEP-0059). It's passed through as the client sent
+ * it, the archive checks it and answers with an error if it doesn't make sense.
+ */
+struct ArchiveQuery {
+   ArchiveQuery() : has_before(false), max(0) {}
+   string owner; // Bare JID of the archive.
+   string to; // Full JID the results go to.
+   string iq_id;
+   string queryid; // Echoed in each result.
+   string with; // Bare or full JID, empty for everyone.
+   string fulltext; // Words the messages must all have (XEP-0431), empty for no search.
+   string start; // XEP-0082 timestamps, empty for no limit.
+   string end;
+   string after; // Archive ids.
+   string before;
+   bool has_before; // An empty <before/> asks for the last page.
+   unsigned int max; // 0 for the default page size.
+};
+
+/**
+ * Message history (XEP-0313). Every routed chat or normal message is appended once to the segment file for the
+ * day (UTC) it was archived on, and an entry pointing at it goes on the end of the sender's and the recipient's
+ * index files. Index entries are fixed size and in id order, and the id is the time it was archived in
+ * microseconds, so a query binary searches its range in the index and reads only the page of messages it returns.
+ *
+ * Archiving and queries run on the archive's own thread, in the order they were queued. Messages are synced to
+ * their segment once per batch and only then are the index entries written, so an entry never points at a
+ * message that was lost in a crash. The full text search index is fed from the index entries as they're written.
+ */
+class MessageArchive: private boost::noncopyable {
+   public:
+      MessageArchive(const string& directory = "", unsigned int default_page = 50, unsigned int max_page = 250); // directory defaults to ~/.config/LazyXMPP/archive
+      ~MessageArchive();
+
+      void Start();
+      void Stop(); // Finishes what's queued first.
+
+      void Archive(const string& from, const string& to, bool for_sender, bool for_recipient, const SharedBuffer& stanza); // Bare JIDs, for_ says whose archives get it.
+      void Query(const ArchiveQuery& query, const LazyXMPPConnectionPtr& connection); // Results and the final <iq/> go out in one write.
+
+   private:
+      struct Operation {
+         bool query;
+         string from;
+         string to;
+         bool for_sender;
+         bool for_recipient;
+         SharedBuffer stanza;
+         ArchiveQuery archive_query;
+         LazyXMPPConnectionPtr connection;
+      };
+
+      // One message in a user's index file.
+      struct IndexEntry {
+         unsigned long long id; // Microseconds since the epoch when it was archived.
+         unsigned long long offset; // Of the stanza in its segment.
+         unsigned int segment; // The day, YYYYMMDD.
+         unsigned int length; // Of the stanza.
+         unsigned int with; // Hash of the other side's bare JID.
+         unsigned int flags;
+      };
+
+      void Run_();
+      void Archive_(Operation& operation);
+      void Query_(Operation& operation);
+      void Commit_(); // Syncs the segment, then writes and syncs the pending index entries.
+      void CatchUpSearch_(const string& owner); // Adds the owner's messages the search index doesn't have yet.
+      bool TakeEntry_(const IndexEntry& entry, const string& with, unsigned int with_hash, unsigned int max_results, vector<IndexEntry>& page); // False if the page was already full.
+      bool Recover_();
+      bool OpenSegment_(unsigned int day);
+      bool Append_(unsigned long long id, const SharedBuffer& stanza, unsigned long long* offset);
+      bool ReadStanza_(const IndexEntry& entry, string& stanza);
+      bool MatchesWith_(const IndexEntry& entry, const string& with, unsigned int with_hash);
+      int getIndexFd_(const string& owner, bool create);
+      int getSegmentFd_(unsigned int day);
+      size_t Search_(int fd, size_t count, unsigned long long id); // First entry with an id >= id.
+      bool ReadEntries_(int fd, size_t first, size_t count, vector<IndexEntry>& entries);
+      string getSegmentPath_(unsigned int day) const;
+      string getIndexPath_(const string& owner) const;
+
+      static unsigned int Hash_(const string& jid);
+      static string BareJid_(const string& jid) { return jid.substr(0, jid.find('/')); }
+      static bool ParseStamp_(const string& stamp, unsigned long long& micros);
+      static bool ParseId_(const string& id, unsigned long long& value);
+      static string FormatStamp_(unsigned long long micros);
+      static string generateError_(const ArchiveQuery& query, const string& type, const string& condition);
+
+      string directory_;
+      unsigned int default_page_;
+      unsigned int max_page_;
+
+      bool ready_; // Recovered, so it can be written to.
+
+      // Only the archive thread touches these.
+      unsigned long long last_id_;
+      unsigned int segment_day_; // The segment being appended to.
+      int segment_fd_;
+      unsigned long long segment_size_;
+      bool dirty_; // Appended since the last sync.
+      boost::unordered_map<string, string> pending_; // Owner -> index entries waiting on the segment sync.
+      boost::unordered_map<string, int> index_fds_; // Open index files.
+      map<unsigned int, int> segment_fds_; // Older segments open for reading.
+      boost::scoped_ptr<FullTextIndex> search_;
+
+      boost::mutex mutex_; // Guards queue_ and stopping_.
+      boost::condition_variable queued_;
+      deque<Operation> queue_;
+      bool stopping_;
+      boost::thread thread_;
+};
+
+#endif /* LAZYXMPP_MESSAGEARCHIVE_HPP_ */
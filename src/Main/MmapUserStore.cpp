@@ -0,0 +1,557 @@
+#include "../Main/MmapUserStore.hpp"
+#include "../Debug/console.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <boost/thread/locks.hpp>
+
+static const char LOG_MAGIC[16] = "LXUSERLOG1";
+static const char INDEX_MAGIC[8] = "LXUIDX1";
+static const unsigned int RECORD_MAGIC = 0x5255584c; // "LXUR"
+static const unsigned long long MIN_SLOTS = 1024;
+static const size_t MIN_LOG_MAP = 64 << 20; // Address space, not memory. Saves remapping for the first few hundred thousand users.
+static const int RECORD_FIELDS = 8;
+
+struct MmapUserStore::IndexHeader {
+   char magic[8];
+   unsigned long long slots; // A power of two.
+   unsigned long long count;
+   unsigned long long log_length; // How much of the log the index covers.
+   unsigned long long clean; // 1 once closed properly, 0 while open.
+   char unused[24];
+};
+
+struct MmapUserStore::Slot {
+   unsigned long long hash;
+   unsigned long long offset; // 0 if empty, records start after the log header.
+};
+
+// Each record in the log is this, then the payload: username, hash, salt, scram_salt, the 4 SCRAM keys, each
+// a 16 bit length and the bytes, then the 32 bit iteration count.
+struct RecordHeader {
+   unsigned int magic;
+   unsigned int length; // Payload only.
+   unsigned long long checksum; // FNV-1a of the payload, catches a torn write at the end of the log.
+};
+
+static unsigned long long Checksum_(const char* data, size_t size) {
+   unsigned long long h = 14695981039346656037ULL;
+   for(size_t i = 0; i < size; i++) {
+      h ^= (unsigned char)data[i];
+      h *= 1099511628211ULL;
+   }
+   return h;
+}
+
+/**
+ * Writes all of it, false if it couldn't.
+ */
+static bool WriteAll_(int fd, const char* data, size_t size, off_t offset) {
+   while(size > 0) {
+      ssize_t written = pwrite(fd, data, size, offset);
+      if(written < 0) {
+         if(errno == EINTR) {
+            continue;
+         }
+         return false;
+      }
+      data += written;
+      size -= written;
+      offset += written;
+   }
+   return true;
+}
+
+MmapUserStore::MmapUserStore(const string& index_file, const string& log_file) : index_file_(index_file), log_file_(log_file), index_fd_(-1), index_map_(NULL), index_map_size_(0), log_fd_(-1), log_map_(NULL), log_map_size_(0), log_length_(0) {
+   LOG("Opening user store '%s'.", log_file_.c_str());
+   if(!openLog_() || !openIndex_()) {
+      ERROR("Could not open user store '%s': %s", log_file_.c_str(), strerror(errno));
+      closeIndex_();
+      return;
+   }
+
+   // Anything that goes wrong from here on, the index gets rebuilt next time.
+   getHeader_()->clean = 0;
+   msync(index_map_, sizeof(IndexHeader), MS_SYNC);
+   LOG("User store holds %llu users, log is %llu KiB.", getHeader_()->count, log_length_ / 1024);
+}
+
+MmapUserStore::~MmapUserStore() {
+   if(index_map_) {
+      getHeader_()->log_length = log_length_;
+      msync(index_map_, index_map_size_, MS_SYNC);
+      getHeader_()->clean = 1;
+      msync(index_map_, sizeof(IndexHeader), MS_SYNC);
+   }
+   closeIndex_();
+   if(log_map_) {
+      munmap((void*)log_map_, log_map_size_);
+   }
+   if(log_fd_ >= 0) {
+      close(log_fd_);
+   }
+}
+
+void MmapUserStore::closeIndex_() {
+   if(index_map_) {
+      munmap(index_map_, index_map_size_);
+      index_map_ = NULL;
+   }
+   if(index_fd_ >= 0) {
+      close(index_fd_);
+      index_fd_ = -1;
+   }
+}
+
+bool MmapUserStore::openLog_() {
+   log_fd_ = open(log_file_.c_str(), O_RDWR | O_CREAT, 0600);
+   if(log_fd_ < 0) {
+      return false;
+   }
+   struct stat st;
+   if(fstat(log_fd_, &st) != 0) {
+      return false;
+   }
+
+   if(st.st_size == 0) {
+      if(!WriteAll_(log_fd_, LOG_MAGIC, sizeof(LOG_MAGIC), 0) || fdatasync(log_fd_) != 0) {
+         return false;
+      }
+      st.st_size = sizeof(LOG_MAGIC);
+   }
+
+   char magic[sizeof(LOG_MAGIC)];
+   if(pread(log_fd_, magic, sizeof(magic), 0) != (ssize_t)sizeof(magic) || memcmp(magic, LOG_MAGIC, sizeof(magic)) != 0) {
+      ERROR("'%s' isn't a user store log.", log_file_.c_str());
+      errno = EINVAL;
+      return false;
+   }
+
+   log_length_ = st.st_size;
+   return mapLog_(log_length_);
+}
+
+/**
+ * Makes sure at least length bytes of the log are mapped. Called with the lock held (or before anyone else can see it).
+ */
+bool MmapUserStore::mapLog_(unsigned long long length) {
+   if(log_map_ && length <= log_map_size_) {
+      return true;
+   }
+   size_t page = sysconf(_SC_PAGESIZE);
+   size_t size = max((size_t)length * 2, MIN_LOG_MAP);
+   size = (size + page - 1) / page * page;
+
+   void* map = mmap(NULL, size, PROT_READ, MAP_SHARED, log_fd_, 0);
+   if(map == MAP_FAILED) {
+      ERROR("Could not map the user store log: %s", strerror(errno));
+      return false;
+   }
+   if(log_map_) {
+      munmap((void*)log_map_, log_map_size_);
+   }
+   log_map_ = (const char*)map;
+   log_map_size_ = size;
+   return true;
+}
+
+bool MmapUserStore::createIndex_(const string& file, unsigned long long slots, int& fd, char*& map, size_t& map_size) {
+   fd = open(file.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+   if(fd < 0) {
+      return false;
+   }
+   map_size = sizeof(IndexHeader) + slots * sizeof(Slot);
+   if(ftruncate(fd, map_size) != 0) { // Zero filled, so every slot starts empty.
+      close(fd);
+      return false;
+   }
+   void* mapped = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   if(mapped == MAP_FAILED) {
+      close(fd);
+      return false;
+   }
+   map = (char*)mapped;
+
+   IndexHeader* header = (IndexHeader*)map;
+   memcpy(header->magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+   header->slots = slots;
+   return true;
+}
+
+bool MmapUserStore::openIndex_() {
+   index_fd_ = open(index_file_.c_str(), O_RDWR | O_CREAT, 0600);
+   if(index_fd_ < 0) {
+      return false;
+   }
+   struct stat st;
+   if(fstat(index_fd_, &st) == 0 && st.st_size >= (off_t)sizeof(IndexHeader)) {
+      void* mapped = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, index_fd_, 0);
+      if(mapped != MAP_FAILED) {
+         index_map_ = (char*)mapped;
+         index_map_size_ = st.st_size;
+
+         IndexHeader* header = getHeader_();
+         bool usable = memcmp(header->magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) == 0 &&
+            header->slots >= MIN_SLOTS && (header->slots & (header->slots - 1)) == 0 &&
+            index_map_size_ == sizeof(IndexHeader) + header->slots * sizeof(Slot) &&
+            header->clean == 1 && header->log_length == log_length_;
+         if(usable) {
+            return true;
+         }
+      }
+   }
+
+   LOG("Rebuilding user store index '%s'.", index_file_.c_str());
+   closeIndex_();
+   return rebuildIndex_();
+}
+
+/**
+ * Replays the whole log into a fresh index. Stops at the first record that doesn't check out and cuts the log off
+ * there, that can only be a write that was interrupted.
+ */
+bool MmapUserStore::rebuildIndex_() {
+   if(!createIndex_(index_file_, MIN_SLOTS, index_fd_, index_map_, index_map_size_)) {
+      return false;
+   }
+
+   unsigned long long offset = sizeof(LOG_MAGIC);
+   while(offset + sizeof(RecordHeader) <= log_length_) {
+      RecordHeader header;
+      memcpy(&header, log_map_ + offset, sizeof(header));
+      const char* payload = log_map_ + offset + sizeof(header);
+      string username;
+      if(header.magic != RECORD_MAGIC || header.length > log_length_ - offset - sizeof(header) ||
+         Checksum_(payload, header.length) != header.checksum || !Decode_(payload, header.length, &username, NULL)) {
+         break;
+      }
+
+      setSlot_(username, HashUsername_(username), offset);
+      if(getHeader_()->count * 2 > getHeader_()->slots && !growIndex_()) {
+         return false;
+      }
+      offset += sizeof(header) + header.length;
+   }
+
+   if(offset != log_length_) {
+      WARNING("User store log '%s' has %llu bytes of incomplete writes at the end, dropping them.", log_file_.c_str(), log_length_ - offset);
+      if(ftruncate(log_fd_, offset) != 0) {
+         return false;
+      }
+      log_length_ = offset;
+   }
+   getHeader_()->log_length = log_length_;
+   return true;
+}
+
+/**
+ * Doubles the index into a new file and swaps it in. Called with the lock held.
+ */
+bool MmapUserStore::growIndex_() {
+   IndexHeader* old_header = getHeader_();
+   Slot* old_slots = getSlots_();
+   unsigned long long old_count = old_header->slots;
+
+   string file = index_file_ + ".new";
+   int fd;
+   char* map;
+   size_t map_size;
+   if(!createIndex_(file, old_count * 2, fd, map, map_size)) {
+      ERROR("Could not grow the user store index: %s", strerror(errno));
+      return false;
+   }
+
+   IndexHeader* header = (IndexHeader*)map;
+   header->count = old_header->count;
+   header->log_length = old_header->log_length;
+   Slot* slots = (Slot*)(map + sizeof(IndexHeader));
+   unsigned long long mask = header->slots - 1;
+   for(unsigned long long i = 0; i < old_count; i++) {
+      if(old_slots[i].offset == 0) {
+         continue;
+      }
+      // Every name is already unique, so it's just the first empty slot.
+      unsigned long long j = old_slots[i].hash & mask;
+      while(slots[j].offset != 0) {
+         j = (j + 1) & mask;
+      }
+      slots[j] = old_slots[i];
+   }
+
+   if(rename(file.c_str(), index_file_.c_str()) != 0) {
+      munmap(map, map_size);
+      close(fd);
+      return false;
+   }
+   closeIndex_();
+   index_fd_ = fd;
+   index_map_ = map;
+   index_map_size_ = map_size;
+   return true;
+}
+
+MmapUserStore::Slot* MmapUserStore::getSlots_() const {
+   return (Slot*)(index_map_ + sizeof(IndexHeader));
+}
+
+/**
+ * Probes for a user's slot. Called with the lock held, at least shared.
+ */
+MmapUserStore::Slot* MmapUserStore::findSlot_(const string& username, unsigned long long hash) const {
+   Slot* slots = getSlots_();
+   unsigned long long mask = getHeader_()->slots - 1;
+   for(unsigned long long i = hash & mask;; i = (i + 1) & mask) {
+      Slot* slot = &slots[i];
+      if(slot->offset == 0) {
+         return slot;
+      }
+      if(slot->hash != hash) {
+         continue;
+      }
+      // Compare the name straight out of the log, there's no need to decode the rest.
+      const char* name = log_map_ + slot->offset + sizeof(RecordHeader);
+      unsigned short length;
+      memcpy(&length, name, sizeof(length));
+      if(length == username.size() && memcmp(name + sizeof(length), username.data(), length) == 0) {
+         return slot;
+      }
+   }
+}
+
+void MmapUserStore::setSlot_(const string& username, unsigned long long hash, unsigned long long offset) {
+   Slot* slot = findSlot_(username, hash);
+   if(slot->offset == 0) {
+      slot->hash = hash;
+      getHeader_()->count++;
+   }
+   slot->offset = offset;
+}
+
+bool MmapUserStore::Lookup(const string& username, UserRecord& record) {
+   unsigned long long hash = HashUsername_(username);
+   boost::shared_lock<boost::shared_mutex> lock(mutex_);
+   if(!index_map_) {
+      return false;
+   }
+   Slot* slot = findSlot_(username, hash);
+   if(slot->offset == 0) {
+      return false;
+   }
+   RecordHeader header;
+   memcpy(&header, log_map_ + slot->offset, sizeof(header));
+   return Decode_(log_map_ + slot->offset + sizeof(header), header.length, NULL, &record);
+}
+
+void MmapUserStore::Scan(const Visitor& visit) {
+   boost::shared_lock<boost::shared_mutex> lock(mutex_);
+   if(!index_map_) {
+      return;
+   }
+   Slot* slots = getSlots_();
+   for(unsigned long long i = 0; i < getHeader_()->slots; i++) {
+      if(slots[i].offset == 0) {
+         continue;
+      }
+      RecordHeader header;
+      memcpy(&header, log_map_ + slots[i].offset, sizeof(header));
+      string username;
+      UserRecord record;
+      if(Decode_(log_map_ + slots[i].offset + sizeof(header), header.length, &username, &record)) {
+         visit(username, record);
+      }
+   }
+}
+
+unsigned long long MmapUserStore::getCount() const {
+   boost::shared_lock<boost::shared_mutex> lock(mutex_);
+   return index_map_ ? getHeader_()->count : 0;
+}
+
+bool MmapUserStore::Begin() {
+   Rollback();
+   return isOpen();
+}
+
+void MmapUserStore::Rollback() {
+   pending_.clear();
+   writes_.clear();
+   pending_users_.clear();
+}
+
+bool MmapUserStore::Insert(const string& username, const UserRecord& record) {
+   UserRecord existing;
+   if(readLatest_(username, existing)) {
+      return false;
+   }
+   return append_(username, record);
+}
+
+bool MmapUserStore::SetScramKeys(const string& username, const ScramCredentials& sha1, const ScramCredentials& sha256) {
+   UserRecord record;
+   if(!readLatest_(username, record)) {
+      return false;
+   }
+   record.setScramCredentials(sha1, sha256);
+   return append_(username, record);
+}
+
+/**
+ * Looks in this batch first, then the index.
+ */
+bool MmapUserStore::readLatest_(const string& username, UserRecord& record) {
+   boost::unordered_map<string, size_t>::const_iterator it = pending_users_.find(username);
+   if(it == pending_users_.end()) {
+      return Lookup(username, record);
+   }
+   const char* data = pending_.data() + (writes_[it->second].offset - log_length_);
+   RecordHeader header;
+   memcpy(&header, data, sizeof(header));
+   return Decode_(data + sizeof(header), header.length, NULL, &record);
+}
+
+bool MmapUserStore::append_(const string& username, const UserRecord& record) {
+   string payload;
+   if(!Encode_(username, record, payload)) {
+      ERROR("User '%s' is too big to store.", username.c_str());
+      return false;
+   }
+   RecordHeader header;
+   header.magic = RECORD_MAGIC;
+   header.length = payload.size();
+   header.checksum = Checksum_(payload.data(), payload.size());
+
+   unsigned long long offset = log_length_ + pending_.size();
+   pending_.append((const char*)&header, sizeof(header));
+   pending_.append(payload);
+
+   boost::unordered_map<string, size_t>::iterator it = pending_users_.find(username);
+   if(it != pending_users_.end()) {
+      writes_[it->second].offset = offset; // Same user twice in one batch, the later one wins.
+      return true;
+   }
+   PendingWrite write;
+   write.username = username;
+   write.hash = HashUsername_(username);
+   write.offset = offset;
+   pending_users_[username] = writes_.size();
+   writes_.push_back(write);
+   return true;
+}
+
+/**
+ * Appends the batch to the log and syncs it, then points the index at the new records. Readers only wait while the
+ * index is changed, and while it's grown or the log remapped, which is rare.
+ */
+bool MmapUserStore::Commit() {
+   if(writes_.empty()) {
+      return true;
+   }
+
+   // Make room first, so once the records are in the log nothing can stop the index pointing at them.
+   {
+      boost::unique_lock<boost::shared_mutex> lock(mutex_);
+      bool room = mapLog_(log_length_ + pending_.size());
+      while(room && (getHeader_()->count + writes_.size()) * 2 > getHeader_()->slots) {
+         room = growIndex_();
+      }
+      if(!room) {
+         ERROR("User store commit of %d writes failed, no room.", (int)writes_.size());
+         Rollback();
+         return false;
+      }
+   }
+
+   if(!WriteAll_(log_fd_, pending_.data(), pending_.size(), log_length_) || fdatasync(log_fd_) != 0) {
+      ERROR("User store commit of %d writes failed: %s", (int)writes_.size(), strerror(errno));
+      if(ftruncate(log_fd_, log_length_) != 0) {
+         ERROR("Could not undo a failed user store commit, the index will be rebuilt on restart.");
+      }
+      Rollback();
+      return false;
+   }
+
+   {
+      boost::unique_lock<boost::shared_mutex> lock(mutex_);
+      for(size_t i = 0; i < writes_.size(); i++) {
+         setSlot_(writes_[i].username, writes_[i].hash, writes_[i].offset);
+      }
+      log_length_ += pending_.size();
+      getHeader_()->log_length = log_length_;
+   }
+
+   Rollback(); // Done with the batch.
+   return true;
+}
+
+unsigned long long MmapUserStore::HashUsername_(const string& username) {
+   unsigned long long h = Checksum_(username.data(), username.size());
+   h ^= h >> 33;
+   h *= 0xff51afd7ed558ccdULL;
+   h ^= h >> 33;
+   return h;
+}
+
+bool MmapUserStore::Encode_(const string& username, const UserRecord& record, string& out) {
+   const string* fields[RECORD_FIELDS] = { &username, &record.hash, &record.salt, &record.scram_salt, &record.sha1_stored_key, &record.sha1_server_key, &record.sha256_stored_key, &record.sha256_server_key };
+   out.clear();
+   for(int i = 0; i < RECORD_FIELDS; i++) {
+      if(fields[i]->size() > 0xffff) {
+         return false;
+      }
+      unsigned short length = fields[i]->size();
+      out.append((const char*)&length, sizeof(length));
+      out.append(*fields[i]);
+   }
+   unsigned int iterations = record.scram_iterations;
+   out.append((const char*)&iterations, sizeof(iterations));
+   return true;
+}
+
+/**
+ * Either of username and record can be NULL if they're not wanted. False if data doesn't hold a whole record.
+ */
+bool MmapUserStore::Decode_(const char* data, size_t size, string* username, UserRecord* record) {
+   string* fields[RECORD_FIELDS] = { username, NULL, NULL, NULL, NULL, NULL, NULL, NULL };
+   if(record) {
+      fields[1] = &record->hash;
+      fields[2] = &record->salt;
+      fields[3] = &record->scram_salt;
+      fields[4] = &record->sha1_stored_key;
+      fields[5] = &record->sha1_server_key;
+      fields[6] = &record->sha256_stored_key;
+      fields[7] = &record->sha256_server_key;
+   }
+
+   size_t offset = 0;
+   for(int i = 0; i < RECORD_FIELDS; i++) {
+      unsigned short length;
+      if(offset + sizeof(length) > size) {
+         return false;
+      }
+      memcpy(&length, data + offset, sizeof(length));
+      offset += sizeof(length);
+      if(offset + length > size) {
+         return false;
+      }
+      if(fields[i]) {
+         fields[i]->assign(data + offset, length);
+      }
+      offset += length;
+   }
+
+   unsigned int iterations;
+   if(offset + sizeof(iterations) != size) {
+      return false;
+   }
+   memcpy(&iterations, data + offset, sizeof(iterations));
+   if(record) {
+      record->scram_iterations = iterations;
+   }
+   return true;
+}
@@ -0,0 +1,90 @@
+#ifndef LAZYXMPP_MMAPUSERSTORE_HPP_
+#define LAZYXMPP_MMAPUSERSTORE_HPP_
+
+#include <string>
+#include <vector>
+using namespace std;
+
+#include <boost/unordered_map.hpp>
+#include <boost/thread/shared_mutex.hpp>
+
+#include "../Main/UserStore.hpp"
+
+/**
+ * Users in two memory mapped files. The log holds every version of every record, appended and never rewritten.
+ * The index is an open addressed hash table (linear probing, at most half full) of username hash -> log offset of
+ * the latest record. Lookups are a hash, a probe or two and a copy out of the mapping, no system calls.
+ *
+ * The log is what's synced to disk, the index can always be rebuilt from it. It's only trusted at startup if it was
+ * closed cleanly and covers exactly the log, otherwise it's rebuilt and any torn record at the end of the log is cut
+ * off. Old versions are never reclaimed, which is fine while records only change once (for the SCRAM upgrade).
+ */
+class MmapUserStore: public UserStore {
+   public:
+      MmapUserStore(const string& index_file, const string& log_file);
+      ~MmapUserStore();
+
+      bool isOpen() const { return index_map_ != NULL; }
+
+      bool Lookup(const string& username, UserRecord& record);
+      void Scan(const Visitor& visit); // Holds the index read locked while visiting, don't call back in to write.
+
+      bool Begin();
+      bool Insert(const string& username, const UserRecord& record);
+      bool SetScramKeys(const string& username, const ScramCredentials& sha1, const ScramCredentials& sha256);
+      bool Commit();
+      void Rollback();
+
+      const char* getName() const { return "mmap"; }
+
+      unsigned long long getCount() const;
+
+   private:
+      struct IndexHeader;
+      struct Slot;
+
+      // A record written since Begin, still in pending_.
+      struct PendingWrite {
+         string username;
+         unsigned long long hash;
+         unsigned long long offset; // Where it'll be in the log once written.
+      };
+
+      bool openLog_();
+      bool openIndex_();
+      bool createIndex_(const string& file, unsigned long long slots, int& fd, char*& map, size_t& map_size);
+      bool rebuildIndex_();
+      bool growIndex_();
+      bool mapLog_(unsigned long long length);
+      void closeIndex_();
+
+      IndexHeader* getHeader_() const { return (IndexHeader*)index_map_; }
+      Slot* getSlots_() const;
+      Slot* findSlot_(const string& username, unsigned long long hash) const; // Its slot, or the empty one it would go in.
+      void setSlot_(const string& username, unsigned long long hash, unsigned long long offset);
+      bool readLatest_(const string& username, UserRecord& record); // Including this batch's writes.
+      bool append_(const string& username, const UserRecord& record); // Adds to this batch.
+
+      static unsigned long long HashUsername_(const string& username);
+      static bool Encode_(const string& username, const UserRecord& record, string& out);
+      static bool Decode_(const char* data, size_t size, string* username, UserRecord* record);
+
+      string index_file_;
+      string log_file_;
+
+      mutable boost::shared_mutex mutex_; // Readers share it, the writer takes it to change the index or remap.
+      int index_fd_;
+      char* index_map_;
+      size_t index_map_size_;
+      int log_fd_;
+      const char* log_map_;
+      size_t log_map_size_; // Can be more than the file, only the first log_length_ bytes are ever touched.
+      unsigned long long log_length_; // Committed.
+
+      // Only touched by the writer.
+      string pending_;
+      vector<PendingWrite> writes_;
+      boost::unordered_map<string, size_t> pending_users_; // username -> writes_ index.
+};
+
+#endif /* LAZYXMPP_MMAPUSERSTORE_HPP_ */
@@ -0,0 +1,549 @@
+#include "../Main/OfflineSpool.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/filesystem.hpp>
+namespace fs=boost::filesystem;
+
+#include "../Main/RawStanza.hpp"
+#include "../Debug/console.h"
+
+static const char SEGMENT_MAGIC[16] = "LXSPOOL1";
+static const unsigned int RECORD_MAGIC = 0x5053584c; // "LXSP"
+static const unsigned int RECORD_STORED = 1; // seq, stamp, jid, then the stanza.
+static const unsigned int RECORD_DELIVERED = 2; // seq, jid. Everything for jid up to seq has gone.
+static const unsigned int MAX_SEGMENTS = 4; // Past this the oldest is compacted however much of it is still live.
+
+struct SpoolRecordHeader {
+   unsigned int magic;
+   unsigned int type;
+   unsigned int length; // Payload only.
+   unsigned int checksum; // FNV-1a of the payload, catches a torn write at the end.
+};
+
+static unsigned int Checksum_(const char* data, size_t size) {
+   unsigned int h = 2166136261U;
+   for(size_t i = 0; i < size; i++) {
+      h ^= (unsigned char)data[i];
+      h *= 16777619U;
+   }
+   return h;
+}
+
+OfflineSpool::OfflineSpool(const string& directory, size_t segment_size, unsigned int max_per_user) : directory_(directory), segment_size_(segment_size), max_per_user_(max_per_user), next_seq_(1), dirty_(false), stopping_(false) {
+   if(directory_.empty()) {
+      fs::path spooldir;
+      spooldir /= getenv("HOME");
+      spooldir /= "/.config/LazyXMPP/offline";
+      directory_ = spooldir.string();
+   }
+}
+
+OfflineSpool::~OfflineSpool() {
+   Stop();
+   for(map<unsigned int, Segment>::iterator it = segments_.begin(); it != segments_.end(); it++) {
+      CloseSegment_(it->second);
+   }
+}
+
+void OfflineSpool::Start() {
+   if(!Recover_()) {
+      ERROR("Offline messages can't be stored, the spool in '%s' won't open.", directory_.c_str());
+   }
+   thread_ = boost::thread(boost::bind(&OfflineSpool::Run_, this));
+}
+
+void OfflineSpool::Stop() {
+   {
+      boost::mutex::scoped_lock lock(mutex_);
+      if(stopping_ || !thread_.joinable()) {
+         return;
+      }
+      stopping_ = true;
+   }
+   queued_.notify_all();
+   thread_.join();
+}
+
+void OfflineSpool::Store(const string& jid, const SharedBuffer& stanza) {
+   Operation operation;
+   operation.type = Operation::STORE;
+   operation.jid = jid;
+   operation.stanza = stanza;
+   operation.stamp = time(NULL);
+   {
+      boost::mutex::scoped_lock lock(mutex_);
+      queue_.push_back(operation);
+   }
+   queued_.notify_one();
+}
+
+void OfflineSpool::Flush(const string& jid, const string& server, const LazyXMPPConnectionPtr& connection) {
+   Operation operation;
+   operation.type = Operation::FLUSH;
+   operation.jid = jid;
+   operation.stamp = 0;
+   operation.server = server;
+   operation.connection = connection;
+   {
+      boost::mutex::scoped_lock lock(mutex_);
+      queue_.push_back(operation);
+   }
+   queued_.notify_one();
+}
+
+/**
+ * The spool thread. Takes everything queued, applies it in order, then syncs once for the lot.
+ */
+void OfflineSpool::Run_() {
+   deque<Operation> batch;
+   for(;;) {
+      {
+         boost::mutex::scoped_lock lock(mutex_);
+         while(queue_.empty() && !stopping_) {
+            queued_.wait(lock);
+         }
+         if(queue_.empty()) {
+            return; // Stopping and nothing left.
+         }
+         batch.swap(queue_);
+      }
+
+      for(deque<Operation>::iterator it = batch.begin(); it != batch.end(); it++) {
+         if(segments_.empty()) {
+            continue; // Never opened.
+         }
+         if(it->type == Operation::FLUSH) {
+            Flush_(*it);
+         } else if(it->type == Operation::FLUSHED) {
+            Flushed_(*it);
+         } else {
+            Store_(*it);
+         }
+      }
+      batch.clear();
+
+      if(dirty_) {
+         fdatasync(segments_.rbegin()->second.fd);
+         dirty_ = false;
+      }
+      Compact_();
+   }
+}
+
+void OfflineSpool::Store_(Operation& operation) {
+   Messages& messages = messages_[operation.jid];
+   if(messages.size() >= max_per_user_) {
+      DEBUG_M("Offline storage for '%s' is full, dropping a message.", operation.jid.c_str());
+      return;
+   }
+   Location location;
+   unsigned long long seq = next_seq_++;
+   if(Append_(RECORD_STORED, seq, operation.stamp, operation.jid, operation.stanza->data(), operation.stanza->size(), &location)) {
+      messages[seq] = location;
+      Segment& segment = segments_[location.segment];
+      segment.live++;
+      segment.live_bytes += location.length;
+   }
+}
+
+/**
+ * Sends a user everything stored for them as a single write. It's only tombstoned once the connection has taken it,
+ * a link that dropped after Flush was queued leaves it all here for next time.
+ */
+void OfflineSpool::Flush_(Operation& operation) {
+   boost::unordered_map<string, Flushing>::iterator flushing = flushing_.find(operation.jid);
+   if(flushing != flushing_.end()) {
+      flushing->second.waiting.push_back(operation); // Otherwise both would get the same backlog.
+      return;
+   }
+   boost::unordered_map<string, Messages>::iterator user = messages_.find(operation.jid);
+   if(user == messages_.end() || user->second.empty()) {
+      return;
+   }
+   Messages& messages = user->second;
+
+   boost::shared_ptr<string> backlog(new string());
+   for(Messages::iterator it = messages.begin(); it != messages.end(); it++) {
+      const Segment& segment = segments_[it->second.segment];
+      const char* payload = segment.map + it->second.offset + sizeof(SpoolRecordHeader);
+      unsigned long long stamp;
+      unsigned short jid_size;
+      memcpy(&stamp, payload + 8, sizeof(stamp));
+      memcpy(&jid_size, payload + 16, sizeof(jid_size));
+      size_t header_size = 18 + jid_size;
+      backlog->append(AddDelay_(payload + header_size, it->second.length - sizeof(SpoolRecordHeader) - header_size, operation.server, stamp));
+   }
+
+   unsigned long long last = messages.rbegin()->first;
+   flushing_[operation.jid].last = last;
+   operation.connection->WriteIfLive(backlog, boost::bind(&OfflineSpool::HandedOver_, this, operation.jid, last, _1));
+}
+
+void OfflineSpool::HandedOver_(const string& jid, unsigned long long last, bool delivered) {
+   Operation operation;
+   operation.type = Operation::FLUSHED;
+   operation.jid = jid;
+   operation.stamp = 0;
+   operation.last = last;
+   operation.delivered = delivered;
+   {
+      boost::mutex::scoped_lock lock(mutex_);
+      queue_.push_back(operation);
+   }
+   queued_.notify_one();
+}
+
+/**
+ * The connection has answered for a backlog. Anything stored since it was read stays.
+ */
+void OfflineSpool::Flushed_(Operation& operation) {
+   deque<Operation> waiting;
+   boost::unordered_map<string, Flushing>::iterator flushing = flushing_.find(operation.jid);
+   if(flushing != flushing_.end()) {
+      waiting.swap(flushing->second.waiting);
+      flushing_.erase(flushing);
+   }
+
+   boost::unordered_map<string, Messages>::iterator user = messages_.find(operation.jid);
+   if(!operation.delivered) {
+      DEBUG_M("'%s' went away before their offline messages were sent, they're kept.", operation.jid.c_str());
+   } else if(user != messages_.end()) {
+      DEBUG_M("Delivered offline messages up to %llu to '%s'.", operation.last, operation.jid.c_str());
+      Append_(RECORD_DELIVERED, operation.last, 0, operation.jid, NULL, 0, NULL);
+      Forget_(user->second, operation.last);
+      if(user->second.empty()) {
+         messages_.erase(user);
+      }
+   }
+
+   for(deque<Operation>::iterator it = waiting.begin(); it != waiting.end(); it++) {
+      Flush_(*it);
+   }
+}
+
+void OfflineSpool::Forget_(Messages& messages, unsigned long long up_to) {
+   while(!messages.empty() && messages.begin()->first <= up_to) {
+      map<unsigned int, Segment>::iterator segment = segments_.find(messages.begin()->second.segment);
+      if(segment != segments_.end()) {
+         segment->second.live--;
+         segment->second.live_bytes -= messages.begin()->second.length;
+      }
+      messages.erase(messages.begin());
+   }
+}
+
+/**
+ * Inserts a <delay/> (XEP-0203) as the last child of a stored message, saying when the server got it.
+ */
+string OfflineSpool::AddDelay_(const char* stanza, size_t size, const string& from, unsigned long long stamp) {
+   char when[32];
+   time_t t = stamp;
+   struct tm utc;
+   gmtime_r(&t, &utc);
+   strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%SZ", &utc);
+
+   string message(stanza, size);
+   size_t close = message.rfind("</");
+   if(close == string::npos) {
+      return message;
+   }
+   message.insert(close, "<delay xmlns=\"urn:xmpp:delay\" from=\"" + RawStanza::Escape(from) + "\" stamp=\"" + when + "\">Offline Storage</delay>");
+   return message;
+}
+
+/**
+ * Appends a record to the newest segment, starting another if it won't fit. location is filled in if it's given.
+ */
+bool OfflineSpool::Append_(unsigned int type, unsigned long long seq, unsigned long long stamp, const string& jid, const char* stanza, size_t stanza_size, Location* location) {
+   unsigned short jid_size = jid.size();
+   string record(sizeof(SpoolRecordHeader), '\0');
+   record.append((const char*)&seq, sizeof(seq));
+   if(type == RECORD_STORED) {
+      record.append((const char*)&stamp, sizeof(stamp));
+   }
+   record.append((const char*)&jid_size, sizeof(jid_size));
+   record.append(jid, 0, jid_size);
+   if(stanza) {
+      record.append(stanza, stanza_size);
+   }
+   SpoolRecordHeader header;
+   header.magic = RECORD_MAGIC;
+   header.type = type;
+   header.length = record.size() - sizeof(header);
+   header.checksum = Checksum_(record.data() + sizeof(header), header.length);
+   memcpy(&record[0], &header, sizeof(header));
+
+   if(record.size() + sizeof(SEGMENT_MAGIC) > segment_size_) {
+      WARNING("An offline message for '%s' is too big for the spool, dropping it.", jid.c_str());
+      return false;
+   }
+
+   unsigned int id = segments_.rbegin()->first;
+   if(segments_.rbegin()->second.size + record.size() > segments_.rbegin()->second.map_size) {
+      // Sync the full one now, after this only the new one is synced.
+      if(dirty_) {
+         fdatasync(segments_.rbegin()->second.fd);
+      }
+      if(!OpenSegment_(++id, true)) {
+         return false;
+      }
+   }
+
+   Segment& segment = segments_[id];
+   const char* data = record.data();
+   size_t left = record.size();
+   off_t offset = segment.size;
+   while(left > 0) {
+      ssize_t written = pwrite(segment.fd, data, left, offset);
+      if(written < 0 && errno == EINTR) {
+         continue;
+      }
+      if(written <= 0) {
+         ERROR("Could not write to the offline spool: %s", strerror(errno));
+         if(ftruncate(segment.fd, segment.size) != 0) {
+            ERROR("Could not undo a partial offline spool write.");
+         }
+         return false;
+      }
+      data += written;
+      left -= written;
+      offset += written;
+   }
+
+   if(location) {
+      location->segment = id;
+      location->offset = segment.size;
+      location->length = record.size();
+   }
+   segment.size += record.size();
+   dirty_ = true;
+   return true;
+}
+
+string OfflineSpool::getSegmentPath_(unsigned int id) const {
+   char name[32];
+   snprintf(name, sizeof(name), "/%08u.seg", id);
+   return directory_ + name;
+}
+
+bool OfflineSpool::OpenSegment_(unsigned int id, bool create) {
+   string path = getSegmentPath_(id);
+   Segment segment;
+   segment.fd = open(path.c_str(), O_RDWR | (create ? O_CREAT | O_EXCL : 0), 0600);
+   if(segment.fd < 0) {
+      ERROR("Could not open offline spool segment '%s': %s", path.c_str(), strerror(errno));
+      return false;
+   }
+
+   struct stat st;
+   if(fstat(segment.fd, &st) != 0) {
+      close(segment.fd);
+      return false;
+   }
+   segment.size = st.st_size;
+   if(create) {
+      if(pwrite(segment.fd, SEGMENT_MAGIC, sizeof(SEGMENT_MAGIC), 0) != (ssize_t)sizeof(SEGMENT_MAGIC)) {
+         close(segment.fd);
+         unlink(path.c_str());
+         return false;
+      }
+      segment.size = sizeof(SEGMENT_MAGIC);
+      dirty_ = true;
+   }
+
+   // Mapped at full size up front, the file grows into it.
+   segment.map_size = max((size_t)segment.size, segment_size_);
+   void* map = mmap(NULL, segment.map_size, PROT_READ, MAP_SHARED, segment.fd, 0);
+   if(map == MAP_FAILED) {
+      ERROR("Could not map offline spool segment '%s': %s", path.c_str(), strerror(errno));
+      close(segment.fd);
+      return false;
+   }
+   segment.map = (const char*)map;
+
+   if(memcmp(segment.map, SEGMENT_MAGIC, sizeof(SEGMENT_MAGIC)) != 0) {
+      ERROR("'%s' isn't an offline spool segment.", path.c_str());
+      CloseSegment_(segment);
+      return false;
+   }
+
+   segments_[id] = segment;
+   return true;
+}
+
+void OfflineSpool::CloseSegment_(Segment& segment) {
+   if(segment.map) {
+      munmap((void*)segment.map, segment.map_size);
+      segment.map = NULL;
+   }
+   if(segment.fd >= 0) {
+      close(segment.fd);
+      segment.fd = -1;
+   }
+}
+
+/**
+ * Rebuilds the index from the segments, oldest first, and starts a fresh segment to append to.
+ */
+bool OfflineSpool::Recover_() {
+   vector<unsigned int> ids;
+   try {
+      fs::create_directories(directory_);
+      for(fs::directory_iterator it(directory_); it != fs::directory_iterator(); it++) {
+         string name = it->path().filename().string();
+         if(name.size() == 12 && name.compare(8, 4, ".seg") == 0) {
+            ids.push_back(strtoul(name.c_str(), NULL, 10));
+         }
+      }
+   } catch(fs::filesystem_error& e) {
+      ERROR("%s", e.what());
+      return false;
+   }
+   sort(ids.begin(), ids.end());
+
+   for(size_t i = 0; i < ids.size(); i++) {
+      if(!OpenSegment_(ids[i], false) || !Scan_(ids[i])) {
+         return false;
+      }
+   }
+
+   unsigned long stored = 0;
+   for(boost::unordered_map<string, Messages>::iterator it = messages_.begin(); it != messages_.end(); it++) {
+      stored += it->second.size();
+   }
+   if(!ids.empty()) {
+      LOG("Offline spool holds %lu messages for %lu users in %lu segments.", stored, (unsigned long)messages_.size(), (unsigned long)ids.size());
+   }
+
+   bool opened = OpenSegment_(ids.empty() ? 1 : ids.back() + 1, true);
+   Compact_();
+   return opened;
+}
+
+/**
+ * Replays one segment into the index. Everything from the first record that doesn't check out is dropped, normally
+ * that's a write torn by a crash.
+ */
+bool OfflineSpool::Scan_(unsigned int id) {
+   Segment& segment = segments_[id];
+   unsigned long long offset = sizeof(SEGMENT_MAGIC);
+   while(offset + sizeof(SpoolRecordHeader) <= segment.size) {
+      SpoolRecordHeader header;
+      memcpy(&header, segment.map + offset, sizeof(header));
+      const char* payload = segment.map + offset + sizeof(header);
+      if(header.magic != RECORD_MAGIC || header.length > segment.size - offset - sizeof(header) || Checksum_(payload, header.length) != header.checksum) {
+         break;
+      }
+
+      unsigned long long seq;
+      unsigned short jid_size;
+      size_t jid_at = header.type == RECORD_STORED ? 16 : 8;
+      memcpy(&seq, payload, sizeof(seq));
+      memcpy(&jid_size, payload + jid_at, sizeof(jid_size));
+      string jid(payload + jid_at + sizeof(jid_size), jid_size);
+      next_seq_ = max(next_seq_, seq + 1);
+
+      Messages& messages = messages_[jid];
+      if(header.type == RECORD_STORED && messages.find(seq) == messages.end()) { // Already there if it was copied by a compaction that didn't finish.
+         Location location;
+         location.segment = id;
+         location.offset = offset;
+         location.length = sizeof(header) + header.length;
+         messages[seq] = location;
+         segment.live++;
+         segment.live_bytes += location.length;
+      } else if(header.type == RECORD_DELIVERED) {
+         Forget_(messages, seq);
+      }
+      if(messages.empty()) {
+         messages_.erase(jid);
+      }
+      offset += sizeof(header) + header.length;
+   }
+
+   if(offset != segment.size) {
+      WARNING("Offline spool segment '%s' has %llu bytes of incomplete writes at the end, dropping them.", getSegmentPath_(id).c_str(), segment.size - offset);
+      if(ftruncate(segment.fd, offset) != 0) {
+         return false;
+      }
+      segment.size = offset;
+   }
+   return true;
+}
+
+/**
+ * Reclaims the oldest segment once everything in it has been delivered, or it's mostly delivered, or there are too
+ * many. Whatever is still waiting in it is copied to the newest first. Only the oldest is ever removed, that way a
+ * tombstone can't go before the messages it covers.
+ */
+void OfflineSpool::Compact_() {
+   while(segments_.size() > 1) {
+      map<unsigned int, Segment>::iterator oldest = segments_.begin();
+      Segment& segment = oldest->second;
+      if(segment.live > 0 && segment.live_bytes * 2 > segment.size && segments_.size() <= MAX_SEGMENTS) {
+         return;
+      }
+
+      if(segment.live > 0) {
+         unsigned long long offset = sizeof(SEGMENT_MAGIC);
+         while(offset < segment.size) {
+            SpoolRecordHeader header;
+            memcpy(&header, segment.map + offset, sizeof(header));
+            const char* payload = segment.map + offset + sizeof(header);
+            unsigned long long record_offset = offset;
+            offset += sizeof(header) + header.length;
+            if(header.type != RECORD_STORED) {
+               continue;
+            }
+
+            unsigned long long seq, stamp;
+            unsigned short jid_size;
+            memcpy(&seq, payload, sizeof(seq));
+            memcpy(&stamp, payload + 8, sizeof(stamp));
+            memcpy(&jid_size, payload + 16, sizeof(jid_size));
+            string jid(payload + 18, jid_size);
+            boost::unordered_map<string, Messages>::iterator user = messages_.find(jid);
+            if(user == messages_.end()) {
+               continue;
+            }
+            Messages::iterator message = user->second.find(seq);
+            if(message == user->second.end() || message->second.segment != oldest->first || message->second.offset != record_offset) {
+               continue; // Delivered.
+            }
+
+            Location location;
+            size_t header_size = 18 + jid_size;
+            if(!Append_(RECORD_STORED, seq, stamp, jid, payload + header_size, header.length - header_size, &location)) {
+               return; // Try again next time.
+            }
+            message->second = location;
+            segment.live--;
+            segment.live_bytes -= header.length + sizeof(header);
+            segments_[location.segment].live++;
+            segments_[location.segment].live_bytes += location.length;
+         }
+         if(dirty_) {
+            fdatasync(segments_.rbegin()->second.fd); // The copies have to be safe before the originals go.
+            dirty_ = false;
+         }
+      }
+
+      DEBUG_M("Removing offline spool segment %u.", oldest->first);
+      unlink(getSegmentPath_(oldest->first).c_str());
+      CloseSegment_(segment);
+      segments_.erase(oldest);
+   }
+}
@@ -0,0 +1,106 @@
+#ifndef LAZYXMPP_OFFLINESPOOL_HPP_
+#define LAZYXMPP_OFFLINESPOOL_HPP_
+
+#include <deque>
+#include <map>
+#include <string>
+using namespace std;
+
+#include <boost/thread.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/noncopyable.hpp>
+
+#include "../Main/LazyXMPPConnection.hpp"
+
+/**
+ * Offline message storage (XEP-0160). Messages for users who aren't online are appended to a spool shared by
+ * everyone, split into segment files. Each user's messages are found through an index kept in memory and read back
+ * through the segments' memory maps. Delivering them appends a tombstone, and once a segment is mostly
+ * tombstoned its remaining messages are copied forward and it's deleted.
+ *
+ * All the disk work, and the syncs, happen on the spool's own thread. Store and Flush just queue and return, so an io
+ * thread never waits on the disk. Changes are synced once per batch, like the user database writer.
+ */
+class OfflineSpool: private boost::noncopyable {
+   public:
+      OfflineSpool(const string& directory = "", size_t segment_size = 16 << 20, unsigned int max_per_user = 1000); // directory defaults to ~/.config/LazyXMPP/offline
+      ~OfflineSpool();
+
+      void Start();
+      void Stop(); // Finishes what's queued first.
+
+      void Store(const string& jid, const SharedBuffer& stanza); // jid is the recipient's bare JID.
+      void Flush(const string& jid, const string& server, const LazyXMPPConnectionPtr& connection); // Sends them all in one write, each with a <delay/> from server.
+
+   private:
+      struct Operation {
+         enum Type { STORE, FLUSH, FLUSHED };
+         Type type;
+         string jid;
+         SharedBuffer stanza;
+         unsigned long long stamp;
+         string server;
+         LazyXMPPConnectionPtr connection;
+         unsigned long long last; // FLUSHED, the newest message in the backlog.
+         bool delivered; // FLUSHED, whether the connection took it.
+      };
+
+      // A backlog out for delivery, the messages stay until the connection says it took it.
+      struct Flushing {
+         unsigned long long last;
+         deque<Operation> waiting; // Flushes for the same user that came in meanwhile.
+      };
+
+      // Where a stored message is.
+      struct Location {
+         unsigned int segment;
+         unsigned long long offset; // Of its record.
+         unsigned int length; // Of the whole record.
+      };
+      typedef map<unsigned long long, Location> Messages; // By sequence number, so oldest first.
+
+      struct Segment {
+         Segment() : fd(-1), map(NULL), map_size(0), size(0), live(0), live_bytes(0) {}
+         int fd;
+         const char* map;
+         size_t map_size; // Can be more than the file, only the first size bytes are ever touched.
+         unsigned long long size;
+         unsigned long live; // Stored messages not delivered yet.
+         unsigned long long live_bytes;
+      };
+
+      void Run_();
+      void Store_(Operation& operation);
+      void Flush_(Operation& operation);
+      void Flushed_(Operation& operation);
+      void HandedOver_(const string& jid, unsigned long long last, bool delivered); // From the connection's io thread.
+      void Compact_();
+      bool Recover_();
+      bool Scan_(unsigned int id);
+      bool OpenSegment_(unsigned int id, bool create);
+      void CloseSegment_(Segment& segment);
+      bool Append_(unsigned int type, unsigned long long seq, unsigned long long stamp, const string& jid, const char* stanza, size_t stanza_size, Location* location);
+      void Forget_(Messages& messages, unsigned long long up_to); // Drops up_to and everything before it.
+      string getSegmentPath_(unsigned int id) const;
+
+      static string AddDelay_(const char* stanza, size_t size, const string& from, unsigned long long stamp);
+
+      string directory_;
+      size_t segment_size_;
+      unsigned int max_per_user_;
+
+      // Only the spool thread touches these.
+      boost::unordered_map<string, Messages> messages_; // Bare JID -> their messages.
+      boost::unordered_map<string, Flushing> flushing_; // Bare JID -> their backlog being handed over.
+      map<unsigned int, Segment> segments_; // Oldest first, the last is the one being appended to.
+      unsigned long long next_seq_;
+      bool dirty_; // Written since the last sync.
+
+      boost::mutex mutex_; // Guards queue_ and stopping_.
+      boost::condition_variable queued_;
+      deque<Operation> queue_;
+      bool stopping_;
+      boost::thread thread_;
+};
+
+#endif /* LAZYXMPP_OFFLINESPOOL_HPP_ */
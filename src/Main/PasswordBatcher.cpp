@@ -0,0 +1,74 @@
+#include "../Main/PasswordBatcher.hpp"
+
+#include <vector>
+
+#include <boost/bind.hpp>
+
+#include "../Main/UserDB.hpp"
+#include "../Main/AuthWorkerPool.hpp"
+#include "../Debug/console.h"
+
+PasswordBatcher::PasswordBatcher(UserDB* userdb, AuthWorkerPool& pool, unsigned int max_batch) : userdb_(userdb), pool_(pool), max_batch_(max_batch), next_id_(0) {
+   if(max_batch_ == 0) {
+      max_batch_ = 1;
+   }
+}
+
+bool PasswordBatcher::Submit(const string& username, const string& password, const Callback& done) {
+   unsigned long id;
+   {
+      boost::mutex::scoped_lock lock(mutex_);
+      Pending pending;
+      pending.id = id = next_id_++;
+      pending.username = username;
+      pending.password = password;
+      pending.done = done;
+      queue_.push_back(pending);
+   }
+
+   // The check has to be queued before the job, otherwise the job could run first and miss it.
+   if(pool_.Submit(boost::bind(&PasswordBatcher::RunBatch_, this))) {
+      return true;
+   }
+
+   // Refused, take it back out. If it's gone another job already has it and will answer it.
+   boost::mutex::scoped_lock lock(mutex_);
+   for(deque<Pending>::iterator it = queue_.begin(); it != queue_.end(); it++) {
+      if(it->id == id) {
+         queue_.erase(it);
+         return false;
+      }
+   }
+   return true;
+}
+
+/**
+ * Runs on an auth worker. Takes whatever is waiting and checks it as one batch. Finding nothing is fine, an
+ * earlier job took this job's check along with its own.
+ */
+void PasswordBatcher::RunBatch_() {
+   vector<Pending> batch;
+   {
+      boost::mutex::scoped_lock lock(mutex_);
+      while(!queue_.empty() && batch.size() < max_batch_) {
+         batch.push_back(queue_.front());
+         queue_.pop_front();
+      }
+   }
+   if(batch.empty()) {
+      return;
+   }
+
+   vector<PasswordCheck> checks;
+   checks.reserve(batch.size());
+   for(size_t i = 0; i < batch.size(); i++) {
+      checks.push_back(PasswordCheck(batch[i].username, batch[i].password));
+   }
+
+   userdb_->verifyPasswords(checks);
+   DEBUG_M("Checked %d passwords in one batch.", (int)checks.size());
+
+   for(size_t i = 0; i < batch.size(); i++) {
+      batch[i].done(checks[i].verified);
+   }
+}
@@ -0,0 +1,47 @@
+#ifndef LAZYXMPP_PASSWORDBATCHER_HPP_
+#define LAZYXMPP_PASSWORDBATCHER_HPP_
+
+#include <string>
+#include <deque>
+using namespace std;
+
+#include <boost/function.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/noncopyable.hpp>
+
+class UserDB;
+class AuthWorkerPool;
+
+/**
+ * Collects password checks so the auth workers can verify several at once with UserDB::verifyPasswords.
+ * Every check queues one job on the pool, but a job takes as many checks as are waiting (up to max_batch). When
+ * logins trickle in each job does one, during a login storm they pile up and get done a batch at a time.
+ */
+class PasswordBatcher: private boost::noncopyable {
+   public:
+      typedef boost::function<void(bool)> Callback; // Called on an auth worker with the result.
+
+      PasswordBatcher(UserDB* userdb, AuthWorkerPool& pool, unsigned int max_batch = 16);
+
+      bool Submit(const string& username, const string& password, const Callback& done); // False if the auth backlog is full.
+
+   private:
+      struct Pending {
+         unsigned long id;
+         string username;
+         string password;
+         Callback done;
+      };
+
+      void RunBatch_();
+
+      UserDB* userdb_;
+      AuthWorkerPool& pool_;
+      unsigned int max_batch_;
+
+      boost::mutex mutex_; // Guards queue_ and next_id_.
+      deque<Pending> queue_;
+      unsigned long next_id_;
+};
+
+#endif /* LAZYXMPP_PASSWORDBATCHER_HPP_ */
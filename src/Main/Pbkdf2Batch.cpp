@@ -0,0 +1,356 @@
+#include "../Main/Pbkdf2Batch.hpp"
+
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+
+// The lockstep kernels need GCC vector extensions, target attributes and __builtin_cpu_supports.
+#if defined(__GNUC__) && !defined(__clang__) && defined(__x86_64__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+   #define LAZYXMPP_PBKDF2_MULTIBUFFER
+#endif
+
+static const uint64_t SHA512_K[80] = {
+   0x428a2f98d728ae22ULL, 0x7137449123ef65cdULL, 0xb5c0fbcfec4d3b2fULL, 0xe9b5dba58189dbbcULL, 0x3956c25bf348b538ULL,
+   0x59f111f1b605d019ULL, 0x923f82a4af194f9bULL, 0xab1c5ed5da6d8118ULL, 0xd807aa98a3030242ULL, 0x12835b0145706fbeULL,
+   0x243185be4ee4b28cULL, 0x550c7dc3d5ffb4e2ULL, 0x72be5d74f27b896fULL, 0x80deb1fe3b1696b1ULL, 0x9bdc06a725c71235ULL,
+   0xc19bf174cf692694ULL, 0xe49b69c19ef14ad2ULL, 0xefbe4786384f25e3ULL, 0x0fc19dc68b8cd5b5ULL, 0x240ca1cc77ac9c65ULL,
+   0x2de92c6f592b0275ULL, 0x4a7484aa6ea6e483ULL, 0x5cb0a9dcbd41fbd4ULL, 0x76f988da831153b5ULL, 0x983e5152ee66dfabULL,
+   0xa831c66d2db43210ULL, 0xb00327c898fb213fULL, 0xbf597fc7beef0ee4ULL, 0xc6e00bf33da88fc2ULL, 0xd5a79147930aa725ULL,
+   0x06ca6351e003826fULL, 0x142929670a0e6e70ULL, 0x27b70a8546d22ffcULL, 0x2e1b21385c26c926ULL, 0x4d2c6dfc5ac42aedULL,
+   0x53380d139d95b3dfULL, 0x650a73548baf63deULL, 0x766a0abb3c77b2a8ULL, 0x81c2c92e47edaee6ULL, 0x92722c851482353bULL,
+   0xa2bfe8a14cf10364ULL, 0xa81a664bbc423001ULL, 0xc24b8b70d0f89791ULL, 0xc76c51a30654be30ULL, 0xd192e819d6ef5218ULL,
+   0xd69906245565a910ULL, 0xf40e35855771202aULL, 0x106aa07032bbd1b8ULL, 0x19a4c116b8d2d0c8ULL, 0x1e376c085141ab53ULL,
+   0x2748774cdf8eeb99ULL, 0x34b0bcb5e19b48a8ULL, 0x391c0cb3c5c95a63ULL, 0x4ed8aa4ae3418acbULL, 0x5b9cca4f7763e373ULL,
+   0x682e6ff3d6b2b8a3ULL, 0x748f82ee5defb2fcULL, 0x78a5636f43172f60ULL, 0x84c87814a1f0ab72ULL, 0x8cc702081a6439ecULL,
+   0x90befffa23631e28ULL, 0xa4506cebde82bde9ULL, 0xbef9a3f7b2c67915ULL, 0xc67178f2e372532bULL, 0xca273eceea26619cULL,
+   0xd186b8c721c0c207ULL, 0xeada7dd6cde0eb1eULL, 0xf57d4f7fee6ed178ULL, 0x06f067aa72176fbaULL, 0x0a637dc5a2c898a6ULL,
+   0x113f9804bef90daeULL, 0x1b710b35131c471bULL, 0x28db77f523047d84ULL, 0x32caab7b40c72493ULL, 0x3c9ebe0a15c9bebcULL,
+   0x431d67c49c100d4cULL, 0x4cc5d4becb3e42b6ULL, 0x597f299cfc657e2aULL, 0x5fcb6fab3ad6faecULL, 0x6c44198c4a475817ULL
+};
+
+static const uint64_t SHA512_IV[8] = {
+   0x6a09e667f3bcc908ULL, 0xbb67ae8584caa73bULL, 0x3c6ef372fe94f82bULL, 0xa54ff53a5f1d36f1ULL,
+   0x510e527fade682d1ULL, 0x9b05688c2b3e6c1fULL, 0x1f83d9abfb41bd6bULL, 0x5be0cd19137e2179ULL
+};
+
+static const unsigned int SHA512_BLOCK = 128;
+static const uint64_t SHA512_PAD = 0x8000000000000000ULL;
+static const uint64_t HMAC_ITERATION_BITS = (128 + 64) * 8; // An inner or outer hash in the loop is one key block plus one digest.
+
+// Written as macros so the same rounds work on plain uint64_t and on vectors of them without passing vectors by value.
+#define SHA512_ROTR(x, n) (((x) >> (n)) | ((x) << (64 - (n))))
+#define SHA512_S0(x) (SHA512_ROTR(x, 28) ^ SHA512_ROTR(x, 34) ^ SHA512_ROTR(x, 39))
+#define SHA512_S1(x) (SHA512_ROTR(x, 14) ^ SHA512_ROTR(x, 18) ^ SHA512_ROTR(x, 41))
+#define SHA512_s0(x) (SHA512_ROTR(x, 1) ^ SHA512_ROTR(x, 8) ^ ((x) >> 7))
+#define SHA512_s1(x) (SHA512_ROTR(x, 19) ^ SHA512_ROTR(x, 61) ^ ((x) >> 6))
+
+/**
+ * The SHA-512 compression function. V is uint64_t for one message or a GCC vector for one message per lane.
+ */
+template <class V> static inline __attribute__((always_inline)) void Sha512Compress_(V* state, const V* block) {
+   V w[16];
+   V a = state[0], b = state[1], c = state[2], d = state[3], e = state[4], f = state[5], g = state[6], h = state[7];
+
+   for(int t = 0; t < 80; t++) {
+      if(t < 16) {
+         w[t] = block[t];
+      } else {
+         w[t & 15] += SHA512_s1(w[(t - 2) & 15]) + w[(t - 7) & 15] + SHA512_s0(w[(t - 15) & 15]);
+      }
+      V t1 = h + SHA512_S1(e) + ((e & f) ^ (~e & g)) + SHA512_K[t] + w[t & 15];
+      V t2 = SHA512_S0(a) + ((a & b) ^ (a & c) ^ (b & c));
+      h = g;
+      g = f;
+      f = e;
+      e = d + t1;
+      d = c;
+      c = b;
+      b = a;
+      a = t1 + t2;
+   }
+
+   state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+   state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+static inline uint64_t LoadBigEndian_(const unsigned char* p) {
+   uint64_t x = 0;
+   for(int i = 0; i < 8; i++) {
+      x = (x << 8) | p[i];
+   }
+   return x;
+}
+
+static inline void StoreBigEndian_(uint64_t x, unsigned char* p) {
+   for(int i = 7; i >= 0; i--) {
+      p[i] = (unsigned char)x;
+      x >>= 8;
+   }
+}
+
+static void CompressBytes_(uint64_t* state, const unsigned char* data) {
+   uint64_t block[16];
+   for(int i = 0; i < 16; i++) {
+      block[i] = LoadBigEndian_(data + i * 8);
+   }
+   Sha512Compress_<uint64_t>(state, block);
+}
+
+/**
+ * Hashes the rest of a message into state and writes the digest. prefix is how many bytes were already compressed.
+ */
+static void Sha512Finish_(uint64_t* state, const unsigned char* data, size_t length, size_t prefix, unsigned char* digest) {
+   size_t total = prefix + length;
+   while(length >= SHA512_BLOCK) {
+      CompressBytes_(state, data);
+      data += SHA512_BLOCK;
+      length -= SHA512_BLOCK;
+   }
+
+   unsigned char last[SHA512_BLOCK * 2];
+   memset(last, 0, sizeof(last));
+   memcpy(last, data, length);
+   last[length] = 0x80;
+   size_t blocks = length + 1 + 16 > SHA512_BLOCK ? 2 : 1;
+   StoreBigEndian_((uint64_t)total * 8, last + blocks * SHA512_BLOCK - 8);
+   for(size_t i = 0; i < blocks; i++) {
+      CompressBytes_(state, last + i * SHA512_BLOCK);
+   }
+
+   for(int i = 0; i < 8; i++) {
+      StoreBigEndian_(state[i], digest + i * 8);
+   }
+}
+
+/**
+ * Where one derivation is at: the HMAC key already run through the ipad and opad blocks, the last U and the XOR of them all.
+ */
+struct Pbkdf2Lane_ {
+   uint64_t inner[8];
+   uint64_t outer[8];
+   uint64_t u[8];
+   uint64_t t[8];
+};
+
+/**
+ * Does the per-request work that doesn't fit in lockstep, the HMAC key setup and U1 = HMAC(P, salt || INT(1)).
+ */
+static void SetupLane_(const Pbkdf2Request& request, Pbkdf2Lane_& lane) {
+   unsigned char key[SHA512_BLOCK];
+   memset(key, 0, sizeof(key));
+   if(request.password.size() > SHA512_BLOCK) {
+      uint64_t state[8];
+      memcpy(state, SHA512_IV, sizeof(state));
+      Sha512Finish_(state, (const unsigned char*)request.password.data(), request.password.size(), 0, key);
+   } else {
+      memcpy(key, request.password.data(), request.password.size());
+   }
+
+   unsigned char ipad[SHA512_BLOCK], opad[SHA512_BLOCK];
+   for(unsigned int i = 0; i < SHA512_BLOCK; i++) {
+      ipad[i] = key[i] ^ 0x36;
+      opad[i] = key[i] ^ 0x5c;
+   }
+   memcpy(lane.inner, SHA512_IV, sizeof(lane.inner));
+   memcpy(lane.outer, SHA512_IV, sizeof(lane.outer));
+   CompressBytes_(lane.inner, ipad);
+   CompressBytes_(lane.outer, opad);
+
+   string message = request.salt;
+   message.append("\0\0\0\1", 4);
+   unsigned char digest[64];
+   uint64_t state[8];
+   memcpy(state, lane.inner, sizeof(state));
+   Sha512Finish_(state, (const unsigned char*)message.data(), message.size(), SHA512_BLOCK, digest);
+   memcpy(state, lane.outer, sizeof(state));
+   Sha512Finish_(state, digest, sizeof(digest), SHA512_BLOCK, digest);
+
+   for(int i = 0; i < 8; i++) {
+      lane.u[i] = LoadBigEndian_(digest + i * 8);
+   }
+   memcpy(lane.t, lane.u, sizeof(lane.t));
+}
+
+/**
+ * Runs U2..Uc for LANES derivations at once. Every iteration is two single block compressions with a fixed layout,
+ * so the lanes never diverge.
+ */
+template <class V, int LANES> static inline __attribute__((always_inline)) void Iterate_(Pbkdf2Lane_* lanes, unsigned int iterations) {
+   uint64_t transpose[8 * LANES];
+   V inner[8], outer[8], u[8], t[8];
+
+   // Word j of lane l goes to element l of vector j.
+   #define PBKDF2_LOAD(vec, field) \
+      for(int j = 0; j < 8; j++) { \
+         for(int l = 0; l < LANES; l++) { transpose[j * LANES + l] = lanes[l].field[j]; } \
+         memcpy(&vec[j], &transpose[j * LANES], sizeof(V)); \
+      }
+   #define PBKDF2_STORE(vec, field) \
+      for(int j = 0; j < 8; j++) { \
+         memcpy(&transpose[j * LANES], &vec[j], sizeof(V)); \
+         for(int l = 0; l < LANES; l++) { lanes[l].field[j] = transpose[j * LANES + l]; } \
+      }
+   PBKDF2_LOAD(inner, inner)
+   PBKDF2_LOAD(outer, outer)
+   PBKDF2_LOAD(u, u)
+   PBKDF2_LOAD(t, t)
+
+   V zero = u[0] ^ u[0];
+   V block[16];
+   for(int j = 8; j < 15; j++) {
+      block[j] = zero;
+   }
+   block[8] = zero + SHA512_PAD;
+   block[15] = zero + HMAC_ITERATION_BITS;
+
+   for(unsigned int i = 1; i < iterations; i++) {
+      V state[8];
+      for(int j = 0; j < 8; j++) {
+         block[j] = u[j];
+         state[j] = inner[j];
+      }
+      Sha512Compress_<V>(state, block);
+
+      for(int j = 0; j < 8; j++) {
+         block[j] = state[j];
+         u[j] = outer[j];
+      }
+      Sha512Compress_<V>(u, block);
+
+      for(int j = 0; j < 8; j++) {
+         t[j] ^= u[j];
+      }
+   }
+
+   PBKDF2_STORE(t, t)
+   #undef PBKDF2_LOAD
+   #undef PBKDF2_STORE
+}
+
+static void Iterate1_(Pbkdf2Lane_* lanes, unsigned int iterations) {
+   Iterate_<uint64_t, 1>(lanes, iterations);
+}
+
+#ifdef LAZYXMPP_PBKDF2_MULTIBUFFER
+typedef uint64_t Pbkdf2Vec4_ __attribute__((vector_size(32)));
+typedef uint64_t Pbkdf2Vec8_ __attribute__((vector_size(64)));
+
+__attribute__((target("avx2"))) static void Iterate4_(Pbkdf2Lane_* lanes, unsigned int iterations) {
+   Iterate_<Pbkdf2Vec4_, 4>(lanes, iterations);
+}
+
+__attribute__((target("avx512f"))) static void Iterate8_(Pbkdf2Lane_* lanes, unsigned int iterations) {
+   Iterate_<Pbkdf2Vec8_, 8>(lanes, iterations);
+}
+#endif
+
+typedef void (*Pbkdf2Kernel_)(Pbkdf2Lane_* lanes, unsigned int iterations);
+
+/**
+ * Picks the kernel with that many lanes, if the CPU can run it.
+ */
+static bool SelectKernel_(unsigned int lanes, Pbkdf2Kernel_& kernel, const char*& name) {
+#ifdef LAZYXMPP_PBKDF2_MULTIBUFFER
+   __builtin_cpu_init();
+   if(lanes == 8 && __builtin_cpu_supports("avx512f")) {
+      kernel = Iterate8_;
+      name = "AVX-512 x8";
+      return true;
+   }
+   if(lanes == 4 && __builtin_cpu_supports("avx2")) {
+      kernel = Iterate4_;
+      name = "AVX2 x4";
+      return true;
+   }
+#endif
+   if(lanes == 1) {
+      kernel = Iterate1_;
+      name = "scalar";
+      return true;
+   }
+   return false;
+}
+
+/**
+ * Picks the widest kernel the CPU can run. Worked out once.
+ */
+static unsigned int ChooseKernel_(Pbkdf2Kernel_& kernel, const char*& name) {
+   if(SelectKernel_(8, kernel, name)) {
+      return 8;
+   }
+   if(SelectKernel_(4, kernel, name)) {
+      return 4;
+   }
+   SelectKernel_(1, kernel, name);
+   return 1;
+}
+
+static Pbkdf2Kernel_ pbkdf2_kernel_ = NULL;
+static const char* pbkdf2_kernel_name_ = NULL;
+static unsigned int pbkdf2_lanes_ = ChooseKernel_(pbkdf2_kernel_, pbkdf2_kernel_name_);
+
+static bool IterationsLess_(const Pbkdf2Request* a, const Pbkdf2Request* b) {
+   return a->iterations < b->iterations;
+}
+
+/**
+ * Derives every request. They're grouped by iteration count and each group is run a kernel's worth of lanes at a time,
+ * short groups are padded out by repeating a lane.
+ */
+void Pbkdf2Sha512::DeriveBatch(vector<Pbkdf2Request>& requests) {
+   vector<Pbkdf2Request*> order;
+   order.reserve(requests.size());
+   for(size_t i = 0; i < requests.size(); i++) {
+      order.push_back(&requests[i]);
+   }
+   stable_sort(order.begin(), order.end(), IterationsLess_);
+
+   Pbkdf2Lane_ lanes[8];
+   size_t next = 0;
+   while(next < order.size()) {
+      unsigned int iterations = order[next]->iterations;
+      size_t count = 0;
+      while(count < pbkdf2_lanes_ && next + count < order.size() && order[next + count]->iterations == iterations) {
+         SetupLane_(*order[next + count], lanes[count]);
+         count++;
+      }
+
+      if(count == 1) {
+         Iterate1_(lanes, iterations); // Not worth a full width pass.
+      } else {
+         for(size_t l = count; l < pbkdf2_lanes_; l++) {
+            lanes[l] = lanes[0];
+         }
+         pbkdf2_kernel_(lanes, iterations);
+      }
+
+      for(size_t l = 0; l < count; l++) {
+         for(int j = 0; j < 8; j++) {
+            StoreBigEndian_(lanes[l].t[j], order[next + l]->key + j * 8);
+         }
+      }
+      next += count;
+   }
+}
+
+void Pbkdf2Sha512::Derive(const string& password, const string& salt, unsigned int iterations, unsigned char* key) {
+   vector<Pbkdf2Request> requests(1, Pbkdf2Request(password, salt, iterations));
+   DeriveBatch(requests);
+   memcpy(key, requests[0].key, KEY_SIZE);
+}
+
+unsigned int Pbkdf2Sha512::getLanes() {
+   return pbkdf2_lanes_;
+}
+
+bool Pbkdf2Sha512::setLanes(unsigned int lanes) {
+   if(!SelectKernel_(lanes, pbkdf2_kernel_, pbkdf2_kernel_name_)) {
+      return false;
+   }
+   pbkdf2_lanes_ = lanes;
+   return true;
+}
+
+const char* Pbkdf2Sha512::getKernelName() {
+   return pbkdf2_kernel_name_;
+}
@@ -0,0 +1,36 @@
+#ifndef LAZYXMPP_PBKDF2BATCH_HPP_
+#define LAZYXMPP_PBKDF2BATCH_HPP_
+
+#include <string>
+#include <vector>
+using namespace std;
+
+/**
+ * One PBKDF2-HMAC-SHA512 derivation in a batch. key is filled in by DeriveBatch.
+ */
+struct Pbkdf2Request {
+   Pbkdf2Request(const string& password_, const string& salt_, unsigned int iterations_) : password(password_), salt(salt_), iterations(iterations_) {}
+   string password;
+   string salt;
+   unsigned int iterations;
+   unsigned char key[64];
+};
+
+/**
+ * PBKDF2-HMAC-SHA512 with a 64 byte key (one PBKDF2 block), the same as Crypto++'s PKCS5_PBKDF2_HMAC<SHA512> with
+ * that key size. Independent derivations are run side by side, one per SIMD lane, so a batch of them costs about
+ * the same as a single one. AVX-512 does 8 at a time, AVX2 4, anything else falls back to one at a time.
+ */
+class Pbkdf2Sha512 {
+   public:
+      enum { KEY_SIZE = 64 };
+
+      static void DeriveBatch(vector<Pbkdf2Request>& requests);
+      static void Derive(const string& password, const string& salt, unsigned int iterations, unsigned char* key);
+
+      static unsigned int getLanes(); // Derivations per kernel pass on this CPU.
+      static bool setLanes(unsigned int lanes); // Forces the 1, 4 or 8 lane kernel, for tests. False if this CPU can't run it. Not while deriving.
+      static const char* getKernelName();
+};
+
+#endif /* LAZYXMPP_PBKDF2BATCH_HPP_ */
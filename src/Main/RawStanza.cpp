@@ -0,0 +1,565 @@
+#include "../Main/RawStanza.hpp"
+
+#include <ctype.h>
+#include <stdlib.h>
+
+static bool isNameChar_(char c) {
+   return !isspace((unsigned char)c) && c != '/' && c != '>' && c != '=' && c != '\0';
+}
+
+static bool isXmlNameStartChar_(unsigned char c) {
+   return isalpha(c) || c == '_' || c == ':' || c >= 0x80;
+}
+
+static bool isXmlNameChar_(unsigned char c) {
+   return isXmlNameStartChar_(c) || isdigit(c) || c == '-' || c == '.';
+}
+
+/**
+ * Scans a qualified name from begin. Returns where it ends, or begin if there isn't a valid one (at most one ':',
+ * not at either end).
+ */
+static size_t scanName_(const string& data, size_t begin, size_t end) {
+   if(begin >= end || !isXmlNameStartChar_(data[begin]) || data[begin] == ':') {
+      return begin;
+   }
+   int colons = 0;
+   size_t i = begin;
+   while(i < end && isXmlNameChar_(data[i])) {
+      colons += data[i] == ':';
+      i++;
+   }
+   if(colons > 1 || data[i - 1] == ':') {
+      return begin;
+   }
+   return i;
+}
+
+static bool isSpace_(char c) {
+   return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+/**
+ * Checks the reference between '&' and ';' is one of the predefined entities or a character reference to a
+ * character XML allows.
+ */
+bool RawStanza::isValidReference_(const string& data, size_t begin, size_t end) {
+   size_t length = end - begin;
+   if(length > 1 && data[begin] == '#') {
+      bool hex = data[begin + 1] == 'x';
+      size_t digits = begin + 1 + hex;
+      if(digits == end || end - digits > 8) {
+         return false;
+      }
+      unsigned long c = 0;
+      for(size_t i = digits; i < end; i++) {
+         unsigned char d = data[i];
+         if(hex ? !isxdigit(d) : !isdigit(d)) {
+            return false;
+         }
+         c = c * (hex ? 16 : 10) + (isdigit(d) ? d - '0' : (tolower(d) - 'a' + 10));
+      }
+      return c == 0x9 || c == 0xA || c == 0xD || (c >= 0x20 && c <= 0xD7FF) || (c >= 0xE000 && c <= 0xFFFD) || (c >= 0x10000 && c <= 0x10FFFF);
+   }
+   return (length == 2 && (data.compare(begin, 2, "lt") == 0 || data.compare(begin, 2, "gt") == 0)) ||
+         (length == 3 && data.compare(begin, 3, "amp") == 0) ||
+         (length == 4 && (data.compare(begin, 4, "apos") == 0 || data.compare(begin, 4, "quot") == 0));
+}
+
+bool RawStanza::isValidText(const string& data, size_t begin, size_t end) {
+   for(size_t i = begin; i < end; i++) {
+      unsigned char c = data[i];
+      if(c == '<' || (c < 0x20 && c != '\t' && c != '\n' && c != '\r')) {
+         return false;
+      }
+      if(c == '&') {
+         size_t semi = data.find(';', i);
+         if(semi >= end || !isValidReference_(data, i + 1, semi)) {
+            return false;
+         }
+         i = semi;
+      }
+   }
+   return true;
+}
+
+/**
+ * Reads the tag from the '<' at lt to the '>' at gt. Anything XML wouldn't accept in a tag is false, so what a
+ * caller splices into or passes on is known to be well formed.
+ */
+bool RawStanza::parseTag(const string& data, size_t lt, size_t gt, Tag& tag) {
+   size_t i = lt + 1;
+   tag.isClose = i < gt && data[i] == '/';
+   tag.isEmpty = false;
+   tag.attributes.clear();
+   if(tag.isClose) {
+      i++;
+   }
+   tag.name_begin = i;
+   tag.name_end = i = scanName_(data, i, gt);
+   if(tag.name_end == tag.name_begin) {
+      return false;
+   }
+
+   while(true) {
+      size_t space = i;
+      while(i < gt && isSpace_(data[i])) {
+         i++;
+      }
+      if(i == gt) {
+         return true;
+      }
+      if(tag.isClose) {
+         return false;
+      }
+      if(data[i] == '/') {
+         tag.isEmpty = true;
+         return i + 1 == gt;
+      }
+      if(i == space) {
+         return false; // Attributes are separated by whitespace.
+      }
+
+      Attribute attribute;
+      attribute.name_begin = i;
+      attribute.name_end = i = scanName_(data, i, gt);
+      if(attribute.name_end == attribute.name_begin) {
+         return false;
+      }
+      while(i < gt && isSpace_(data[i])) {
+         i++;
+      }
+      if(i == gt || data[i] != '=') {
+         return false;
+      }
+      i++;
+      while(i < gt && isSpace_(data[i])) {
+         i++;
+      }
+      if(i == gt || (data[i] != '"' && data[i] != '\'')) {
+         return false;
+      }
+      attribute.value_begin = i + 1;
+      attribute.value_end = data.find(data[i], attribute.value_begin);
+      if(attribute.value_end >= gt || !isValidText(data, attribute.value_begin, attribute.value_end)) {
+         return false;
+      }
+      i = attribute.value_end + 1;
+
+      size_t name_size = attribute.name_end - attribute.name_begin;
+      for(size_t a = 0; a < tag.attributes.size(); a++) {
+         if(tag.attributes[a].name_end - tag.attributes[a].name_begin == name_size && data.compare(attribute.name_begin, name_size, data, tag.attributes[a].name_begin, name_size) == 0) {
+            return false;
+         }
+      }
+      tag.attributes.push_back(attribute);
+   }
+}
+
+/**
+ * True if the name has no prefix, or it's prefix is xml or one of those declared.
+ */
+bool RawStanza::isDeclared_(const string& data, size_t name_begin, size_t name_end, const vector<pair<size_t, size_t> >& prefixes) {
+   size_t colon = data.find(':', name_begin);
+   if(colon >= name_end || (colon - name_begin == 3 && data.compare(name_begin, 3, "xml") == 0)) {
+      return true;
+   }
+   for(size_t p = 0; p < prefixes.size(); p++) {
+      if(prefixes[p].second - prefixes[p].first == colon - name_begin && data.compare(name_begin, colon - name_begin, data, prefixes[p].first, colon - name_begin) == 0) {
+         return true;
+      }
+   }
+   return false;
+}
+
+/**
+ * Tokenizes the whole stanza once. It has to be a single element, every tag has to parse and close in order, text
+ * and references have to be valid, CDATA is stepped over, comments and processing instructions aren't allowed
+ * (XMPP forbids them), and prefixes have to be declared in scope. Anything the raw paths pass on is checked with
+ * this first, a recipient's stream can't recover from bad XML.
+ */
+bool RawStanza::isWellFormed(const string& stanza) {
+   Tag tag;
+   vector<pair<size_t, size_t> > open; // Names of the open elements.
+   vector<pair<size_t, size_t> > prefixes; // Declared prefixes in scope.
+   vector<size_t> scopes; // prefixes.size() as each open element started.
+
+   if(stanza.empty() || stanza[0] != '<') {
+      return false;
+   }
+   size_t i = 0;
+   while(i == 0 || !open.empty()) {
+      size_t lt = stanza.find('<', i);
+      if(lt == string::npos || !isValidText(stanza, i, lt)) {
+         return false;
+      }
+      if(stanza.compare(lt, 9, "<![CDATA[") == 0 && !open.empty()) {
+         size_t end = stanza.find("]]>", lt + 9);
+         if(end == string::npos) {
+            return false;
+         }
+         i = end + 3;
+         continue;
+      }
+
+      size_t gt = findStartTagEnd_(stanza, lt + 1);
+      if(gt == string::npos || !parseTag(stanza, lt, gt, tag)) {
+         return false; // Comments and processing instructions fail here too, they don't start with a name.
+      }
+      i = gt + 1;
+
+      if(tag.isClose) {
+         size_t name_size = tag.name_end - tag.name_begin;
+         if(open.back().second - open.back().first != name_size || stanza.compare(tag.name_begin, name_size, stanza, open.back().first, name_size) != 0) {
+            return false;
+         }
+         open.pop_back();
+         prefixes.resize(scopes.back());
+         scopes.pop_back();
+         continue;
+      }
+
+      scopes.push_back(prefixes.size());
+      for(size_t a = 0; a < tag.attributes.size(); a++) {
+         const Attribute& attribute = tag.attributes[a];
+         if(stanza.compare(attribute.name_begin, 6, "xmlns:") == 0 && attribute.name_end - attribute.name_begin > 6) {
+            if(attribute.value_end == attribute.value_begin) {
+               return false; // A prefix can't be undeclared.
+            }
+            prefixes.push_back(make_pair(attribute.name_begin + 6, attribute.name_end));
+         }
+      }
+      if(!isDeclared_(stanza, tag.name_begin, tag.name_end, prefixes)) {
+         return false;
+      }
+      for(size_t a = 0; a < tag.attributes.size(); a++) {
+         const Attribute& attribute = tag.attributes[a];
+         if(stanza.compare(attribute.name_begin, 6, "xmlns:") != 0 && !isDeclared_(stanza, attribute.name_begin, attribute.name_end, prefixes)) {
+            return false;
+         }
+      }
+      if(tag.isEmpty) {
+         prefixes.resize(scopes.back());
+         scopes.pop_back();
+      } else {
+         open.push_back(make_pair(tag.name_begin, tag.name_end));
+      }
+   }
+   return i == stanza.size();
+}
+
+/**
+ * For the raw forwarding path, which reads 'to' and splices 'from' without a DOM. On top of being well formed, the
+ * start tag mustn't have a prefixed from or to (eg. x:from), another reader could take that as the real one.
+ * Duplicates are already caught by parseTag.
+ */
+bool RawStanza::isForwardable(const string& stanza) {
+   if(!isWellFormed(stanza)) {
+      return false;
+   }
+   Tag tag;
+   parseTag(stanza, 0, findStartTagEnd_(stanza), tag);
+   for(size_t a = 0; a < tag.attributes.size(); a++) {
+      size_t colon = stanza.find(':', tag.attributes[a].name_begin);
+      if(colon < tag.attributes[a].name_end) {
+         size_t local_size = tag.attributes[a].name_end - colon - 1;
+         if((local_size == 4 && stanza.compare(colon + 1, 4, "from") == 0) || (local_size == 2 && stanza.compare(colon + 1, 2, "to") == 0)) {
+            return false;
+         }
+      }
+   }
+   return true;
+}
+
+/**
+ * Finds the '>' that ends the tag starting at or after from, skipping any inside quoted values.
+ */
+size_t RawStanza::findStartTagEnd_(const string& stanza, size_t from) {
+   char quote = 0;
+   for(size_t i = from; i < stanza.size(); i++) {
+      char c = stanza[i];
+      if(quote) {
+         if(c == quote) {
+            quote = 0;
+         }
+      } else if(c == '"' || c == '\'') {
+         quote = c;
+      } else if(c == '>') {
+         return i;
+      }
+   }
+   return string::npos;
+}
+
+/**
+ * Returns the element name of the stanza, eg. 'message'.
+ */
+string RawStanza::getTagName(const string& stanza) {
+   size_t begin = stanza.find('<');
+   if(begin == string::npos) {
+      return "";
+   }
+   begin++;
+   size_t end = begin;
+   while(end < stanza.size() && isNameChar_(stanza[end])) {
+      end++;
+   }
+   return stanza.substr(begin, end - begin);
+}
+
+/**
+ * Locates an attribute on the start tag. begin is the whitespace before the name, the value is [value_begin, value_end).
+ */
+bool RawStanza::findAttribute_(const string& stanza, const string& name, size_t& begin, size_t& value_begin, size_t& value_end) {
+   size_t tag_end = findStartTagEnd_(stanza);
+   if(tag_end == string::npos) {
+      return false;
+   }
+
+   // Skip the element name.
+   size_t i = stanza.find('<');
+   while(i < tag_end && !isspace((unsigned char)stanza[i]) && stanza[i] != '/') {
+      i++;
+   }
+
+   while(i < tag_end) {
+      size_t space = i;
+      while(i < tag_end && isspace((unsigned char)stanza[i])) {
+         i++;
+      }
+      size_t name_begin = i;
+      while(i < tag_end && isNameChar_(stanza[i])) {
+         i++;
+      }
+      size_t name_end = i;
+      while(i < tag_end && isspace((unsigned char)stanza[i])) {
+         i++;
+      }
+      if(i >= tag_end || stanza[i] != '=') {
+         return false; // The '/' of an empty element, or garbage.
+      }
+      i++;
+      while(i < tag_end && isspace((unsigned char)stanza[i])) {
+         i++;
+      }
+      if(i >= tag_end || (stanza[i] != '"' && stanza[i] != '\'')) {
+         return false;
+      }
+      char quote = stanza[i];
+      size_t vbegin = i + 1;
+      size_t vend = stanza.find(quote, vbegin);
+      if(vend == string::npos || vend > tag_end) {
+         return false;
+      }
+      i = vend + 1;
+
+      if(name_end - name_begin == name.size() && stanza.compare(name_begin, name.size(), name) == 0) {
+         begin = space;
+         value_begin = vbegin;
+         value_end = vend;
+         return true;
+      }
+   }
+   return false;
+}
+
+/**
+ * Reads an attribute from the start tag, with entities decoded.
+ */
+bool RawStanza::getAttribute(const string& stanza, const string& name, string& value) {
+   size_t begin, value_begin, value_end;
+   if(!findAttribute_(stanza, name, begin, value_begin, value_end)) {
+      value.clear();
+      return false;
+   }
+   value = Unescape(stanza.substr(value_begin, value_end - value_begin));
+   return true;
+}
+
+/**
+ * Checks whether there is a <name> element anywhere in the stanza.
+ */
+bool RawStanza::hasChild(const string& stanza, const string& name) {
+   string open = "<" + name;
+   size_t tag_end = findStartTagEnd_(stanza);
+   if(tag_end == string::npos) {
+      return false;
+   }
+   for(size_t pos = stanza.find(open, tag_end); pos != string::npos; pos = stanza.find(open, pos + 1)) {
+      size_t after = pos + open.size();
+      if(after < stanza.size() && !isNameChar_(stanza[after])) {
+         return true;
+      }
+   }
+   return false;
+}
+
+/**
+ * Returns the stanza with name="value" on the start tag. Any existing attribute of that name is removed first.
+ * The rest of the stanza is copied through byte for byte.
+ */
+string RawStanza::setAttribute(const string& stanza, const string& name, const string& value) {
+   string rest = removeAttribute(stanza, name);
+   size_t name_end = rest.find('<') + 1 + getTagName(rest).size();
+
+   string result;
+   result.reserve(rest.size() + name.size() + value.size() + 4);
+   result.append(rest, 0, name_end);
+   result.append(" ");
+   result.append(name);
+   result.append("=\"");
+   result.append(Escape(value));
+   result.append("\"");
+   result.append(rest, name_end, string::npos);
+   return result;
+}
+
+/**
+ * Returns the stanza without the attribute on it's start tag. Every occurrence goes, so a repeated one can't be
+ * left behind for another reader to find.
+ */
+string RawStanza::removeAttribute(const string& stanza, const string& name) {
+   string result = stanza;
+   size_t begin, value_begin, value_end;
+   while(findAttribute_(result, name, begin, value_begin, value_end)) {
+      result.erase(begin, value_end + 1 - begin);
+   }
+   return result;
+}
+
+/**
+ * True if the tag starting at lt is <message, <presence or <iq.
+ */
+static bool isStanzaTag_(const string& data, size_t lt) {
+   size_t end = lt + 1;
+   while(end < data.size() && isNameChar_(data[end])) {
+      end++;
+   }
+   return RawStanza::isStanza(data.substr(lt + 1, end - lt - 1));
+}
+
+/**
+ * Splits serialized output into its top level elements and keeps the stanzas, skipping anything else (stream errors,
+ * nonzas). Comments, CDATA and processing instructions are stepped over. An element cut off at the end is left out.
+ */
+void RawStanza::findStanzas(const string& data, vector<pair<size_t, size_t> >& stanzas) {
+   int depth = 0;
+   size_t begin = 0;
+   size_t i = data.find('<');
+   while(i != string::npos && i + 1 < data.size()) {
+      size_t end;
+      if(data.compare(i, 4, "<!--") == 0) {
+         end = data.find("-->", i);
+      } else if(data.compare(i, 9, "<![CDATA[") == 0) {
+         end = data.find("]]>", i);
+      } else if(data[i + 1] == '?') {
+         end = data.find("?>", i);
+      } else {
+         // The '>' ending the tag, skipping any inside quoted values.
+         char quote = 0;
+         for(end = i + 1; end < data.size(); end++) {
+            if(quote) {
+               if(data[end] == quote) {
+                  quote = 0;
+               }
+            } else if(data[end] == '"' || data[end] == '\'') {
+               quote = data[end];
+            } else if(data[end] == '>') {
+               break;
+            }
+         }
+         if(end == data.size()) {
+            return;
+         }
+
+         if(data[i + 1] == '/') {
+            if(depth > 0 && --depth == 0 && isStanzaTag_(data, begin)) {
+               stanzas.push_back(make_pair(begin, end + 1));
+            }
+         } else if(data[end - 1] == '/') {
+            if(depth == 0 && isStanzaTag_(data, i)) {
+               stanzas.push_back(make_pair(i, end + 1));
+            }
+         } else if(depth++ == 0) {
+            begin = i;
+         }
+      }
+      if(end == string::npos) {
+         return;
+      }
+      i = data.find('<', end + 1);
+   }
+}
+
+/**
+ * Escapes a string for use as an attribute value.
+ */
+string RawStanza::Escape(const string& value) {
+   string result;
+   result.reserve(value.size());
+   for(size_t i = 0; i < value.size(); i++) {
+      switch(value[i]) {
+         case '&': result.append("&amp;"); break;
+         case '<': result.append("&lt;"); break;
+         case '>': result.append("&gt;"); break;
+         case '"': result.append("&quot;"); break;
+         case '\'': result.append("&apos;"); break;
+         default: result.push_back(value[i]);
+      }
+   }
+   return result;
+}
+
+/**
+ * Decodes the predefined XML entities and character references.
+ */
+string RawStanza::Unescape(const string& value) {
+   if(value.find('&') == string::npos) {
+      return value;
+   }
+
+   string result;
+   result.reserve(value.size());
+   for(size_t i = 0; i < value.size(); i++) {
+      size_t semi;
+      if(value[i] != '&' || (semi = value.find(';', i)) == string::npos) {
+         result.push_back(value[i]);
+         continue;
+      }
+
+      string entity = value.substr(i + 1, semi - i - 1);
+      if(entity == "amp") {
+         result.push_back('&');
+      } else if(entity == "lt") {
+         result.push_back('<');
+      } else if(entity == "gt") {
+         result.push_back('>');
+      } else if(entity == "quot") {
+         result.push_back('"');
+      } else if(entity == "apos") {
+         result.push_back('\'');
+      } else if(entity.size() > 1 && entity[0] == '#') {
+         unsigned long c = entity[1] == 'x' ? strtoul(entity.c_str() + 2, NULL, 16) : strtoul(entity.c_str() + 1, NULL, 10);
+         // Encode as UTF-8.
+         if(c < 0x80) {
+            result.push_back((char)c);
+         } else if(c < 0x800) {
+            result.push_back((char)(0xC0 | (c >> 6)));
+            result.push_back((char)(0x80 | (c & 0x3F)));
+         } else if(c < 0x10000) {
+            result.push_back((char)(0xE0 | (c >> 12)));
+            result.push_back((char)(0x80 | ((c >> 6) & 0x3F)));
+            result.push_back((char)(0x80 | (c & 0x3F)));
+         } else {
+            result.push_back((char)(0xF0 | (c >> 18)));
+            result.push_back((char)(0x80 | ((c >> 12) & 0x3F)));
+            result.push_back((char)(0x80 | ((c >> 6) & 0x3F)));
+            result.push_back((char)(0x80 | (c & 0x3F)));
+         }
+      } else {
+         result.append(value, i, semi - i + 1); // Unknown, leave it alone.
+      }
+      i = semi;
+   }
+   return result;
+}
@@ -0,0 +1,50 @@
+#ifndef LAZYXMPP_RAWSTANZA_HPP_
+#define LAZYXMPP_RAWSTANZA_HPP_
+
+#include <string>
+#include <vector>
+#include <utility>
+using namespace std;
+
+/**
+ * Helpers for reading and patching a serialized stanza without building a DOM.
+ * Only the start tag is ever looked at, the payload is passed through untouched.
+ */
+class RawStanza {
+   public:
+      struct Attribute {
+         size_t name_begin, name_end; // [begin, end) of the qualified name.
+         size_t value_begin, value_end; // Between the quotes, still escaped.
+      };
+      struct Tag { // One start, end or empty element tag, as offsets into the data it was read from.
+         bool isClose;
+         bool isEmpty;
+         size_t name_begin, name_end;
+         vector<Attribute> attributes;
+      };
+
+      static bool parseTag(const string& data, size_t lt, size_t gt, Tag& tag); // Checks the syntax of the tag in [lt, gt]: names, quoting, unique attributes, references.
+      static bool isValidText(const string& data, size_t begin, size_t end); // Character data in [begin, end): no '<', no control characters, only well formed references.
+      static bool isWellFormed(const string& stanza); // Exactly one element, balanced, every prefix declared.
+      static bool isForwardable(const string& stanza); // Well formed, and 'from' and 'to' can only be read one way.
+
+      static string getTagName(const string& stanza);
+      static bool getAttribute(const string& stanza, const string& name, string& value);
+      static bool hasChild(const string& stanza, const string& name); // Cheap check for a child element, doesn't look inside CDATA.
+      static string setAttribute(const string& stanza, const string& name, const string& value); // Replaces (or adds) an attribute on the start tag.
+      static string removeAttribute(const string& stanza, const string& name); // Every copy of it, if the start tag has more than one.
+      static string setFrom(const string& stanza, const string& from) { return setAttribute(stanza, "from", from); }
+      static void findStanzas(const string& data, vector<pair<size_t, size_t> >& stanzas); // [begin, end) of each top level <message>, <presence> and <iq> in data.
+      static bool isStanza(const string& tag_name) { return tag_name == "message" || tag_name == "presence" || tag_name == "iq"; }
+
+      static string Escape(const string& value);
+      static string Unescape(const string& value);
+
+   private:
+      static bool isValidReference_(const string& data, size_t begin, size_t end);
+      static size_t findStartTagEnd_(const string& stanza, size_t from = 0);
+      static bool isDeclared_(const string& data, size_t name_begin, size_t name_end, const vector<pair<size_t, size_t> >& prefixes);
+      static bool findAttribute_(const string& stanza, const string& name, size_t& begin, size_t& value_begin, size_t& value_end);
+};
+
+#endif /* LAZYXMPP_RAWSTANZA_HPP_ */
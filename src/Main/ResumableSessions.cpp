@@ -0,0 +1,26 @@
+#include "../Main/ResumableSessions.hpp"
+
+void ResumableSessions::Add(const string& id, const string& jid, const LazyXMPPConnectionPtr& connection) {
+   boost::mutex::scoped_lock lock(mutex_);
+   Entry& entry = sessions_[id];
+   entry.jid = jid;
+   entry.connection = connection;
+   entry.raw = connection.get();
+}
+
+LazyXMPPConnectionPtr ResumableSessions::Find(const string& id, const string& jid) {
+   boost::mutex::scoped_lock lock(mutex_);
+   Entries::const_iterator it = sessions_.find(id);
+   if(it == sessions_.end() || it->second.jid != jid) {
+      return LazyXMPPConnectionPtr();
+   }
+   return it->second.connection.lock();
+}
+
+void ResumableSessions::Remove(const string& id, const LazyXMPPConnection* connection) {
+   boost::mutex::scoped_lock lock(mutex_);
+   Entries::iterator it = sessions_.find(id);
+   if(it != sessions_.end() && it->second.raw == connection) {
+      sessions_.erase(it);
+   }
+}
@@ -0,0 +1,35 @@
+#ifndef LAZYXMPP_RESUMABLESESSIONS_HPP_
+#define LAZYXMPP_RESUMABLESESSIONS_HPP_
+
+#include <string>
+using namespace std;
+
+#include <boost/unordered_map.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/noncopyable.hpp>
+
+#include "../Main/LazyXMPPConnection.hpp"
+
+/**
+ * Streams that can be resumed (XEP-0198), by their id. An entry lasts as long as its connection, attached or waiting
+ * out its timeout after the link dropped, and moves to the new connection when it's resumed.
+ */
+class ResumableSessions: private boost::noncopyable {
+   public:
+      void Add(const string& id, const string& jid, const LazyXMPPConnectionPtr& connection); // Replaces the id's connection if it has one.
+      LazyXMPPConnectionPtr Find(const string& id, const string& jid); // NULL if the id is unknown, gone or not jid's (bare).
+      void Remove(const string& id, const LazyXMPPConnection* connection); // Only if the id is still connection's. Called from it's destructor.
+
+   private:
+      struct Entry {
+         string jid;
+         LazyXMPPConnectionWeakPtr connection;
+         const LazyXMPPConnection* raw; // To match on in the destructor, the weak pointer has expired by then.
+      };
+      typedef boost::unordered_map<string, Entry> Entries;
+
+      Entries sessions_;
+      boost::mutex mutex_;
+};
+
+#endif /* LAZYXMPP_RESUMABLESESSIONS_HPP_ */
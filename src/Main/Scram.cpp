@@ -0,0 +1,233 @@
+#include "../Main/Scram.hpp"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <crypto++/cryptlib.h>
+#include <crypto++/sha.h>
+#include <crypto++/hmac.h>
+#include <crypto++/pwdbased.h>
+#include <crypto++/misc.h>
+using namespace CryptoPP;
+
+static const string SCRAM_SHA1 = "SCRAM-SHA-1";
+static const string SCRAM_SHA256 = "SCRAM-SHA-256";
+static const char BASE64_CHARS[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+bool Scram::fromName(const string& name, Mechanism& mechanism) {
+   if(name.compare(SCRAM_SHA256) == 0) {
+      mechanism = SHA256;
+      return true;
+   } else if(name.compare(SCRAM_SHA1) == 0) {
+      mechanism = SHA1;
+      return true;
+   }
+   return false;
+}
+
+string Scram::getName(Mechanism mechanism) {
+   return mechanism == SHA256 ? SCRAM_SHA256 : SCRAM_SHA1;
+}
+
+size_t Scram::getDigestSize(Mechanism mechanism) {
+   return mechanism == SHA256 ? (size_t)CryptoPP::SHA256::DIGESTSIZE : (size_t)CryptoPP::SHA1::DIGESTSIZE;
+}
+
+/**
+ * Works out the StoredKey and ServerKey for a password. This is the slow part, done once at registration.
+ */
+void Scram::DeriveKeys(Mechanism mechanism, const string& password, const string& salt, unsigned int iterations, ScramCredentials& credentials) {
+   size_t size = getDigestSize(mechanism);
+   byte salted[CryptoPP::SHA256::DIGESTSIZE];
+
+   if(mechanism == SHA256) {
+      PKCS5_PBKDF2_HMAC<CryptoPP::SHA256> dk;
+      dk.DeriveKey(salted, size, (byte)0, (const byte*)password.data(), password.size(), (const byte*)salt.data(), salt.size(), iterations, 0);
+   } else {
+      PKCS5_PBKDF2_HMAC<CryptoPP::SHA1> dk;
+      dk.DeriveKey(salted, size, (byte)0, (const byte*)password.data(), password.size(), (const byte*)salt.data(), salt.size(), iterations, 0);
+   }
+
+   string salted_password((const char*)salted, size);
+   credentials.salt = salt;
+   credentials.iterations = iterations;
+   credentials.stored_key = Hash(mechanism, Hmac(mechanism, salted_password, "Client Key"));
+   credentials.server_key = Hmac(mechanism, salted_password, "Server Key");
+}
+
+string Scram::Hmac(Mechanism mechanism, const string& key, const string& data) {
+   byte digest[CryptoPP::SHA256::DIGESTSIZE];
+   if(mechanism == SHA256) {
+      HMAC<CryptoPP::SHA256> hmac((const byte*)key.data(), key.size());
+      hmac.CalculateDigest(digest, (const byte*)data.data(), data.size());
+   } else {
+      HMAC<CryptoPP::SHA1> hmac((const byte*)key.data(), key.size());
+      hmac.CalculateDigest(digest, (const byte*)data.data(), data.size());
+   }
+   return string((const char*)digest, getDigestSize(mechanism));
+}
+
+string Scram::Hash(Mechanism mechanism, const string& data) {
+   byte digest[CryptoPP::SHA256::DIGESTSIZE];
+   if(mechanism == SHA256) {
+      CryptoPP::SHA256().CalculateDigest(digest, (const byte*)data.data(), data.size());
+   } else {
+      CryptoPP::SHA1().CalculateDigest(digest, (const byte*)data.data(), data.size());
+   }
+   return string((const char*)digest, getDigestSize(mechanism));
+}
+
+string Scram::Base64Encode(const string& data) {
+   string result;
+   result.reserve((data.size() + 2) / 3 * 4);
+   for(size_t i = 0; i < data.size(); i += 3) {
+      unsigned int n = (unsigned char)data[i] << 16;
+      if(i + 1 < data.size()) n |= (unsigned char)data[i + 1] << 8;
+      if(i + 2 < data.size()) n |= (unsigned char)data[i + 2];
+      result.push_back(BASE64_CHARS[(n >> 18) & 63]);
+      result.push_back(BASE64_CHARS[(n >> 12) & 63]);
+      result.push_back(i + 1 < data.size() ? BASE64_CHARS[(n >> 6) & 63] : '=');
+      result.push_back(i + 2 < data.size() ? BASE64_CHARS[n & 63] : '=');
+   }
+   return result;
+}
+
+/**
+ * Decodes base64, ignoring whitespace. Returns false on anything else that isn't base64.
+ */
+bool Scram::Base64Decode(const string& data, string& result) {
+   result.clear();
+   unsigned int n = 0;
+   int bits = 0;
+   for(size_t i = 0; i < data.size(); i++) {
+      char c = data[i];
+      if(c == '=') {
+         break;
+      }
+      if(c == ' ' || c == '\t' || c == '\r' || c == '\n') {
+         continue;
+      }
+      const char* p = strchr(BASE64_CHARS, c);
+      if(!p || c == '\0') {
+         return false;
+      }
+      n = (n << 6) | (unsigned int)(p - BASE64_CHARS);
+      bits += 6;
+      if(bits >= 8) {
+         bits -= 8;
+         result.push_back((char)((n >> bits) & 0xFF));
+      }
+   }
+   return true;
+}
+
+/**
+ * Pulls "x=value" out of a comma seperated SCRAM message.
+ */
+static bool getScramAttribute_(const string& message, char name, string& value) {
+   size_t pos = 0;
+   while(pos < message.size()) {
+      size_t end = message.find(',', pos);
+      if(end == string::npos) {
+         end = message.size();
+      }
+      if(end - pos >= 2 && message[pos] == name && message[pos + 1] == '=') {
+         value = message.substr(pos + 2, end - pos - 2);
+         return true;
+      }
+      pos = end + 1;
+   }
+   return false;
+}
+
+/**
+ * Parses gs2-header and client-first-message-bare. Channel binding isn't supported, so 'p=' is refused.
+ */
+bool ScramSession::ClientFirst(const string& message, string& username) {
+   if(message.size() < 3 || (message[0] != 'n' && message[0] != 'y') || message[1] != ',') {
+      return false;
+   }
+   size_t bare = message.find(',', 2);
+   if(bare == string::npos) {
+      return false;
+   }
+   gs2_header_ = message.substr(0, bare + 1);
+   client_first_bare_ = message.substr(bare + 1);
+
+   string saslname;
+   if(!getScramAttribute_(client_first_bare_, 'n', saslname) || !getScramAttribute_(client_first_bare_, 'r', nonce_) || nonce_.empty()) {
+      return false;
+   }
+
+   // Undo the saslname escaping, "=2C" is ',' and "=3D" is '='.
+   username_.clear();
+   for(size_t i = 0; i < saslname.size(); i++) {
+      if(saslname[i] != '=') {
+         username_.push_back(saslname[i]);
+      } else if(saslname.compare(i, 3, "=2C") == 0) {
+         username_.push_back(',');
+         i += 2;
+      } else if(saslname.compare(i, 3, "=3D") == 0) {
+         username_.push_back('=');
+         i += 2;
+      } else {
+         return false;
+      }
+   }
+   username = username_;
+   return !username_.empty();
+}
+
+/**
+ * Builds the server-first-message, extending the client's nonce with our own.
+ */
+string ScramSession::ServerFirst(const ScramCredentials& credentials, const string& server_nonce) {
+   credentials_ = credentials;
+   nonce_.append(server_nonce);
+
+   char iterations[16];
+   snprintf(iterations, sizeof(iterations), "%u", credentials.iterations);
+   server_first_ = "r=" + nonce_ + ",s=" + Scram::Base64Encode(credentials.salt) + ",i=" + iterations;
+   return server_first_;
+}
+
+/**
+ * Checks the client proof: H(ClientProof XOR HMAC(StoredKey, AuthMessage)) must equal StoredKey.
+ * On success server_final holds the server signature for the client to check.
+ */
+bool ScramSession::ClientFinal(const string& message, string& server_final) {
+   size_t proof_pos = message.rfind(",p=");
+   if(proof_pos == string::npos) {
+      return false;
+   }
+   string without_proof = message.substr(0, proof_pos);
+
+   string channel_binding, nonce, proof_b64, proof;
+   if(!getScramAttribute_(without_proof, 'c', channel_binding) || !getScramAttribute_(without_proof, 'r', nonce)) {
+      return false;
+   }
+   proof_b64 = message.substr(proof_pos + 3);
+   if(channel_binding != Scram::Base64Encode(gs2_header_) || nonce != nonce_ || !Scram::Base64Decode(proof_b64, proof)) {
+      return false;
+   }
+
+   size_t size = Scram::getDigestSize(mechanism_);
+   if(proof.size() != size || credentials_.stored_key.size() != size) {
+      return false;
+   }
+
+   string auth_message = client_first_bare_ + "," + server_first_ + "," + without_proof;
+   string client_signature = Scram::Hmac(mechanism_, credentials_.stored_key, auth_message);
+   string client_key(size, '\0');
+   for(size_t i = 0; i < size; i++) {
+      client_key[i] = proof[i] ^ client_signature[i];
+   }
+   string check = Scram::Hash(mechanism_, client_key);
+   if(!VerifyBufsEqual((const byte*)check.data(), (const byte*)credentials_.stored_key.data(), size)) {
+      return false;
+   }
+
+   server_final = "v=" + Scram::Base64Encode(Scram::Hmac(mechanism_, credentials_.server_key, auth_message));
+   return true;
+}
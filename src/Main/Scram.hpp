@@ -0,0 +1,62 @@
+#ifndef LAZYXMPP_SCRAM_HPP_
+#define LAZYXMPP_SCRAM_HPP_
+
+#include <string>
+using namespace std;
+
+/**
+ * Stored SCRAM credentials for one user and hash (RFC 5802). The server never needs the password itself.
+ */
+struct ScramCredentials {
+   string salt;
+   unsigned int iterations;
+   string stored_key; // H(HMAC(SaltedPassword, "Client Key"))
+   string server_key; // HMAC(SaltedPassword, "Server Key")
+};
+
+/**
+ * SCRAM primitives for the supported hashes.
+ */
+class Scram {
+   public:
+      enum Mechanism { SHA1, SHA256 };
+
+      static bool fromName(const string& name, Mechanism& mechanism); // "SCRAM-SHA-1" etc.
+      static string getName(Mechanism mechanism);
+      static size_t getDigestSize(Mechanism mechanism);
+
+      static void DeriveKeys(Mechanism mechanism, const string& password, const string& salt, unsigned int iterations, ScramCredentials& credentials);
+      static string Hmac(Mechanism mechanism, const string& key, const string& data);
+      static string Hash(Mechanism mechanism, const string& data);
+
+      static string Base64Encode(const string& data);
+      static bool Base64Decode(const string& data, string& result);
+};
+
+/**
+ * Server side of one SCRAM exchange.
+ *   client-first -> ClientFirst() -> server-first (challenge)
+ *   client-final -> ClientFinal() -> server-final (success data)
+ */
+class ScramSession {
+   public:
+      ScramSession(Scram::Mechanism mechanism) : mechanism_(mechanism) {}
+
+      bool ClientFirst(const string& message, string& username); // Parses the client-first-message, false if malformed.
+      string ServerFirst(const ScramCredentials& credentials, const string& server_nonce);
+      bool ClientFinal(const string& message, string& server_final); // Checks the proof, false if wrong.
+
+      Scram::Mechanism getMechanism() const { return mechanism_; }
+      const string& getUsername() const { return username_; }
+
+   private:
+      Scram::Mechanism mechanism_;
+      string gs2_header_;
+      string client_first_bare_;
+      string server_first_;
+      string nonce_;
+      string username_;
+      ScramCredentials credentials_;
+};
+
+#endif /* LAZYXMPP_SCRAM_HPP_ */
@@ -0,0 +1,246 @@
+#include "../Main/SqliteUserStore.hpp"
+#include "../Debug/console.h"
+
+static const string CREATEDB_S = "CREATE TABLE users (username, hash, salt, scram_salt, scram_iterations, sha1_stored_key, sha1_server_key, sha256_stored_key, sha256_server_key, PRIMARY KEY(username), UNIQUE(username));";
+static const string REGISTER_S = "INSERT INTO users (username, hash, salt, scram_salt, scram_iterations, sha1_stored_key, sha1_server_key, sha256_stored_key, sha256_server_key) VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?);";
+static const string LOOKUP_S = "SELECT hash, salt, scram_salt, scram_iterations, sha1_stored_key, sha1_server_key, sha256_stored_key, sha256_server_key FROM users WHERE username = ?;";
+static const string SCAN_S = "SELECT username, hash, salt, scram_salt, scram_iterations, sha1_stored_key, sha1_server_key, sha256_stored_key, sha256_server_key FROM users;";
+static const string SCRAM_UPDATE_S = "UPDATE users SET scram_salt = ?, scram_iterations = ?, sha1_stored_key = ?, sha1_server_key = ?, sha256_stored_key = ?, sha256_server_key = ? WHERE username = ?;";
+
+// Set on every connection. WAL lets readers carry on while a write is going, NORMAL sync is safe with WAL (a power
+// cut can lose the last commits but not corrupt anything), and the users table is small enough to map and cache.
+static const char* CONNECTION_PRAGMAS = "PRAGMA synchronous=NORMAL; PRAGMA cache_size=-8192; PRAGMA mmap_size=268435456; PRAGMA temp_store=MEMORY;";
+static const int BUSY_TIMEOUT_MS = 5000; // Writers wait for each other rather than fail.
+
+/**
+ * Opens a connection with the pragmas set, NULL on failure.
+ */
+static sqlite3* OpenDB_(const string& database) {
+   sqlite3* db = NULL;
+   // NOMUTEX, a connection belongs to one thread so SQLite's own per-connection locking is wasted.
+   if(sqlite3_open_v2(database.c_str(), &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_NOMUTEX, NULL) != SQLITE_OK) {
+      ERROR("Could not open database '%s': %s", database.c_str(), db ? sqlite3_errmsg(db) : "out of memory");
+      sqlite3_close(db);
+      return NULL;
+   }
+   sqlite3_busy_timeout(db, BUSY_TIMEOUT_MS);
+   sqlite3_exec(db, CONNECTION_PRAGMAS, NULL, NULL, NULL);
+   return db;
+}
+
+SqliteUserStore::SqliteUserStore(const string& database) : database_(database), open_(false) {
+   LOG("Opening user database '%s'. SQLite version %s.", database_.c_str(), sqlite3_libversion());
+
+   // Connections are never shared between threads, but SQLite still has to be built to allow more than one thread.
+   if(!sqlite3_threadsafe()) {
+      ERROR("DANGER! DANGER! DANGER! SQLite was *NOT* compiled with SQLITE_THREADSAFE, this could result in db corruption.");
+   }
+
+   // Open this thread's connection now so a broken database shows up at startup.
+   open_ = createSchema_() && getConnection_();
+}
+
+SqliteUserStore::~SqliteUserStore() {
+   // Other threads' connections are closed as those threads exit, this only closes the current thread's.
+   connection_.reset();
+}
+
+/**
+ * Creates or upgrades the users table and switches the database to WAL. Both stick, so it's only done once.
+ */
+bool SqliteUserStore::createSchema_() {
+   sqlite3* db = OpenDB_(database_);
+   if(!db) {
+      return false;
+   }
+
+   char* mode = NULL;
+   char** table = NULL;
+   int rows, columns;
+   if(sqlite3_get_table(db, "PRAGMA journal_mode=WAL;", &table, &rows, &columns, &mode) == SQLITE_OK && rows == 1) {
+      LOG("User database journal mode is '%s'.", table[1]);
+   }
+   sqlite3_free_table(table);
+   sqlite3_free(mode);
+
+   sqlite3_exec(db, CREATEDB_S.c_str(), NULL, NULL, NULL);
+
+   // Databases from before SCRAM support are missing the key columns. Adding one that's already there just fails.
+   static const char* scram_columns[] = { "scram_salt", "scram_iterations", "sha1_stored_key", "sha1_server_key", "sha256_stored_key", "sha256_server_key" };
+   for(unsigned int i = 0; i < sizeof(scram_columns)/sizeof(scram_columns[0]); i++) {
+      string alter_s = string("ALTER TABLE users ADD COLUMN ") + scram_columns[i] + ";";
+      sqlite3_exec(db, alter_s.c_str(), NULL, NULL, NULL);
+   }
+
+   sqlite3_close(db);
+   return true;
+}
+
+UserDBConnection* SqliteUserStore::getConnection_() {
+   UserDBConnection* connection = connection_.get();
+   if(connection) {
+      return connection;
+   }
+
+   connection = new UserDBConnection(database_);
+   if(!connection->isOpen()) {
+      delete connection;
+      return NULL;
+   }
+   connection_.reset(connection);
+   return connection;
+}
+
+UserDBConnection::UserDBConnection(const string& database) : register_stmt(NULL), lookup_stmt(NULL), scram_update_stmt(NULL) {
+   db = OpenDB_(database);
+   if(!db) {
+      return;
+   }
+
+   if(sqlite3_prepare_v2(db, REGISTER_S.c_str(), REGISTER_S.size()+1, &register_stmt, NULL) != SQLITE_OK ||
+      sqlite3_prepare_v2(db, LOOKUP_S.c_str(), LOOKUP_S.size()+1, &lookup_stmt, NULL) != SQLITE_OK ||
+      sqlite3_prepare_v2(db, SCRAM_UPDATE_S.c_str(), SCRAM_UPDATE_S.size()+1, &scram_update_stmt, NULL) != SQLITE_OK) {
+      ERROR("Failed to create sqlite statements: %s", sqlite3_errmsg(db));
+      close();
+   }
+}
+
+UserDBConnection::~UserDBConnection() {
+   close();
+}
+
+void UserDBConnection::close() {
+   sqlite3_finalize(register_stmt);
+   sqlite3_finalize(lookup_stmt);
+   sqlite3_finalize(scram_update_stmt);
+   register_stmt = lookup_stmt = scram_update_stmt = NULL;
+   sqlite3_close(db);
+   db = NULL;
+}
+
+bool SqliteUserStore::Lookup(const string& username, UserRecord& record) {
+   UserDBConnection* connection = getConnection_();
+   if(!connection) {
+      return false;
+   }
+   sqlite3_stmt* lookup_stmt = connection->lookup_stmt;
+   bool result = false;
+   sqlite3_bind_text(lookup_stmt, 1, username.c_str(), username.size(), SQLITE_TRANSIENT);
+
+   if(sqlite3_step(lookup_stmt) == SQLITE_ROW) {
+      readRecord_(lookup_stmt, 0, record);
+      result = true;
+   }
+
+   sqlite3_reset(lookup_stmt);
+   sqlite3_clear_bindings(lookup_stmt);
+   return result;
+}
+
+void SqliteUserStore::Scan(const Visitor& visit) {
+   UserDBConnection* connection = getConnection_();
+   if(!connection) {
+      return;
+   }
+   sqlite3_stmt* scan_stmt = NULL;
+   if(sqlite3_prepare_v2(connection->db, SCAN_S.c_str(), SCAN_S.size()+1, &scan_stmt, NULL) != SQLITE_OK) {
+      ERROR("Failed to read the users table: %s", sqlite3_errmsg(connection->db));
+      return;
+   }
+
+   while(sqlite3_step(scan_stmt) == SQLITE_ROW) {
+      string username((const char*)sqlite3_column_text(scan_stmt, 0), sqlite3_column_bytes(scan_stmt, 0));
+      UserRecord record;
+      readRecord_(scan_stmt, 1, record);
+      visit(username, record);
+   }
+   sqlite3_finalize(scan_stmt);
+}
+
+/**
+ * Reads hash, salt, then the SCRAM columns, starting from first_column.
+ */
+void SqliteUserStore::readRecord_(sqlite3_stmt* stmt, int first_column, UserRecord& record) {
+   string* blobs[] = { &record.hash, &record.salt, &record.scram_salt, NULL, &record.sha1_stored_key, &record.sha1_server_key, &record.sha256_stored_key, &record.sha256_server_key };
+   for(int i = 0; i < (int)(sizeof(blobs)/sizeof(blobs[0])); i++) {
+      if(blobs[i]) {
+         // Raw bytes, they can contain nulls. Accounts from before SCRAM support have NULLs here, which come out empty.
+         blobs[i]->assign((const char*)sqlite3_column_blob(stmt, first_column + i), sqlite3_column_bytes(stmt, first_column + i));
+      }
+   }
+   record.scram_iterations = sqlite3_column_int(stmt, first_column + 3);
+}
+
+bool SqliteUserStore::Begin() {
+   UserDBConnection* connection = getConnection_();
+   return connection && sqlite3_exec(connection->db, "BEGIN IMMEDIATE;", NULL, NULL, NULL) == SQLITE_OK;
+}
+
+bool SqliteUserStore::Commit() {
+   UserDBConnection* connection = getConnection_();
+   if(sqlite3_exec(connection->db, "COMMIT;", NULL, NULL, NULL) != SQLITE_OK) {
+      ERROR("User database commit failed: %s", sqlite3_errmsg(connection->db));
+      sqlite3_exec(connection->db, "ROLLBACK;", NULL, NULL, NULL);
+      return false;
+   }
+   return true;
+}
+
+void SqliteUserStore::Rollback() {
+   sqlite3_exec(getConnection_()->db, "ROLLBACK;", NULL, NULL, NULL);
+}
+
+bool SqliteUserStore::Insert(const string& username, const UserRecord& record) {
+   sqlite3_stmt* register_stmt = getConnection_()->register_stmt;
+
+   // Bind the SQL paramaters
+   sqlite3_bind_text(register_stmt, 1, username.c_str(), username.size(), SQLITE_TRANSIENT);
+   sqlite3_bind_text(register_stmt, 2, record.hash.data(), record.hash.size(), SQLITE_TRANSIENT);
+   sqlite3_bind_text(register_stmt, 3, record.salt.data(), record.salt.size(), SQLITE_TRANSIENT);
+   bindBlob_(register_stmt, 4, record.scram_salt);
+   sqlite3_bind_int(register_stmt, 5, record.scram_iterations);
+   bindBlob_(register_stmt, 6, record.sha1_stored_key);
+   bindBlob_(register_stmt, 7, record.sha1_server_key);
+   bindBlob_(register_stmt, 8, record.sha256_stored_key);
+   bindBlob_(register_stmt, 9, record.sha256_server_key);
+
+   // Perform the SQL register query
+   bool result = true;
+   int status = sqlite3_step(register_stmt);
+   if(status == SQLITE_CONSTRAINT) {
+      DEBUG_M("User '%s' is already registered.", username.c_str());
+      result = false;
+   } else if(status != SQLITE_DONE) {
+      ERROR("Failed to register new user '%s'.", username.c_str());
+      result = false;
+   }
+
+   sqlite3_reset(register_stmt);
+   sqlite3_clear_bindings(register_stmt);
+   return result;
+}
+
+bool SqliteUserStore::SetScramKeys(const string& username, const ScramCredentials& sha1, const ScramCredentials& sha256) {
+   sqlite3_stmt* scram_update_stmt = getConnection_()->scram_update_stmt;
+   bindBlob_(scram_update_stmt, 1, sha256.salt);
+   sqlite3_bind_int(scram_update_stmt, 2, sha256.iterations);
+   bindBlob_(scram_update_stmt, 3, sha1.stored_key);
+   bindBlob_(scram_update_stmt, 4, sha1.server_key);
+   bindBlob_(scram_update_stmt, 5, sha256.stored_key);
+   bindBlob_(scram_update_stmt, 6, sha256.server_key);
+   sqlite3_bind_text(scram_update_stmt, 7, username.c_str(), username.size(), SQLITE_TRANSIENT);
+
+   bool result = true;
+   if(sqlite3_step(scram_update_stmt) != SQLITE_DONE) {
+      ERROR("Failed to store SCRAM keys for user '%s'.", username.c_str());
+      result = false;
+   }
+
+   sqlite3_reset(scram_update_stmt);
+   sqlite3_clear_bindings(scram_update_stmt);
+   return result;
+}
+
+void SqliteUserStore::bindBlob_(sqlite3_stmt* stmt, int index, const string& data) {
+   sqlite3_bind_blob(stmt, index, data.data(), data.size(), SQLITE_TRANSIENT);
+}
@@ -0,0 +1,62 @@
+#ifndef LAZYXMPP_SQLITEUSERSTORE_HPP_
+#define LAZYXMPP_SQLITEUSERSTORE_HPP_
+
+#include <string>
+using namespace std;
+
+#include <sqlite3.h>
+
+#include <boost/thread/tss.hpp>
+
+#include "../Main/UserStore.hpp"
+
+/**
+ * One thread's SQLite connection and prepared statements. Only ever used by the thread that opened it.
+ */
+struct UserDBConnection {
+   UserDBConnection(const string& database);
+   ~UserDBConnection();
+
+   bool isOpen() const { return db != NULL; }
+   void close();
+
+   sqlite3* db;
+   sqlite3_stmt* register_stmt;
+   sqlite3_stmt* lookup_stmt;
+   sqlite3_stmt* scram_update_stmt;
+};
+
+/**
+ * Users in an SQLite table. Each thread gets its own connection, in WAL mode readers don't block each other or the
+ * writer.
+ */
+class SqliteUserStore: public UserStore {
+   public:
+      SqliteUserStore(const string& database);
+      ~SqliteUserStore();
+
+      bool isOpen() const { return open_; }
+
+      bool Lookup(const string& username, UserRecord& record);
+      void Scan(const Visitor& visit);
+
+      bool Begin();
+      bool Insert(const string& username, const UserRecord& record);
+      bool SetScramKeys(const string& username, const ScramCredentials& sha1, const ScramCredentials& sha256);
+      bool Commit();
+      void Rollback();
+
+      const char* getName() const { return "sqlite"; }
+
+   private:
+      bool createSchema_();
+      UserDBConnection* getConnection_(); // This thread's connection, opened on first use. NULL if it can't be.
+      static void readRecord_(sqlite3_stmt* stmt, int first_column, UserRecord& record);
+      static void bindBlob_(sqlite3_stmt* stmt, int index, const string& data);
+
+      string database_;
+      bool open_;
+      boost::thread_specific_ptr<UserDBConnection> connection_;
+};
+
+#endif /* LAZYXMPP_SQLITEUSERSTORE_HPP_ */
@@ -0,0 +1,218 @@
+#include "../Main/StanzaFramer.hpp"
+
+#include <string.h>
+#include <ctype.h>
+
+static const string STREAM_TAG = "stream:stream";
+
+StanzaFramer::StanzaFramer(size_t max_stanza_size) : max_stanza_size_(max_stanza_size) {
+   Reset();
+}
+
+/**
+ * Forget everything, including buffered data.
+ */
+void StanzaFramer::Reset() {
+   buffer_.clear();
+   consumed_ = 0;
+   pos_ = 0;
+   start_ = 0;
+   depth_ = 0;
+   open_.clear();
+}
+
+/**
+ * For when the bytes after the last element need decoding first (they're compressed), the caller feeds them back in.
+ */
+void StanzaFramer::TakeBuffered(string& rest) {
+   rest.assign(buffer_, consumed_, string::npos);
+   Reset();
+}
+
+/**
+ * Appends newly read data. Drops anything already handed out first so the buffer doesn't grow forever.
+ */
+void StanzaFramer::Feed(const char* data, size_t size) {
+   if(consumed_ > 0) {
+      buffer_.erase(0, consumed_);
+      pos_ -= consumed_;
+      start_ = start_ > consumed_ ? start_ - consumed_ : 0;
+      consumed_ = 0;
+   }
+   buffer_.append(data, size);
+}
+
+/**
+ * Finds the '>' closing the tag that starts at from, skipping any inside quoted attribute values.
+ */
+size_t StanzaFramer::findTagEnd_(size_t from) const {
+   char quote = 0;
+   for(size_t i = from; i < buffer_.size(); i++) {
+      char c = buffer_[i];
+      if(quote) {
+         if(c == quote) {
+            quote = 0;
+         }
+      } else if(c == '"' || c == '\'') {
+         quote = c;
+      } else if(c == '>') {
+         return i;
+      }
+   }
+   return string::npos;
+}
+
+/**
+ * Checks if the tag between lt and gt is a <stream:stream> or </stream:stream>.
+ */
+bool StanzaFramer::isStreamTag_(const string& buffer, size_t lt, size_t gt) {
+   size_t name = lt + 1;
+   if(buffer[name] == '/') {
+      name++;
+   }
+   if(gt - name < STREAM_TAG.size() || buffer.compare(name, STREAM_TAG.size(), STREAM_TAG) != 0) {
+      return false;
+   }
+   char after = buffer[name + STREAM_TAG.size()];
+   return after == '>' || after == '/' || isspace((unsigned char)after);
+}
+
+/**
+ * Checks the text in a stanza from pos_ up to end.
+ */
+bool StanzaFramer::CheckText_(size_t end) {
+   return depth_ < 2 || RawStanza::isValidText(buffer_, pos_, end);
+}
+
+/**
+ * Hands out buffer_[from, end) and marks everything up to end as used.
+ */
+void StanzaFramer::Consume_(size_t end, string& element, size_t from) {
+   element.assign(buffer_, from, end - from);
+   consumed_ = end;
+   pos_ = end;
+   start_ = end;
+}
+
+/**
+ * Scans forward for the next complete top level element.
+ */
+StanzaFramer::Event StanzaFramer::Next(string& element) {
+   while(true) {
+      size_t lt = buffer_.find('<', pos_);
+      if(lt == string::npos) {
+         if(depth_ < 2) {
+            // Whitespace keepalives and other text between stanzas, nothing to keep.
+            consumed_ = pos_ = start_ = buffer_.size();
+         } else {
+            // Text so far is checked now, except a reference that hasn't been finished yet.
+            size_t end = buffer_.size();
+            size_t amp = buffer_.rfind('&');
+            if(amp != string::npos && amp >= pos_ && buffer_.find(';', amp) == string::npos) {
+               end = amp;
+            }
+            if(!CheckText_(end)) {
+               return NOT_WELL_FORMED;
+            }
+            pos_ = end;
+         }
+         break;
+      }
+
+      if(!CheckText_(lt)) {
+         return NOT_WELL_FORMED;
+      }
+      pos_ = lt;
+
+      // Comments, CDATA and processing instructions have their own terminators.
+      if(buffer_.size() - lt < 2 || (buffer_.size() - lt < 9 && buffer_[lt + 1] == '!')) {
+         break; // Not enough to tell what kind of markup this is yet.
+      }
+      if(buffer_.compare(lt, 4, "<!--") == 0 || buffer_.compare(lt, 9, "<![CDATA[") == 0 || buffer_.compare(lt, 2, "<?") == 0) {
+         const char* terminator = buffer_[lt + 1] == '?' ? "?>" : (buffer_[lt + 2] == '-' ? "-->" : "]]>");
+         size_t end = buffer_.find(terminator, lt + 2);
+         if(end == string::npos) {
+            break;
+         }
+         pos_ = end + strlen(terminator);
+         if(depth_ < 2) {
+            // The <?xml?> declaration, or junk between stanzas.
+            consumed_ = start_ = pos_;
+         }
+         continue;
+      } else if(buffer_[lt + 1] == '!') {
+         return NOT_WELL_FORMED; // DTDs aren't allowed in XMPP.
+      }
+
+      size_t gt = findTagEnd_(lt + 1);
+      if(gt == string::npos) {
+         break;
+      }
+
+      if(!RawStanza::parseTag(buffer_, lt, gt, tag_)) {
+         return NOT_WELL_FORMED;
+      }
+      bool isClose = tag_.isClose;
+      bool isEmpty = tag_.isEmpty;
+
+      if(depth_ == 0) {
+         if(isClose || isEmpty || !isStreamTag_(buffer_, lt, gt)) {
+            return NOT_WELL_FORMED;
+         }
+         depth_ = 1;
+         Consume_(gt + 1, element, lt);
+         return STREAM_OPEN;
+      }
+
+      if(depth_ == 1) {
+         if(isClose) {
+            if(!isStreamTag_(buffer_, lt, gt)) {
+               return NOT_WELL_FORMED;
+            }
+            depth_ = 0;
+            Consume_(gt + 1, element, lt);
+            return STREAM_CLOSE;
+         }
+         if(isStreamTag_(buffer_, lt, gt)) {
+            // A stream restart (after SASL etc).
+            Consume_(gt + 1, element, lt);
+            return STREAM_OPEN;
+         }
+         if(isEmpty) {
+            Consume_(gt + 1, element, lt);
+            return STANZA;
+         }
+         start_ = lt;
+         depth_ = 2;
+         open_.assign(1, string(buffer_, tag_.name_begin, tag_.name_end - tag_.name_begin));
+         pos_ = gt + 1;
+         continue;
+      }
+
+      // Inside a stanza.
+      size_t name_size = tag_.name_end - tag_.name_begin;
+      if(isClose) {
+         if(open_.back().size() != name_size || buffer_.compare(tag_.name_begin, name_size, open_.back()) != 0) {
+            return NOT_WELL_FORMED;
+         }
+         open_.pop_back();
+      } else if(!isEmpty) {
+         open_.push_back(string(buffer_, tag_.name_begin, name_size));
+      }
+      pos_ = gt + 1;
+      if(isClose) {
+         depth_--;
+         if(depth_ == 1) {
+            Consume_(gt + 1, element, start_);
+            return STANZA;
+         }
+      } else if(!isEmpty) {
+         depth_++;
+      }
+   }
+
+   if(buffer_.size() - consumed_ > max_stanza_size_) {
+      return TOO_BIG;
+   }
+   return NEED_MORE;
+}
@@ -0,0 +1,51 @@
+#ifndef LAZYXMPP_STANZAFRAMER_HPP_
+#define LAZYXMPP_STANZAFRAMER_HPP_
+
+#include <string>
+#include <vector>
+using namespace std;
+
+#include "../Main/RawStanza.hpp"
+
+/**
+ * Splits a raw XMPP byte stream into complete top level elements.
+ * Data is fed in as it arrives from the socket, partial elements are carried over until the rest turns up.
+ * Tags, text and references are checked as they're framed and close tags must match, so a STANZA is well formed.
+ */
+class StanzaFramer {
+   public:
+      enum Event {
+         NEED_MORE, // No complete element buffered.
+         STREAM_OPEN, // A <stream:stream> open tag (also sent on a stream restart).
+         STANZA, // A complete first level child of the stream.
+         STREAM_CLOSE, // The </stream:stream> close tag.
+         TOO_BIG, // An element grew past the maximum stanza size.
+         NOT_WELL_FORMED // Something that can't be an XMPP stream.
+      };
+
+      StanzaFramer(size_t max_stanza_size = 65536);
+
+      void Feed(const char* data, size_t size); // Append data read from the socket.
+      Event Next(string& element); // Pull out the next complete element, if there is one.
+      void Reset(); // Forget all state, the next thing expected is a new stream.
+      void TakeBuffered(string& rest); // Hands back whatever hasn't been framed yet and resets.
+
+      size_t getBufferedSize() const { return buffer_.size() - consumed_; }
+
+   private:
+      size_t findTagEnd_(size_t from) const;
+      static bool isStreamTag_(const string& buffer, size_t lt, size_t gt);
+      bool CheckText_(size_t end);
+      void Consume_(size_t end, string& element, size_t from);
+
+      string buffer_;
+      size_t consumed_; // Everything before this has been handed out.
+      size_t pos_; // Where scanning carries on from.
+      size_t start_; // Start of the element being built.
+      int depth_; // 0 outside the stream, 1 inside <stream:stream>, 2+ inside a stanza.
+      vector<string> open_; // Names of the elements open inside the stanza, the stanza's own first.
+      RawStanza::Tag tag_; // Reused for every tag.
+      size_t max_stanza_size_;
+};
+
+#endif /* LAZYXMPP_STANZAFRAMER_HPP_ */
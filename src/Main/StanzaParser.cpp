@@ -0,0 +1,79 @@
+#include "../Main/StanzaParser.hpp"
+
+#include "../Debug/console.h"
+
+boost::thread_specific_ptr<StanzaParser> StanzaParser::instance_(&StanzaParser::Release_);
+
+/**
+ * Returns the calling thread's parser, creating it the first time.
+ */
+StanzaParser& StanzaParser::get() {
+   StanzaParser* parser = instance_.get();
+   if(!parser) {
+      parser = new StanzaParser();
+      instance_.reset(parser);
+   }
+   return *parser;
+}
+
+/**
+ * Set up everything once. XMPP has no DTDs or schemas, and namespaces are read as plain xmlns attributes.
+ */
+StanzaParser::StanzaParser() : parser_(0, XMLPlatformUtils::fgMemoryManager), input_(NULL, 0, "xmppstanza", false) {
+   DEBUG_M("New stanza parser for this thread.");
+   parser_.setValidationScheme(XercesDOMParser::Val_Never);
+   parser_.setDoNamespaces(false);
+   parser_.setDoSchema(false);
+   parser_.setLoadExternalDTD(false);
+   parser_.setCreateEntityReferenceNodes(false);
+   parser_.setCreateCommentNodes(false);
+   parser_.setIncludeIgnorableWhitespace(false);
+   parser_.setErrorHandler(&errHandler_);
+}
+
+StanzaParser::~StanzaParser() {
+}
+
+void StanzaParser::Release_(StanzaParser* parser) {
+   delete parser;
+}
+
+/**
+ * Parses a stanza. The previous document is handed back to the parser's pool rather than freed.
+ */
+DOMElement* StanzaParser::Parse(const string& stanza) {
+   parser_.resetDocumentPool();
+   input_.resetMemBufInputSource(reinterpret_cast<const XMLByte*>(stanza.data()), stanza.size());
+
+   try {
+      parser_.parse(input_); // Parse the recieved XML
+   } catch (const XMLException& toCatch) {
+      char* message = XMLString::transcode(toCatch.getMessage());
+      ERROR("XMPP parsing exception: %s", message);
+      // TODO: Send a valid XMPP error message
+      XMLString::release(&message);
+      return NULL;
+   } catch (const DOMException& toCatch) {
+      char* message = XMLString::transcode(toCatch.msg);
+      ERROR("XMPP parsing exception: %s", message);
+      // TODO: Send a valid XMPP error message
+      XMLString::release(&message);
+      return NULL;
+   } catch(const SAXParseException& toCatch) {
+      // The framer only hands out balanced elements, so this is a malformed stanza (bad attributes, entities, etc).
+      char* message = XMLString::transcode(toCatch.getMessage());
+      DEBUG_M("XMPP parsing exception: %s", message);
+      XMLString::release(&message);
+      return NULL;
+   } catch (...) {
+      ERROR("XMPP parsing, unexpected exception...");
+      // TODO: Send a valid XMPP error message
+      return NULL;
+   }
+
+   DOMDocument* xmlDoc = parser_.getDocument();
+   if(!xmlDoc) {
+      return NULL;
+   }
+   return xmlDoc->getDocumentElement();
+}
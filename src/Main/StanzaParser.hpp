@@ -0,0 +1,40 @@
+#ifndef LAZYXMPP_STANZAPARSER_HPP_
+#define LAZYXMPP_STANZAPARSER_HPP_
+
+#include <string>
+using namespace std;
+
+#include <boost/thread/tss.hpp>
+
+#include <xercesc/parsers/XercesDOMParser.hpp>
+#include <xercesc/dom/DOM.hpp>
+#include <xercesc/sax/HandlerBase.hpp>
+#include <xercesc/framework/MemBufInputSource.hpp>
+using namespace xercesc;
+
+/**
+ * A preconfigured Xerces DOM parser, one per thread, so parsing a stanza doesn't build and tear down a parser every time.
+ * Documents are owned by the parser and are only valid until the next Parse() on the same thread.
+ */
+class StanzaParser {
+   public:
+      static StanzaParser& get(); // This thread's parser.
+
+      DOMElement* Parse(const string& stanza); // Returns the root element or NULL.
+
+   private:
+      StanzaParser();
+      ~StanzaParser();
+      StanzaParser(const StanzaParser&);
+      StanzaParser& operator=(const StanzaParser&);
+
+      static void Release_(StanzaParser* parser);
+
+      XercesDOMParser parser_;
+      HandlerBase errHandler_;
+      MemBufInputSource input_;
+
+      static boost::thread_specific_ptr<StanzaParser> instance_;
+};
+
+#endif /* LAZYXMPP_STANZAPARSER_HPP_ */
@@ -0,0 +1,158 @@
+#include "../Main/StreamCompression.hpp"
+
+#include <string.h>
+
+#include <algorithm>
+
+#include "../Debug/console.h"
+
+static const size_t MAX_WINDOW = 32768;
+static const size_t INFLATE_CHUNK = 16384;
+static const size_t MAX_INFLATED = 1 << 20; // Out of one read, anything more is a zlib bomb.
+
+boost::thread_specific_ptr<StreamCompression::Deflater> StreamCompression::deflater_(&StreamCompression::Release_);
+
+StreamCompression::Deflater::Deflater() : ready_(false), level_(Z_DEFAULT_COMPRESSION) {
+   memset(&stream_, 0, sizeof(stream_));
+   DEBUG_M("New deflate state for this thread.");
+   // Raw deflate, the zlib header is written by the connection and the adler32 trailer is never sent.
+   ready_ = deflateInit2(&stream_, level_, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+}
+
+StreamCompression::Deflater::~Deflater() {
+   if(ready_) {
+      deflateEnd(&stream_);
+   }
+}
+
+/**
+ * Readies the state for a new flush, forgetting whatever connection used it last.
+ */
+z_stream* StreamCompression::Deflater::Begin(int level, const string& dictionary) {
+   if(!ready_ || deflateReset(&stream_) != Z_OK) {
+      return NULL;
+   }
+   if(level != level_) {
+      if(deflateParams(&stream_, level, Z_DEFAULT_STRATEGY) != Z_OK) {
+         return NULL;
+      }
+      level_ = level;
+   }
+   if(!dictionary.empty() && deflateSetDictionary(&stream_, (const Bytef*)dictionary.data(), dictionary.size()) != Z_OK) {
+      return NULL;
+   }
+   return &stream_;
+}
+
+StreamCompression::Deflater& StreamCompression::getDeflater_() {
+   Deflater* deflater = deflater_.get();
+   if(!deflater) {
+      deflater = new Deflater();
+      deflater_.reset(deflater);
+   }
+   return *deflater;
+}
+
+void StreamCompression::Release_(Deflater* deflater) {
+   delete deflater;
+}
+
+StreamCompression::StreamCompression(int level, size_t history_size) : level_(level), history_size_(min(history_size, MAX_WINDOW)), header_sent_(false), started_(false) {
+   memset(&inflate_, 0, sizeof(inflate_));
+}
+
+StreamCompression::~StreamCompression() {
+   if(started_) {
+      inflateEnd(&inflate_);
+   }
+}
+
+bool StreamCompression::Start() {
+   started_ = inflateInit(&inflate_) == Z_OK;
+   return started_;
+}
+
+bool StreamCompression::Inflate(const char* data, size_t size, string& out) {
+   inflate_.next_in = (Bytef*)data;
+   inflate_.avail_in = size;
+   size_t start = out.size();
+   // Carries on until inflate has room left over, a full buffer can mean there's more held back even once all the
+   // input is used up.
+   while(true) {
+      if(out.size() - start > MAX_INFLATED) {
+         ERROR("Compressed stream inflated too far, dropping it.");
+         return false;
+      }
+      size_t at = out.size();
+      out.resize(at + INFLATE_CHUNK);
+      inflate_.next_out = (Bytef*)&out[at];
+      inflate_.avail_out = INFLATE_CHUNK;
+      int result = inflate(&inflate_, Z_SYNC_FLUSH);
+      out.resize(out.size() - inflate_.avail_out);
+      if(result == Z_STREAM_END) {
+         // The client finished the stream, anything after it isn't compressed and isn't allowed.
+         return inflate_.avail_in == 0;
+      }
+      if(result != Z_OK && result != Z_BUF_ERROR) {
+         ERROR("Could not inflate the client's stream: %s", inflate_.msg ? inflate_.msg : "unknown error");
+         return false;
+      }
+      if(result == Z_BUF_ERROR || inflate_.avail_out > 0) {
+         break; // Everything there is so far is out, the rest needs more input.
+      }
+   }
+   return true;
+}
+
+/**
+ * Deflates everything from begin to end as one block, ending in a sync flush so the client can read all of it.
+ */
+void StreamCompression::Deflate(vector<boost::shared_ptr<const string> >::const_iterator begin, vector<boost::shared_ptr<const string> >::const_iterator end, string& out) {
+   if(!header_sent_) {
+      out.append("\x78\x9c", 2);
+      header_sent_ = true;
+   }
+
+   z_stream* stream = getDeflater_().Begin(level_, history_);
+   if(!stream) {
+      // Stored blocks need no state at all, better than dropping the stream.
+      ERROR("Could not set up deflate, sending uncompressed blocks.");
+   }
+
+   for(vector<boost::shared_ptr<const string> >::const_iterator it = begin; it != end; it++) {
+      const string& data = **it;
+      bool last = it + 1 == end;
+
+      if(!stream) {
+         for(size_t i = 0; i < data.size() || (last && i == 0); i += 65535) {
+            size_t n = min(data.size() - i, (size_t)65535);
+            unsigned char header[5] = {0, (unsigned char)n, (unsigned char)(n >> 8), (unsigned char)~n, (unsigned char)(~n >> 8)};
+            out.append((const char*)header, sizeof(header));
+            out.append(data, i, n);
+         }
+      } else {
+         stream->next_in = (Bytef*)data.data();
+         stream->avail_in = data.size();
+         int flush = last ? Z_SYNC_FLUSH : Z_NO_FLUSH;
+         do {
+            size_t at = out.size();
+            size_t room = deflateBound(stream, stream->avail_in) + 16;
+            out.resize(at + room);
+            stream->next_out = (Bytef*)&out[at];
+            stream->avail_out = room;
+            deflate(stream, flush);
+            out.resize(out.size() - stream->avail_out);
+         } while(stream->avail_out == 0 || stream->avail_in > 0);
+      }
+
+      // Keep the tail for next time.
+      if(data.size() >= history_size_) {
+         history_.assign(data, data.size() - history_size_, history_size_);
+      } else {
+         history_.append(data);
+         if(history_.size() > history_size_) {
+            history_.erase(0, history_.size() - history_size_);
+         }
+      }
+   }
+}
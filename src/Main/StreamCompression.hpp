@@ -0,0 +1,58 @@
+#ifndef LAZYXMPP_STREAMCOMPRESSION_HPP_
+#define LAZYXMPP_STREAMCOMPRESSION_HPP_
+
+#include <string>
+#include <vector>
+using namespace std;
+
+#include <zlib.h>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/tss.hpp>
+#include <boost/noncopyable.hpp>
+
+/**
+ * zlib stream compression (XEP-0138) for one connection.
+ *
+ * Inbound is a normal zlib stream, the client's, so each connection has it's own inflate state. Outbound is sent as a
+ * zlib header and then raw deflate, each flush of the write queue deflated on it's own with a Z_SYNC_FLUSH. That means
+ * the deflate state (about 256KB) doesn't have to belong to the connection, each io thread has one that every one of
+ * it's connections borrows while it's flushing. To still get repeated XML out of earlier writes the connection keeps
+ * the last few KB it sent and the borrowed state is primed with them as a dictionary. The client already has those
+ * bytes in it's inflate window so it needs no help finding them.
+ */
+class StreamCompression: private boost::noncopyable {
+   public:
+      StreamCompression(int level = Z_DEFAULT_COMPRESSION, size_t history_size = 8192);
+      ~StreamCompression();
+
+      bool Start(); // False if zlib couldn't be set up.
+
+      bool Inflate(const char* data, size_t size, string& out); // Appends to out. False if the client's stream is broken.
+      void Deflate(vector<boost::shared_ptr<const string> >::const_iterator begin, vector<boost::shared_ptr<const string> >::const_iterator end, string& out); // Appends to out.
+
+   private:
+      // One deflate state per io thread, reset for every use.
+      class Deflater {
+         public:
+            Deflater();
+            ~Deflater();
+            z_stream* Begin(int level, const string& dictionary); // NULL if it can't be used.
+         private:
+            z_stream stream_;
+            bool ready_;
+            int level_;
+      };
+      static Deflater& getDeflater_();
+      static void Release_(Deflater* deflater);
+      static boost::thread_specific_ptr<Deflater> deflater_;
+
+      int level_;
+      size_t history_size_; // At most 32KB, the client's window.
+      string history_; // The tail of what's been sent, uncompressed.
+      bool header_sent_;
+      z_stream inflate_;
+      bool started_;
+};
+
+#endif /* LAZYXMPP_STREAMCOMPRESSION_HPP_ */
@@ -0,0 +1,55 @@
+#include "../Main/StreamSession.hpp"
+
+#include "../Main/RawStanza.hpp"
+
+StreamSession::StreamSession(const string& id, unsigned int timeout) : id_(id), timeout_(timeout), handled_(0), acked_(0), ack_requested_(false) {
+}
+
+void StreamSession::Sent(const boost::shared_ptr<const string>& prefix, const boost::shared_ptr<const string>& body) {
+   Unacked stanza;
+   stanza.prefix = prefix;
+   stanza.body = body;
+   stanza.begin = 0;
+   stanza.end = body->size();
+   unacked_.push_back(stanza);
+}
+
+void StreamSession::Sent(const boost::shared_ptr<const string>& data) {
+   vector<pair<size_t, size_t> > stanzas;
+   RawStanza::findStanzas(*data, stanzas);
+   for(size_t i = 0; i < stanzas.size(); i++) {
+      Unacked stanza;
+      stanza.body = data;
+      stanza.begin = stanzas[i].first;
+      stanza.end = stanzas[i].second;
+      unacked_.push_back(stanza);
+   }
+}
+
+/**
+ * Drops everything up to the client's count. Counts wrap, so it's the difference that matters.
+ */
+bool StreamSession::Acked(unsigned int h) {
+   unsigned int acked = h - acked_;
+   if(acked > unacked_.size()) {
+      return false;
+   }
+   unacked_.erase(unacked_.begin(), unacked_.begin() + acked);
+   acked_ = h;
+   return true;
+}
+
+/**
+ * Copies out whatever doesn't already have a buffer of its own.
+ */
+void StreamSession::getUnacked(vector<boost::shared_ptr<const string> >& stanzas) const {
+   for(deque<Unacked>::const_iterator it = unacked_.begin(); it != unacked_.end(); it++) {
+      if(it->prefix) {
+         stanzas.push_back(boost::shared_ptr<const string>(new string(*it->prefix + *it->body)));
+      } else if(it->begin == 0 && it->end == it->body->size()) {
+         stanzas.push_back(it->body);
+      } else {
+         stanzas.push_back(boost::shared_ptr<const string>(new string(*it->body, it->begin, it->end - it->begin)));
+      }
+   }
+}
@@ -0,0 +1,53 @@
+#ifndef LAZYXMPP_STREAMSESSION_HPP_
+#define LAZYXMPP_STREAMSESSION_HPP_
+
+#include <string>
+#include <deque>
+#include <vector>
+using namespace std;
+
+#include <boost/shared_ptr.hpp>
+#include <boost/noncopyable.hpp>
+
+/**
+ * Stream Management (XEP-0198) state of one stream: how many stanzas have been handled each way and what's been sent
+ * that the client hasn't acked yet. The stanzas aren't copied, each unacked one is a range of a buffer that was
+ * written. Only touched from the connection's io thread, on a resume it's handed over to the new connection.
+ */
+class StreamSession: private boost::noncopyable {
+   public:
+      StreamSession(const string& id, unsigned int timeout); // id is empty if it can't be resumed.
+
+      const string& getId() const { return id_; }
+      unsigned int getTimeout() const { return timeout_; } // Seconds it's kept after the link drops.
+
+      unsigned int getHandled() const { return handled_; } // Inbound stanzas handled, what <a h=''/> tells the client.
+      void Handled() { handled_++; }
+
+      void Sent(const boost::shared_ptr<const string>& prefix, const boost::shared_ptr<const string>& body); // One stanza.
+      void Sent(const boost::shared_ptr<const string>& data); // Any number of stanzas, nothing else in it is counted.
+      bool Acked(unsigned int h); // False if h is more than was sent.
+      unsigned int getSent() const { return acked_ + unacked_.size(); }
+      size_t getUnackedCount() const { return unacked_.size(); }
+      void getUnacked(vector<boost::shared_ptr<const string> >& stanzas) const; // One buffer per stanza, oldest first.
+
+      bool isAckRequested() const { return ack_requested_; }
+      void setAckRequested(bool requested) { ack_requested_ = requested; }
+
+   private:
+      struct Unacked {
+         boost::shared_ptr<const string> prefix; // Only for a prefix/body pair.
+         boost::shared_ptr<const string> body;
+         size_t begin; // The stanza is [begin, end) of body.
+         size_t end;
+      };
+
+      string id_;
+      unsigned int timeout_;
+      unsigned int handled_; // Both counts wrap at 2^32, as the XEP wants.
+      unsigned int acked_; // The client's last h.
+      deque<Unacked> unacked_;
+      bool ack_requested_; // An <r/> is out and hasn't been answered.
+};
+
+#endif /* LAZYXMPP_STREAMSESSION_HPP_ */
@@ -0,0 +1,156 @@
+#include "../Main/TlsContext.hpp"
+
+#include <string.h>
+
+#include <openssl/rand.h>
+#include <openssl/err.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#endif
+
+#include "../Debug/console.h"
+
+static const unsigned char SESSION_ID_CONTEXT[] = "LazyXMPP";
+
+static int g_context_index = -1; // SSL_CTX ex_data slot holding the TlsContext, asio has app_data.
+
+TlsContext::TlsContext(size_t cache_size, long session_lifetime, long ticket_key_lifetime) : context_(boost::asio::ssl::context::sslv23_server), loaded_(false), ticket_key_lifetime_(ticket_key_lifetime) {
+   context_.set_options(boost::asio::ssl::context::default_workarounds | boost::asio::ssl::context::no_sslv2 | boost::asio::ssl::context::no_sslv3 | boost::asio::ssl::context::no_tlsv1 | boost::asio::ssl::context::no_tlsv1_1 | boost::asio::ssl::context::single_dh_use);
+
+   SSL_CTX* ctx = context_.native_handle();
+   SSL_CTX_set_options(ctx, SSL_OP_NO_COMPRESSION | SSL_OP_CIPHER_SERVER_PREFERENCE); // XEP-0138 does compression, after TLS.
+#ifdef SSL_OP_NO_RENEGOTIATION
+   SSL_CTX_set_options(ctx, SSL_OP_NO_RENEGOTIATION);
+#endif
+   SSL_CTX_set_mode(ctx, SSL_MODE_RELEASE_BUFFERS); // Idle connections don't keep 34KB of record buffers.
+
+   // The session cache, shared by every io thread (OpenSSL locks it).
+   SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+   SSL_CTX_set_session_id_context(ctx, SESSION_ID_CONTEXT, sizeof(SESSION_ID_CONTEXT) - 1);
+   SSL_CTX_sess_set_cache_size(ctx, cache_size);
+   SSL_CTX_set_timeout(ctx, session_lifetime);
+
+   // Session tickets under our own keys.
+   if(g_context_index < 0) {
+      g_context_index = SSL_CTX_get_ex_new_index(0, NULL, NULL, NULL, NULL);
+   }
+   SSL_CTX_set_ex_data(ctx, g_context_index, this);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+   SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, &TlsContext::TicketKeyCallback_);
+#else
+   SSL_CTX_set_tlsext_ticket_key_cb(ctx, &TlsContext::TicketKeyCallback_);
+#endif
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+   SSL_CTX_set_num_tickets(ctx, 1); // A reconnect only needs one.
+#endif
+}
+
+TlsContext::~TlsContext() {
+   boost::mutex::scoped_lock lock(ticket_keys_mutex_);
+   for(deque<TicketKey>::iterator it = ticket_keys_.begin(); it != ticket_keys_.end(); it++) {
+      OPENSSL_cleanse(&*it, sizeof(TicketKey));
+   }
+}
+
+bool TlsContext::Load(const string& certificate, const string& key) {
+   boost::system::error_code error;
+   context_.use_certificate_chain_file(certificate, error);
+   if(!error) {
+      context_.use_private_key_file(key, boost::asio::ssl::context::pem, error);
+   }
+   if(error) {
+      LOG("TLS is off, could not load '%s' and '%s': %s", certificate.c_str(), key.c_str(), error.message().c_str());
+      return false;
+   }
+   if(SSL_CTX_check_private_key(context_.native_handle()) != 1) {
+      ERROR("TLS is off, the key in '%s' isn't for the certificate in '%s'.", key.c_str(), certificate.c_str());
+      return false;
+   }
+   loaded_ = true;
+   return true;
+}
+
+const TlsContext::TicketKey* TlsContext::getEncryptKey_() {
+   time_t now = time(NULL);
+   if(ticket_keys_.empty() || now - ticket_keys_.front().created >= ticket_key_lifetime_) {
+      TicketKey key;
+      if(RAND_bytes(key.name, sizeof(key.name)) != 1 || RAND_bytes(key.aes_key, sizeof(key.aes_key)) != 1 || RAND_bytes(key.hmac_key, sizeof(key.hmac_key)) != 1) {
+         ERROR("Could not make a session ticket key.");
+         return NULL;
+      }
+      key.created = now;
+      ticket_keys_.push_front(key);
+      OPENSSL_cleanse(&key, sizeof(key));
+      while(ticket_keys_.size() > 2) {
+         OPENSSL_cleanse(&ticket_keys_.back(), sizeof(TicketKey));
+         ticket_keys_.pop_back();
+      }
+      DEBUG_M("New session ticket key.");
+   }
+   return &ticket_keys_.front();
+}
+
+const TlsContext::TicketKey* TlsContext::getDecryptKey_(const unsigned char* name, bool& renew) {
+   time_t now = time(NULL);
+   for(size_t i = 0; i < ticket_keys_.size(); i++) {
+      const TicketKey& key = ticket_keys_[i];
+      if(memcmp(key.name, name, sizeof(key.name)) == 0) {
+         if(now - key.created >= ticket_key_lifetime_ * 2) {
+            return NULL; // Retired, it just hasn't been pushed out yet.
+         }
+         renew = i > 0 || now - key.created >= ticket_key_lifetime_;
+         return &key;
+      }
+   }
+   return NULL;
+}
+
+/**
+ * OpenSSL's session ticket key callback. Returns 1 to use the key, 2 to use it and issue a new ticket, 0 if the ticket's
+ * key is unknown (a full handshake) and -1 on error.
+ */
+int TlsContext::TicketKeyCallback_(SSL* ssl, unsigned char* name, unsigned char* iv, EVP_CIPHER_CTX* cipher, TicketHmac* hmac, int encrypt) {
+   TlsContext* self = (TlsContext*)SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), g_context_index);
+   if(!self) {
+      return -1;
+   }
+
+   boost::mutex::scoped_lock lock(self->ticket_keys_mutex_);
+   const TicketKey* key;
+   bool renew = false;
+   if(encrypt) {
+      key = self->getEncryptKey_();
+      if(!key || RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) != 1) {
+         return -1;
+      }
+      memcpy(name, key->name, sizeof(key->name));
+      if(EVP_EncryptInit_ex(cipher, EVP_aes_256_cbc(), NULL, key->aes_key, iv) != 1) {
+         return -1;
+      }
+   } else {
+      key = self->getDecryptKey_(name, renew);
+      if(!key) {
+         return 0;
+      }
+      if(EVP_DecryptInit_ex(cipher, EVP_aes_256_cbc(), NULL, key->aes_key, iv) != 1) {
+         return -1;
+      }
+      // TLS 1.3 clients use a ticket once, OpenSSL only sends the next one if asked to renew.
+      renew = renew || SSL_version(ssl) >= TLS1_3_VERSION;
+   }
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+   OSSL_PARAM params[3];
+   params[0] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, (void*)key->hmac_key, sizeof(key->hmac_key));
+   params[1] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, (char*)"SHA256", 0);
+   params[2] = OSSL_PARAM_construct_end();
+   if(EVP_MAC_CTX_set_params(hmac, params) != 1) {
+      return -1;
+   }
+#else
+   if(HMAC_Init_ex(hmac, key->hmac_key, sizeof(key->hmac_key), EVP_sha256(), NULL) != 1) {
+      return -1;
+   }
+#endif
+   return renew ? 2 : 1;
+}
@@ -0,0 +1,55 @@
+#ifndef LAZYXMPP_TLSCONTEXT_HPP_
+#define LAZYXMPP_TLSCONTEXT_HPP_
+
+#include <time.h>
+
+#include <string>
+#include <deque>
+using namespace std;
+
+#include <boost/asio/ssl.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/noncopyable.hpp>
+
+/**
+ * The server's TLS setup, shared by every connection. Reconnecting clients get an abbreviated handshake, either from
+ * a session ticket (stateless, TLS 1.2 and 1.3) or from OpenSSL's session cache (TLS 1.2 clients without tickets).
+ *
+ * Ticket keys are made here rather than left to OpenSSL so they rotate: tickets are issued under the newest key, the
+ * one before it is still accepted (and the ticket reissued), anything older means a full handshake. A stolen key only
+ * opens the sessions of the last two periods.
+ */
+class TlsContext: private boost::noncopyable {
+   public:
+      TlsContext(size_t cache_size = 20480, long session_lifetime = 7200, long ticket_key_lifetime = 43200); // Lifetimes in seconds.
+      ~TlsContext();
+
+      bool Load(const string& certificate, const string& key); // PEM files, the certificate may be a chain. False if they won't load.
+      bool isLoaded() const { return loaded_; }
+      boost::asio::ssl::context& getContext() { return context_; }
+
+   private:
+      struct TicketKey {
+         unsigned char name[16];
+         unsigned char aes_key[32];
+         unsigned char hmac_key[32];
+         time_t created;
+      };
+
+      const TicketKey* getEncryptKey_(); // Rotates if the newest is too old.
+      const TicketKey* getDecryptKey_(const unsigned char* name, bool& renew);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+      typedef EVP_MAC_CTX TicketHmac;
+#else
+      typedef HMAC_CTX TicketHmac;
+#endif
+      static int TicketKeyCallback_(SSL* ssl, unsigned char* name, unsigned char* iv, EVP_CIPHER_CTX* cipher, TicketHmac* hmac, int encrypt);
+
+      boost::asio::ssl::context context_;
+      bool loaded_;
+      long ticket_key_lifetime_;
+      deque<TicketKey> ticket_keys_; // Newest first, never more than two.
+      boost::mutex ticket_keys_mutex_; // Handshakes happen on every io thread.
+};
+
+#endif /* LAZYXMPP_TLSCONTEXT_HPP_ */
@@ -0,0 +1,66 @@
+#include "../Main/UserCache.hpp"
+
+#include <boost/thread/locks.hpp>
+
+UserCache::UserCache(size_t max_records) : max_records_(max_records) {
+}
+
+bool UserCache::MayExist(const string& username) const {
+   boost::shared_lock<boost::shared_mutex> lock(mutex_);
+   return filter_.MayContain(username);
+}
+
+bool UserCache::Get(const string& username, UserRecord& record) const {
+   boost::shared_lock<boost::shared_mutex> lock(mutex_);
+   Records::const_iterator it = records_.find(username);
+   if(it == records_.end()) {
+      return false;
+   }
+   record = it->second;
+   return true;
+}
+
+void UserCache::Put(const string& username, const UserRecord& record) {
+   boost::unique_lock<boost::shared_mutex> lock(mutex_);
+   filter_.Add(username);
+   Insert_(username, record, true);
+}
+
+void UserCache::Fill(const string& username, const UserRecord& record) {
+   boost::unique_lock<boost::shared_mutex> lock(mutex_);
+   // A reader can finish its SELECT after the writer has committed and cached something newer.
+   Insert_(username, record, false);
+}
+
+void UserCache::Insert_(const string& username, const UserRecord& record, bool overwrite) {
+   Records::iterator it = records_.find(username);
+   if(it != records_.end()) {
+      if(overwrite) {
+         it->second = record;
+      }
+      return;
+   }
+   if(max_records_ == 0) {
+      return;
+   }
+   if(records_.size() >= max_records_) {
+      records_.erase(records_.begin()); // Whichever is first in the table, near enough random.
+   }
+   records_.insert(make_pair(username, record));
+}
+
+void UserCache::Load(BloomFilter& filter, Records& records) {
+   boost::unique_lock<boost::shared_mutex> lock(mutex_);
+   filter_.swap(filter);
+   records_.swap(records);
+}
+
+bool UserCache::isFilterFull() const {
+   boost::shared_lock<boost::shared_mutex> lock(mutex_);
+   return filter_.isOverloaded();
+}
+
+size_t UserCache::getRecordCount() const {
+   boost::shared_lock<boost::shared_mutex> lock(mutex_);
+   return records_.size();
+}
@@ -0,0 +1,47 @@
+#ifndef LAZYXMPP_USERCACHE_HPP_
+#define LAZYXMPP_USERCACHE_HPP_
+
+#include <string>
+using namespace std;
+
+#include <boost/unordered_map.hpp>
+#include <boost/thread/shared_mutex.hpp>
+#include <boost/noncopyable.hpp>
+
+#include "../Main/BloomFilter.hpp"
+#include "../Main/UserStore.hpp"
+
+/**
+ * UserDB's in-memory copy of the users table. A Bloom filter of every registered name sits in front, so logins and
+ * registration checks for names that don't exist are turned away without touching the store. Behind that, up to
+ * max_records users are held in full, anyone else is read from the store and kept.
+ *
+ * Only the writer thread changes the filter or overwrites records, anyone can read or fill in a record that's missing.
+ */
+class UserCache: private boost::noncopyable {
+   public:
+      typedef boost::unordered_map<string, UserRecord> Records;
+
+      UserCache(size_t max_records = 100000);
+
+      bool MayExist(const string& username) const; // False means definitely not registered.
+      bool Get(const string& username, UserRecord& record) const;
+      void Put(const string& username, const UserRecord& record); // A newly committed or changed user.
+      void Fill(const string& username, const UserRecord& record); // Just read from the store, only kept if nothing newer is there already.
+
+      void Load(BloomFilter& filter, Records& records); // Swaps in a freshly built filter and records.
+      bool isFilterFull() const; // Time to rebuild the filter bigger.
+
+      size_t getMaxRecords() const { return max_records_; }
+      size_t getRecordCount() const;
+
+   private:
+      void Insert_(const string& username, const UserRecord& record, bool overwrite);
+
+      mutable boost::shared_mutex mutex_; // Guards filter_ and records_.
+      BloomFilter filter_;
+      Records records_;
+      size_t max_records_;
+};
+
+#endif /* LAZYXMPP_USERCACHE_HPP_ */
@@ -1,121 +1,372 @@
 #include "UserDB.hpp"
+#include "../Main/Pbkdf2Batch.hpp"
 
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <boost/bind.hpp>
 #include <boost/filesystem.hpp>
 namespace fs=boost::filesystem;
 
-UserDB::UserDB() {
-   LOG("Opening user database. SQLite version %s.", sqlite3_libversion());
-
-   // Check for thread safety
-   if(!sqlite3_threadsafe()) {
-      ERROR("DANGER! DANGER! DANGER! SQLite was *NOT* compiled with SQLITE_THREADSAFE, this could result in db corruption.");
-      // TODO: Look at implementing inbuilt fallback mutexes.
-   }
-
-   int result;
-
-   db_ = NULL;
-   string dbfile = findOrCreateDB_();
-   if(dbfile.empty()) {
-      ERROR("No database found.");;
-   }
-
-   result = openDB_(dbfile);
-   if(result != SQLITE_OK) {
-      ERROR("Could not open database.");
+UserDB::UserDB(const string& store) : writer_(this) {
+   string datadir = findDataDir_();
+   store_.reset(UserStore::Create(store, datadir));
+   if(!store_) {
+      ERROR("Could not open the '%s' user store in '%s'.", store.c_str(), datadir.c_str());
+      throw "User database error.";
    }
 
-   string createdb_s = "CREATE TABLE users (username, hash, salt, PRIMARY KEY(username), UNIQUE(username));";
-   string register_s = "INSERT INTO users (username, hash, salt) VALUES (?, ?, ?);";
-   string lookup_s = "SELECT * FROM users WHERE username = ?;";
-
-   if(sqlite3_prepare_v2(db_, createdb_s.c_str(), -1, &createdb_stmt, NULL) == SQLITE_OK) {
-      result = sqlite3_step(createdb_stmt);
-      result = sqlite3_finalize(createdb_stmt);
-   }
+   salt_len_ = 16;
+   rounds_ = 5000;
+   scram_rounds_ = 4096; // The RFC 7677 minimum, the client pays for these.
 
-   if(!sqlite3_prepare_v2(db_, register_s.c_str(), register_s.size()+1, &register_stmt, NULL) == SQLITE_OK) {
-      ERROR("Failed to create sqlite register statement.");
-      closeDB_();
-      throw "User database error.";
-   }
-   
-   if(!sqlite3_prepare_v2(db_, lookup_s.c_str(), lookup_s.size()+1, &lookup_stmt, NULL) == SQLITE_OK) {
-      ERROR("Failed to create sqlite lookup statement.");
-      closeDB_();
+   if(!loadFakeSaltKey_(datadir + "/scram_fake_salt.key")) {
       throw "User database error.";
    }
 
-   salt_len_ = 16;
-   rounds_ = 5000;
+   warmCache_();
+
+   writer_.Start();
 }
 
 UserDB::~UserDB() {
-   closeDB_();
-   sqlite3_finalize(register_stmt);
-   sqlite3_finalize(lookup_stmt);
+   writer_.Stop(); // Everything queued gets written first.
 }
 
-string UserDB::findDB_() const {
+string UserDB::findDataDir_() const {
    fs::path confdir;
    confdir /= getenv("HOME");
-   confdir /= "/.config/LazyXMPP/users.db";
-   fs::create_directories(confdir.parent_path());
+   confdir /= "/.config/LazyXMPP";
+   fs::create_directories(confdir);
 
    return confdir.string();
 }
 
+/**
+ * Reads the key for the fake SCRAM salts, making it the first time. It has to outlive restarts, a real user's salt
+ * does, so a fake one that changed would give away which names are registered.
+ */
+bool UserDB::loadFakeSaltKey_(const string& path) {
+   byte key[32];
+   int fd = open(path.c_str(), O_RDONLY);
+   if(fd >= 0) {
+      bool ok = read(fd, key, sizeof(key)) == (ssize_t)sizeof(key);
+      close(fd);
+      if(!ok) {
+         ERROR("SCRAM salt key '%s' is damaged, remove it to make a new one.", path.c_str());
+         return false;
+      }
+      fake_salt_key_.assign((const char*)key, sizeof(key));
+      return true;
+   }
+   if(errno != ENOENT) {
+      ERROR("Could not read SCRAM salt key '%s': %s", path.c_str(), strerror(errno));
+      return false;
+   }
+
+   // Synced under a temporary name first, so a crash never leaves a short key behind.
+   rng.GenerateBlock(key, sizeof(key));
+   string tmp = path + ".tmp";
+   fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+   bool ok = fd >= 0 && write(fd, key, sizeof(key)) == (ssize_t)sizeof(key) && fsync(fd) == 0;
+   if(fd >= 0) {
+      close(fd);
+   }
+   if(!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+      ERROR("Could not write SCRAM salt key '%s': %s", path.c_str(), strerror(errno));
+      unlink(tmp.c_str());
+      return false;
+   }
+   fake_salt_key_.assign((const char*)key, sizeof(key));
+   return true;
+}
+
+/**
+ * Registers a user and waits until it's on disk. Don't call it from the writer thread.
+ */
 bool UserDB::registerUser(const string& username, const string& password) {
+   boost::promise<bool> promise;
+   boost::unique_future<bool> result = promise.get_future();
+   registerUserAsync(username, password, boost::bind(&UserDB::setResult_, &promise, _1));
+   return result.get();
+}
+
+/**
+ * Works out the password hash and SCRAM keys on the calling thread, then leaves the insert to the writer.
+ * done is called on the writer thread once the user is committed, or has failed (most likely already registered).
+ */
+void UserDB::registerUserAsync(const string& username, const string& password, const UserDBWriter::Callback& done) {
+   UserRecord record;
+
    byte hash[SHA512::DIGESTSIZE];
    byte salt[salt_len_];
-   rng.GenerateBlock(salt, salt_len_); // Generate some random salt
+   {
+      boost::mutex::scoped_lock lock(rng_mutex_);
+      rng.GenerateBlock(salt, salt_len_); // Generate some random salt
+   }
+   PKCS5_PBKDF2_HMAC<SHA512> dk;
    dk.DeriveKey(hash, SHA512::DIGESTSIZE, (byte)0, (const byte*)password.c_str(), password.length(), salt, salt_len_, rounds_, 0); // Hash+Salt password
+   record.hash.assign((const char*)hash, SHA512::DIGESTSIZE);
+   record.salt.assign((const char*)salt, salt_len_);
+
+   string scram_salt;
+   ScramCredentials sha1, sha256;
+   deriveScramKeys_(password, scram_salt, sha1, sha256);
+   record.setScramCredentials(sha1, sha256);
+
+   writer_.Submit(boost::bind(&UserStore::Insert, _1, username, record), boost::bind(&UserDB::userInserted_, this, username, record, done, _1));
+}
+
+/**
+ * Runs on the writer thread once the insert has been committed (or not). The new user goes straight into the cache,
+ * replacing anything left there, before whoever registered them hears about it.
+ */
+void UserDB::userInserted_(const string& username, const UserRecord& record, const UserDBWriter::Callback& done, bool committed) {
+   if(committed) {
+      cache_.Put(username, record);
+
+      if(cache_.isFilterFull()) {
+         warmCache_(); // Nothing else is being committed while the writer is here, so the scan can't miss anyone.
+      }
+   }
+   if(done) {
+      done(committed);
+   }
+}
 
-   // Bind the SQL paramaters
-   sqlite3_bind_text(register_stmt, 1, username.c_str(), username.size(), SQLITE_TRANSIENT);
-   sqlite3_bind_text(register_stmt, 2, (char*) hash, SHA512::DIGESTSIZE, SQLITE_TRANSIENT);
-   sqlite3_bind_text(register_stmt, 3, (char*) salt, salt_len_, SQLITE_TRANSIENT);
+/**
+ * Registers a batch of users in one transaction, for provisioning accounts in bulk. Everything slow happens on the
+ * calling thread: the PBKDF2 hashes several at a time with the multi-buffer kernel, then the SCRAM keys. Call it from
+ * several threads at once to use every core, the writer commits their batches together. Without with_scram the SCRAM
+ * keys are left for each user's first PLAIN login, the SCRAM derivations are most of the work.
+ * Returns false if the commit failed, otherwise each user's imported says whether they were new.
+ */
+bool UserDB::importUsers(vector<ImportUser>& users, bool with_scram) {
+   // Don't spend any time on users that are already there, re-running an import should be quick.
+   vector<ImportUser> all;
+   all.swap(users);
+   for(size_t i = 0; i < all.size(); i++) {
+      all[i].imported = false;
+      if(!isRegistered(all[i].username)) {
+         users.push_back(all[i]);
+      }
+   }
 
-   // Perform the SQL register query
-   if(sqlite3_step(register_stmt) != SQLITE_DONE) {
-      ERROR("Failed to register new user '%s'.", username.c_str());
+   vector<Pbkdf2Request> requests;
+   requests.reserve(users.size());
+   for(size_t i = 0; i < users.size(); i++) {
+      byte salt[salt_len_];
+      {
+         boost::mutex::scoped_lock lock(rng_mutex_);
+         rng.GenerateBlock(salt, salt_len_);
+      }
+      requests.push_back(Pbkdf2Request(users[i].password, string((const char*)salt, salt_len_), rounds_));
    }
+   Pbkdf2Sha512::DeriveBatch(requests);
 
-   sqlite3_reset(register_stmt);
-   sqlite3_clear_bindings(register_stmt);
-   return false;
+   vector<UserRecord> records(users.size());
+   for(size_t i = 0; i < users.size(); i++) {
+      records[i].hash.assign((const char*)requests[i].key, Pbkdf2Sha512::KEY_SIZE);
+      records[i].salt = requests[i].salt;
+      if(with_scram) {
+         string scram_salt;
+         ScramCredentials sha1, sha256;
+         deriveScramKeys_(users[i].password, scram_salt, sha1, sha256);
+         records[i].setScramCredentials(sha1, sha256);
+      }
+   }
+
+   bool committed = true;
+   if(!users.empty()) {
+      boost::promise<bool> promise;
+      boost::unique_future<bool> result = promise.get_future();
+      writer_.Submit(boost::bind(&UserDB::insertUsers_, _1, &users, &records), boost::bind(&UserDB::usersImported_, this, &users, &records, &promise, _1));
+      committed = result.get();
+   }
+
+   // Put the ones that were skipped back.
+   for(size_t i = 0, j = 0; i < all.size(); i++) {
+      if(j < users.size() && all[i].username == users[j].username) {
+         all[i].imported = users[j++].imported;
+      }
+   }
+   users.swap(all);
+   return committed;
+}
+
+/**
+ * Runs on the writer thread, inside its transaction. Users that are already there are skipped, not an error.
+ */
+bool UserDB::insertUsers_(UserStore* store, vector<ImportUser>* users, const vector<UserRecord>* records) {
+   for(size_t i = 0; i < users->size(); i++) {
+      (*users)[i].imported = store->Insert((*users)[i].username, (*records)[i]);
+   }
+   return true;
+}
+
+void UserDB::usersImported_(vector<ImportUser>* users, const vector<UserRecord>* records, boost::promise<bool>* promise, bool committed) {
+   if(committed) {
+      for(size_t i = 0; i < users->size(); i++) {
+         if((*users)[i].imported) {
+            cache_.Put((*users)[i].username, (*records)[i]);
+         }
+      }
+      if(cache_.isFilterFull()) {
+         warmCache_();
+      }
+   } else {
+      for(size_t i = 0; i < users->size(); i++) {
+         (*users)[i].imported = false;
+      }
+   }
+   promise->set_value(committed);
+}
+
+void UserDB::setResult_(boost::promise<bool>* promise, bool result) {
+   promise->set_value(result);
 }
 
 bool UserDB::isRegistered(const string& username) {
-   bool result = false;
-   sqlite3_bind_text(lookup_stmt, 1, username.c_str(), username.size(), SQLITE_TRANSIENT);
+   UserRecord record;
+   return lookup_(username, record);
+}
 
-   if(sqlite3_step(lookup_stmt) == SQLITE_ROW) {
-      result = true;
+/**
+ * Fetches a user's record. Names the filter has never seen are turned away here, without going near the store.
+ */
+bool UserDB::lookup_(const string& username, UserRecord& record) {
+   if(!cache_.MayExist(username)) {
+      return false;
+   }
+   if(cache_.Get(username, record)) {
+      return true;
    }
 
-   sqlite3_reset(lookup_stmt);
-   sqlite3_clear_bindings(lookup_stmt);
+   bool result = store_->Lookup(username, record);
+   if(result) {
+      cache_.Fill(username, record);
+   }
    return result;
 }
 
+static void CacheWarmer_(const string& username, const UserRecord& record, vector<string>* usernames, UserCache::Records* records, size_t max_records) {
+   if(records->size() < max_records) {
+      (*records)[username] = record;
+   }
+   usernames->push_back(username);
+}
+
+/**
+ * Builds a new filter and records from everyone in the store and swaps them in. The filter is sized with room to
+ * grow, once it's past that the writer calls this again.
+ */
+void UserDB::warmCache_() {
+   vector<string> usernames;
+   UserCache::Records records;
+   store_->Scan(boost::bind(&CacheWarmer_, _1, _2, &usernames, &records, cache_.getMaxRecords()));
+
+   BloomFilter filter(usernames.size() * 2 + 1024);
+   for(size_t i = 0; i < usernames.size(); i++) {
+      filter.Add(usernames[i]);
+   }
+   size_t filter_size = filter.getMemoryUsage();
+   cache_.Load(filter, records);
+   LOG("User cache holds %lu of %lu users, filter is %lu KiB.", (unsigned long)cache_.getRecordCount(), (unsigned long)usernames.size(), (unsigned long)filter_size / 1024);
+}
+
 bool UserDB::verifyPassword(const string& username, const string& password) {
-   bool result = false;
-   sqlite3_bind_text(lookup_stmt, 1, username.c_str(), username.size(), SQLITE_TRANSIENT);
-
-   if(sqlite3_step(lookup_stmt) == SQLITE_ROW) {
-      byte checkhash[SHA512::DIGESTSIZE];
-      const char* storedhash = (char*)sqlite3_column_text(lookup_stmt, 1);
-      const char* salt = (char*)sqlite3_column_text(lookup_stmt, 2);
-
-      // Check the stored hash is the same as the one we generated from the password+salt
-      dk.DeriveKey(checkhash, SHA512::DIGESTSIZE, (byte)0, (const byte*)password.c_str(), password.length(), (byte*)salt, salt_len_, rounds_, 0);
-      if(strncmp((char*)checkhash, storedhash, strlen(storedhash)) == 0) {
-         return true;
+   vector<PasswordCheck> checks(1, PasswordCheck(username, password));
+   verifyPasswords(checks);
+   return checks[0].verified;
+}
+
+/**
+ * Checks a batch of logins. The PBKDF2 derivations for all of them are done together by the multi-buffer kernel.
+ */
+void UserDB::verifyPasswords(vector<PasswordCheck>& checks) {
+   vector<Pbkdf2Request> requests;
+   vector<size_t> owners;
+   vector<string> storedhashes;
+   requests.reserve(checks.size());
+
+   for(size_t i = 0; i < checks.size(); i++) {
+      checks[i].verified = false;
+      UserRecord record;
+      if(!lookup_(checks[i].username, record) || record.hash.size() != SHA512::DIGESTSIZE) {
+         continue;
       }
+      requests.push_back(Pbkdf2Request(checks[i].password, record.salt, rounds_));
+      owners.push_back(i);
+      storedhashes.push_back(record.hash);
+   }
+
+   Pbkdf2Sha512::DeriveBatch(requests);
+
+   // Check the stored hash is the same as the one we generated from the password+salt
+   for(size_t i = 0; i < requests.size(); i++) {
+      PasswordCheck& check = checks[owners[i]];
+      check.verified = VerifyBufsEqual(requests[i].key, (const byte*)storedhashes[i].data(), SHA512::DIGESTSIZE);
+      if(check.verified) {
+         addMissingScramKeys_(check.username, check.password);
+      }
+   }
+}
+
+/**
+ * Accounts from before SCRAM support only have the PBKDF2 hash. A good login is the one time we see the password, so add the keys then.
+ */
+void UserDB::addMissingScramKeys_(const string& username, const string& password) {
+   ScramCredentials existing;
+   if(getScramCredentials(username, Scram::SHA256, existing) != SCRAM_NO_KEYS) {
+      return;
+   }
+   string scram_salt;
+   ScramCredentials sha1, sha256;
+   deriveScramKeys_(password, scram_salt, sha1, sha256);
+   writer_.Submit(boost::bind(&UserStore::SetScramKeys, _1, username, sha1, sha256), boost::bind(&UserDB::scramKeysStored_, this, username, sha1, sha256, _1));
+   LOG("Adding SCRAM keys for user '%s'.", username.c_str());
+}
+
+/**
+ * Fetches the SCRAM keys for a user. Users without them get made up credentials that can never match.
+ */
+UserDB::ScramLookup UserDB::getScramCredentials(const string& username, Scram::Mechanism mechanism, ScramCredentials& credentials) {
+   UserRecord record;
+   ScramLookup result = SCRAM_UNKNOWN_USER;
+   if(lookup_(username, record)) {
+      result = record.getScramCredentials(mechanism, credentials) ? SCRAM_FOUND : SCRAM_NO_KEYS;
    }
 
-   sqlite3_reset(lookup_stmt);
-   sqlite3_clear_bindings(lookup_stmt);
+   if(result != SCRAM_FOUND) {
+      // Same salt every time for the same name, so probing twice doesn't give it away. The keys are junk.
+      credentials.salt = Scram::Hmac(Scram::SHA256, fake_salt_key_, username).substr(0, salt_len_);
+      credentials.iterations = scram_rounds_;
+      credentials.stored_key = Scram::Hmac(mechanism, fake_salt_key_, "stored" + username);
+      credentials.server_key = Scram::Hmac(mechanism, fake_salt_key_, "server" + username);
+   }
    return result;
 }
+
+/**
+ * Works out the SCRAM keys for both hashes with a fresh salt. Slow.
+ */
+void UserDB::deriveScramKeys_(const string& password, string& salt, ScramCredentials& sha1, ScramCredentials& sha256) {
+   byte salt_b[salt_len_];
+   {
+      boost::mutex::scoped_lock lock(rng_mutex_);
+      rng.GenerateBlock(salt_b, salt_len_);
+   }
+   salt.assign((const char*)salt_b, salt_len_);
+   Scram::DeriveKeys(Scram::SHA1, password, salt, scram_rounds_, sha1);
+   Scram::DeriveKeys(Scram::SHA256, password, salt, scram_rounds_, sha256);
+}
+
+void UserDB::scramKeysStored_(const string& username, const ScramCredentials& sha1, const ScramCredentials& sha256, bool committed) {
+   UserRecord record;
+   if(committed && cache_.Get(username, record)) {
+      record.setScramCredentials(sha1, sha256);
+      cache_.Put(username, record);
+   }
+}
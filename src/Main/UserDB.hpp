@@ -2,56 +2,103 @@
 #define LAZYXMPP_USERDB_HPP_
 
 #include <string>
+#include <vector>
 using namespace std;
 
-#include <sqlite3.h>
-
 #include <crypto++/cryptlib.h>
 #include <crypto++/sha.h>
 #include <crypto++/osrng.h>
 #include <crypto++/integer.h>
 #include <crypto++/pwdbased.h>
+#include <crypto++/misc.h>
 using namespace CryptoPP;
 
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/future.hpp>
+#include <boost/scoped_ptr.hpp>
+
 #include "../Debug/console.h"
+#include "../Main/Scram.hpp"
+#include "../Main/UserDBWriter.hpp"
+#include "../Main/UserCache.hpp"
+#include "../Main/UserStore.hpp"
+
+/**
+ * One login in a verifyPasswords batch.
+ */
+struct PasswordCheck {
+   PasswordCheck(const string& username_, const string& password_) : username(username_), password(password_), verified(false) {}
+   string username;
+   string password;
+   bool verified; // Filled in.
+};
+
+/**
+ * One account in an importUsers batch.
+ */
+struct ImportUser {
+   ImportUser(const string& username_, const string& password_) : username(username_), password(password_), imported(false) {}
+   string username;
+   string password;
+   bool imported; // Filled in, false if they were already registered.
+};
 
 class UserDB {
    public:
-      UserDB();
+      enum ScramLookup {
+         SCRAM_FOUND,
+         SCRAM_NO_KEYS, // Registered before SCRAM support, only PLAIN can log them in until it adds the keys.
+         SCRAM_UNKNOWN_USER
+      };
+
+      UserDB(const string& store = "sqlite"); // See UserStore::Create.
 
       ~UserDB();
 
-      bool registerUser(const string& username, const string& password);
+      // These are safe to call from any thread. Lookups are answered from the cache where they can be, otherwise from
+      // the store, writes all go through the writer thread.
+      bool registerUser(const string& username, const string& password); // Waits for the write.
+      void registerUserAsync(const string& username, const string& password, const UserDBWriter::Callback& done); // Slow, the key derivation runs on the caller.
       bool isRegistered(const string& username);
-      bool verifyPassword(const string& username, const string& password);
+      bool verifyPassword(const string& username, const string& password); // Also fills in missing SCRAM keys on success.
+      void verifyPasswords(vector<PasswordCheck>& checks); // Much cheaper per login than one at a time, the derivations run side by side.
+      bool importUsers(vector<ImportUser>& users, bool with_scram = true); // Bulk registration, see the .cpp. Waits for the write.
 
-   private:
-      string findDB_() const;
+      // Whatever it returns credentials is filled, users without keys get a stable fake salt so a SCRAM exchange looks
+      // the same whether or not the account exists.
+      ScramLookup getScramCredentials(const string& username, Scram::Mechanism mechanism, ScramCredentials& credentials);
 
-      string findOrCreateDB_() {
-         string dbfile = findDB_();
-         return dbfile;
-      }
+      UserDBWriter::Stats getWriterStats() const { return writer_.getStats(); }
+      const char* getStoreName() const { return store_->getName(); }
 
-      bool openDB_(const string& database) {
-         int result = sqlite3_open(database.c_str(), &db_);
-         return result;
-      }
+   private:
+      friend class UserDBWriter;
 
-      void closeDB_() {
-         sqlite3_close(db_);
-         db_ = NULL;
-      }
+      string findDataDir_() const;
+      bool loadFakeSaltKey_(const string& path);
+      bool lookup_(const string& username, UserRecord& record);
+      void warmCache_(); // Reads every user into a new filter and records.
+      void addMissingScramKeys_(const string& username, const string& password);
+      void deriveScramKeys_(const string& password, string& salt, ScramCredentials& sha1, ScramCredentials& sha256);
+      void userInserted_(const string& username, const UserRecord& record, const UserDBWriter::Callback& done, bool committed); // These run on the writer once it's committed.
+      void scramKeysStored_(const string& username, const ScramCredentials& sha1, const ScramCredentials& sha256, bool committed);
+      static bool insertUsers_(UserStore* store, vector<ImportUser>* users, const vector<UserRecord>* records);
+      void usersImported_(vector<ImportUser>* users, const vector<UserRecord>* records, boost::promise<bool>* promise, bool committed);
+      static void setResult_(boost::promise<bool>* promise, bool result);
+      UserStore* getStore_() { return store_.get(); }
 
-      sqlite3 *db_;
-      sqlite3_stmt* register_stmt;
-      sqlite3_stmt* lookup_stmt;
-      sqlite3_stmt* createdb_stmt;
+      boost::scoped_ptr<UserStore> store_;
+      boost::mutex rng_mutex_; // Guards rng.
 
-      PKCS5_PBKDF2_HMAC<SHA512> dk;
       AutoSeededRandomPool rng;
       int salt_len_;
       int rounds_;
+      unsigned int scram_rounds_;
+      string fake_salt_key_; // Keys the fake salts for users without SCRAM keys, kept in the data dir.
+
+      UserCache cache_;
+
+      UserDBWriter writer_; // Last, so it's built after everything it uses.
 };
 
 #endif /* LAZYXMPP_USERDB_HPP_ */
@@ -0,0 +1,130 @@
+#include "../Main/UserDBWriter.hpp"
+
+#include <boost/bind.hpp>
+
+#include "../Main/UserDB.hpp"
+#include "../Main/UserStore.hpp"
+#include "../Debug/console.h"
+
+UserDBWriter::UserDBWriter(UserDB* userdb, unsigned int commit_window_ms, unsigned int max_batch) : userdb_(userdb), commit_window_(boost::posix_time::milliseconds(commit_window_ms)), max_batch_(max_batch), stopping_(false) {
+   if(max_batch_ == 0) {
+      max_batch_ = 1;
+   }
+}
+
+UserDBWriter::~UserDBWriter() {
+   Stop();
+}
+
+void UserDBWriter::Start() {
+   thread_ = boost::thread(boost::bind(&UserDBWriter::Run_, this));
+}
+
+void UserDBWriter::Stop() {
+   {
+      boost::mutex::scoped_lock lock(mutex_);
+      if(stopping_ || !thread_.joinable()) {
+         return;
+      }
+      stopping_ = true;
+   }
+   queued_.notify_all();
+   thread_.join();
+
+   Stats stats = getStats();
+   if(stats.commits > 0) {
+      LOG("User database writer: %lu writes in %lu commits (%.1f per commit, largest %lu), %lu failed. Latency %.2fms average, %.2fms max.",
+         stats.writes, stats.commits, (double)stats.writes / stats.commits, stats.largest_batch, stats.failed, stats.total_latency_ms / stats.writes, stats.max_latency_ms);
+   }
+}
+
+void UserDBWriter::Submit(const Mutation& mutation, const Callback& done) {
+   Pending pending;
+   pending.mutation = mutation;
+   pending.done = done;
+   pending.queued = boost::posix_time::microsec_clock::universal_time();
+   {
+      boost::mutex::scoped_lock lock(mutex_);
+      queue_.push_back(pending);
+   }
+   queued_.notify_one();
+}
+
+UserDBWriter::Stats UserDBWriter::getStats() const {
+   boost::mutex::scoped_lock lock(mutex_);
+   return stats_;
+}
+
+/**
+ * The writer thread. Waits for a write, gives others the commit window to join it, then commits them all together.
+ */
+void UserDBWriter::Run_() {
+   vector<Pending> batch;
+   for(;;) {
+      {
+         boost::mutex::scoped_lock lock(mutex_);
+         while(queue_.empty() && !stopping_) {
+            queued_.wait(lock);
+         }
+         if(queue_.empty()) {
+            return; // Stopping and nothing left.
+         }
+
+         boost::system_time deadline = boost::get_system_time() + commit_window_;
+         while(!stopping_ && queue_.size() < max_batch_ && queued_.timed_wait(lock, deadline)) {
+         }
+
+         while(!queue_.empty() && batch.size() < max_batch_) {
+            batch.push_back(queue_.front());
+            queue_.pop_front();
+         }
+      }
+
+      CommitBatch_(batch);
+      batch.clear();
+   }
+}
+
+/**
+ * Applies a batch in one transaction. A write that fails on its own (say a duplicate user) doesn't stop the others,
+ * if the commit itself fails they all fail.
+ */
+void UserDBWriter::CommitBatch_(vector<Pending>& batch) {
+   UserStore* store = userdb_->getStore_();
+   vector<bool> results(batch.size(), false);
+   bool committed = false;
+
+   if(store->Begin()) {
+      for(size_t i = 0; i < batch.size(); i++) {
+         results[i] = batch[i].mutation(store);
+      }
+      committed = store->Commit();
+   } else {
+      ERROR("Could not start a user database transaction.");
+   }
+
+   boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+   unsigned long failed = 0;
+   double total_latency_ms = 0, max_latency_ms = 0;
+   for(size_t i = 0; i < batch.size(); i++) {
+      bool ok = committed && results[i];
+      if(!ok) {
+         failed++;
+      }
+      double latency_ms = (now - batch[i].queued).total_microseconds() / 1000.0;
+      total_latency_ms += latency_ms;
+      max_latency_ms = max(max_latency_ms, latency_ms);
+      if(batch[i].done) {
+         batch[i].done(ok);
+      }
+   }
+
+   boost::mutex::scoped_lock lock(mutex_);
+   stats_.commits++;
+   stats_.writes += batch.size();
+   stats_.failed += failed;
+   stats_.largest_batch = max(stats_.largest_batch, (unsigned long)batch.size());
+   stats_.total_latency_ms += total_latency_ms;
+   stats_.max_latency_ms = max(stats_.max_latency_ms, max_latency_ms);
+   DEBUG_M("Committed %d user database writes.", (int)batch.size());
+}
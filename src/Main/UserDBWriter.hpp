@@ -0,0 +1,68 @@
+#ifndef LAZYXMPP_USERDBWRITER_HPP_
+#define LAZYXMPP_USERDBWRITER_HPP_
+
+#include <deque>
+#include <vector>
+using namespace std;
+
+#include <boost/function.hpp>
+#include <boost/thread.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+class UserDB;
+class UserStore;
+
+/**
+ * Write-behind for UserDB. Changes are queued and a single writer thread applies them in batches, one transaction
+ * (and so one sync to disk) per batch. While a batch is being committed the next one builds up, so the busier it
+ * gets the bigger the batches get. Callers hear back through a callback once their change is committed.
+ */
+class UserDBWriter: private boost::noncopyable {
+   public:
+      typedef boost::function<bool(UserStore*)> Mutation; // Runs inside the writer's transaction, false if it failed.
+      typedef boost::function<void(bool)> Callback; // Called on the writer thread, true once committed.
+
+      struct Stats {
+         Stats() : commits(0), writes(0), failed(0), largest_batch(0), total_latency_ms(0), max_latency_ms(0) {}
+         unsigned long commits;
+         unsigned long writes;
+         unsigned long failed;
+         unsigned long largest_batch;
+         double total_latency_ms; // Queued to committed, summed over every write.
+         double max_latency_ms;
+      };
+
+      UserDBWriter(UserDB* userdb, unsigned int commit_window_ms = 2, unsigned int max_batch = 512);
+      ~UserDBWriter();
+
+      void Start();
+      void Stop(); // Commits whatever is queued, then stops the thread.
+
+      void Submit(const Mutation& mutation, const Callback& done = Callback());
+
+      Stats getStats() const;
+
+   private:
+      struct Pending {
+         Mutation mutation;
+         Callback done;
+         boost::posix_time::ptime queued;
+      };
+
+      void Run_();
+      void CommitBatch_(vector<Pending>& batch);
+
+      UserDB* userdb_;
+      boost::posix_time::time_duration commit_window_; // How long to hold the first write of a batch for company.
+      unsigned int max_batch_;
+
+      mutable boost::mutex mutex_; // Guards queue_, stopping_ and stats_.
+      boost::condition_variable queued_;
+      deque<Pending> queue_;
+      bool stopping_;
+      Stats stats_;
+      boost::thread thread_;
+};
+
+#endif /* LAZYXMPP_USERDBWRITER_HPP_ */
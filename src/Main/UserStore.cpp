@@ -0,0 +1,44 @@
+#include "../Main/UserStore.hpp"
+#include "../Main/SqliteUserStore.hpp"
+#include "../Main/MmapUserStore.hpp"
+#include "../Debug/console.h"
+
+UserStore* UserStore::Create(const string& type, const string& directory) {
+   UserStore* store = NULL;
+   if(type == "sqlite") {
+      store = new SqliteUserStore(directory + "/users.db");
+   } else if(type == "mmap") {
+      store = new MmapUserStore(directory + "/users.idx", directory + "/users.log");
+   } else {
+      ERROR("Unknown user store '%s'.", type.c_str());
+      return NULL;
+   }
+
+   if(!store->isOpen()) {
+      delete store;
+      return NULL;
+   }
+   return store;
+}
+
+bool UserRecord::getScramCredentials(Scram::Mechanism mechanism, ScramCredentials& credentials) const {
+   const string& stored_key = mechanism == Scram::SHA256 ? sha256_stored_key : sha1_stored_key;
+   const string& server_key = mechanism == Scram::SHA256 ? sha256_server_key : sha1_server_key;
+   if(scram_salt.empty() || stored_key.size() != Scram::getDigestSize(mechanism)) {
+      return false;
+   }
+   credentials.salt = scram_salt;
+   credentials.iterations = scram_iterations;
+   credentials.stored_key = stored_key;
+   credentials.server_key = server_key;
+   return true;
+}
+
+void UserRecord::setScramCredentials(const ScramCredentials& sha1, const ScramCredentials& sha256) {
+   scram_salt = sha256.salt;
+   scram_iterations = sha256.iterations;
+   sha1_stored_key = sha1.stored_key;
+   sha1_server_key = sha1.server_key;
+   sha256_stored_key = sha256.stored_key;
+   sha256_server_key = sha256.server_key;
+}
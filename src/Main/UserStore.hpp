@@ -0,0 +1,57 @@
+#ifndef LAZYXMPP_USERSTORE_HPP_
+#define LAZYXMPP_USERSTORE_HPP_
+
+#include <string>
+using namespace std;
+
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+
+#include "../Main/Scram.hpp"
+
+/**
+ * Everything UserDB keeps for one user.
+ */
+struct UserRecord {
+   UserRecord() : scram_iterations(0) {}
+
+   bool getScramCredentials(Scram::Mechanism mechanism, ScramCredentials& credentials) const; // False if there aren't any keys for it.
+   void setScramCredentials(const ScramCredentials& sha1, const ScramCredentials& sha256);
+
+   string hash;
+   string salt;
+   string scram_salt; // Shared by both SCRAM hashes.
+   unsigned int scram_iterations;
+   string sha1_stored_key;
+   string sha1_server_key;
+   string sha256_stored_key;
+   string sha256_server_key;
+};
+
+/**
+ * Where UserDB keeps its users. Lookup and Scan can be called from any thread. The rest are only called by the
+ * UserDBWriter thread, which brackets each batch of changes with Begin and Commit (or Rollback).
+ */
+class UserStore: private boost::noncopyable {
+   public:
+      typedef boost::function<void(const string&, const UserRecord&)> Visitor;
+
+      static UserStore* Create(const string& type, const string& directory); // "sqlite" or "mmap", NULL if it's neither or won't open.
+
+      virtual ~UserStore() {}
+
+      virtual bool isOpen() const = 0;
+
+      virtual bool Lookup(const string& username, UserRecord& record) = 0;
+      virtual void Scan(const Visitor& visit) = 0; // Every user, in no particular order.
+
+      virtual bool Begin() = 0;
+      virtual bool Insert(const string& username, const UserRecord& record) = 0; // False if they're already registered.
+      virtual bool SetScramKeys(const string& username, const ScramCredentials& sha1, const ScramCredentials& sha256) = 0;
+      virtual bool Commit() = 0; // Nothing since Begin is kept if this fails.
+      virtual void Rollback() = 0;
+
+      virtual const char* getName() const = 0;
+};
+
+#endif /* LAZYXMPP_USERSTORE_HPP_ */
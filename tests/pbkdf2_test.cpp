@@ -0,0 +1,66 @@
+/**
+ * Pbkdf2Sha512 against OpenSSL's PKCS5_PBKDF2_HMAC with SHA-512, on every kernel width this CPU can run. Batches
+ * are sized to leave lanes empty, fill them, and spill over, with mixed iteration counts and passwords longer than
+ * a SHA-512 block.
+ *   scons test
+ */
+#include <stdio.h>
+
+#include <string>
+#include <vector>
+using namespace std;
+
+#include <openssl/evp.h>
+
+#include "../src/Main/Pbkdf2Batch.hpp"
+
+static int failures_ = 0;
+
+#define CHECK(condition) do { if(!(condition)) { printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); failures_++; } } while(0)
+
+static string Expected_(const Pbkdf2Request& request) {
+   unsigned char key[Pbkdf2Sha512::KEY_SIZE];
+   PKCS5_PBKDF2_HMAC(request.password.data(), request.password.size(), (const unsigned char*)request.salt.data(), request.salt.size(), request.iterations, EVP_sha512(), sizeof(key), key);
+   return string((const char*)key, sizeof(key));
+}
+
+static void TestBatch_(unsigned int size) {
+   vector<Pbkdf2Request> requests;
+   for(unsigned int i = 0; i < size; i++) {
+      char salt[17];
+      snprintf(salt, sizeof(salt), "salt%012u", i);
+      string password = i % 5 == 4 ? string(200 + i, 'p') : "password" + string(i, 'x'); // Some longer than a block.
+      unsigned int iterations = i % 3 == 2 ? 7 : 50; // Two groups, in mixed order.
+      requests.push_back(Pbkdf2Request(password, string(salt, 16), iterations));
+   }
+   requests.push_back(Pbkdf2Request("", "", 1));
+
+   Pbkdf2Sha512::DeriveBatch(requests);
+   for(size_t i = 0; i < requests.size(); i++) {
+      CHECK(Expected_(requests[i]) == string((const char*)requests[i].key, Pbkdf2Sha512::KEY_SIZE));
+   }
+}
+
+int main() {
+   unsigned int widths[] = {1, 4, 8};
+   for(size_t w = 0; w < sizeof(widths) / sizeof(*widths); w++) {
+      if(!Pbkdf2Sha512::setLanes(widths[w])) {
+         printf("pbkdf2_test: no %u lane kernel on this CPU, skipped.\n", widths[w]);
+         continue;
+      }
+      CHECK(Pbkdf2Sha512::getLanes() == widths[w]);
+      unsigned int sizes[] = {1, 2, 3, 4, 5, 7, 8, 9, 16, 17, 25};
+      for(size_t s = 0; s < sizeof(sizes) / sizeof(*sizes); s++) {
+         TestBatch_(sizes[s]);
+      }
+
+      unsigned char key[Pbkdf2Sha512::KEY_SIZE];
+      Pbkdf2Sha512::Derive("pencil", "salty", 4096, key);
+      CHECK(Expected_(Pbkdf2Request("pencil", "salty", 4096)) == string((const char*)key, sizeof(key)));
+      printf("pbkdf2_test: %s checked.\n", Pbkdf2Sha512::getKernelName());
+   }
+   CHECK(!Pbkdf2Sha512::setLanes(3));
+
+   printf("pbkdf2_test: %s\n", failures_ ? "FAILED" : "passed");
+   return failures_ ? 1 : 0;
+}
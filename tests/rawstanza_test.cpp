@@ -0,0 +1,106 @@
+/**
+ * RawStanza's attribute reading and rewriting, and the well formed checks the raw forwarding path relies on.
+ *   scons test
+ */
+#include <stdio.h>
+
+#include <string>
+#include <vector>
+using namespace std;
+
+#include "../src/Main/RawStanza.hpp"
+
+static int failures_ = 0;
+
+#define CHECK(condition) do { if(!(condition)) { printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); failures_++; } } while(0)
+
+static void TestGetAttribute_() {
+   string value;
+   CHECK(RawStanza::getTagName("<message to='a'/>") == "message");
+   CHECK(RawStanza::getAttribute("<message to='a&amp;b' type=\"chat\"><body/></message>", "to", value) && value == "a&b");
+   CHECK(RawStanza::getAttribute("<message to='a' type=\"chat\"><body/></message>", "type", value) && value == "chat");
+   CHECK(RawStanza::getAttribute("<message title='x>y' to='a'/>", "to", value) && value == "a");
+   CHECK(!RawStanza::getAttribute("<message><body to='a'/></message>", "to", value) && value.empty());
+   CHECK(RawStanza::hasChild("<message to='a'><body>x</body></message>", "body"));
+   CHECK(!RawStanza::hasChild("<message to='a'><bodyx/></message>", "body"));
+}
+
+/**
+ * setAttribute replaces every copy, nothing after the start tag changes.
+ */
+static void TestSetAttribute_() {
+   CHECK(RawStanza::setFrom("<message to='bob'><body>x</body></message>", "a@b/r") == "<message from=\"a@b/r\" to='bob'><body>x</body></message>");
+   CHECK(RawStanza::setFrom("<message from='x' to='bob'/>", "a@b/r") == "<message from=\"a@b/r\" to='bob'/>");
+   CHECK(RawStanza::setFrom("<message to='bob' from='x' from = \"admin@localhost\"><body from='c'/></message>", "a@b/r") == "<message from=\"a@b/r\" to='bob'><body from='c'/></message>");
+   CHECK(RawStanza::setFrom("<presence/>", "a&b") == "<presence from=\"a&amp;b\"/>");
+   CHECK(RawStanza::removeAttribute("<presence to='' type='away' to=\"x\"/>", "to") == "<presence type='away'/>");
+   CHECK(RawStanza::removeAttribute("<presence type='away'/>", "to") == "<presence type='away'/>");
+}
+
+static void TestWellFormed_() {
+   const char* good[] = {
+      "<presence/>",
+      "<message to='bob'><body>a &amp; &#233; &#x10FFFF;</body></message>",
+      "<message to='bob'><body><![CDATA[<not> &a tag]]></body></message>",
+      "<message to='bob'><x:y xmlns:x='urn:x'><x:z a:b='1' xmlns:a='urn:a'/></x:y></message>",
+      "<message to='bob' xml:lang='en'><body>x</body></message>",
+   };
+   for(size_t i = 0; i < sizeof(good) / sizeof(*good); i++) {
+      CHECK(RawStanza::isWellFormed(good[i]));
+      CHECK(RawStanza::isForwardable(good[i]));
+   }
+
+   const char* bad[] = {
+      "<message to='bob'><body>a <b></message></b></body></message>",
+      "<message to='bob'><body>a &bogus; </body></message>",
+      "<message to='bob' from='x' from='admin@localhost'><body>a</body></message>",
+      "<message to='bob'><body>a</body></message><message/>",
+      "<presence to='a'/> ",
+      " <presence to='a'/>",
+      "<message to='bob'><x:y/></message>",
+      "<message to='bob'><x:y xmlns:x='urn:x'/><x:z/></message>",
+      "<message to='bob'><!-- comment --><body/></message>",
+      "<message to='bob'><?pi?><body/></message>",
+      "<message to='bob'><body>x</body>",
+      "<message to='bob'><body><![CDATA[x</body></message>",
+   };
+   for(size_t i = 0; i < sizeof(bad) / sizeof(*bad); i++) {
+      CHECK(!RawStanza::isWellFormed(bad[i]));
+      CHECK(!RawStanza::isForwardable(bad[i]));
+   }
+
+   // Well formed, but 'from' could be read two ways.
+   CHECK(RawStanza::isWellFormed("<message to='bob' x:from='admin@localhost' xmlns:x='urn:x'><body/></message>"));
+   CHECK(!RawStanza::isForwardable("<message to='bob' x:from='admin@localhost' xmlns:x='urn:x'><body/></message>"));
+   CHECK(!RawStanza::isForwardable("<message x:to='bob' xmlns:x='urn:x'><body/></message>"));
+}
+
+/**
+ * findStanzas, which Stream Management counts with, only counts message, presence and iq.
+ */
+static void TestFindStanzas_() {
+   string data = "<message to='a'><body>x</body></message><r xmlns='urn:xmpp:sm:3'/><presence/><!-- <iq/> --><iq type='get'><q/></iq><message";
+   vector<pair<size_t, size_t> > stanzas;
+   RawStanza::findStanzas(data, stanzas);
+   CHECK(stanzas.size() == 3);
+   if(stanzas.size() == 3) {
+      CHECK(data.substr(stanzas[0].first, stanzas[0].second - stanzas[0].first) == "<message to='a'><body>x</body></message>");
+      CHECK(data.substr(stanzas[1].first, stanzas[1].second - stanzas[1].first) == "<presence/>");
+      CHECK(data.substr(stanzas[2].first, stanzas[2].second - stanzas[2].first) == "<iq type='get'><q/></iq>");
+   }
+}
+
+static void TestEscape_() {
+   CHECK(RawStanza::Escape("<a&'\">") == "&lt;a&amp;&apos;&quot;&gt;");
+   CHECK(RawStanza::Unescape("&lt;a&amp;&apos;&quot;&gt;&#233;&#x41;") == "<a&'\">\xc3\xa9" "A");
+}
+
+int main() {
+   TestGetAttribute_();
+   TestSetAttribute_();
+   TestWellFormed_();
+   TestFindStanzas_();
+   TestEscape_();
+   printf("rawstanza_test: %s\n", failures_ ? "FAILED" : "passed");
+   return failures_ ? 1 : 0;
+}
@@ -0,0 +1,164 @@
+/**
+ * StanzaFramer on whole, split and pipelined input, and on markup that isn't well formed.
+ *   scons test
+ */
+#include <stdio.h>
+
+#include <string>
+#include <vector>
+using namespace std;
+
+#include "../src/Main/StanzaFramer.hpp"
+
+static int failures_ = 0;
+
+#define CHECK(condition) do { if(!(condition)) { printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); failures_++; } } while(0)
+
+static const string STREAM_OPEN = "<?xml version='1.0'?><stream:stream xmlns='jabber:client' xmlns:stream='http://etherx.jabber.org/streams' to='localhost' version='1.0'>";
+
+struct Framed {
+   StanzaFramer::Event event;
+   string element;
+};
+
+/**
+ * Feeds data chunk bytes at a time and collects everything the framer hands out, stopping at the first error.
+ */
+static vector<Framed> Frame_(const string& data, size_t chunk) {
+   StanzaFramer framer;
+   vector<Framed> framed;
+   for(size_t i = 0; i < data.size(); i += chunk) {
+      framer.Feed(data.data() + i, min(chunk, data.size() - i));
+      Framed next;
+      while((next.event = framer.Next(next.element)) != StanzaFramer::NEED_MORE) {
+         framed.push_back(next);
+         if(next.event == StanzaFramer::TOO_BIG || next.event == StanzaFramer::NOT_WELL_FORMED) {
+            return framed;
+         }
+      }
+   }
+   return framed;
+}
+
+static StanzaFramer::Event LastEvent_(const string& data, size_t chunk) {
+   vector<Framed> framed = Frame_(data, chunk);
+   return framed.empty() ? StanzaFramer::NEED_MORE : framed.back().event;
+}
+
+/**
+ * The same stanzas come out however the input is split, including one byte at a time.
+ */
+static void TestSplitAndPipelined_() {
+   const char* stanzas[] = {
+      "<message to='bob@localhost' type='chat'><body>a &amp; b &#x1F600; &lt;c&gt;</body></message>",
+      "<presence/>",
+      "<iq type='get' id='1'><query xmlns='jabber:iq:roster'/></iq>",
+      "<message to='bob@localhost'><body><![CDATA[</body> & <x>]]></body></message>",
+      "<presence to='a@b' title='a > b'><status>x</status></presence>",
+   };
+   size_t count = sizeof(stanzas) / sizeof(*stanzas);
+   string data = STREAM_OPEN;
+   for(size_t i = 0; i < count; i++) {
+      data += stanzas[i];
+      data += "\n ";
+   }
+   data += "</stream:stream>";
+
+   size_t chunks[] = {1, 2, 3, 7, 64, data.size()};
+   for(size_t c = 0; c < sizeof(chunks) / sizeof(*chunks); c++) {
+      vector<Framed> framed = Frame_(data, chunks[c]);
+      CHECK(framed.size() == count + 2);
+      if(framed.size() != count + 2) {
+         continue;
+      }
+      CHECK(framed[0].event == StanzaFramer::STREAM_OPEN);
+      for(size_t i = 0; i < count; i++) {
+         CHECK(framed[i + 1].event == StanzaFramer::STANZA);
+         CHECK(framed[i + 1].element == stanzas[i]);
+      }
+      CHECK(framed.back().event == StanzaFramer::STREAM_CLOSE);
+   }
+}
+
+/**
+ * A stream restart after SASL comes out as a second STREAM_OPEN.
+ */
+static void TestRestart_() {
+   vector<Framed> framed = Frame_(STREAM_OPEN + "<auth xmlns='urn:ietf:params:xml:ns:xmpp-sasl' mechanism='PLAIN'>AGEAYg==</auth>" + STREAM_OPEN, 5);
+   CHECK(framed.size() == 3);
+   if(framed.size() == 3) {
+      CHECK(framed[0].event == StanzaFramer::STREAM_OPEN);
+      CHECK(framed[1].event == StanzaFramer::STANZA);
+      CHECK(framed[2].event == StanzaFramer::STREAM_OPEN);
+   }
+
+   // A self-closed restart is still a STREAM_OPEN, handed out as it came so it isn't closed a second time.
+   string self_closed = STREAM_OPEN.substr(0, STREAM_OPEN.size() - 1) + "/>";
+   framed = Frame_(STREAM_OPEN + self_closed, 7);
+   CHECK(framed.size() == 2);
+   if(framed.size() == 2) {
+      CHECK(framed[1].event == StanzaFramer::STREAM_OPEN);
+      CHECK(framed[1].element == self_closed.substr(self_closed.find("<stream")));
+   }
+}
+
+/**
+ * Close tags that don't match, bad references and broken tags never make it out as a STANZA.
+ */
+static void TestNotWellFormed_() {
+   const char* bad[] = {
+      "<message to='bob'><body><b></message></b></body></message>",
+      "<message to='bob'><body>a</bodx></message>",
+      "</iq>",
+      "<message to='bob'><body>a &bogus; b</body></message>",
+      "<message to='bob'><body>&#0;</body></message>",
+      "<message to='bob'><body>&#xD800;</body></message>",
+      "<message to='bob'><body>& b</body></message>",
+      "<message to='bob' from='x' from='y'><body/></message>",
+      "<message to='bob'from='x'/>",
+      "<message to=bob/>",
+      "<message to='a<b'/>",
+      "<1message/>",
+      "<!DOCTYPE x>",
+   };
+   for(size_t i = 0; i < sizeof(bad) / sizeof(*bad); i++) {
+      CHECK(LastEvent_(STREAM_OPEN + bad[i], 1000) == StanzaFramer::NOT_WELL_FORMED);
+      CHECK(LastEvent_(STREAM_OPEN + bad[i], 1) == StanzaFramer::NOT_WELL_FORMED);
+   }
+   CHECK(LastEvent_("<message/>", 1000) == StanzaFramer::NOT_WELL_FORMED); // No stream yet.
+}
+
+/**
+ * A reference split across reads is only judged once it's complete.
+ */
+static void TestSplitReference_() {
+   StanzaFramer framer;
+   string element;
+   string open = STREAM_OPEN + "<message><body>a &am";
+   framer.Feed(open.data(), open.size());
+   CHECK(framer.Next(element) == StanzaFramer::STREAM_OPEN);
+   CHECK(framer.Next(element) == StanzaFramer::NEED_MORE);
+   string rest = "p; b</body></message>";
+   framer.Feed(rest.data(), rest.size());
+   CHECK(framer.Next(element) == StanzaFramer::STANZA);
+   CHECK(element == "<message><body>a &amp; b</body></message>");
+}
+
+static void TestTooBig_() {
+   StanzaFramer framer(64);
+   string element;
+   string data = STREAM_OPEN + "<message><body>" + string(100, 'x');
+   framer.Feed(data.data(), data.size());
+   CHECK(framer.Next(element) == StanzaFramer::STREAM_OPEN);
+   CHECK(framer.Next(element) == StanzaFramer::TOO_BIG);
+}
+
+int main() {
+   TestSplitAndPipelined_();
+   TestRestart_();
+   TestNotWellFormed_();
+   TestSplitReference_();
+   TestTooBig_();
+   printf("stanzaframer_test: %s\n", failures_ ? "FAILED" : "passed");
+   return failures_ ? 1 : 0;
+}
@@ -0,0 +1,97 @@
+/**
+ * Logs in an account from before SCRAM support, on both user stores: SCRAM has to report it as having no keys (the
+ * connection answers that with <invalid-mechanism/>), PLAIN has to work and add the keys, and after a restart a full
+ * SCRAM-SHA-256 exchange has to succeed. Unknown users have to keep their fake salt over the restart. Runs in a
+ * throwaway $HOME.
+ *   scons test
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <string>
+#include <vector>
+using namespace std;
+
+#include <boost/filesystem.hpp>
+namespace fs=boost::filesystem;
+
+#include "../src/Main/UserDB.hpp"
+
+static int failures_ = 0;
+
+#define CHECK(condition) do { if(!(condition)) { printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); failures_++; } } while(0)
+
+/**
+ * The client side of SCRAM-SHA-256 against a ScramSession, true if the server took the proof.
+ */
+static bool ScramLogin_(const ScramCredentials& credentials, const string& username, const string& password) {
+   ScramSession session(Scram::SHA256);
+   string client_first_bare = "n=" + username + ",r=clientnonce";
+   string parsed_username;
+   if(!session.ClientFirst("n,," + client_first_bare, parsed_username) || parsed_username != username) {
+      return false;
+   }
+   string server_first = session.ServerFirst(credentials, "servernonce");
+
+   byte salted[CryptoPP::SHA256::DIGESTSIZE];
+   PKCS5_PBKDF2_HMAC<CryptoPP::SHA256> dk;
+   dk.DeriveKey(salted, sizeof(salted), (byte)0, (const byte*)password.data(), password.size(), (const byte*)credentials.salt.data(), credentials.salt.size(), credentials.iterations, 0);
+   string client_key = Scram::Hmac(Scram::SHA256, string((const char*)salted, sizeof(salted)), "Client Key");
+   string without_proof = "c=" + Scram::Base64Encode("n,,") + ",r=clientnonceservernonce";
+   string signature = Scram::Hmac(Scram::SHA256, Scram::Hash(Scram::SHA256, client_key), client_first_bare + "," + server_first + "," + without_proof);
+   string proof(client_key.size(), '\0');
+   for(size_t i = 0; i < proof.size(); i++) {
+      proof[i] = client_key[i] ^ signature[i];
+   }
+
+   string server_final;
+   return session.ClientFinal(without_proof + ",p=" + Scram::Base64Encode(proof), server_final);
+}
+
+static void TestPreScramLogin_(const string& store) {
+   ScramCredentials credentials, unknown;
+   {
+      UserDB userdb(store);
+      vector<ImportUser> users(1, ImportUser("romeo", "balcony"));
+      CHECK(userdb.importUsers(users, false));
+      CHECK(users[0].imported);
+
+      CHECK(userdb.getScramCredentials("romeo", Scram::SHA256, credentials) == UserDB::SCRAM_NO_KEYS);
+      CHECK(userdb.getScramCredentials("romeo", Scram::SHA1, credentials) == UserDB::SCRAM_NO_KEYS);
+      CHECK(userdb.getScramCredentials("nobody", Scram::SHA256, unknown) == UserDB::SCRAM_UNKNOWN_USER);
+      CHECK(!ScramLogin_(unknown, "nobody", "balcony"));
+
+      CHECK(!userdb.verifyPassword("romeo", "wrong"));
+      CHECK(userdb.verifyPassword("romeo", "balcony"));
+   } // The keys from the PLAIN login are written before it's gone.
+
+   UserDB userdb(store);
+   // A fake salt that changed over a restart would give the unknown user away.
+   ScramCredentials again;
+   CHECK(userdb.getScramCredentials("nobody", Scram::SHA256, again) == UserDB::SCRAM_UNKNOWN_USER);
+   CHECK(again.salt == unknown.salt);
+
+   CHECK(userdb.getScramCredentials("romeo", Scram::SHA256, credentials) == UserDB::SCRAM_FOUND);
+   CHECK(ScramLogin_(credentials, "romeo", "balcony"));
+   CHECK(!ScramLogin_(credentials, "romeo", "wrong"));
+   CHECK(userdb.getScramCredentials("romeo", Scram::SHA1, credentials) == UserDB::SCRAM_FOUND);
+}
+
+int main() {
+   char home[] = "/tmp/userdb_test.XXXXXX";
+   if(!mkdtemp(home)) {
+      printf("userdb_test: could not make a temporary directory.\n");
+      return 1;
+   }
+   setenv("HOME", home, 1);
+
+   const char* stores[] = {"sqlite", "mmap"};
+   for(size_t i = 0; i < sizeof(stores) / sizeof(*stores); i++) {
+      TestPreScramLogin_(stores[i]);
+      printf("userdb_test: %s checked.\n", stores[i]);
+   }
+   fs::remove_all(home);
+
+   printf("userdb_test: %s\n", failures_ ? "FAILED" : "passed");
+   return failures_ ? 1 : 0;
+}
@@ -0,0 +1,410 @@
+/**
+ * Offline administration for LazyXMPP's user database. Run it with the server stopped, the mmap store can only be
+ * open in one process at a time.
+ *
+ *   lazyxmpp-admin import [--store sqlite|mmap] [--threads N] [--no-scram] [--format csv|jsonl] FILE
+ *
+ * FILE ('-' for stdin) holds one user per line, either CSV "username,password" (an optional header line and
+ * RFC 4180 quoting are understood) or JSON Lines {"username": "...", "password": "..."}. The format comes from the
+ * file extension unless it's given. Users that are already registered are left alone.
+ *
+ * --no-scram skips the SCRAM keys. Until their first PLAIN login those users can't use SCRAM, the server turns it
+ * down with <invalid-mechanism/>, so they need a client that then falls back to PLAIN, and PLAIN enabled.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+using namespace std;
+
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
+#include "../src/Main/UserDB.hpp"
+
+static const size_t CHUNK_SIZE = 512; // Users per importUsers call.
+
+static double Now_() {
+   struct timeval tv;
+   gettimeofday(&tv, NULL);
+   return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/**
+ * Splits a CSV line into fields. Quoted fields can hold commas and doubled quotes, but not newlines.
+ */
+static bool ParseCsvLine_(const string& line, vector<string>& fields) {
+   fields.clear();
+   string field;
+   bool quoted = false;
+   for(size_t i = 0; i < line.size(); i++) {
+      char c = line[i];
+      if(quoted) {
+         if(c == '"' && i + 1 < line.size() && line[i + 1] == '"') {
+            field += '"';
+            i++;
+         } else if(c == '"') {
+            quoted = false;
+         } else {
+            field += c;
+         }
+      } else if(c == '"' && field.empty()) {
+         quoted = true;
+      } else if(c == ',') {
+         fields.push_back(field);
+         field.clear();
+      } else if(c != '\r') {
+         field += c;
+      }
+   }
+   fields.push_back(field);
+   return !quoted;
+}
+
+static void AppendUtf8_(string& out, unsigned long c) {
+   if(c < 0x80) {
+      out += (char)c;
+   } else if(c < 0x800) {
+      out += (char)(0xc0 | (c >> 6));
+      out += (char)(0x80 | (c & 0x3f));
+   } else if(c < 0x10000) {
+      out += (char)(0xe0 | (c >> 12));
+      out += (char)(0x80 | ((c >> 6) & 0x3f));
+      out += (char)(0x80 | (c & 0x3f));
+   } else {
+      out += (char)(0xf0 | (c >> 18));
+      out += (char)(0x80 | ((c >> 12) & 0x3f));
+      out += (char)(0x80 | ((c >> 6) & 0x3f));
+      out += (char)(0x80 | (c & 0x3f));
+   }
+}
+
+static void SkipSpace_(const string& s, size_t& i) {
+   while(i < s.size() && (s[i] == ' ' || s[i] == '\t' || s[i] == '\r' || s[i] == '\n')) {
+      i++;
+   }
+}
+
+static bool ParseHex4_(const string& s, size_t i, unsigned long& value) {
+   if(i + 4 > s.size()) {
+      return false;
+   }
+   char* end;
+   string hex = s.substr(i, 4);
+   value = strtoul(hex.c_str(), &end, 16);
+   return *end == '\0';
+}
+
+/**
+ * Reads a JSON string starting at the opening quote, leaves i after the closing one.
+ */
+static bool ParseJsonString_(const string& s, size_t& i, string& out) {
+   out.clear();
+   if(i >= s.size() || s[i] != '"') {
+      return false;
+   }
+   for(i++; i < s.size(); i++) {
+      char c = s[i];
+      if(c == '"') {
+         i++;
+         return true;
+      }
+      if(c != '\\') {
+         out += c;
+         continue;
+      }
+      if(++i >= s.size()) {
+         return false;
+      }
+      switch(s[i]) {
+         case '"': out += '"'; break;
+         case '\\': out += '\\'; break;
+         case '/': out += '/'; break;
+         case 'b': out += '\b'; break;
+         case 'f': out += '\f'; break;
+         case 'n': out += '\n'; break;
+         case 'r': out += '\r'; break;
+         case 't': out += '\t'; break;
+         case 'u': {
+            unsigned long c, low;
+            if(!ParseHex4_(s, i + 1, c)) {
+               return false;
+            }
+            i += 4;
+            if(c >= 0xd800 && c < 0xdc00) { // A surrogate pair.
+               if(i + 2 >= s.size() || s[i + 1] != '\\' || s[i + 2] != 'u' || !ParseHex4_(s, i + 3, low) || low < 0xdc00 || low >= 0xe000) {
+                  return false;
+               }
+               c = 0x10000 + ((c - 0xd800) << 10) + (low - 0xdc00);
+               i += 6;
+            }
+            AppendUtf8_(out, c);
+            break;
+         }
+         default:
+            return false;
+      }
+   }
+   return false;
+}
+
+/**
+ * Pulls username and password out of a flat JSON object. Other members are skipped, as long as they're not
+ * objects or arrays.
+ */
+static bool ParseJsonLine_(const string& line, string& username, string& password) {
+   size_t i = 0;
+   SkipSpace_(line, i);
+   if(i >= line.size() || line[i++] != '{') {
+      return false;
+   }
+   bool have_username = false, have_password = false;
+   for(;;) {
+      SkipSpace_(line, i);
+      if(i < line.size() && line[i] == '}') {
+         break;
+      }
+      string key, value;
+      if(!ParseJsonString_(line, i, key)) {
+         return false;
+      }
+      SkipSpace_(line, i);
+      if(i >= line.size() || line[i++] != ':') {
+         return false;
+      }
+      SkipSpace_(line, i);
+      if(i < line.size() && line[i] == '"') {
+         if(!ParseJsonString_(line, i, value)) {
+            return false;
+         }
+         if(key == "username") {
+            username = value;
+            have_username = true;
+         } else if(key == "password") {
+            password = value;
+            have_password = true;
+         }
+      } else {
+         while(i < line.size() && line[i] != ',' && line[i] != '}') {
+            if(line[i] == '{' || line[i] == '[') {
+               return false;
+            }
+            i++;
+         }
+      }
+      SkipSpace_(line, i);
+      if(i < line.size() && line[i] == ',') {
+         i++;
+      } else if(i < line.size() && line[i] == '}') {
+         break;
+      } else {
+         return false;
+      }
+   }
+   return have_username && have_password;
+}
+
+/**
+ * Chunks of users waiting for a worker. Bounded, so a huge file isn't read into memory ahead of the workers.
+ */
+class ImportQueue {
+   public:
+      ImportQueue(size_t max_chunks) : max_chunks_(max_chunks), finished_(false), imported_(0), existing_(0), failed_(0) {}
+
+      void Push(const vector<ImportUser>& chunk) {
+         boost::mutex::scoped_lock lock(mutex_);
+         while(chunks_.size() >= max_chunks_) {
+            changed_.wait(lock);
+         }
+         chunks_.push_back(chunk);
+         changed_.notify_all();
+      }
+
+      bool Pop(vector<ImportUser>& chunk) {
+         boost::mutex::scoped_lock lock(mutex_);
+         while(chunks_.empty() && !finished_) {
+            changed_.wait(lock);
+         }
+         if(chunks_.empty()) {
+            return false;
+         }
+         chunk.swap(chunks_.front());
+         chunks_.pop_front();
+         changed_.notify_all();
+         return true;
+      }
+
+      void Finish() {
+         boost::mutex::scoped_lock lock(mutex_);
+         finished_ = true;
+         changed_.notify_all();
+      }
+
+      void Count(unsigned long imported, unsigned long existing, unsigned long failed) {
+         boost::mutex::scoped_lock lock(mutex_);
+         imported_ += imported;
+         existing_ += existing;
+         failed_ += failed;
+      }
+
+      void getCounts(unsigned long& imported, unsigned long& existing, unsigned long& failed) {
+         boost::mutex::scoped_lock lock(mutex_);
+         imported = imported_;
+         existing = existing_;
+         failed = failed_;
+      }
+
+   private:
+      boost::mutex mutex_;
+      boost::condition_variable changed_;
+      deque< vector<ImportUser> > chunks_;
+      size_t max_chunks_;
+      bool finished_;
+      unsigned long imported_;
+      unsigned long existing_;
+      unsigned long failed_;
+};
+
+static void ImportWorker_(UserDB* userdb, ImportQueue* queue, bool with_scram) {
+   vector<ImportUser> chunk;
+   while(queue->Pop(chunk)) {
+      if(!userdb->importUsers(chunk, with_scram)) {
+         queue->Count(0, 0, chunk.size());
+         continue;
+      }
+      unsigned long imported = 0;
+      for(size_t i = 0; i < chunk.size(); i++) {
+         imported += chunk[i].imported;
+      }
+      queue->Count(imported, chunk.size() - imported, 0);
+   }
+}
+
+static int Usage_(const char* name) {
+   fprintf(stderr, "Usage: %s import [--store sqlite|mmap] [--threads N] [--no-scram] [--format csv|jsonl] FILE\n", name);
+   return 2;
+}
+
+static int Import_(int argc, char* argv[]) {
+   string store = "sqlite", format, file;
+   unsigned int threads = boost::thread::hardware_concurrency();
+   bool with_scram = true;
+   for(int i = 2; i < argc; i++) {
+      string arg = argv[i];
+      if(arg == "--store" && i + 1 < argc) {
+         store = argv[++i];
+      } else if(arg == "--threads" && i + 1 < argc) {
+         threads = atoi(argv[++i]);
+      } else if(arg == "--no-scram") {
+         with_scram = false;
+      } else if(arg == "--format" && i + 1 < argc) {
+         format = argv[++i];
+      } else if(file.empty() && (arg == "-" || arg[0] != '-')) {
+         file = arg;
+      } else {
+         return Usage_(argv[0]);
+      }
+   }
+   if(file.empty()) {
+      return Usage_(argv[0]);
+   }
+   if(format.empty()) {
+      format = file.size() > 5 && (file.compare(file.size() - 6, 6, ".jsonl") == 0 || file.compare(file.size() - 5, 5, ".json") == 0) ? "jsonl" : "csv";
+   }
+   if(format != "csv" && format != "jsonl") {
+      return Usage_(argv[0]);
+   }
+   if(threads < 1) {
+      threads = 1;
+   }
+
+   ifstream in;
+   if(file != "-") {
+      in.open(file.c_str());
+      if(!in) {
+         fprintf(stderr, "Could not open '%s'.\n", file.c_str());
+         return 1;
+      }
+   }
+   istream& input = file == "-" ? cin : in;
+
+   if(!with_scram) {
+      fprintf(stderr, "Warning: --no-scram users can only log in with PLAIN until their first login adds the SCRAM keys. Clients have to fall back to PLAIN after SCRAM's <invalid-mechanism/>, and PLAIN has to be enabled.\n");
+   }
+
+   UserDB userdb(store);
+   ImportQueue queue(threads * 2);
+   boost::thread_group workers;
+   for(unsigned int i = 0; i < threads; i++) {
+      workers.create_thread(boost::bind(&ImportWorker_, &userdb, &queue, with_scram));
+   }
+
+   printf("Importing %s users from '%s' into the %s store, %u threads, %s.\n", format.c_str(), file.c_str(), store.c_str(), threads, with_scram ? "PLAIN hashes and SCRAM keys" : "PLAIN hashes only");
+   double start = Now_(), last_report = start;
+   unsigned long line_number = 0, bad = 0;
+   vector<ImportUser> chunk;
+   vector<string> fields;
+   string line, username, password;
+   while(getline(input, line)) {
+      line_number++;
+      if(line.find_first_not_of(" \t\r") == string::npos) {
+         continue;
+      }
+      bool ok;
+      if(format == "csv") {
+         ok = ParseCsvLine_(line, fields) && fields.size() >= 2;
+         if(ok && line_number == 1 && fields[0] == "username") {
+            continue; // The header.
+         }
+         if(ok) {
+            username = fields[0];
+            password = fields[1];
+         }
+      } else {
+         ok = ParseJsonLine_(line, username, password);
+      }
+      if(!ok || username.empty() || password.empty()) {
+         fprintf(stderr, "Line %lu: not a username and password, skipped.\n", line_number);
+         bad++;
+         continue;
+      }
+
+      chunk.push_back(ImportUser(username, password));
+      if(chunk.size() >= CHUNK_SIZE) {
+         queue.Push(chunk);
+         chunk.clear();
+      }
+
+      if(Now_() - last_report >= 10) {
+         unsigned long imported, existing, failed;
+         queue.getCounts(imported, existing, failed);
+         last_report = Now_();
+         printf("  %lu imported, %.0f users/s.\n", imported, (imported + existing) / (last_report - start));
+      }
+   }
+   if(!chunk.empty()) {
+      queue.Push(chunk);
+   }
+   queue.Finish();
+   workers.join_all();
+
+   unsigned long imported, existing, failed;
+   queue.getCounts(imported, existing, failed);
+   double elapsed = Now_() - start;
+   printf("Imported %lu users in %.1fs (%.0f users/s). %lu were already registered, %lu failed to commit, %lu lines skipped.\n",
+      imported, elapsed, (imported + existing) / elapsed, existing, failed, bad);
+   return failed > 0 || bad > 0 ? 1 : 0;
+}
+
+int main(int argc, char* argv[]) {
+   if(argc >= 2 && strcmp(argv[1], "import") == 0) {
+      return Import_(argc, argv);
+   }
+   return Usage_(argv[0]);
+}